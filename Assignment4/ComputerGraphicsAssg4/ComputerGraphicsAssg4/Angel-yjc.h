@@ -50,9 +50,12 @@
 
 namespace Angel {
 
-//  Helper function to load vertex and fragment shader files
+//  Helper function to load vertex and fragment shader files; defines
+//    (e.g. "#define PER_PIXEL\n") go in right after their #version line,
+//    and a line #include "file" is replaced by that file
 GLuint InitShader( const char* vertexShaderFile,
-		   const char* fragmentShaderFile );
+		   const char* fragmentShaderFile,
+		   const char* defines = NULL );
 
 //  Defined constant for when numbers are too small to be used in the
 //    denominator of a division operation.  This is only used if the
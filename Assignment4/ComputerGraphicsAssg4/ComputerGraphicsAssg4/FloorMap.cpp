@@ -0,0 +1,26 @@
+#include "FloorMap.h"
+
+//---------------------------------------------------------
+void FloorMap::place(float x0, float x1, float z0, float z1)
+{
+	min_x = x0; max_x = x1;
+	min_z = z0; max_z = z1;
+	last_key.clear();
+}
+//---------------------------------------------------------
+bool FloorMap::changed(const std::vector<float>& key)
+{
+	if (!last_key.empty() && key == last_key) return false;
+	last_key = key;
+	return true;
+}
+//---------------------------------------------------------
+mat4 FloorMap::projection() const
+{
+	//Given by columns, like Angel's own; the shadow matrix leaves w != 1, so the offsets scale with w
+	float sx = 2.0f / (max_x - min_x), sz = 2.0f / (max_z - min_z);
+	return mat4(sx, 0.0f, 0.0f, 0.0f,
+		0.0f, 0.0f, 0.0f, 0.0f,
+		0.0f, sz, 0.0f, 0.0f,
+		-1.0f - min_x * sx, -1.0f - min_z * sz, 0.0f, 1.0f);
+}
@@ -0,0 +1,48 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- FloorMap.h ---
+//
+//   What the floor-space textures (ShadowMask, Lightmap) share: the floor
+//   rectangle they cover, mapped to texture coordinates for the floor
+//   shader and to clip space for drawing into them, and the key that says
+//   when they must be redrawn.
+//
+//   A map is redrawn only when what it depends on changes: its owner
+//   describes that as a list of floats (sphere transforms, lights, draw
+//   settings) and changed() compares it with the list of the last update.
+//   A paused scene therefore never redraws one.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __FLOORMAP_H__
+#define __FLOORMAP_H__
+
+#include "Angel-yjc.h"
+#include <vector>
+
+class FloorMap {
+public:
+	//Covers [min_x, max_x] x [min_z, max_z], and forgets the last key
+	void place(float min_x, float max_x, float min_z, float max_z);
+
+	//True when key differs from the one of the last update, which it replaces
+	bool changed(const std::vector<float>& key);
+	//Forces the next changed() to report a change
+	void invalidate() { last_key.clear(); }
+
+	//Floor x, z of the first texel corner, then one over the extent: uv = (xz - bounds.xy) * bounds.zw
+	vec4 bounds() const { return vec4(min_x, min_z, 1.0f / (max_x - min_x), 1.0f / (max_z - min_z)); }
+	//Maps world x, z to clip x, y over the rectangle, for drawing into a map from above
+	mat4 projection() const;
+	//Floor x, z of the center of texel (column, row) of a size x size map, rows of increasing z
+	vec2 texelCenter(int column, int row, int size) const
+	{
+		return vec2(min_x + (column + 0.5f) * ((max_x - min_x) / size), min_z + (row + 0.5f) * ((max_z - min_z) / size));
+	}
+
+private:
+	float min_x = 0, max_x = 1, min_z = 0, max_z = 1;
+	std::vector<float> last_key;
+};
+
+#endif // __FLOORMAP_H__
@@ -0,0 +1,446 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "FrameCapture.h"
+#include "Timing.h"
+#include <string.h>
+#include "GLStats.h"
+
+namespace {
+
+//---------------------------------------------------------
+unsigned crc32(const unsigned char* data, size_t size, unsigned crc = 0)
+{
+	static unsigned table[256];
+	if (table[1] == 0)
+		for (unsigned n = 0; n < 256; n++) {
+			unsigned c = n;
+			for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			table[n] = c;
+		}
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+//---------------------------------------------------------
+unsigned adler32(const unsigned char* data, size_t size)
+{
+	unsigned a = 1, b = 0;
+	while (size > 0) {
+		size_t n = size < 5552 ? size : 5552; //The most bytes before b can overflow
+		for (size_t i = 0; i < n; i++) {
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += n;
+		size -= n;
+	}
+	return b << 16 | a;
+}
+
+//Deflate's bits go out least significant first; its Huffman codes most significant first
+class BitWriter {
+public:
+	explicit BitWriter(std::vector<unsigned char>& out) : out(out) {}
+	void put(unsigned value, int count)
+	{
+		bits |= (unsigned long long)value << used;
+		used += count;
+		while (used >= 8) {
+			out.push_back((unsigned char)bits);
+			bits >>= 8;
+			used -= 8;
+		}
+	}
+	void flush() { if (used > 0) out.push_back((unsigned char)bits); bits = 0; used = 0; }
+private:
+	std::vector<unsigned char>& out;
+	unsigned long long bits = 0;
+	int used = 0;
+};
+
+const int length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115,
+	131, 163, 195, 227, 258 };
+const int length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const int distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025,
+	1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const int distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12,
+	13, 13 };
+
+const int WindowSize = 32768, MaxMatch = 258, HashBits = 15;
+
+struct FixedCodes {
+	unsigned short literal[288];      //Reversed, ready for BitWriter
+	unsigned char literal_bits[288];
+	unsigned char distance[30];
+	unsigned char length_symbol[MaxMatch + 1];
+	unsigned char distance_symbol[WindowSize + 1];
+
+	static unsigned reverse(unsigned code, int bits)
+	{
+		unsigned r = 0;
+		for (int i = 0; i < bits; i++, code >>= 1) r = r << 1 | (code & 1);
+		return r;
+	}
+	FixedCodes()
+	{
+		for (int s = 0; s < 288; s++) {
+			unsigned code;
+			int bits;
+			if (s < 144) { code = 0x30 + s; bits = 8; }
+			else if (s < 256) { code = 0x190 + s - 144; bits = 9; }
+			else if (s < 280) { code = s - 256; bits = 7; }
+			else { code = 0xc0 + s - 280; bits = 8; }
+			literal[s] = (unsigned short)reverse(code, bits);
+			literal_bits[s] = (unsigned char)bits;
+		}
+		for (int s = 0; s < 30; s++) distance[s] = (unsigned char)reverse(s, 5);
+		for (int s = 0; s < 29; s++)
+			for (int l = length_base[s]; l <= MaxMatch && l < length_base[s] + (1 << length_extra[s]); l++) length_symbol[l] = (unsigned char)s;
+		length_symbol[MaxMatch] = 28;
+		for (int s = 0; s < 30; s++)
+			for (int d = distance_base[s]; d <= WindowSize && d < distance_base[s] + (1 << distance_extra[s]); d++)
+				distance_symbol[d] = (unsigned char)s;
+	}
+};
+
+//A zlib stream of data: one fixed Huffman block, greedy matches of at least 4 bytes found through a hash of the next 4
+void deflate(const unsigned char* data, size_t size, std::vector<unsigned char>& out)
+{
+	static const FixedCodes codes;
+	std::vector<int> head(1 << HashBits, -WindowSize - 1);
+
+	out.push_back(0x78);
+	out.push_back(0x01);
+	BitWriter bits(out);
+	bits.put(1, 1); //Final block
+	bits.put(1, 2); //Fixed codes
+
+	size_t i = 0;
+	while (i < size) {
+		int length = 0, distance = 0;
+		if (i + 4 <= size) {
+			unsigned next;
+			memcpy(&next, data + i, 4);
+			unsigned h = (next * 2654435761u) >> (32 - HashBits);
+			long long candidate = head[h];
+			head[h] = (int)i;
+			distance = (int)(i - candidate);
+			if (distance <= WindowSize && memcmp(data + candidate, data + i, 4) == 0) {
+				size_t limit = size - i < MaxMatch ? size - i : MaxMatch;
+				length = 4;
+				while ((size_t)length < limit && data[candidate + length] == data[i + length]) length++;
+			}
+		}
+		if (length == 0) {
+			bits.put(codes.literal[data[i]], codes.literal_bits[data[i]]);
+			i++;
+			continue;
+		}
+		int s = codes.length_symbol[length];
+		bits.put(codes.literal[257 + s], codes.literal_bits[257 + s]);
+		bits.put(length - length_base[s], length_extra[s]);
+		int d = codes.distance_symbol[distance];
+		bits.put(codes.distance[d], 5);
+		bits.put(distance - distance_base[d], distance_extra[d]);
+		i += length;
+	}
+	bits.put(codes.literal[256], codes.literal_bits[256]);
+	bits.flush();
+
+	unsigned adler = adler32(data, size);
+	for (int shift = 24; shift >= 0; shift -= 8) out.push_back((unsigned char)(adler >> shift));
+}
+//---------------------------------------------------------
+void putChunk(std::vector<unsigned char>& png, const char* type, const unsigned char* data, size_t size)
+{
+	unsigned char length[4] = { (unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size };
+	png.insert(png.end(), length, length + 4);
+	size_t start = png.size();
+	png.insert(png.end(), type, type + 4);
+	png.insert(png.end(), data, data + size);
+	unsigned crc = crc32(&png[start], png.size() - start);
+	for (int shift = 24; shift >= 0; shift -= 8) png.push_back((unsigned char)(crc >> shift));
+}
+
+} // namespace
+
+//---------------------------------------------------------
+bool FrameCapture::open(const char* capture_path, int frames_per_second, int ring)
+{
+	close();
+	path = capture_path;
+	fps = frames_per_second;
+	y4m = path.size() >= 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+	if (!y4m && path.find('%') == std::string::npos) {
+		error_text = "a PNG capture needs a %d for the frame number in its name";
+		return false;
+	}
+	if (y4m && (y4m_file = fopen(path.c_str(), "wb")) == NULL) {
+		error_text = "cannot write " + path;
+		return false;
+	}
+	y4m_width = y4m_height = 0;
+
+	slots.assign(ring, Slot());
+	for (int i = 0; i < ring; i++) glGenBuffers(1, &slots[i].pbo);
+	next_slot = in_flight = frame_number = 0;
+	totals = Stats();
+	stopping = false;
+	writer = std::thread(&FrameCapture::writerLoop, this);
+	opened = true;
+	return true;
+}
+//---------------------------------------------------------
+void FrameCapture::capture(GLuint framebuffer, int width, int height)
+{
+	if (!opened) return;
+	double start = wallTimeMs();
+	int number = frame_number++;
+	totals.captured++;
+
+	GLint read_framebuffer = 0;
+	glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_framebuffer);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+	if (slots.empty()) {
+		Frame frame = takeFrame(width, height, number);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, frame.rgba.data());
+		queueFrame(frame);
+	}
+	else {
+		//The oldest read has to be out of the slot before the next goes in
+		if (in_flight == (int)slots.size()) {
+			retire(slots[next_slot], true);
+			in_flight--;
+		}
+		Slot& slot = slots[next_slot];
+		size_t bytes = (size_t)width * height * 4;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		if (slot.bytes != bytes) {
+			glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+			slot.bytes = bytes;
+		}
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, (void*)0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		slot.width = width;
+		slot.height = height;
+		slot.number = number;
+		next_slot = (next_slot + 1) % (int)slots.size();
+		in_flight++;
+
+		//Then the older reads that are done by now, in order; the one just issued is not
+		while (in_flight > 1) {
+			int oldest = (next_slot - in_flight + (int)slots.size()) % (int)slots.size();
+			if (!retire(slots[oldest], false)) break;
+			in_flight--;
+		}
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, read_framebuffer);
+	totals.gl_ms += wallTimeMs() - start;
+}
+//---------------------------------------------------------
+bool FrameCapture::retire(Slot& slot, bool wait)
+{
+	GLenum state = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+	if (state == GL_TIMEOUT_EXPIRED) {
+		if (!wait) return false;
+		double start = wallTimeMs();
+		while ((state = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)) == GL_TIMEOUT_EXPIRED) {}
+		totals.fence_wait_ms += wallTimeMs() - start;
+	}
+	glDeleteSync(slot.fence);
+	slot.fence = 0;
+
+	Frame frame = takeFrame(slot.width, slot.height, slot.number);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+	const void* pixels = state == GL_WAIT_FAILED ? NULL : glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame.rgba.size(), GL_MAP_READ_BIT);
+	if (pixels != NULL) {
+		memcpy(frame.rgba.data(), pixels, frame.rgba.size());
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	if (pixels != NULL) queueFrame(frame);
+	else {
+		std::lock_guard<std::mutex> lock(mutex);
+		totals.failed++;
+		spare.push_back(std::move(frame.rgba));
+	}
+	return true;
+}
+//---------------------------------------------------------
+FrameCapture::Frame FrameCapture::takeFrame(int width, int height, int number)
+{
+	Frame frame;
+	frame.width = width;
+	frame.height = height;
+	frame.number = number;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!spare.empty()) {
+			frame.rgba.swap(spare.back());
+			spare.pop_back();
+		}
+	}
+	frame.rgba.resize((size_t)width * height * 4);
+	return frame;
+}
+//---------------------------------------------------------
+void FrameCapture::queueFrame(Frame& frame)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (queue.size() >= MaxQueued) {
+		double start = wallTimeMs();
+		changed.wait(lock, [this]() { return queue.size() < MaxQueued; });
+		totals.queue_wait_ms += wallTimeMs() - start;
+	}
+	queue.push_back(std::move(frame));
+	changed.notify_all();
+}
+//---------------------------------------------------------
+void FrameCapture::close()
+{
+	if (!opened) return;
+	double start = wallTimeMs();
+	for (; in_flight > 0; in_flight--)
+		retire(slots[(next_slot - in_flight + (int)slots.size()) % (int)slots.size()], true);
+	for (size_t i = 0; i < slots.size(); i++) glDeleteBuffers(1, &slots[i].pbo);
+	slots.clear();
+	stopWriter();
+	totals.gl_ms += wallTimeMs() - start;
+
+	if (y4m_file != NULL) fclose(y4m_file);
+	y4m_file = NULL;
+	spare.clear();
+	opened = false;
+}
+//---------------------------------------------------------
+void FrameCapture::stopWriter()
+{
+	if (!writer.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		changed.notify_all();
+	}
+	writer.join();
+}
+//---------------------------------------------------------
+void FrameCapture::writerLoop()
+{
+	for (;;) {
+		Frame frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [this]() { return stopping || !queue.empty(); });
+			if (queue.empty()) return; //Stopping, and every frame written
+			frame = std::move(queue.front());
+			queue.pop_front();
+			changed.notify_all();
+		}
+		double start = wallTimeMs();
+		long long bytes = 0;
+		bool ok = write(frame, bytes);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		totals.write_ms += wallTimeMs() - start;
+		totals.bytes += bytes;
+		if (ok) totals.written++;
+		else totals.failed++;
+		spare.push_back(std::move(frame.rgba));
+	}
+}
+//---------------------------------------------------------
+bool FrameCapture::write(const Frame& frame, long long& bytes)
+{
+	if (y4m) return writeY4M(frame, bytes);
+
+	//Rows top first, each a filter byte (2: Up, the difference from the row above) and RGB
+	int w = frame.width, h = frame.height;
+	size_t stride = (size_t)w * 3 + 1;
+	rows.resize(stride * h);
+	static const unsigned char zeros[4] = { 0, 0, 0, 0 };
+	for (int y = 0; y < h; y++) {
+		const unsigned char* in = &frame.rgba[(size_t)(h - 1 - y) * w * 4];
+		const unsigned char* above = y > 0 ? in + (size_t)w * 4 : zeros;
+		int above_step = y > 0 ? 4 : 0;
+		unsigned char* out = &rows[y * stride];
+		*out++ = 2;
+		for (int x = 0; x < w; x++, in += 4, above += above_step, out += 3) {
+			out[0] = (unsigned char)(in[0] - above[0]);
+			out[1] = (unsigned char)(in[1] - above[1]);
+			out[2] = (unsigned char)(in[2] - above[2]);
+		}
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	unsigned char header[13] = { (unsigned char)(w >> 24), (unsigned char)(w >> 16), (unsigned char)(w >> 8), (unsigned char)w,
+		(unsigned char)(h >> 24), (unsigned char)(h >> 16), (unsigned char)(h >> 8), (unsigned char)h,
+		8, 2, 0, 0, 0 }; //8 bit RGB, deflate, adaptive filtering, no interlace
+	std::vector<unsigned char> compressed;
+	compressed.reserve(rows.size() / 4);
+	deflate(rows.data(), rows.size(), compressed);
+	encoded.assign(signature, signature + 8);
+	putChunk(encoded, "IHDR", header, sizeof(header));
+	putChunk(encoded, "IDAT", compressed.data(), compressed.size());
+	putChunk(encoded, "IEND", NULL, 0);
+
+	char name[1024];
+	snprintf(name, sizeof(name), path.c_str(), frame.number);
+	FILE* f = fopen(name, "wb");
+	if (f == NULL) return false;
+	bool ok = fwrite(encoded.data(), 1, encoded.size(), f) == encoded.size();
+	ok = fclose(f) == 0 && ok;
+	if (ok) bytes = (long long)encoded.size();
+	return ok;
+}
+//---------------------------------------------------------
+/*
+	Y4M: "YUV4MPEG2 W H F I A C" once, then per frame "FRAME\n" and the Y,
+	Cb and Cr planes. 4:2:0 with the chroma of each 2x2 averaged (centered,
+	C420jpeg); BT.601 studio range, Y in [16, 235], chroma in [16, 240].
+*/
+bool FrameCapture::writeY4M(const Frame& frame, long long& bytes)
+{
+	int w = frame.width, h = frame.height;
+	if (y4m_width == 0) {
+		y4m_width = w;
+		y4m_height = h;
+		bytes += fprintf(y4m_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", w, h, fps);
+	}
+	if (w != y4m_width || h != y4m_height) return false; //A stream has one size
+
+	int cw = (w + 1) / 2, ch = (h + 1) / 2;
+	encoded.resize((size_t)w * h + 2 * (size_t)cw * ch);
+	unsigned char* luma = encoded.data();
+	unsigned char* cb = luma + (size_t)w * h;
+	unsigned char* cr = cb + (size_t)cw * ch;
+	for (int y = 0; y < h; y++) {
+		const unsigned char* in = &frame.rgba[(size_t)(h - 1 - y) * w * 4];
+		for (int x = 0; x < w; x++, in += 4)
+			luma[(size_t)y * w + x] = (unsigned char)((66 * in[0] + 129 * in[1] + 25 * in[2] + 128 + 16 * 256) >> 8);
+	}
+	for (int y = 0; y < ch; y++) {
+		//The two rows, the second repeating the first past an odd bottom edge; likewise the columns
+		const unsigned char* row0 = &frame.rgba[(size_t)(h - 1 - 2 * y) * w * 4];
+		const unsigned char* row1 = 2 * y + 1 < h ? row0 - (size_t)w * 4 : row0;
+		for (int x = 0; x < cw; x++) {
+			int x0 = 8 * x, x1 = 2 * x + 1 < w ? x0 + 4 : x0;
+			int r = row0[x0] + row0[x1] + row1[x0] + row1[x1];
+			int g = row0[x0 + 1] + row0[x1 + 1] + row1[x0 + 1] + row1[x1 + 1];
+			int b = row0[x0 + 2] + row0[x1 + 2] + row1[x0 + 2] + row1[x1 + 2];
+			//Sums of 4, so the shift is by 10; the offset keeps them positive for it
+			cb[(size_t)y * cw + x] = (unsigned char)((-38 * r - 74 * g + 112 * b + (128 << 10) + 512) >> 10);
+			cr[(size_t)y * cw + x] = (unsigned char)((112 * r - 94 * g - 18 * b + (128 << 10) + 512) >> 10);
+		}
+	}
+
+	bool ok = fputs("FRAME\n", y4m_file) >= 0 && fwrite(encoded.data(), 1, encoded.size(), y4m_file) == encoded.size();
+	if (ok) bytes += 6 + (long long)encoded.size();
+	return ok;
+}
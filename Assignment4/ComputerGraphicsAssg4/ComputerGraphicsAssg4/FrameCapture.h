@@ -0,0 +1,110 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- FrameCapture.h ---
+//
+//   Records every frame without stalling the GL thread on its pixels.
+//   glReadPixels into client memory waits for the GPU to finish the frame
+//   and copy it back. Here each read goes into the next pixel pack buffer
+//   (PBO) of a ring of them, with a fence behind it, and the GL thread maps
+//   the buffer only once its fence has signaled, a frame or more later, or
+//   when the ring wraps around to it. The mapped pixels are copied into a
+//   frame handed to a writer thread, which turns them right side up and
+//   encodes them:
+//     PNG  a file per frame, named by a printf pattern of the frame number;
+//          Up filtered rows, deflated with fixed Huffman codes and a one
+//          probe LZ77 hash, which is fast and still does well on flat sky
+//          and floor colors
+//     Y4M  one YUV4MPEG2 stream, 4:2:0 BT.601 (studio range), for video tools
+//   At most MaxQueued frames wait for the writer; past that, capture() waits
+//   for it rather than drop frames, and stats() says for how long.
+//
+//   A ring of 0 reads each frame straight into client memory, the stalling
+//   way, to compare against.
+//
+//   Usage:
+//       capture.open("frames/%04d.png", 60);
+//       ... every frame, before the swap: capture.capture(framebuffer, width, height);
+//       capture.close();
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __FRAMECAPTURE_H__
+#define __FRAMECAPTURE_H__
+
+#include "Angel-yjc.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+class FrameCapture {
+public:
+	enum { DefaultRing = 3, MaxQueued = 4 };
+
+	struct Stats {
+		int captured = 0, written = 0, failed = 0;
+		double gl_ms = 0.0;         //The GL thread in capture() and close(): reads, maps and copies, and the waits below
+		double fence_wait_ms = 0.0; //Waiting for a read to finish
+		double queue_wait_ms = 0.0; //Waiting for the writer to take a frame
+		double write_ms = 0.0;      //The writer thread: converting, encoding and writing
+		long long bytes = 0;        //Written
+	};
+
+	~FrameCapture() { stopWriter(); }
+
+	//A path ending in .y4m is a Y4M stream of fps frames a second; any other is a PNG pattern, which needs a %d
+	bool open(const char* path, int fps, int ring = DefaultRing);
+	bool isOpen() const { return opened; }
+	const std::string& error() const { return error_text; }
+
+	//Reads the color of framebuffer, width x height, into the ring; hands the reads that finished to the writer
+	void capture(GLuint framebuffer, int width, int height);
+	//Hands the frames still in the ring to the writer and waits for it to write them all; needs the GL context
+	void close();
+
+	//Complete once close() returns
+	const Stats& stats() const { return totals; }
+
+private:
+	struct Slot {
+		GLuint pbo = 0;
+		GLsync fence = 0;
+		size_t bytes = 0; //Allocated
+		int width = 0, height = 0, number = 0;
+	};
+	struct Frame {
+		int width = 0, height = 0, number = 0;
+		std::vector<unsigned char> rgba; //Bottom row first, as read
+	};
+
+	bool retire(Slot& slot, bool wait); //False while its read is not done and wait is false
+	Frame takeFrame(int width, int height, int number);
+	void queueFrame(Frame& frame);
+	void stopWriter();
+	void writerLoop();
+	bool write(const Frame& frame, long long& bytes);
+	bool writeY4M(const Frame& frame, long long& bytes);
+
+	bool opened = false, y4m = false;
+	std::string path, error_text;
+	int fps = 60, frame_number = 0;
+	std::vector<Slot> slots;
+	int next_slot = 0, in_flight = 0;
+	Stats totals;
+
+	//Writer thread
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<Frame> queue;
+	std::vector<std::vector<unsigned char> > spare; //Buffers of written frames, for the next ones
+	bool stopping = false;
+	FILE* y4m_file = NULL;
+	int y4m_width = 0, y4m_height = 0;
+	std::vector<unsigned char> rows, encoded;       //The writer's scratch
+};
+
+#endif // __FRAMECAPTURE_H__
@@ -0,0 +1,91 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "GBuffer.h"
+#include <stdio.h>
+#include "GLStats.h"
+
+static const GLenum target_formats[GBuffer::TargetCount] = { GL_RGBA16F, GL_RGBA8, GL_RGBA8, GL_RGBA32F, GL_RGBA16F };
+static const GLenum draw_buffers[GBuffer::TargetCount] = {
+	GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4
+};
+
+//---------------------------------------------------------
+void GBuffer::init(int unit, int w, int h)
+{
+	first_unit = unit;
+	width = w;
+	height = h;
+
+	//Read with texelFetch() at the pixel drawn, so no filtering
+	GLint active = 0;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+	glGenTextures(TargetCount, targets);
+	glGenTextures(1, &depth);
+	for (int i = 0; i <= TargetCount; i++) {
+		glActiveTexture(GL_TEXTURE0 + first_unit + i);
+		glBindTexture(GL_TEXTURE_2D, i < TargetCount ? targets[i] : depth);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glActiveTexture(active);
+
+	GLint previous = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	allocate();
+	for (int i = 0; i < TargetCount; i++)
+		glFramebufferTexture2D(GL_FRAMEBUFFER, draw_buffers[i], GL_TEXTURE_2D, targets[i], 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		printf("Error: G-buffer framebuffer incomplete\n");
+	glBindFramebuffer(GL_FRAMEBUFFER, previous);
+}
+//---------------------------------------------------------
+//Storage of every texture at the current size; the attachments keep referring to the same textures
+void GBuffer::allocate()
+{
+	GLint active = 0;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+	for (int i = 0; i < TargetCount; i++) {
+		glActiveTexture(GL_TEXTURE0 + first_unit + i);
+		glTexImage2D(GL_TEXTURE_2D, 0, target_formats[i], width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+	}
+	//With the stencil, for the shadows drawn through it
+	glActiveTexture(GL_TEXTURE0 + depthUnit());
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, width, height, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL);
+	glActiveTexture(active);
+}
+//---------------------------------------------------------
+void GBuffer::resize(int w, int h)
+{
+	if (w == width && h == height) return;
+	width = w;
+	height = h;
+	allocate();
+}
+//---------------------------------------------------------
+void GBuffer::begin()
+{
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &saved_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glDrawBuffers(TargetCount, draw_buffers);
+
+	const GLfloat zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	for (int i = 0; i < TargetCount; i++) glClearBufferfv(GL_COLOR, i, zero);
+	glClearBufferfi(GL_DEPTH_STENCIL, 0, 1.0f, 0);
+}
+//---------------------------------------------------------
+void GBuffer::beginLights()
+{
+	glDrawBuffer(draw_buffers[Color]);
+}
+//---------------------------------------------------------
+void GBuffer::end()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, saved_fbo);
+}
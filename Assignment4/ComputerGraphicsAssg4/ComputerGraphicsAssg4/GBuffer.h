@@ -0,0 +1,68 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- GBuffer.h ---
+//
+//   The surfaces of a frame for deferred lighting: five targets and a depth
+//   and stencil texture, the size of the viewport, each texture kept bound
+//   in a texture unit of its own for the passes reading them.
+//
+//       Color     RGBA16F  what no light adds to: the global ambient, or
+//                          the whole color of an unlit surface; the light
+//                          passes add to it, HDR until the resolve
+//       Diffuse   RGBA8    material diffuse color, tint and texture
+//       Specular  RGBA8    material specular color, tint and texture
+//       Position  RGBA32F  eye frame, times w: 1 where a surface was drawn,
+//                          the alpha of a blended decal over nothing
+//       Normal    RGBA16F  eye frame; w: the shininess, 0 if unlit
+//
+//   The surfaces are drawn with every target. Decals over them (the
+//   projected shadows) leave Normal alone, so blending one changes the
+//   colors, not how the surface shines; a decal lies on its surface, so
+//   blending its position changes nothing but w past the surface. Each
+//   light then adds, over the pixels it may reach, its diffuse and specular
+//   terms to Color; the resolve fogs Color and writes it and the depth to
+//   the framebuffer that was bound before begin().
+//
+//   Usage per frame:
+//       resize(w, h); begin();  ... draw the surfaces ...
+//       beginLights();  ... draw the lights, added ...
+//       end();  ... draw the resolve reading the units ...
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __GBUFFER_H__
+#define __GBUFFER_H__
+
+#include "Angel-yjc.h"
+
+class GBuffer {
+public:
+	enum { Color, Diffuse, Specular, Position, Normal, TargetCount };
+	//The targets a decal leaves unwritten, as bits for RenderState::masked_targets
+	enum { DecalTargets = 1 << Normal };
+
+	//Targets in texture units first_unit on, the depth after them; needs the GL context
+	void init(int first_unit, int width, int height);
+	bool isInitialized() const { return fbo != 0; }
+	//Reallocates the textures for another viewport size
+	void resize(int width, int height);
+
+	int unit(int target) const { return first_unit + target; }
+	int depthUnit() const { return first_unit + TargetCount; }
+
+	//Binds every target and clears them all to zero, until end() restores the previous framebuffer
+	void begin();
+	//Only the Color target, which the lights add to
+	void beginLights();
+	void end();
+
+private:
+	void allocate();
+
+	GLuint fbo = 0, targets[TargetCount] = { 0 }, depth = 0;
+	int first_unit = 0, width = 0, height = 0;
+
+	GLint saved_fbo = 0;
+};
+
+#endif // __GBUFFER_H__
@@ -0,0 +1,51 @@
+#define GL_STATS_DISABLED
+#include "GLStats.h"
+#include <stdio.h>
+
+GLStats gl_stats;
+GLStats gl_stats_last;
+
+//---------------------------------------------------------
+GLStats& GLStats::operator+=(const GLStats& o)
+{
+	draw_calls += o.draw_calls;
+	vertices += o.vertices;
+	program_binds += o.program_binds;
+	buffer_binds += o.buffer_binds;
+	attribute_pointers += o.attribute_pointers;
+	attribute_toggles += o.attribute_toggles;
+	uniform_uploads += o.uniform_uploads;
+	uniform_lookups += o.uniform_lookups;
+	polygon_mode += o.polygon_mode;
+	depth_mask += o.depth_mask;
+	color_mask += o.color_mask;
+	capability_toggles += o.capability_toggles;
+	return *this;
+}
+//---------------------------------------------------------
+//Everything counted except the draws themselves
+long long GLStats::stateChanges() const
+{
+	return program_binds + buffer_binds + attribute_pointers + attribute_toggles + uniform_uploads + uniform_lookups +
+		polygon_mode + depth_mask + color_mask + capability_toggles;
+}
+//---------------------------------------------------------
+void glStatsBeginFrame()
+{
+	gl_stats = GLStats();
+}
+//---------------------------------------------------------
+void glStatsEndFrame()
+{
+	gl_stats_last = gl_stats;
+}
+//---------------------------------------------------------
+void printGLStats(const GLStats& s, int frames)
+{
+	double n = frames > 0 ? frames : 1;
+	printf("  draws %.1f (%.0f vertices), program binds %.1f, buffer binds %.1f, attribute pointers %.1f, attribute toggles %.1f\n",
+		s.draw_calls / n, s.vertices / n, s.program_binds / n, s.buffer_binds / n, s.attribute_pointers / n, s.attribute_toggles / n);
+	printf("  uniform uploads %.1f, uniform lookups %.1f, polygon mode %.1f, depth mask %.1f, color mask %.1f, enable/disable %.1f\n",
+		s.uniform_uploads / n, s.uniform_lookups / n, s.polygon_mode / n, s.depth_mask / n, s.color_mask / n, s.capability_toggles / n);
+	printf("  state changes %.1f per draw\n", s.draw_calls ? (double)s.stateChanges() / s.draw_calls : 0.0);
+}
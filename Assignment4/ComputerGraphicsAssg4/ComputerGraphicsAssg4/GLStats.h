@@ -0,0 +1,131 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- GLStats.h ---
+//
+//   Counts the GL calls of a frame that cost driver work: draws and the
+//   vertices they submit, program and buffer binds, vertex attribute
+//   (re)specification, uniform uploads and lookups, and the fixed-function
+//   state toggles display() makes (glPolygonMode, glDepthMask, glColorMask,
+//   glEnable/glDisable).
+//
+//   Include it last in a file that issues GL calls: the calls below are
+//   redirected to wrappers that bump gl_stats and forward to the real entry
+//   point (GLEW's, for the post-1.1 ones). Define GL_STATS_DISABLED to
+//   compile the redirection out.
+//
+//   display() brackets its passes with glStatsBeginFrame() and
+//   glStatsEndFrame(); gl_stats_last then holds the finished frame.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __GLSTATS_H__
+#define __GLSTATS_H__
+
+#include "Angel-yjc.h"
+
+struct GLStats {
+	long long draw_calls = 0, vertices = 0;   //Vertices times instances
+	long long program_binds = 0, buffer_binds = 0;
+	long long attribute_pointers = 0;          //glVertexAttribPointer, glVertexAttribDivisor
+	long long attribute_toggles = 0;           //glEnable/DisableVertexAttribArray
+	long long uniform_uploads = 0, uniform_lookups = 0;
+	long long polygon_mode = 0, depth_mask = 0, color_mask = 0;
+	long long capability_toggles = 0;          //glEnable, glDisable
+
+	GLStats& operator+=(const GLStats& o);
+	long long stateChanges() const;
+};
+
+extern GLStats gl_stats;      //The frame in progress
+extern GLStats gl_stats_last; //The last finished frame
+
+void glStatsBeginFrame();
+void glStatsEndFrame();
+
+//Prints the counts divided by frames (per-frame averages of a run's total)
+void printGLStats(const GLStats& s, int frames = 1);
+
+#ifndef GL_STATS_DISABLED
+
+inline void statUseProgram(GLuint p) { gl_stats.program_binds++; glUseProgram(p); }
+inline void statBindBuffer(GLenum target, GLuint b) { gl_stats.buffer_binds++; glBindBuffer(target, b); }
+inline void statVertexAttribPointer(GLuint i, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* p) {
+	gl_stats.attribute_pointers++; glVertexAttribPointer(i, size, type, normalized, stride, p);
+}
+inline void statVertexAttribDivisor(GLuint i, GLuint d) { gl_stats.attribute_pointers++; glVertexAttribDivisor(i, d); }
+inline void statEnableVertexAttribArray(GLuint i) { gl_stats.attribute_toggles++; glEnableVertexAttribArray(i); }
+inline void statDisableVertexAttribArray(GLuint i) { gl_stats.attribute_toggles++; glDisableVertexAttribArray(i); }
+
+inline GLint statGetUniformLocation(GLuint p, const GLchar* name) { gl_stats.uniform_lookups++; return glGetUniformLocation(p, name); }
+inline void statUniform1i(GLint l, GLint v) { gl_stats.uniform_uploads++; glUniform1i(l, v); }
+inline void statUniform1f(GLint l, GLfloat v) { gl_stats.uniform_uploads++; glUniform1f(l, v); }
+inline void statUniform1iv(GLint l, GLsizei n, const GLint* v) { gl_stats.uniform_uploads++; glUniform1iv(l, n, v); }
+inline void statUniform1fv(GLint l, GLsizei n, const GLfloat* v) { gl_stats.uniform_uploads++; glUniform1fv(l, n, v); }
+inline void statUniform3fv(GLint l, GLsizei n, const GLfloat* v) { gl_stats.uniform_uploads++; glUniform3fv(l, n, v); }
+inline void statUniform4fv(GLint l, GLsizei n, const GLfloat* v) { gl_stats.uniform_uploads++; glUniform4fv(l, n, v); }
+inline void statUniformMatrix3fv(GLint l, GLsizei n, GLboolean t, const GLfloat* v) { gl_stats.uniform_uploads++; glUniformMatrix3fv(l, n, t, v); }
+inline void statUniformMatrix4fv(GLint l, GLsizei n, GLboolean t, const GLfloat* v) { gl_stats.uniform_uploads++; glUniformMatrix4fv(l, n, t, v); }
+
+inline void statDrawArrays(GLenum mode, GLint first, GLsizei count) {
+	gl_stats.draw_calls++; gl_stats.vertices += count; glDrawArrays(mode, first, count);
+}
+inline void statDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instances) {
+	gl_stats.draw_calls++; gl_stats.vertices += (long long)count * instances; glDrawArraysInstanced(mode, first, count, instances);
+}
+
+inline void statPolygonMode(GLenum face, GLenum mode) { gl_stats.polygon_mode++; glPolygonMode(face, mode); }
+inline void statDepthMask(GLboolean on) { gl_stats.depth_mask++; glDepthMask(on); }
+inline void statColorMask(GLboolean r, GLboolean g, GLboolean b, GLboolean a) { gl_stats.color_mask++; glColorMask(r, g, b, a); }
+inline void statEnable(GLenum cap) { gl_stats.capability_toggles++; glEnable(cap); }
+inline void statDisable(GLenum cap) { gl_stats.capability_toggles++; glDisable(cap); }
+
+//The wrappers above were expanded with GLEW's definitions; from here on the names mean the wrappers
+#undef glUseProgram
+#undef glBindBuffer
+#undef glVertexAttribPointer
+#undef glVertexAttribDivisor
+#undef glEnableVertexAttribArray
+#undef glDisableVertexAttribArray
+#undef glGetUniformLocation
+#undef glUniform1i
+#undef glUniform1f
+#undef glUniform1iv
+#undef glUniform1fv
+#undef glUniform3fv
+#undef glUniform4fv
+#undef glUniformMatrix3fv
+#undef glUniformMatrix4fv
+#undef glDrawArrays
+#undef glDrawArraysInstanced
+#undef glPolygonMode
+#undef glDepthMask
+#undef glColorMask
+#undef glEnable
+#undef glDisable
+
+#define glUseProgram statUseProgram
+#define glBindBuffer statBindBuffer
+#define glVertexAttribPointer statVertexAttribPointer
+#define glVertexAttribDivisor statVertexAttribDivisor
+#define glEnableVertexAttribArray statEnableVertexAttribArray
+#define glDisableVertexAttribArray statDisableVertexAttribArray
+#define glGetUniformLocation statGetUniformLocation
+#define glUniform1i statUniform1i
+#define glUniform1f statUniform1f
+#define glUniform1iv statUniform1iv
+#define glUniform1fv statUniform1fv
+#define glUniform3fv statUniform3fv
+#define glUniform4fv statUniform4fv
+#define glUniformMatrix3fv statUniformMatrix3fv
+#define glUniformMatrix4fv statUniformMatrix4fv
+#define glDrawArrays statDrawArrays
+#define glDrawArraysInstanced statDrawArraysInstanced
+#define glPolygonMode statPolygonMode
+#define glDepthMask statDepthMask
+#define glColorMask statColorMask
+#define glEnable statEnable
+#define glDisable statDisable
+
+#endif // GL_STATS_DISABLED
+
+#endif // __GLSTATS_H__
@@ -0,0 +1,150 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "GpuTimer.h"
+
+//---------------------------------------------------------
+void GpuTimer::init(const char* const* pass_names, int pass_count)
+{
+	if (pass_count > MaxPasses) pass_count = MaxPasses;
+	names.assign(pass_names, pass_names + pass_count);
+
+	queries.resize(Latency * (MaxPasses + 1));
+	glGenQueries((GLsizei)queries.size(), queries.data());
+	for (int i = 0; i < pass_count; i++) {
+		samples[i].assign(Window, 0.0);
+		sample_count[i] = 0;
+	}
+	for (int s = 0; s < Latency; s++) frames[s].marks = 0;
+	current = -1;
+	frame_count = dropped_frames = 0;
+}
+//---------------------------------------------------------
+void GpuTimer::beginFrame()
+{
+	if (!isInitialized()) return;
+
+	current = frame_count % Latency;
+	if (frames[current].marks > 0) resolve(current, false);
+	frames[current].marks = 0;
+	frames[current].frame_number = frame_count++;
+}
+//---------------------------------------------------------
+void GpuTimer::beginPass(int pass)
+{
+	if (current < 0 || pass >= (int)names.size()) return;
+
+	Frame& f = frames[current];
+	if (f.marks >= MaxPasses) return;
+	glQueryCounter(queries[current * (MaxPasses + 1) + f.marks], GL_TIMESTAMP);
+	f.pass[f.marks++] = pass;
+}
+//---------------------------------------------------------
+void GpuTimer::endFrame()
+{
+	if (current < 0) return;
+
+	Frame& f = frames[current];
+	glQueryCounter(queries[current * (MaxPasses + 1) + f.marks], GL_TIMESTAMP);
+	f.pass[f.marks++] = -1;
+	current = -1;
+}
+//---------------------------------------------------------
+void GpuTimer::flush()
+{
+	for (int i = 0; i < Latency; i++) {
+		int slot = (frame_count + i) % Latency;
+		if (slot != current && frames[slot].marks > 0) {
+			resolve(slot, true);
+			frames[slot].marks = 0;
+		}
+	}
+}
+//---------------------------------------------------------
+void GpuTimer::resolve(int slot, bool wait)
+{
+	Frame& f = frames[slot];
+	const GLuint* q = &queries[slot * (MaxPasses + 1)];
+
+	//The timestamps complete in order, so the last one tells for the whole frame
+	if (!wait) {
+		GLint available = 0;
+		glGetQueryObjectiv(q[f.marks - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			dropped_frames++;
+			return;
+		}
+	}
+
+	GLuint64 stamp[MaxPasses + 1];
+	for (int m = 0; m < f.marks; m++)
+		glGetQueryObjectui64v(q[m], GL_QUERY_RESULT, &stamp[m]);
+
+	double ms[MaxPasses];
+	bool drawn[MaxPasses] = { false };
+	for (int m = 0; m + 1 < f.marks; m++) {
+		int pass = f.pass[m];
+		double t = (stamp[m + 1] - stamp[m]) / 1.0e6;
+		ms[pass] = drawn[pass] ? ms[pass] + t : t;
+		drawn[pass] = true;
+	}
+
+	for (int pass = 0; pass < (int)names.size(); pass++)
+		if (drawn[pass]) samples[pass][sample_count[pass]++ % Window] = ms[pass];
+
+	if (csv) {
+		fprintf(csv, "%d", f.frame_number);
+		for (int pass = 0; pass < (int)names.size(); pass++) {
+			if (drawn[pass]) fprintf(csv, ",%.4f", ms[pass]);
+			else fprintf(csv, ",");
+		}
+		fprintf(csv, ",%.4f\n", (stamp[f.marks - 1] - stamp[0]) / 1.0e6);
+	}
+}
+//---------------------------------------------------------
+TimingSeries GpuTimer::passStats(int pass) const
+{
+	TimingSeries s;
+	int n = sample_count[pass] < Window ? sample_count[pass] : Window;
+	for (int i = 0; i < n; i++) s.add(samples[pass][i]);
+	return s;
+}
+//---------------------------------------------------------
+void GpuTimer::clearStats()
+{
+	for (int pass = 0; pass < MaxPasses; pass++) sample_count[pass] = 0;
+	dropped_frames = 0;
+}
+//---------------------------------------------------------
+std::string GpuTimer::summary() const
+{
+	char line[128];
+	sprintf(line, "%-12s %7s %7s %7s\n", "gpu ms", "min", "avg", "p99");
+	std::string text = line;
+	for (int pass = 0; pass < (int)names.size(); pass++) {
+		TimingSeries s = passStats(pass);
+		if (s.count() == 0) continue;
+		sprintf(line, "%-12s %7.3f %7.3f %7.3f\n", names[pass], s.min(), s.average(), s.percentile(99));
+		text += line;
+	}
+	return text;
+}
+//---------------------------------------------------------
+bool GpuTimer::openCSV(const char* path)
+{
+	closeCSV();
+	csv = fopen(path, "w");
+	if (csv == NULL) return false;
+
+	fprintf(csv, "frame");
+	for (size_t i = 0; i < names.size(); i++) fprintf(csv, ",%s ms", names[i]);
+	fprintf(csv, ",frame ms\n");
+	return true;
+}
+//---------------------------------------------------------
+void GpuTimer::closeCSV()
+{
+	if (csv) fclose(csv);
+	csv = NULL;
+}
@@ -0,0 +1,83 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- GpuTimer.h ---
+//
+//   GPU time per render pass, from GL_TIMESTAMP queries (glQueryCounter):
+//   one timestamp when each pass begins and one when the frame ends, so a
+//   pass lasts from its timestamp to the next one. Timestamps, unlike
+//   GL_TIME_ELAPSED, may be issued inside another timer query, so a frame
+//   can be timed as a whole and per pass at the same time.
+//
+//   The queries of a frame are read Latency frames later, when its slot in
+//   the ring comes round again; if the GPU has not caught up by then the
+//   frame is dropped rather than waited for. Each pass keeps its last
+//   Window samples for the rolling statistics; a pass that was not drawn in
+//   a frame adds no sample.
+//
+//   Usage per frame:
+//       beginFrame();  beginPass(0); ... beginPass(1); ...  endFrame();
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __GPUTIMER_H__
+#define __GPUTIMER_H__
+
+#include "Angel-yjc.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class GpuTimer {
+public:
+	enum { MaxPasses = 16, Latency = 4, Window = 120 };
+
+	//Needs the GL context; pass_names outlive the timer
+	void init(const char* const* pass_names, int pass_count);
+	bool isInitialized() const { return !queries.empty(); }
+
+	void beginFrame();
+	void beginPass(int pass);
+	void endFrame();
+
+	//Reads every frame still in the ring, waiting for the GPU (for the end of a run)
+	void flush();
+
+	int passCount() const { return (int)names.size(); }
+	const char* passName(int pass) const { return names[pass]; }
+
+	//Rolling statistics over the last Window samples of the pass
+	TimingSeries passStats(int pass) const;
+	int droppedFrames() const { return dropped_frames; }
+
+	//Forgets the samples of every pass and the dropped frames (between the runs of a benchmark)
+	void clearStats();
+
+	//A header line, then one line per pass that has samples: name, min, avg, p99 in ms
+	std::string summary() const;
+
+	//Writes a CSV row per resolved frame (ms per pass, empty if not drawn) from now on
+	bool openCSV(const char* path);
+	void closeCSV();
+
+private:
+	struct Frame {
+		int marks = 0;
+		int pass[MaxPasses + 1]; //Pass begun at each mark; the last mark ends the frame
+		int frame_number = 0;
+	};
+
+	void resolve(int slot, bool wait);
+
+	std::vector<const char*> names;
+	std::vector<GLuint> queries; //[slot * (MaxPasses + 1) + mark]
+	Frame frames[Latency];
+	int current = -1, frame_count = 0, dropped_frames = 0;
+
+	std::vector<double> samples[MaxPasses]; //Rings of Window samples
+	int sample_count[MaxPasses] = { 0 };
+
+	FILE* csv = NULL;
+};
+
+#endif // __GPUTIMER_H__
@@ -0,0 +1,225 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "Headless.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#ifdef HAVE_EGL
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLContext egl_context = EGL_NO_CONTEXT;
+#endif
+
+static GLuint fbo = 0, color_rb = 0, depth_rb = 0;
+
+//---------------------------------------------------------
+bool createHeadlessContext(int width, int height)
+{
+#ifdef HAVE_EGL
+	//Prefer the surfaceless platform, it needs neither a GPU nor a display server
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+		egl_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (egl_display == EGL_NO_DISPLAY)
+		egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, &major, &minor)) {
+		printf("Error: no EGL display available\n");
+		return false;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		printf("Error: EGL implementation has no desktop OpenGL\n");
+		return false;
+	}
+
+	//The context renders into our own FBO, so any config (or none) will do
+	EGLint config_attribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config = NULL;
+	EGLint config_count = 0;
+	eglChooseConfig(egl_display, config_attribs, &config, 1, &config_count);
+
+	EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+		EGL_NONE
+	};
+	egl_context = eglCreateContext(egl_display, config_count > 0 ? config : (EGLConfig)0,
+		EGL_NO_CONTEXT, context_attribs);
+	if (egl_context == EGL_NO_CONTEXT ||
+		!eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context)) {
+		printf("Error: could not create a surfaceless OpenGL 3.3 context (EGL %d.%d)\n", major, minor);
+		return false;
+	}
+
+	//GLEW built for GLX reports a missing X display here, after it has loaded the GL entry points
+	glewExperimental = GL_TRUE;
+	GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+	if (err == GLEW_ERROR_NO_GLX_DISPLAY) err = GLEW_OK;
+#endif
+	if (GLEW_OK != err) {
+		printf("Error: glewInit failed: %s\n", (char*)glewGetErrorString(err));
+		return false;
+	}
+
+	glGenRenderbuffers(1, &color_rb);
+	glBindRenderbuffer(GL_RENDERBUFFER, color_rb);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+	glGenRenderbuffers(1, &depth_rb);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth_rb);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color_rb);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth_rb);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("Error: offscreen framebuffer is incomplete\n");
+		return false;
+	}
+
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
+	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glViewport(0, 0, width, height);
+	return true;
+#else
+	printf("Error: headless mode needs EGL, rebuild with HAVE_EGL\n");
+	return false;
+#endif
+}
+//---------------------------------------------------------
+void destroyHeadlessContext()
+{
+#ifdef HAVE_EGL
+	if (egl_context == EGL_NO_CONTEXT) return;
+
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteRenderbuffers(1, &color_rb);
+	glDeleteRenderbuffers(1, &depth_rb);
+
+	eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(egl_display, egl_context);
+	eglTerminate(egl_display);
+	egl_context = EGL_NO_CONTEXT;
+#endif
+}
+//---------------------------------------------------------
+GLuint headlessFramebuffer()
+{
+	return fbo;
+}
+//---------------------------------------------------------
+void readHeadlessPixels(int width, int height, unsigned char* rgb)
+{
+	std::vector<unsigned char> rows(width * height * 3);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rows.data());
+
+	//OpenGL returns the bottom row first
+	for (int y = 0; y < height; y++)
+		memcpy(rgb + y * width * 3, &rows[(height - 1 - y) * width * 3], width * 3);
+}
+//---------------------------------------------------------
+bool writePPM(const char* path, int width, int height, const unsigned char* rgb)
+{
+	FILE* fp = fopen(path, "wb");
+	if (fp == NULL) return false;
+
+	fprintf(fp, "P6\n%d %d\n255\n", width, height);
+	fwrite(rgb, 1, width * height * 3, fp);
+	fclose(fp);
+	return true;
+}
+//---------------------------------------------------------
+bool readPPM(const char* path, int* width, int* height, std::vector<unsigned char>* rgb)
+{
+	FILE* fp = fopen(path, "rb");
+	if (fp == NULL) return false;
+
+	int max_value = 0;
+	bool ok = fscanf(fp, "P6 %d %d %d", width, height, &max_value) == 3 && max_value == 255 &&
+		*width > 0 && *height > 0 && fgetc(fp) != EOF; //The single whitespace after the header
+	if (ok) {
+		rgb->resize(*width * *height * 3);
+		ok = fread(rgb->data(), 1, rgb->size(), fp) == rgb->size();
+	}
+	fclose(fp);
+	return ok;
+}
+//---------------------------------------------------------
+ImageDiff compareImages(const unsigned char* a, const unsigned char* b, int width, int height, int tolerance)
+{
+	ImageDiff d;
+	long long sum = 0;
+	for (int i = 0; i < width * height; i++) {
+		int pixel_max = 0;
+		for (int c = 0; c < 3; c++) {
+			int diff = abs((int)a[i * 3 + c] - (int)b[i * 3 + c]);
+			sum += diff;
+			if (diff > pixel_max) pixel_max = diff;
+		}
+		if (pixel_max > d.max_channel) d.max_channel = pixel_max;
+		if (pixel_max > tolerance) d.pixels_over++;
+	}
+	d.mean_channel = width * height > 0 ? (double)sum / (width * height * 3) : 0.0;
+	return d;
+}
+//---------------------------------------------------------
+//Sums of the 3x3 neighborhood of every pixel of an RGB image, per channel; the edges repeat
+static void boxSums(const unsigned char* rgb, int width, int height, std::vector<int>* sums)
+{
+	std::vector<int> rows(width * height * 3);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++) {
+			int left = x > 0 ? x - 1 : x, right = x < width - 1 ? x + 1 : x;
+			for (int c = 0; c < 3; c++)
+				rows[(y * width + x) * 3 + c] = rgb[(y * width + left) * 3 + c] + rgb[(y * width + x) * 3 + c] +
+					rgb[(y * width + right) * 3 + c];
+		}
+	sums->resize(rows.size());
+	for (int y = 0; y < height; y++) {
+		int up = y > 0 ? y - 1 : y, down = y < height - 1 ? y + 1 : y;
+		for (int i = 0; i < width * 3; i++)
+			(*sums)[y * width * 3 + i] = rows[up * width * 3 + i] + rows[y * width * 3 + i] + rows[down * width * 3 + i];
+	}
+}
+//---------------------------------------------------------
+ImageDiff comparePerceptual(const unsigned char* a, const unsigned char* b, int width, int height, int tolerance)
+{
+	ImageDiff d;
+	std::vector<int> sums_a, sums_b;
+	boxSums(a, width, height, &sums_a);
+	boxSums(b, width, height, &sums_b);
+
+	double sum = 0.0;
+	for (int i = 0; i < width * height; i++) {
+		//BT.601 luma and chroma of the difference of the 3x3 means
+		double r = (sums_a[i * 3] - sums_b[i * 3]) / 9.0;
+		double g = (sums_a[i * 3 + 1] - sums_b[i * 3 + 1]) / 9.0;
+		double bl = (sums_a[i * 3 + 2] - sums_b[i * 3 + 2]) / 9.0;
+		double y = 0.299 * r + 0.587 * g + 0.114 * bl;
+		double cb = (bl - y) * 0.564, cr = (r - y) * 0.713;
+		double diff = sqrt(y * y + 0.25 * (cb * cb + cr * cr));
+		sum += diff;
+		if ((int)(diff + 0.5) > d.max_channel) d.max_channel = (int)(diff + 0.5);
+		if (diff > tolerance) d.pixels_over++;
+	}
+	d.mean_channel = width * height > 0 ? sum / (width * height) : 0.0;
+	return d;
+}
@@ -0,0 +1,50 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- Headless.h ---
+//
+//   Offscreen OpenGL context for running without a window: an EGL context
+//   with no surface (EGL_MESA_platform_surfaceless, so it also works on Mesa
+//   llvmpipe with no GPU and no display server), rendering into a
+//   framebuffer object with RGBA8 color and 24/8 depth-stencil attachments.
+//
+//   Only available when built with HAVE_EGL; otherwise createHeadlessContext()
+//   reports the missing support and fails.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+#include "Angel-yjc.h"
+#include <vector>
+
+//Creates the context and a width x height FBO, makes both current
+bool createHeadlessContext(int width, int height);
+void destroyHeadlessContext();
+
+//The offscreen framebuffer, bound by createHeadlessContext()
+GLuint headlessFramebuffer();
+
+//Reads the offscreen color buffer as tightly packed RGB rows, top row first
+void readHeadlessPixels(int width, int height, unsigned char* rgb);
+
+//Writes an RGB image (top row first) as a binary PPM
+bool writePPM(const char* path, int width, int height, const unsigned char* rgb);
+
+//Reads a binary (P6, 8-bit) PPM written by writePPM()
+bool readPPM(const char* path, int* width, int* height, std::vector<unsigned char>* rgb);
+
+//Per-pixel difference of two RGB images of the same size
+struct ImageDiff {
+	int max_channel = 0;      //Largest difference of one channel
+	double mean_channel = 0;  //Mean over all channels
+	int pixels_over = 0;      //Pixels with a channel differing by more than the tolerance
+};
+ImageDiff compareImages(const unsigned char* a, const unsigned char* b, int width, int height, int tolerance);
+
+//The same, but closer to what is seen: each pixel is the mean of its 3x3 neighborhood, so an edge
+//rasterized a pixel over counts for a ninth of its step, and the difference is that of luma, with the
+//two chroma differences at half weight. max_channel and pixels_over are in those units
+ImageDiff comparePerceptual(const unsigned char* a, const unsigned char* b, int width, int height, int tolerance);
+
+#endif // __HEADLESS_H__
@@ -4,6 +4,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <string>
 
 #include "Angel-yjc.h"
 
@@ -40,9 +42,53 @@ readShaderSource(const char* shaderFile)
 }
 
 
+// Replaces each line #include "file" of source with that file's text, and
+// puts defines right after the #version line (which must stay first).
+// #line directives keep the compiler's line numbers those of the file.
+static char*
+expandShaderSource(char* source, const char* shaderFile, const char* defines)
+{
+    std::string out;
+    int line = 1;
+    for (char* p = source; *p != '\0'; line++) {
+	char* end = strchr(p, '\n');
+	size_t length = end ? end - p + 1 : strlen(p);
+	std::string text(p, length);
+	p += length;
+
+	size_t first = text.find_first_not_of(" \t");
+	if (first != std::string::npos && text.compare(first, 8, "#include") == 0) {
+	    size_t open = text.find('"', first), close = text.find('"', open + 1);
+	    std::string name = open != std::string::npos && close != std::string::npos ? text.substr(open + 1, close - open - 1) : "";
+	    char* included = name.empty() ? NULL : readShaderSource(name.c_str());
+	    if (included == NULL) {
+		std::cerr << shaderFile << ":" << line << ": cannot include " << text;
+		exit( EXIT_FAILURE );
+	       }
+	    out += included;
+	    delete [] included;
+	    out += "\n#line " + std::to_string(line + 1) + "\n";
+	   }
+	else {
+	    out += text;
+	    if (defines != NULL && first != std::string::npos && text.compare(first, 8, "#version") == 0) {
+		if (out[out.size() - 1] != '\n') out += "\n";
+		out += defines;
+		out += "\n#line " + std::to_string(line + 1) + "\n";
+	       }
+	   }
+       }
+
+    delete [] source;
+    char* buf = new char[out.size() + 1];
+    memcpy(buf, out.c_str(), out.size() + 1);
+    return buf;
+}
+
+
 // Create a GLSL program object from vertex and fragment shader files
 GLuint
-InitShader(const char* vShaderFile, const char* fShaderFile)
+InitShader(const char* vShaderFile, const char* fShaderFile, const char* defines)
 {
     struct Shader {
 	const char*  filename;
@@ -63,6 +109,7 @@ InitShader(const char* vShaderFile, const char* fShaderFile)
 	    exit( EXIT_FAILURE );	
 	   }
         else printf("Successfully read %s\n", s.filename);
+	s.source = expandShaderSource( s.source, s.filename, defines );
 
 	GLuint shader = glCreateShader( s.type );
 	glShaderSource( shader, 1, (const GLchar**) &s.source, NULL );
@@ -0,0 +1,138 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "InputLog.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char log_magic[4] = { 'R', 'S', 'I', 'N' };
+static const uint32_t log_version = 2; //1 stored value in 16 bits, still read
+
+//Little endian regardless of the host, byte by byte
+static void put(std::vector<unsigned char>& out, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; i++) out.push_back((unsigned char)(v >> (8 * i)));
+}
+static uint64_t get(const unsigned char*& in, int bytes)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < bytes; i++) v |= (uint64_t)in[i] << (8 * i);
+	in += bytes;
+	return v;
+}
+
+//---------------------------------------------------------
+void InputLog::startRecording(double step, int window_width, int window_height)
+{
+	step_ms = step;
+	width = window_width;
+	height = window_height;
+	log.clear();
+	cursor = 0;
+	is_recording = true;
+	start_ms = wallTimeMs();
+}
+//---------------------------------------------------------
+void InputLog::record(int frame, Type type, int code, int value, int x, int y)
+{
+	if (!is_recording) return;
+
+	Event e;
+	e.frame = (uint32_t)frame;
+	e.wall_ms = (float)(wallTimeMs() - start_ms);
+	e.type = (uint8_t)type;
+	e.code = (uint8_t)code;
+	e.value = (int32_t)value;
+	e.x = (int16_t)x;
+	e.y = (int16_t)y;
+	log.push_back(e);
+}
+//---------------------------------------------------------
+bool InputLog::save(const char* path, int frame)
+{
+	record(frame, End, 0, 0);
+	is_recording = false;
+
+	std::vector<unsigned char> out(log_magic, log_magic + 4);
+	put(out, log_version, 4);
+	uint64_t step_bits;
+	memcpy(&step_bits, &step_ms, 8);
+	put(out, step_bits, 8);
+	put(out, width, 4);
+	put(out, height, 4);
+	put(out, sphere_file.size(), 4);
+	out.insert(out.end(), sphere_file.begin(), sphere_file.end());
+	put(out, log.size(), 4);
+	for (size_t i = 0; i < log.size(); i++) {
+		const Event& e = log[i];
+		uint32_t ms_bits;
+		memcpy(&ms_bits, &e.wall_ms, 4);
+		put(out, e.frame, 4);
+		put(out, ms_bits, 4);
+		put(out, e.type, 1);
+		put(out, e.code, 1);
+		put(out, (uint32_t)e.value, 4);
+		put(out, (uint16_t)e.x, 2);
+		put(out, (uint16_t)e.y, 2);
+	}
+
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) return false;
+	bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+	return fclose(f) == 0 && ok;
+}
+//---------------------------------------------------------
+bool InputLog::load(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) return false;
+	std::vector<unsigned char> data;
+	unsigned char chunk[4096];
+	for (size_t n; (n = fread(chunk, 1, sizeof(chunk), f)) > 0;) data.insert(data.end(), chunk, chunk + n);
+	fclose(f);
+
+	const unsigned char* in = data.data();
+	const unsigned char* end = in + data.size();
+	if (data.size() < 32 || memcmp(in, log_magic, 4) != 0) return false;
+	in += 4;
+	uint32_t version = (uint32_t)get(in, 4);
+	if (version < 1 || version > log_version) return false;
+	const int value_bytes = version == 1 ? 2 : 4;
+	uint64_t step_bits = get(in, 8);
+	memcpy(&step_ms, &step_bits, 8);
+	width = (int)get(in, 4);
+	height = (int)get(in, 4);
+	size_t name_length = (size_t)get(in, 4);
+	if (name_length > (size_t)(end - in) - 4) return false;
+	sphere_file.assign((const char*)in, name_length);
+	in += name_length;
+
+	size_t count = (size_t)get(in, 4);
+	if (count == 0 || count > (size_t)(end - in) / (14 + value_bytes)) return false;
+	log.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		Event& e = log[i];
+		e.frame = (uint32_t)get(in, 4);
+		uint32_t ms_bits = (uint32_t)get(in, 4);
+		memcpy(&e.wall_ms, &ms_bits, 4);
+		e.type = (uint8_t)get(in, 1);
+		e.code = (uint8_t)get(in, 1);
+		e.value = version == 1 ? (int16_t)get(in, 2) : (int32_t)get(in, 4);
+		e.x = (int16_t)get(in, 2);
+		e.y = (int16_t)get(in, 2);
+	}
+	is_recording = false;
+	cursor = 0;
+	return log.back().type == End;
+}
+//---------------------------------------------------------
+const InputLog::Event* InputLog::next(int frame)
+{
+	if (cursor >= log.size()) return NULL;
+	const Event& e = log[cursor];
+	if (e.type == End || (int)e.frame > frame) return NULL;
+	cursor++;
+	return &e;
+}
@@ -0,0 +1,75 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- InputLog.h ---
+//
+//   Records the GLUT input callbacks of a session (keys, mouse buttons,
+//   menu selections, reshapes) so the session can be replayed as a
+//   benchmark workload.
+//
+//   Each event is stamped with the number of frames displayed before it
+//   arrived. The recording runs on the fixed simulation clock, so the
+//   animation state at a given frame depends only on the events before it;
+//   a replay that dispatches every event before the same frame and steps
+//   the clock the same way draws exactly the same frames, at any speed.
+//
+//   File format, little endian: the magic "RSIN", version, step in ms
+//   (double), window width and height, the sphere file name (length and
+//   bytes), the event count, then 18 bytes per event:
+//       frame (u32), wall ms since recording began (f32), type (u8),
+//       code (u8), value (i32), x (i16), y (i16)
+//   Version 1 logs, with a 16 bit value, are read too.
+//   The log ends with an End event at the frame count of the session.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __INPUTLOG_H__
+#define __INPUTLOG_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class InputLog {
+public:
+	enum Type {
+		Keyboard, //value: key, x, y: mouse position
+		Mouse,    //code: button, value: state, x, y
+		Menu,     //code: menu index (the order menus are numbered in by the caller), value: entry id
+		Reshape,  //x, y: width and height
+		End       //Frame count of the session, last event of every log
+	};
+
+	struct Event {
+		uint32_t frame;
+		float wall_ms;
+		uint8_t type, code;
+		int32_t value;  //Wide enough for a menu entry id such as a --spheres count
+		int16_t x, y;
+	};
+
+	double step_ms = 0.0;
+	int width = 0, height = 0;
+	std::string sphere_file;
+
+	void startRecording(double step, int window_width, int window_height);
+	bool recording() const { return is_recording; }
+	void record(int frame, Type type, int code, int value, int x = 0, int y = 0);
+
+	//Ends the log with an End event at frame and writes it
+	bool save(const char* path, int frame);
+	bool load(const char* path);
+
+	const std::vector<Event>& events() const { return log; }
+	int endFrame() const { return log.empty() ? 0 : (int)log.back().frame; }
+
+	//Replay: the next event before frame (in recorded order), or NULL once they are all taken
+	const Event* next(int frame);
+
+private:
+	std::vector<Event> log;
+	bool is_recording = false;
+	double start_ms = 0.0;
+	size_t cursor = 0;
+};
+
+#endif // __INPUTLOG_H__
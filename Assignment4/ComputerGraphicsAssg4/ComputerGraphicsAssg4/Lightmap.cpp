@@ -0,0 +1,75 @@
+#include "Lightmap.h"
+#include "ThreadPool.h"
+#include "Timing.h"
+#include <math.h>
+#include "GLStats.h"
+
+//---------------------------------------------------------
+void Lightmap::init(int texture_unit, int texels_per_side, float x0, float x1, float z0, float z1, float y)
+{
+	unit = texture_unit;
+	size = texels_per_side;
+	area.place(x0, x1, z0, z1);
+	height = y;
+	texel_data.assign((size_t)size * size * 3, 0.0f);
+	bake_count = 0;
+	if (unit < 0) return;
+
+	//Half floats: the gradients of a spot light band visibly in 8 bits
+	GLint active = 0;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glGenTextures(1, &map);
+	glBindTexture(GL_TEXTURE_2D, map);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, size, size, 0, GL_RGB, GL_FLOAT, texel_data.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glActiveTexture(active);
+}
+//---------------------------------------------------------
+void Lightmap::bake(const BakeLight* lights, int count)
+{
+	double start = wallTimeMs();
+	const vec3 N(0.0, 1.0, 0.0);
+
+	ThreadPool::instance().parallelFor(size, [&](int begin, int end, int) {
+		for (int row = begin; row < end; row++) {
+			float* out = &texel_data[(size_t)row * size * 3];
+			for (int column = 0; column < size; column++, out += 3) {
+				vec2 xz = area.texelCenter(column, row, size);
+				point3 pos(xz.x, height, xz.y);
+				color4 c(0.0, 0.0, 0.0, 0.0);
+				for (int i = 0; i < count; i++) {
+					const BakeLight& light = lights[i];
+					vec3 D = light.position - pos;
+					float dist = length(D);
+					vec3 L = D / dist;
+					float attenuation = 1.0f / (light.const_att + light.linear_att * dist + light.quad_att * dist * dist);
+					if (light.type == 3) {
+						float Lfl = dot(normalize(light.focus - light.position), -L);
+						if (Lfl < cos(light.cutoff * DegreesToRadians)) continue;
+						attenuation *= pow(Lfl, light.exponent);
+					}
+					c += attenuation * (light.ambient + (float)fmax(dot(L, N), 0.0) * light.diffuse);
+				}
+				out[0] = c.x;
+				out[1] = c.y;
+				out[2] = c.z;
+			}
+		}
+	});
+
+	if (map != 0) {
+		GLint active = 0;
+		glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+		glActiveTexture(GL_TEXTURE0 + unit);
+		glBindTexture(GL_TEXTURE_2D, map);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size, size, GL_RGB, GL_FLOAT, texel_data.data());
+		glActiveTexture(active);
+	}
+
+	bake_count++;
+	last_bake_ms = wallTimeMs() - start;
+}
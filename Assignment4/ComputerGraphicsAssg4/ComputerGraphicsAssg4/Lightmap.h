@@ -0,0 +1,78 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- Lightmap.h ---
+//
+//   Baked lighting of the floor: the ambient and diffuse terms of the lights
+//   fixed in the world frame, evaluated per texel on the CPU (rows split
+//   over the ThreadPool) into a floating-point texture over the floor
+//   rectangle, which the floor shader samples instead of interpolating its
+//   few vertices. Specular light depends on the viewer and stays in the
+//   shader, as do lights given in the eye frame.
+//
+//   The lighting math is processLight() of vshader53.glsl, in the world
+//   frame: attenuation 1 / (c + l d + q d^2), and for spot lights the
+//   cone cutoff and the cosine power falloff around the focus.
+//
+//   The map is rebaked only when its key (light parameters and the floor's
+//   material products) changes; see FloorMap.h.
+//
+//   Usage:
+//       if (map.changed(key)) map.bake(lights, count);
+//       ... draw the floor sampling texture() through bounds() ...
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __LIGHTMAP_H__
+#define __LIGHTMAP_H__
+
+#include "Angel-yjc.h"
+#include "FloorMap.h"
+#include <vector>
+
+typedef Angel::vec4  color4;
+typedef Angel::vec3  point3;
+
+//A point (type 2) or spot (type 3) light in the world frame, with its products for the floor's material
+struct BakeLight {
+	int type;
+	point3 position;
+	point3 focus; //Spot only
+	color4 ambient, diffuse;
+	float const_att, linear_att, quad_att;
+	float cutoff, exponent; //Spot only, cutoff in degrees
+};
+
+class Lightmap {
+public:
+	//size x size texels over [min_x, max_x] x [min_z, max_z] of the plane y = height, facing up,
+	//kept in texture unit `unit`, which needs the GL context; a negative unit keeps them on the CPU only
+	void init(int unit, int size, float min_x, float max_x, float min_z, float max_z, float height);
+	bool isInitialized() const { return size > 0; }
+
+	bool changed(const std::vector<float>& key) { return area.changed(key); }
+
+	//Evaluates the lights at every texel center and uploads the result
+	void bake(const BakeLight* lights, int count);
+
+	//The floor's mapping onto the map
+	vec4 bounds() const { return area.bounds(); }
+	GLuint texture() const { return map; }
+
+	//The baked RGB texels, rows of increasing z, for the software rasterizer
+	const float* texels() const { return texel_data.data(); }
+	int texelsPerSide() const { return size; }
+
+	int bakes() const { return bake_count; }
+	double lastBakeMs() const { return last_bake_ms; }
+
+private:
+	GLuint map = 0;
+	int unit = 0, size = 0;
+	FloorMap area;
+	float height = 0;
+	std::vector<float> texel_data; //RGB
+	int bake_count = 0;
+	double last_bake_ms = 0.0;
+};
+
+#endif // __LIGHTMAP_H__
@@ -0,0 +1,154 @@
+#include "MipChain.h"
+#include "ThreadPool.h"
+#include "Timing.h"
+#include <math.h>
+#include <string.h>
+#include "GLStats.h"
+
+namespace {
+
+const int Taps = 8;
+
+//Modified Bessel function of the first kind, order 0 (the Kaiser window's), by its series
+double besselI0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+//Weight of the source texel t source texels from an output texel's center, for a reduction by scale
+double kernel(double t, double scale, MipChain::Filter filter)
+{
+	if (filter == MipChain::Box) return fabs(t) < 0.5 * scale ? 1.0 : 0.0;
+
+	const double alpha = 4.0;
+	double u = t / (2.0 * scale); //The window reaches 2 output texels either side
+	if (fabs(u) >= 1.0) return 0.0;
+	double x = M_PI * t / scale;
+	double sinc = x == 0.0 ? 1.0 : sin(x) / x;
+	return sinc * besselI0(alpha * sqrt(1.0 - u * u)) / besselI0(alpha);
+}
+
+//For each of the m output texels of an axis of n source texels: the first source texel and Taps weights
+void makeTaps(int n, int m, MipChain::Filter filter, std::vector<int>& first, std::vector<float>& weights)
+{
+	first.resize(m);
+	weights.assign((size_t)m * Taps, 0.0f);
+	if (m == n) { //A 1 texel axis stays as it is
+		for (int x = 0; x < m; x++) {
+			first[x] = x;
+			weights[x * Taps] = 1.0f;
+		}
+		return;
+	}
+
+	double scale = (double)n / m;
+	for (int x = 0; x < m; x++) {
+		double center = (x + 0.5) * scale;
+		first[x] = (int)floor(center) - Taps / 2;
+		double sum = 0.0;
+		for (int k = 0; k < Taps; k++) sum += kernel(first[x] + k + 0.5 - center, scale, filter);
+		for (int k = 0; k < Taps; k++)
+			weights[x * Taps + k] = (float)(kernel(first[x] + k + 0.5 - center, scale, filter) / sum);
+	}
+}
+
+//fn(begin, end) over [0, count) rows, split over the pool when the pass touches enough texels
+void forRows(int count, int texels, const std::function<void(int, int)>& fn)
+{
+	if (texels < MipChain::ParallelTexels) fn(0, count);
+	else ThreadPool::instance().parallelFor(count, [&](int begin, int end, int) { fn(begin, end); });
+}
+
+} // namespace
+
+//---------------------------------------------------------
+void MipChain::build(const GLubyte* rgba, int width, int height, Filter filter)
+{
+	double start = wallTimeMs();
+	images.assign(1, std::vector<GLubyte>(rgba, rgba + (size_t)width * height * 4));
+	widths.assign(1, width);
+	heights.assign(1, height);
+
+	while (widths.back() > 1 || heights.back() > 1) {
+		int w = widths.back(), h = heights.back();
+		int dw = w > 1 ? w / 2 : 1, dh = h > 1 ? h / 2 : 1;
+		images.push_back(std::vector<GLubyte>());
+		halve(images[images.size() - 2], w, h, images.back(), dw, dh, filter);
+		widths.push_back(dw);
+		heights.push_back(dh);
+	}
+	last_build_ms = wallTimeMs() - start;
+}
+//---------------------------------------------------------
+void MipChain::halve(const std::vector<GLubyte>& src, int w, int h, std::vector<GLubyte>& dst, int dw, int dh, Filter filter)
+{
+	std::vector<int> first_x, first_y;
+	std::vector<float> weights_x, weights_y;
+	makeTaps(w, dw, filter, first_x, weights_x);
+	makeTaps(h, dh, filter, first_y, weights_y);
+
+	//Rows: w x h bytes to dw x h floats
+	rows.resize((size_t)dw * h * 4);
+	forRows(h, dw * h, [&](int begin, int end) {
+		for (int y = begin; y < end; y++) {
+			const GLubyte* in = &src[(size_t)y * w * 4];
+			float* out = &rows[(size_t)y * dw * 4];
+			for (int x = 0; x < dw; x++, out += 4) {
+				float c[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+				for (int k = 0; k < Taps; k++) {
+					float weight = weights_x[x * Taps + k];
+					if (weight == 0.0f) continue;
+					const GLubyte* texel = in + (((first_x[x] + k) % w + w) % w) * 4;
+					for (int i = 0; i < 4; i++) c[i] += weight * texel[i];
+				}
+				memcpy(out, c, sizeof(c));
+			}
+		}
+	});
+
+	//Columns: dw x h floats to dw x dh bytes
+	dst.resize((size_t)dw * dh * 4);
+	forRows(dh, dw * dh, [&](int begin, int end) {
+		for (int y = begin; y < end; y++) {
+			GLubyte* out = &dst[(size_t)y * dw * 4];
+			for (int x = 0; x < dw; x++, out += 4) {
+				float c[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+				for (int k = 0; k < Taps; k++) {
+					float weight = weights_y[y * Taps + k];
+					if (weight == 0.0f) continue;
+					const float* texel = &rows[((size_t)(((first_y[y] + k) % h + h) % h) * dw + x) * 4];
+					for (int i = 0; i < 4; i++) c[i] += weight * texel[i];
+				}
+				for (int i = 0; i < 4; i++) out[i] = (GLubyte)fmin(fmax(c[i] + 0.5f, 0.0f), 255.0f);
+			}
+		}
+	});
+}
+//---------------------------------------------------------
+void MipChain::pack(std::vector<GLubyte>& data) const
+{
+	data.clear();
+	for (int level = 0; level < levels(); level++) data.insert(data.end(), images[level].begin(), images[level].end());
+}
+//---------------------------------------------------------
+bool MipChain::unpack(const GLubyte* data, size_t size, int width, int height)
+{
+	images.clear();
+	widths.clear();
+	heights.clear();
+	for (int w = width, h = height;; w = w > 1 ? w / 2 : 1, h = h > 1 ? h / 2 : 1) {
+		size_t bytes = (size_t)w * h * 4;
+		if (bytes > size) return false;
+		images.push_back(std::vector<GLubyte>(data, data + bytes));
+		widths.push_back(w);
+		heights.push_back(h);
+		data += bytes;
+		size -= bytes;
+		if (w == 1 && h == 1) return size == 0;
+	}
+}
@@ -0,0 +1,58 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- MipChain.h ---
+//
+//   The mipmap levels of an RGBA8 image, built on the CPU down to 1x1 so
+//   the filter is ours rather than the driver's (glGenerateMipmap is a box
+//   filter on most drivers, and says nothing about which).
+//
+//   Each level halves the one above it, rounding down, with a separable
+//   filter: a row pass into floats, then a column pass back to bytes.
+//     Box     the 2x2 average; blurry, but cheap and never rings.
+//     Kaiser  a windowed sinc over 4 source texels on each side (alpha 4);
+//             keeps the checker edges sharper further into the chain, with a
+//             little ringing, clamped to [0, 255].
+//   Addressing wraps, matching GL_REPEAT. Levels of at least ParallelTexels
+//   texels split their rows over the ThreadPool.
+//
+//   Usage:
+//       chain.build(rgba, width, height, MipChain::Kaiser);
+//       array.setLayer(layer, chain);  (TextureArray)
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __MIPCHAIN_H__
+#define __MIPCHAIN_H__
+
+#include "Angel-yjc.h"
+#include <vector>
+
+class MipChain {
+public:
+	enum Filter { Box, Kaiser };
+	enum { ParallelTexels = 64 * 1024 };
+
+	//Level 0 is a copy of the width x height image; no GL context needed
+	void build(const GLubyte* rgba, int width, int height, Filter filter);
+
+	int levels() const { return (int)images.size(); }
+	int width(int level) const { return widths[level]; }
+	int height(int level) const { return heights[level]; }
+	const GLubyte* data(int level) const { return images[level].data(); }
+
+	//All the levels one after another, and back; unpack() fails if size is not that of a width x height chain
+	void pack(std::vector<GLubyte>& data) const;
+	bool unpack(const GLubyte* data, size_t size, int width, int height);
+
+	double lastBuildMs() const { return last_build_ms; }
+
+private:
+	void halve(const std::vector<GLubyte>& src, int w, int h, std::vector<GLubyte>& dst, int dw, int dh, Filter filter);
+
+	std::vector<std::vector<GLubyte> > images;
+	std::vector<int> widths, heights;
+	std::vector<float> rows; //The row pass of the level being built
+	double last_build_ms = 0.0;
+};
+
+#endif // __MIPCHAIN_H__
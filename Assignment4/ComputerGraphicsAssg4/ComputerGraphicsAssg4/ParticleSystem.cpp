@@ -0,0 +1,528 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "ParticleSystem.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "GLStats.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PARTICLE_SIMD
+#include <emmintrin.h>
+#endif
+
+ParticleSystem::ParticleSystem(int per_burst, int emitter_limit)
+	: N(per_burst), max_emitters(emitter_limit)
+{
+	capacity = N * max_emitters;
+	staging.resize(capacity);
+	pending.resize(max_emitters, false);
+	landing.resize(N);
+
+	int padded = (capacity + 3) & ~3;
+	px.resize(padded); py.resize(padded); pz.resize(padded);
+	vx.resize(padded); vy.resize(padded); vz.resize(padded);
+	age.resize(padded);
+	owner.resize(padded);
+	pcolor.resize(padded);
+	packed.resize(capacity);
+}
+//---------------------------------------------------------
+void ParticleSystem::init()
+{
+	if (emitters.empty()) addEmitter(initialPosition);
+
+	//One quad shared by all instances, drawn as a triangle strip
+	vec2 corners[] = { vec2(-0.5, -0.5), vec2(0.5, -0.5), vec2(-0.5, 0.5), vec2(0.5, 0.5) };
+	glGenBuffers(1, &quad_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, quad_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+
+	//Instance pool for GPU mode, N slots per emitter, filled one burst at a time
+	glGenBuffers(1, &particle_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, particle_buffer);
+	glBufferData(GL_ARRAY_BUFFER,
+		sizeof(ParticleInstance) * capacity,
+		NULL, GL_DYNAMIC_DRAW);
+
+	//Live particles for CPU mode, re-specified every step
+	glGenBuffers(1, &cpu_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, cpu_buffer);
+	glBufferData(GL_ARRAY_BUFFER,
+		sizeof(ParticleState) * capacity,
+		NULL, GL_STREAM_DRAW);
+
+	shaderProgram = InitShader("vshaderParticle.glsl", "fshaderParticle.glsl");
+	model_view_loc = glGetUniformLocation(shaderProgram, "model_view");
+	projection_loc = glGetUniformLocation(shaderProgram, "projection");
+	t_loc = glGetUniformLocation(shaderProgram, "t");
+	cull_below_floor_loc = glGetUniformLocation(shaderProgram, "cull_below_floor");
+	vCorner = glGetAttribLocation(shaderProgram, "vCorner");
+	const char* names[] = { "vOrigin", "vVelocity", "vColor", "vSpawnTime", "vSize" };
+	for (int i = 0; i < 5; i++) instance_attribs[i] = glGetAttribLocation(shaderProgram, names[i]);
+}
+//---------------------------------------------------------
+int ParticleSystem::addEmitter(const point3& origin)
+{
+	if ((int)emitters.size() >= max_emitters) return -1;
+
+	Emitter e;
+	e.origin = origin;
+	e.burst_end = 0.0; //Launches on the next update() while active
+	e.live = 0;
+	emitters.push_back(e);
+	return (int)emitters.size() - 1;
+}
+//---------------------------------------------------------
+//The first emitter stays where it is, the others are spread on a ring around it
+void ParticleSystem::setEmitterCount(int n)
+{
+	if (n < 1) n = 1;
+	if (n > max_emitters) n = max_emitters;
+
+	while ((int)emitters.size() > n) {
+		removeEmitterParticles((int)emitters.size() - 1);
+		emitters.pop_back();
+	}
+	if (emitters.empty()) addEmitter(initialPosition);
+	const point3 center = emitters[0].origin;
+	while ((int)emitters.size() < n) addEmitter(center);
+	for (int i = 1; i < n; i++) {
+		float a = 2.0 * M_PI * (i - 1) / (n - 1);
+		emitters[i].origin = center + point3(ring_radius * cos(a), 0.0, ring_radius * sin(a));
+	}
+
+	if (active) startAnimation();
+}
+//---------------------------------------------------------
+void ParticleSystem::setFloor(const point3& floor_min, const point3& floor_max)
+{
+	floor_y = floor_min.y;
+	floor_min_x = floor_min.x; floor_max_x = floor_max.x;
+	floor_min_z = floor_min.z; floor_max_z = floor_max.z;
+	has_floor = true;
+}
+//---------------------------------------------------------
+void ParticleSystem::setMode(Mode m)
+{
+	if (m == CPU_STREAMED && !stream) m = CPU;
+	if (m == mode) return;
+
+	mode = m;
+	if (active) startAnimation();
+}
+//---------------------------------------------------------
+void ParticleSystem::startAnimation()
+{
+	float now = (float)simTimeMs();
+	live = 0;
+	for (int i = 0; i < (int)emitters.size(); i++) {
+		emitters[i].live = 0;
+		burst(i, now);
+	}
+	last_step = now;
+}
+//---------------------------------------------------------
+void ParticleSystem::update()
+{
+	if (!active) return;
+
+	t = (float)simTimeMs();
+
+	if (mode != GPU) simulate(t - last_step);
+	last_step = t;
+
+	//An emitter relaunches once most of its particles are below the floor (GPU) or dead (CPU), or tMax has passed
+	for (int i = 0; i < (int)emitters.size(); i++)
+		if (t >= emitters[i].burst_end || (mode != GPU && emitters[i].live < 10))
+			burst(i, t);
+}
+//---------------------------------------------------------
+//Fills emitter i's slots with a fresh burst
+void ParticleSystem::burst(int i, float now)
+{
+	Emitter& e = emitters[i];
+
+	if (mode != GPU) {
+		spawnCPU(i);
+		e.burst_end = now + tMax;
+		t = now;
+		return;
+	}
+
+	for (int j = 0; j < N; j++) {
+		ParticleInstance& p = staging[N * i + j];
+		p.origin = e.origin;
+
+		p.velocity.x = 2.0*((rand() % 256) / 256.0 - 0.5);
+		p.velocity.y = 1.2*2.0*((rand() % 256) / 256.0);
+		p.velocity.z = 2.0*((rand() % 256) / 256.0 - 0.5);
+
+		p.color.x = (rand() % 256) / 256.0;
+		p.color.y = (rand() % 256) / 256.0;
+		p.color.z = (rand() % 256) / 256.0;
+		p.color.w = 1.0;
+
+		p.spawn_time = now;
+		p.size = particle_size;
+
+		//Time at which this particle drops below y = 0.1, from y0 + 0.001*vy*t - 0.5*g*t^2 = 0.1
+		float v = 0.001 * p.velocity.y, a = 0.5 * gravity;
+		landing[j] = (v + sqrt(v * v + 4.0 * a * fmax(e.origin.y - 0.1, 0.0))) / (2.0 * a);
+	}
+
+	//Relaunch once all but 10 particles are below the threshold
+	int k = N > 10 ? N - 10 : N - 1;
+	std::nth_element(landing.begin(), landing.begin() + k, landing.end());
+	e.burst_end = now + fmin(landing[k], tMax);
+
+	//Only this emitter's slots are uploaded, at the next draw()
+	pending[i] = true;
+
+	t = now;
+}
+//---------------------------------------------------------
+//Appends a burst of emitter i to the SoA arrays, replacing what is left of its previous one
+void ParticleSystem::spawnCPU(int i)
+{
+	Emitter& e = emitters[i];
+	removeEmitterParticles(i);
+
+	for (int j = 0; j < N && live < capacity; j++, live++) {
+		px[live] = e.origin.x;
+		py[live] = e.origin.y;
+		pz[live] = e.origin.z;
+
+		//Stored in units per ms, i.e. the 0.001 factor of the shader is applied here
+		vx[live] = 0.001 * 2.0*((rand() % 256) / 256.0 - 0.5);
+		vy[live] = 0.001 * 1.2*2.0*((rand() % 256) / 256.0);
+		vz[live] = 0.001 * 2.0*((rand() % 256) / 256.0 - 0.5);
+
+		pcolor[live] = color4((rand() % 256) / 256.0, (rand() % 256) / 256.0, (rand() % 256) / 256.0, 1.0);
+		age[live] = 0.0;
+		owner[live] = i;
+	}
+	e.live = N;
+	dirty = true;
+}
+//---------------------------------------------------------
+void ParticleSystem::removeEmitterParticles(int i)
+{
+	for (int j = 0; j < live; ) {
+		if (owner[j] == i) {
+			live--;
+			px[j] = px[live]; py[j] = py[live]; pz[j] = pz[live];
+			vx[j] = vx[live]; vy[j] = vy[live]; vz[j] = vz[live];
+			age[j] = age[live]; owner[j] = owner[live]; pcolor[j] = pcolor[live];
+		}
+		else j++;
+	}
+}
+//---------------------------------------------------------
+void ParticleSystem::simulate(float dt)
+{
+	//Sub-step long frames so particles cannot tunnel through the floor
+	const float max_step = 20.0;
+	while (dt > 0.0) {
+		float h = fmin(dt, max_step);
+		integrate(h);
+		dt -= h;
+	}
+	collideWithBodies();
+	cull();
+	dirty = true;
+}
+//---------------------------------------------------------
+/*
+	Semi-implicit Euler step with a floor contact. A particle over the floor
+	extent that moves into it is pushed back on top, its normal speed is
+	reflected and scaled by the restitution, and its tangential speed loses
+	friction * (normal impulse), clamped at zero so friction never reverses it.
+*/
+void ParticleSystem::integrate(float dt)
+{
+	const float radius = 0.5 * particle_size;
+	const float ground = floor_y + radius;
+	const float rest_speed = 2.0 * gravity * dt; //Below this a bounce becomes resting contact
+	const int n = (live + 3) & ~3;
+
+	if (!has_floor) {
+		for (int i = 0; i < live; i++) {
+			vy[i] -= gravity * dt;
+			px[i] += vx[i] * dt; py[i] += vy[i] * dt; pz[i] += vz[i] * dt;
+			age[i] += dt;
+		}
+		return;
+	}
+
+#ifdef PARTICLE_SIMD
+	const __m128 vdt = _mm_set1_ps(dt), vgdt = _mm_set1_ps(gravity * dt);
+	const __m128 vground = _mm_set1_ps(ground), zero = _mm_setzero_ps(), eps = _mm_set1_ps(1e-12f);
+	const __m128 e = _mm_set1_ps(restitution), one_e = _mm_set1_ps(1.0f + restitution);
+	const __m128 mu = _mm_set1_ps(friction), one = _mm_set1_ps(1.0f), rest = _mm_set1_ps(rest_speed);
+	const __m128 min_x = _mm_set1_ps(floor_min_x), max_x = _mm_set1_ps(floor_max_x);
+	const __m128 min_z = _mm_set1_ps(floor_min_z), max_z = _mm_set1_ps(floor_max_z);
+
+	for (int i = 0; i < n; i += 4) {
+		__m128 x = _mm_loadu_ps(&px[i]), y = _mm_loadu_ps(&py[i]), z = _mm_loadu_ps(&pz[i]);
+		__m128 u = _mm_loadu_ps(&vx[i]), v = _mm_loadu_ps(&vy[i]), w = _mm_loadu_ps(&vz[i]);
+
+		v = _mm_sub_ps(v, vgdt);
+		x = _mm_add_ps(x, _mm_mul_ps(u, vdt));
+		y = _mm_add_ps(y, _mm_mul_ps(v, vdt));
+		z = _mm_add_ps(z, _mm_mul_ps(w, vdt));
+
+		__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(x, min_x), _mm_cmple_ps(x, max_x)),
+			_mm_and_ps(_mm_cmpge_ps(z, min_z), _mm_cmple_ps(z, max_z)));
+		__m128 hit = _mm_and_ps(inside, _mm_and_ps(_mm_cmplt_ps(y, vground), _mm_cmplt_ps(v, zero)));
+
+		//Normal response
+		__m128 impulse = _mm_mul_ps(one_e, _mm_sub_ps(zero, v));
+		__m128 bounced = _mm_mul_ps(e, _mm_sub_ps(zero, v));
+		bounced = _mm_and_ps(bounced, _mm_cmpge_ps(bounced, rest));
+
+		//Tangential response
+		__m128 vt = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(w, w)), eps));
+		__m128 scale = _mm_max_ps(zero, _mm_sub_ps(one, _mm_div_ps(_mm_mul_ps(mu, impulse), vt)));
+
+		y = _mm_or_ps(_mm_and_ps(hit, vground), _mm_andnot_ps(hit, y));
+		v = _mm_or_ps(_mm_and_ps(hit, bounced), _mm_andnot_ps(hit, v));
+		u = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(u, scale)), _mm_andnot_ps(hit, u));
+		w = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(w, scale)), _mm_andnot_ps(hit, w));
+
+		_mm_storeu_ps(&px[i], x); _mm_storeu_ps(&py[i], y); _mm_storeu_ps(&pz[i], z);
+		_mm_storeu_ps(&vx[i], u); _mm_storeu_ps(&vy[i], v); _mm_storeu_ps(&vz[i], w);
+		_mm_storeu_ps(&age[i], _mm_add_ps(_mm_loadu_ps(&age[i]), vdt));
+	}
+#else
+	for (int i = 0; i < n; i++) {
+		vy[i] -= gravity * dt;
+		px[i] += vx[i] * dt; py[i] += vy[i] * dt; pz[i] += vz[i] * dt;
+		age[i] += dt;
+
+		bool inside = px[i] >= floor_min_x && px[i] <= floor_max_x && pz[i] >= floor_min_z && pz[i] <= floor_max_z;
+		if (inside && py[i] < ground && vy[i] < 0.0) {
+			float impulse = (1.0 + restitution) * -vy[i];
+			float vt = sqrt(vx[i] * vx[i] + vz[i] * vz[i] + 1e-12f);
+			float scale = fmax(0.0, 1.0 - friction * impulse / vt);
+
+			py[i] = ground;
+			vy[i] = restitution * -vy[i];
+			if (vy[i] < rest_speed) vy[i] = 0.0;
+			vx[i] *= scale;
+			vz[i] *= scale;
+		}
+	}
+#endif
+}
+//---------------------------------------------------------
+//Pushes particles out of the collider bodies and reflects their velocity off the contact normal
+void ParticleSystem::collideWithBodies()
+{
+	if (!colliders || colliders->bodyCount() == 0) return;
+
+	const float r = 0.5 * particle_size, reach = r + colliders->bodyRadius();
+	for (int i = 0; i < live; i++) {
+		colliders->query(px[i], py[i], pz[i], r, [&](int, float bx, float by, float bz) {
+			float nx = px[i] - bx, ny = py[i] - by, nz = pz[i] - bz;
+			float d = sqrt(nx * nx + ny * ny + nz * nz);
+			if (d < 1e-6f) return;
+			nx /= d; ny /= d; nz /= d;
+
+			px[i] = bx + nx * reach;
+			py[i] = by + ny * reach;
+			pz[i] = bz + nz * reach;
+
+			float vn = vx[i] * nx + vy[i] * ny + vz[i] * nz;
+			if (vn < 0.0) {
+				float k = (1.0 + restitution) * vn;
+				vx[i] -= k * nx; vy[i] -= k * ny; vz[i] -= k * nz;
+			}
+		});
+	}
+}
+//---------------------------------------------------------
+//Removes expired particles and those that fell past the floor, and recounts each emitter
+void ParticleSystem::cull()
+{
+	for (int i = 0; i < (int)emitters.size(); i++) emitters[i].live = 0;
+
+	for (int j = 0; j < live; ) {
+		bool dead = age[j] >= tMax || (has_floor && py[j] < floor_y);
+		if (dead) {
+			live--;
+			px[j] = px[live]; py[j] = py[live]; pz[j] = pz[live];
+			vx[j] = vx[live]; vy[j] = vy[live]; vz[j] = vz[live];
+			age[j] = age[live]; owner[j] = owner[live]; pcolor[j] = pcolor[live];
+		}
+		else {
+			emitters[owner[j]].live++;
+			j++;
+		}
+	}
+}
+//---------------------------------------------------------
+//Copies staged bursts into their emitters' slots, through the stream buffer when there is one
+void ParticleSystem::flushBursts()
+{
+	for (int i = 0; i < (int)emitters.size(); i++) {
+		if (!pending[i]) continue;
+		pending[i] = false;
+
+		GLsizeiptr size = sizeof(ParticleInstance) * N;
+		GLintptr dst = sizeof(ParticleInstance) * N * i;
+
+		StreamAllocation a = { NULL, 0, size };
+		if (stream) a = stream->allocate(size);
+
+		if (a.ptr) {
+			memcpy(a.ptr, &staging[N * i], size);
+			stream->commit(a);
+
+			//GPU-side copy, so the pool is never written while a previous frame still reads it
+			glBindBuffer(GL_COPY_READ_BUFFER, stream->buffer());
+			glBindBuffer(GL_COPY_WRITE_BUFFER, particle_buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, a.offset, dst, size);
+		}
+		else {
+			glBindBuffer(GL_ARRAY_BUFFER, particle_buffer);
+			glBufferSubData(GL_ARRAY_BUFFER, dst, size, &staging[N * i]);
+		}
+	}
+}
+//---------------------------------------------------------
+//Packs the live particles, either into this frame's stream region or into cpu_buffer
+void ParticleSystem::upload()
+{
+	if (mode == CPU_STREAMED) {
+		StreamAllocation a = stream->allocate(sizeof(ParticleState) * live, sizeof(ParticleState));
+		if (a.ptr) {
+			ParticleState* out = (ParticleState*)a.ptr;
+			for (int i = 0; i < live; i++) {
+				out[i].position = point3(px[i], py[i], pz[i]);
+				out[i].color = pcolor[i];
+				out[i].size = particle_size;
+			}
+			stream->commit(a);
+			stream_offset = a.offset;
+			streamed = true;
+			return;
+		}
+		//No room in the stream this frame: draw from cpu_buffer, which the streamed frames left stale
+		streamed = false;
+		dirty = true;
+	}
+
+	if (!dirty) return;
+	dirty = false;
+
+	ParticleState* out = packed.data();
+	for (int i = 0; i < live; i++) {
+		out[i].position = point3(px[i], py[i], pz[i]);
+		out[i].color = pcolor[i];
+		out[i].size = particle_size;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, cpu_buffer);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(ParticleState) * live, out);
+}
+//---------------------------------------------------------
+int ParticleSystem::liveCount() const
+{
+	if (!active) return 0;
+	return mode == GPU ? N * (int)emitters.size() : live;
+}
+//---------------------------------------------------------
+void ParticleSystem::draw(mat4& modelview, mat4& projection)
+{
+	int count = liveCount();
+	if (count == 0) return;
+
+	if (mode == GPU) flushBursts();
+	else upload();
+
+	glUseProgram(shaderProgram);
+
+	glUniformMatrix4fv(model_view_loc, 1, GL_TRUE, modelview); // GL_TRUE: matrix is row-major
+	glUniformMatrix4fv(projection_loc, 1, GL_TRUE, projection);
+	glUniform1f(t_loc, t);
+
+	//CPU particles below y = 0.1 are resting on the floor, not hidden under it
+	glUniform1i(cull_below_floor_loc, mode == GPU);
+
+	//--- Per-vertex quad corner ---//
+	glBindBuffer(GL_ARRAY_BUFFER, quad_buffer);
+	glEnableVertexAttribArray(vCorner);
+	glVertexAttribPointer(vCorner, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+
+	if (mode == GPU) bindInstanceAttributes(particle_buffer, 0);
+	else if (mode == CPU_STREAMED && streamed) bindInstanceAttributes(stream->buffer(), stream_offset);
+	else bindInstanceAttributes(cpu_buffer, 0);
+
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+
+	/*--- Disable each vertex attribute array being enabled ---*/
+	//The divisors must be reset too, since the attribute indices are shared with the main program
+	glDisableVertexAttribArray(vCorner);
+	for (int i = 0; i < 5; i++) {
+		glVertexAttribDivisor(instance_attribs[i], 0);
+		glDisableVertexAttribArray(instance_attribs[i]);
+	}
+}
+//---------------------------------------------------------
+/*
+	GPU mode reads the full ParticleInstance. The CPU modes only supply the
+	current position as vOrigin; vVelocity and vSpawnTime are left as constant
+	attributes (zero velocity, spawned now), so the shader's ballistic path
+	reduces to the uploaded position.
+*/
+void ParticleSystem::bindInstanceAttributes(GLuint buffer, size_t base)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+	const GLuint vOrigin = instance_attribs[0], vVelocity = instance_attribs[1], vColor = instance_attribs[2],
+		vSpawnTime = instance_attribs[3], vSize = instance_attribs[4];
+
+	if (mode == GPU) {
+		const GLuint attribs[] = { vOrigin, vVelocity, vColor, vSpawnTime, vSize };
+		const int sizes[] = { 3, 3, 4, 1, 1 };
+		const size_t offsets[] = { offsetof(ParticleInstance, origin), offsetof(ParticleInstance, velocity),
+			offsetof(ParticleInstance, color), offsetof(ParticleInstance, spawn_time), offsetof(ParticleInstance, size) };
+		for (int i = 0; i < 5; i++) {
+			glEnableVertexAttribArray(attribs[i]);
+			glVertexAttribPointer(attribs[i], sizes[i], GL_FLOAT, GL_FALSE, sizeof(ParticleInstance),
+				BUFFER_OFFSET(base + offsets[i]));
+			glVertexAttribDivisor(attribs[i], 1);
+		}
+		return;
+	}
+
+	const GLuint attribs[] = { vOrigin, vColor, vSize };
+	const int sizes[] = { 3, 4, 1 };
+	const size_t offsets[] = { offsetof(ParticleState, position), offsetof(ParticleState, color),
+		offsetof(ParticleState, size) };
+	for (int i = 0; i < 3; i++) {
+		glEnableVertexAttribArray(attribs[i]);
+		glVertexAttribPointer(attribs[i], sizes[i], GL_FLOAT, GL_FALSE, sizeof(ParticleState),
+			BUFFER_OFFSET(base + offsets[i]));
+		glVertexAttribDivisor(attribs[i], 1);
+	}
+
+	glDisableVertexAttribArray(vVelocity);
+	glDisableVertexAttribArray(vSpawnTime);
+	glVertexAttrib3f(vVelocity, 0.0, 0.0, 0.0);
+	glVertexAttrib1f(vSpawnTime, t);
+}
+//---------------------------------------------------------
+void ParticleSystem::setParticleActive(bool a)
+{
+	if (a && !active) startAnimation();
+
+	active = a;
+}
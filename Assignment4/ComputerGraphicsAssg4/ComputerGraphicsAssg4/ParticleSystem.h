@@ -0,0 +1,142 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- ParticleSystem.h ---
+//
+//   Firework particles drawn as instanced camera-facing quads. One 4-vertex
+//   quad is shared by every particle; each emitter owns N instance slots.
+//
+//   GPU mode:  each instance carries its origin, launch velocity, color,
+//              spawn time and size, and vshaderParticle.glsl evaluates the
+//              ballistic path. A burst only re-uploads its emitter's slots.
+//   CPU modes: particles are integrated on the CPU (SIMD over SoA arrays)
+//              and bounce on the floor with restitution and friction. Dead
+//              particles are removed before upload, so only live ones are
+//              drawn. CPU_STREAMED writes the packed state straight into
+//              the frame's StreamBuffer region.
+//
+//   All uploads happen in draw(), inside the frame, so bursts launched by
+//   update() are staged and go through the StreamBuffer too when one is set.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __PARTICLESYSTEM_H__
+#define __PARTICLESYSTEM_H__
+
+#include "Angel-yjc.h"
+#include "StreamBuffer.h"
+#include "SpatialGrid.h"
+#include <vector>
+
+typedef Angel::vec4  color4;
+typedef Angel::vec3  point3;
+
+// Per-instance record of the GPU (ballistic) mode
+struct ParticleInstance {
+	point3 origin;
+	point3 velocity;
+	color4 color;
+	float spawn_time; // in ms, same clock as GLUT_ELAPSED_TIME
+	float size;       // quad edge length in world units
+};
+
+// Per-instance record of the CPU modes, one per live particle
+struct ParticleState {
+	point3 position;
+	color4 color;
+	float size;
+};
+
+class ParticleSystem {
+public:
+	enum Mode { GPU = 0, CPU = 1, CPU_STREAMED = 2 };
+
+	ParticleSystem(int per_burst = 300, int emitter_limit = 8);
+
+	void init();
+
+	//Per-frame allocator used for bursts and CPU_STREAMED; without one they fall back to glBufferSubData
+	void setStream(StreamBuffer* s) { stream = s; }
+
+	//Returns the emitter index, or -1 when the pool is full
+	int addEmitter(const point3& origin);
+
+	//Keeps the first n emitters, or adds emitters on a ring around the first, up to the pool's limit
+	void setEmitterCount(int n);
+	int emitterCount() const { return (int)emitters.size(); }
+	int maxEmitters() const { return max_emitters; }
+
+	//Floor plane height and xz extent used for collisions, from its bounding box
+	void setFloor(const point3& floor_min, const point3& floor_max);
+
+	//Bodies (e.g. the spheres) that CPU-simulated particles bounce off
+	void setColliders(const SpatialGrid* grid) { colliders = grid; }
+
+	void setMode(Mode m);
+	Mode getMode() const { return mode; }
+
+	void startAnimation();
+	void update();
+	void draw(mat4& modelview, mat4& projection);
+	void setParticleActive(bool a);
+
+	//Number of particles that will be drawn this frame
+	int liveCount() const;
+
+	float restitution = 0.55; // fraction of normal speed kept after a bounce
+	float friction = 0.3;     // Coulomb coefficient, tangential impulse = friction * normal impulse
+
+private:
+	struct Emitter {
+		point3 origin;
+		float burst_end; //Time at which this emitter launches again
+		int live;        //CPU modes: particles of this emitter still alive
+	};
+
+	void burst(int i, float now);
+	void spawnCPU(int i);
+	void removeEmitterParticles(int i);
+	void simulate(float dt);
+	void integrate(float dt);
+	void collideWithBodies();
+	void cull();
+	void flushBursts();
+	void upload();
+	void bindInstanceAttributes(GLuint buffer, size_t base);
+
+	Mode mode = GPU;
+	int N, max_emitters, capacity;
+	point3 initialPosition = point3(0.0, 0.1, 0.0);
+	std::vector<Emitter> emitters;
+	std::vector<ParticleInstance> staging; //N records per emitter, uploaded by flushBursts()
+	std::vector<bool> pending;
+	std::vector<float> landing;
+	float ring_radius = 3.0; //Of setEmitterCount(), in world units
+
+	//CPU state, structure of arrays padded to a multiple of 4
+	std::vector<float> px, py, pz, vx, vy, vz, age;
+	std::vector<int> owner;
+	std::vector<color4> pcolor;
+	std::vector<ParticleState> packed;
+	int live = 0;
+	bool dirty = false;
+
+	float floor_y = 0.0, floor_min_x = 0.0, floor_max_x = 0.0, floor_min_z = 0.0, floor_max_z = 0.0;
+	bool has_floor = false;
+	const SpatialGrid* colliders = NULL;
+
+	const float gravity = 0.00000049; //Matches vshaderParticle.glsl, in units per ms^2
+	float particle_size = 0.06;
+	float t = 0, last_step = 0, tMax = 10000;
+
+	GLuint quad_buffer, particle_buffer, cpu_buffer, shaderProgram;
+	GLint model_view_loc, projection_loc, t_loc, cull_below_floor_loc;
+	GLuint vCorner, instance_attribs[5]; //vOrigin, vVelocity, vColor, vSpawnTime, vSize
+
+	StreamBuffer* stream = NULL;
+	GLintptr stream_offset = 0;
+	bool streamed = false; //CPU_STREAMED: this frame's state is in stream at stream_offset, not in cpu_buffer
+
+	bool active = false;
+};
+
+#endif // __PARTICLESYSTEM_H__
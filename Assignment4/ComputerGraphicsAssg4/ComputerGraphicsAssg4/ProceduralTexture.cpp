@@ -0,0 +1,279 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "ProceduralTexture.h"
+#include "ThreadPool.h"
+#include "Timing.h"
+#include <emmintrin.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "GLStats.h"
+
+namespace {
+
+const int BandRows = 64, ParallelTexels = 16 * 1024;
+const int NoiseOctaves = 4;
+const char cache_magic[8] = { 'P', 'T', 'E', 'X', 'C', 'A', 'C', 'H' };
+
+//Lattice value in [0, 1) of point (x, y) of an octave
+float latticeValue(unsigned x, unsigned y, unsigned octave, unsigned seed)
+{
+	unsigned h = x * 0x8da6b343u ^ y * 0xd8163841u ^ octave * 0xcb1ab31fu ^ seed * 0x9e3779b9u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+//t in [0, 1] of every texel of row y
+void patternRow(const TextureDesc& d, int y, float* t, std::vector<float>& lattice)
+{
+	const __m128 lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	switch (d.pattern) {
+	case TextureDesc::Checker: {
+		int row = (int)((long long)y * d.cells / d.height);
+		for (int x = 0; x < d.width; x++) t[x] = (float)((row + (int)((long long)x * d.cells / d.width)) & 1);
+		break;
+	}
+	case TextureDesc::Stripe:
+		for (int x = 0; x < d.width; x++) {
+			float u = (x + 0.5f) * d.cells / d.width;
+			t[x] = u - floorf(u) < d.split ? 0.0f : 1.0f;
+		}
+		break;
+	case TextureDesc::Gradient: {
+		const __m128 scale = _mm_set1_ps(1.0f / d.width);
+		for (int x = 0; x < d.width; x += 4)
+			_mm_storeu_ps(t + x, _mm_mul_ps(_mm_add_ps(_mm_set1_ps((float)x), lanes), scale));
+		break;
+	}
+	case TextureDesc::Noise: {
+		const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), three = _mm_set1_ps(3.0f);
+		for (int x = 0; x < d.width; x += 4) _mm_storeu_ps(t + x, _mm_setzero_ps());
+		float amplitude = 1.0f, total = 0.0f;
+		for (int octave = 0; octave < NoiseOctaves; octave++, amplitude *= 0.5f) {
+			int n = d.cells << octave;
+			total += amplitude;
+
+			//The row's values at the lattice columns, interpolated between the lattice rows around it
+			float v = (y + 0.5f) * n / d.height - 0.5f;
+			int y0 = (int)floorf(v);
+			float fy = v - y0;
+			fy = fy * fy * (3.0f - 2.0f * fy);
+			unsigned r0 = (unsigned)((y0 % n + n) % n), r1 = (r0 + 1) % n;
+			lattice.resize(n + 1);
+			for (int i = 0; i < n; i++) {
+				float v0 = latticeValue(i, r0, octave, d.seed), v1 = latticeValue(i, r1, octave, d.seed);
+				lattice[i] = v0 + (v1 - v0) * fy;
+			}
+			lattice[n] = lattice[0];
+
+			//Then along the row, 4 texels at a time; u is shifted by a period so it stays positive
+			const __m128 scale = _mm_set1_ps((float)n / d.width), offset = _mm_set1_ps((float)n - 0.5f);
+			const __m128 weight = _mm_set1_ps(amplitude);
+			for (int x = 0; x < d.width; x += 4) {
+				__m128 u = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_set1_ps((float)x), lanes), scale), offset);
+				__m128i cell = _mm_cvttps_epi32(u);
+				__m128 f = _mm_sub_ps(u, _mm_cvtepi32_ps(cell));
+				f = _mm_mul_ps(_mm_mul_ps(f, f), _mm_sub_ps(three, _mm_mul_ps(two, f)));
+				int c[4];
+				_mm_storeu_si128((__m128i*)c, cell);
+				for (int i = 0; i < 4; i++) c[i] %= n;
+				__m128 v0 = _mm_setr_ps(lattice[c[0]], lattice[c[1]], lattice[c[2]], lattice[c[3]]);
+				__m128 v1 = _mm_setr_ps(lattice[c[0] + 1], lattice[c[1] + 1], lattice[c[2] + 1], lattice[c[3] + 1]);
+				__m128 value = _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), f));
+				_mm_storeu_ps(t + x, _mm_add_ps(_mm_loadu_ps(t + x), _mm_mul_ps(value, weight)));
+			}
+		}
+		__m128 normalize = _mm_set1_ps(1.0f / total);
+		for (int x = 0; x < d.width; x += 4)
+			_mm_storeu_ps(t + x, _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(t + x), normalize), one));
+		break;
+	}
+	}
+}
+
+//a + t (b - a) of every texel, rounded, packed as RGBA bytes 4 texels at a time
+void mixRow(const TextureDesc& d, const float* t, GLubyte* out)
+{
+	__m128 base[4], delta[4];
+	for (int c = 0; c < 4; c++) {
+		base[c] = _mm_set1_ps(d.a[c] + 0.5f);
+		delta[c] = _mm_set1_ps((float)d.b[c] - d.a[c]);
+	}
+	int x = 0;
+	for (; x + 4 <= d.width; x += 4) {
+		__m128 tx = _mm_loadu_ps(t + x);
+		__m128i texels = _mm_setzero_si128();
+		for (int c = 0; c < 4; c++) {
+			__m128i channel = _mm_cvttps_epi32(_mm_add_ps(base[c], _mm_mul_ps(tx, delta[c])));
+			texels = _mm_or_si128(texels, _mm_sll_epi32(channel, _mm_cvtsi32_si128(8 * c)));
+		}
+		_mm_storeu_si128((__m128i*)(out + 4 * x), texels);
+	}
+	for (; x < d.width; x++)
+		for (int c = 0; c < 4; c++) out[4 * x + c] = (GLubyte)(d.a[c] + 0.5f + t[x] * ((float)d.b[c] - d.a[c]));
+}
+
+} // namespace
+
+//---------------------------------------------------------
+std::string TextureDesc::key() const
+{
+	int version = GeneratorVersion;
+	std::string k;
+	k.append((const char*)&version, sizeof(version));
+	k.append((const char*)&pattern, sizeof(pattern));
+	k.append((const char*)&width, sizeof(width));
+	k.append((const char*)&height, sizeof(height));
+	k.append((const char*)&cells, sizeof(cells));
+	k.append((const char*)&split, sizeof(split));
+	k.append((const char*)&seed, sizeof(seed));
+	k.append((const char*)a, 4);
+	k.append((const char*)b, 4);
+	return k;
+}
+//---------------------------------------------------------
+void generateTexture(const TextureDesc& desc, std::vector<GLubyte>& texels)
+{
+	texels.resize((size_t)desc.width * desc.height * 4);
+	for (int band = 0; band < desc.height; band += BandRows) {
+		int rows = desc.height - band < BandRows ? desc.height - band : BandRows;
+		auto fn = [&](int begin, int end, int) {
+			std::vector<float> t(desc.width + 3); //The SIMD patterns write whole groups of 4
+			std::vector<float> lattice;
+			for (int y = band + begin; y < band + end; y++) {
+				patternRow(desc, y, t.data(), lattice);
+				mixRow(desc, t.data(), &texels[(size_t)y * desc.width * 4]);
+			}
+		};
+		if (desc.width * rows < ParallelTexels) fn(0, rows, 0);
+		else ThreadPool::instance().parallelFor(rows, fn);
+	}
+}
+
+//---------------------------------------------------------
+/*
+	The file: 8 magic bytes, then records of
+	    uint32 key size, the key, uint32 data size, the data (texels, or a packed mip chain)
+	A record cut short (a run ended while writing it) ends the index; the next
+	store() writes over it.
+*/
+bool TextureCache::open(const char* path)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	file.clear();
+	records.clear();
+	end = sizeof(cache_magic);
+
+	FILE* f = fopen(path, "rb");
+	if (f != NULL) {
+		char magic[sizeof(cache_magic)];
+		if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, cache_magic, sizeof(magic)) != 0) {
+			fclose(f);
+			return false;
+		}
+		fseek(f, 0, SEEK_END);
+		long size = ftell(f);
+		fseek(f, end, SEEK_SET);
+
+		unsigned key_size, data_size;
+		while (fread(&key_size, sizeof(key_size), 1, f) == 1 && key_size < 256) {
+			std::string key(key_size, '\0');
+			if (fread(&key[0], 1, key_size, f) != key_size || fread(&data_size, sizeof(data_size), 1, f) != 1) break;
+			long data = ftell(f);
+			if (data + (long)data_size > size) break;
+			records[key] = std::make_pair(data, data_size);
+			fseek(f, end = data + data_size, SEEK_SET);
+		}
+		fclose(f);
+	}
+	file = path;
+	return true;
+}
+//---------------------------------------------------------
+bool TextureCache::load(const std::string& key, std::vector<GLubyte>& data)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::map<std::string, std::pair<long, unsigned> >::const_iterator found = records.find(key);
+	if (found == records.end()) return false;
+
+	FILE* f = fopen(file.c_str(), "rb");
+	if (f == NULL) return false;
+	data.resize(found->second.second);
+	fseek(f, found->second.first, SEEK_SET);
+	bool ok = fread(data.data(), 1, data.size(), f) == data.size();
+	fclose(f);
+	return ok;
+}
+//---------------------------------------------------------
+void TextureCache::store(const std::string& key, const std::vector<GLubyte>& data)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (file.empty()) return;
+
+	FILE* f = fopen(file.c_str(), "r+b");
+	if (f == NULL) {
+		f = fopen(file.c_str(), "wb");
+		if (f == NULL) return;
+		fwrite(cache_magic, 1, sizeof(cache_magic), f);
+		end = sizeof(cache_magic);
+	}
+	unsigned key_size = (unsigned)key.size(), data_size = (unsigned)data.size();
+	fseek(f, end, SEEK_SET);
+	bool ok = fwrite(&key_size, sizeof(key_size), 1, f) == 1 && fwrite(key.data(), 1, key_size, f) == key_size &&
+		fwrite(&data_size, sizeof(data_size), 1, f) == 1 && fwrite(data.data(), 1, data_size, f) == data_size;
+	if (ok) {
+		long offset = end + (long)(2 * sizeof(unsigned) + key_size);
+		records[key] = std::make_pair(offset, data_size);
+		end = offset + data_size;
+	}
+	fclose(f);
+}
+//---------------------------------------------------------
+bool TextureCache::get(const TextureDesc& desc, std::vector<GLubyte>& texels)
+{
+	std::string key = desc.key();
+	if (load(key, texels) && texels.size() == (size_t)desc.width * desc.height * 4) {
+		hit_count++;
+		return true;
+	}
+	generateTexture(desc, texels);
+	store(key, texels);
+	miss_count++;
+	return false;
+}
+
+//---------------------------------------------------------
+void AsyncTexture::start(const TextureDesc& desc, TextureCache* cache, MipChain::Filter filter)
+{
+	wait();
+	job_desc = desc;
+	done = false;
+	worker = std::thread([this, cache, filter]() {
+		double start = wallTimeMs();
+		std::string key = job_desc.key() + (char)filter;
+		std::vector<GLubyte> data;
+		from_cache = cache && cache->load(key, data) && mips.unpack(data.data(), data.size(), job_desc.width, job_desc.height);
+		if (!from_cache) {
+			generateTexture(job_desc, data);
+			mips.build(data.data(), job_desc.width, job_desc.height, filter);
+			if (cache) {
+				mips.pack(data);
+				cache->store(key, data);
+			}
+		}
+		job_ms = wallTimeMs() - start;
+		done = true;
+	});
+}
+//---------------------------------------------------------
+const MipChain& AsyncTexture::finish()
+{
+	wait();
+	return mips;
+}
@@ -0,0 +1,117 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- ProceduralTexture.h ---
+//
+//   RGBA8 textures generated at any resolution from a few parameters
+//   (TextureDesc), each a pattern mixing two colors a and b:
+//     Checker   cells x cells squares, a on the even ones (the top left)
+//     Stripe    along x, cells periods: a over the first split of each, then b
+//     Noise     fractal value noise, 4 octaves over a cells x cells lattice
+//     Gradient  a at the left edge to b at the right
+//   Texels are sampled at their centers, so the same pattern at twice the
+//   size is the same picture, and every pattern wraps like GL_REPEAT.
+//
+//   Rows are generated in bands of BandRows, each split over the ThreadPool.
+//   A generation running on another thread then holds the pool one band at
+//   a time, so the frame's own jobs get in between. Within a row, 4 texels
+//   are mixed and packed at a time with SSE2.
+//
+//   TextureCache keeps generated texels in one binary file, keyed by the
+//   description's bytes, so later runs read a texture instead of generating
+//   it again. Records are only appended; delete the file to drop them.
+//
+//   AsyncTexture generates a texture and builds its mip chain on a thread of
+//   its own. The GL thread polls it and uploads the chain once ready, so a
+//   4096x4096 texture holds up neither init() nor a frame. It caches the
+//   whole chain (key: the description and the mip filter): at that size the
+//   chain costs ten times the pattern.
+//
+//   Usage:
+//       job.start(desc, &cache, MipChain::Kaiser);
+//       ... every frame: if (job.ready()) array.setLayer(layer, job.finish());
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __PROCEDURALTEXTURE_H__
+#define __PROCEDURALTEXTURE_H__
+
+#include "Angel-yjc.h"
+#include "MipChain.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct TextureDesc {
+	enum Pattern { Checker, Stripe, Noise, Gradient };
+	enum { GeneratorVersion = 1 }; //Part of the cache key: bump when a pattern's texels change
+
+	int pattern = Checker;
+	int width = 32, height = 32; //A height of 1 for a 1D texture
+	int cells = 4;
+	float split = 0.5f;          //Stripe only
+	unsigned seed = 0;           //Noise only
+	GLubyte a[4] = { 0, 0, 0, 255 }, b[4] = { 255, 255, 255, 255 };
+
+	//The fields as bytes, the cache's key
+	std::string key() const;
+};
+
+//width x height RGBA texels of desc, rows from the top
+void generateTexture(const TextureDesc& desc, std::vector<GLubyte>& texels);
+
+class TextureCache {
+public:
+	//Indexes the records in path; the file is created by the first store(). False if path is not a cache
+	bool open(const char* path);
+	bool isOpen() const { return !file.empty(); }
+
+	//The bytes stored under key, if any
+	bool load(const std::string& key, std::vector<GLubyte>& data);
+	void store(const std::string& key, const std::vector<GLubyte>& data);
+
+	//The texels of desc, loaded, or generated and stored; true when read from the file. Works unopened, without the file
+	bool get(const TextureDesc& desc, std::vector<GLubyte>& texels);
+
+	int hits() const { return hit_count; }
+	int misses() const { return miss_count; }
+
+private:
+	std::string file;
+	std::map<std::string, std::pair<long, unsigned> > records; //Key to the offset and size of its data
+	long end = 0;                        //Where the next record goes
+	std::mutex mutex;                    //AsyncTexture jobs use the cache from their threads
+	std::atomic<int> hit_count { 0 }, miss_count { 0 };
+};
+
+class AsyncTexture {
+public:
+	~AsyncTexture() { wait(); }
+
+	//Generates desc through cache (may be NULL) and its mip chain on a new thread, after the last job ends
+	void start(const TextureDesc& desc, TextureCache* cache, MipChain::Filter filter);
+
+	//A job was started and not finished yet
+	bool pending() const { return worker.joinable(); }
+	bool ready() const { return pending() && done; }
+	void wait() { if (worker.joinable()) worker.join(); }
+
+	//Waits for the job if need be; its chain stays valid until the next start()
+	const MipChain& finish();
+
+	const TextureDesc& desc() const { return job_desc; }
+	double lastJobMs() const { return job_ms; }   //Generating the texture and its chain, or reading them
+	bool lastFromCache() const { return from_cache; }
+
+private:
+	std::thread worker;
+	std::atomic<bool> done { false };
+	TextureDesc job_desc;
+	MipChain mips;
+	double job_ms = 0.0;
+	bool from_cache = false;
+};
+
+#endif // __PROCEDURALTEXTURE_H__
@@ -0,0 +1,125 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "Profiler.h"
+#include <stdio.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+std::atomic<bool> profiler_enabled(false);
+
+struct ProfileEvent {
+	const char* name;
+	uint64_t begin, end;
+};
+
+//Events live in fixed-size chunks, so appending never moves recorded ones
+struct ThreadBuffer {
+	enum { ChunkSize = 4096 };
+
+	int id;
+	std::string name;
+	std::vector<std::unique_ptr<ProfileEvent[]> > chunks;
+	long long count = 0;
+};
+
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<ThreadBuffer> > registry;
+static thread_local ThreadBuffer* thread_buffer = NULL;
+
+//---------------------------------------------------------
+static ThreadBuffer* threadBuffer()
+{
+	if (thread_buffer == NULL) {
+		std::lock_guard<std::mutex> lock(registry_mutex);
+		registry.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer()));
+		thread_buffer = registry.back().get();
+		thread_buffer->id = (int)registry.size();
+		thread_buffer->name = "thread " + std::to_string(thread_buffer->id);
+	}
+	return thread_buffer;
+}
+//---------------------------------------------------------
+void profilerEnable(bool on)
+{
+	profilerNowNs(); //Start the clock
+	profiler_enabled.store(on, std::memory_order_relaxed);
+}
+//---------------------------------------------------------
+uint64_t profilerNowNs()
+{
+	static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+//---------------------------------------------------------
+void profilerRecord(const char* name, uint64_t begin_ns, uint64_t end_ns)
+{
+	ThreadBuffer* b = threadBuffer();
+	int slot = (int)(b->count % ThreadBuffer::ChunkSize);
+	if (slot == 0) b->chunks.push_back(std::unique_ptr<ProfileEvent[]>(new ProfileEvent[ThreadBuffer::ChunkSize]));
+
+	ProfileEvent& e = b->chunks.back()[slot];
+	e.name = name;
+	e.begin = begin_ns;
+	e.end = end_ns;
+	b->count++;
+}
+//---------------------------------------------------------
+void profilerSetThreadName(const char* name)
+{
+	threadBuffer()->name = name;
+}
+//---------------------------------------------------------
+long long profilerZoneCount()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	long long n = 0;
+	for (size_t i = 0; i < registry.size(); i++) n += registry[i]->count;
+	return n;
+}
+//---------------------------------------------------------
+static void writeJSONString(FILE* fp, const char* s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') fputc('\\', fp);
+		fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+//---------------------------------------------------------
+/*
+	Complete ("X") events with microsecond timestamps, to the nanosecond,
+	plus one thread_name metadata event per thread.
+*/
+bool profilerWriteChromeTrace(const char* path)
+{
+	FILE* fp = fopen(path, "w");
+	if (fp == NULL) return false;
+
+	std::lock_guard<std::mutex> lock(registry_mutex);
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	bool first = true;
+	for (size_t t = 0; t < registry.size(); t++) {
+		const ThreadBuffer& b = *registry[t];
+
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",\n", b.id);
+		writeJSONString(fp, b.name.c_str());
+		fprintf(fp, "}}");
+		first = false;
+
+		for (long long i = 0; i < b.count; i++) {
+			const ProfileEvent& e = b.chunks[i / ThreadBuffer::ChunkSize][i % ThreadBuffer::ChunkSize];
+			fprintf(fp, ",\n{\"name\":");
+			writeJSONString(fp, e.name);
+			fprintf(fp, ",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				b.id, e.begin / 1000.0, (e.end - e.begin) / 1000.0);
+		}
+	}
+	fprintf(fp, "\n]}\n");
+	return fclose(fp) == 0;
+}
@@ -0,0 +1,74 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- Profiler.h ---
+//
+//   Scoped CPU zones: PROFILE_ZONE("name") times the rest of the enclosing
+//   scope. Each thread appends its zones (name, begin and end in
+//   nanoseconds) to its own buffer, registered under a lock the first time
+//   the thread records and written without one after that. While profiling
+//   is off a zone costs one relaxed atomic load.
+//
+//   profilerWriteChromeTrace() writes every recorded zone in the Chrome
+//   trace_event JSON format (chrome://tracing, Perfetto). It reads the
+//   other threads' buffers, so call it while no zones are being recorded,
+//   e.g. between frames or at exit.
+//
+//   ProfileZone::restart() splits one scope into consecutive zones, for
+//   stages that share their locals (the passes of display()).
+//
+//   Zone names must be string literals (or otherwise outlive the profiler).
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <atomic>
+#include <stdint.h>
+
+extern std::atomic<bool> profiler_enabled;
+
+void profilerEnable(bool on);
+inline bool profilerEnabled() { return profiler_enabled.load(std::memory_order_relaxed); }
+
+//Monotonic clock, nanoseconds since the first call
+uint64_t profilerNowNs();
+
+void profilerRecord(const char* name, uint64_t begin_ns, uint64_t end_ns);
+
+//Names the calling thread in the trace; the name is copied
+void profilerSetThreadName(const char* name);
+
+bool profilerWriteChromeTrace(const char* path);
+long long profilerZoneCount();
+
+class ProfileZone {
+public:
+	explicit ProfileZone(const char* name) : zone_name(name), active(profilerEnabled()) {
+		if (active) begin = profilerNowNs();
+	}
+	~ProfileZone() {
+		if (active) profilerRecord(zone_name, begin, profilerNowNs());
+	}
+
+	//Closes this zone and opens the next one, for consecutive stages of one scope
+	void restart(const char* name) {
+		if (active) {
+			uint64_t now = profilerNowNs();
+			profilerRecord(zone_name, begin, now);
+			begin = now;
+		}
+		zone_name = name;
+	}
+
+private:
+	const char* zone_name;
+	bool active;
+	uint64_t begin = 0;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__)(name)
+
+#endif // __PROFILER_H__
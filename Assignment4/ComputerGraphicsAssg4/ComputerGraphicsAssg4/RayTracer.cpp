@@ -0,0 +1,598 @@
+#include "RayTracer.h"
+#include "ThreadPool.h"
+#include "Timing.h"
+#include "Profiler.h"
+#include <math.h>
+#include <algorithm>
+#include <emmintrin.h>
+
+//BVH build parameters: binned SAH with Bins bins per axis, leaves of at most MaxLeaf triangles
+static const int Bins = 16, MaxLeaf = 8, MaxDepth = 60;
+static const float TraversalCost = 1.0, IntersectionCost = 1.0;
+
+//Image tiles handed to the threads, in pixels; packets are 2x2 pixels
+static const int Tile = 16;
+
+static const float NoHit = 1e30f;
+static const float RayEpsilon = 1e-4f, ShadowOffset = 1e-3f;
+static const double Pi = 3.1415926535897932384626433832795;
+
+struct RayTracer::Packet {
+	__m128 ox, oy, oz;  //Origins
+	__m128 dx, dy, dz;  //Directions
+	__m128 ix, iy, iz;  //1 / direction
+	__m128 t;           //Nearest hit so far; the segment length for shadow rays
+	__m128 u, v;        //Barycentrics of the hit
+	__m128i tri;        //Hit triangle, -1 for none
+	__m128 active;      //Lanes still being traced
+};
+
+//---------------------------------------------------------
+static inline __m128 select(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+//---------------------------------------------------------
+static inline float surfaceArea(const float* mn, const float* mx)
+{
+	float x = mx[0] - mn[0], y = mx[1] - mn[1], z = mx[2] - mn[2];
+	return 2.0f * (x * y + y * z + z * x);
+}
+//---------------------------------------------------------
+static inline void growBox(float* mn, float* mx, const float* p_min, const float* p_max)
+{
+	for (int k = 0; k < 3; k++) {
+		mn[k] = std::min(mn[k], p_min[k]);
+		mx[k] = std::max(mx[k], p_max[k]);
+	}
+}
+//---------------------------------------------------------
+static inline void emptyBox(float* mn, float* mx)
+{
+	mn[0] = mn[1] = mn[2] = NoHit;
+	mx[0] = mx[1] = mx[2] = -NoHit;
+}
+//---------------------------------------------------------
+static void initPacket(RayTracer::Packet& p, const float* o, const float* d, __m128 active, __m128 t)
+{
+	p.ox = _mm_loadu_ps(o); p.oy = _mm_loadu_ps(o + 4); p.oz = _mm_loadu_ps(o + 8);
+	p.dx = _mm_loadu_ps(d); p.dy = _mm_loadu_ps(d + 4); p.dz = _mm_loadu_ps(d + 8);
+	__m128 one = _mm_set1_ps(1.0f);
+	p.ix = _mm_div_ps(one, p.dx);
+	p.iy = _mm_div_ps(one, p.dy);
+	p.iz = _mm_div_ps(one, p.dz);
+	p.t = t;
+	p.u = p.v = _mm_setzero_ps();
+	p.tri = _mm_set1_epi32(-1);
+	p.active = active;
+}
+//---------------------------------------------------------
+//Moller-Trumbore, one triangle against the four rays
+static inline void intersectTriangle(const RayTracer::Triangle& tri, int index, RayTracer::Packet& p, bool any_hit)
+{
+	__m128 e1x = _mm_set1_ps(tri.e1[0]), e1y = _mm_set1_ps(tri.e1[1]), e1z = _mm_set1_ps(tri.e1[2]);
+	__m128 e2x = _mm_set1_ps(tri.e2[0]), e2y = _mm_set1_ps(tri.e2[1]), e2z = _mm_set1_ps(tri.e2[2]);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(p.dy, e2z), _mm_mul_ps(p.dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(p.dz, e2x), _mm_mul_ps(p.dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(p.dx, e2y), _mm_mul_ps(p.dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	__m128 sx = _mm_sub_ps(p.ox, _mm_set1_ps(tri.v0[0]));
+	__m128 sy = _mm_sub_ps(p.oy, _mm_set1_ps(tri.v0[1]));
+	__m128 sz = _mm_sub_ps(p.oz, _mm_set1_ps(tri.v0[2]));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(p.dx, qx), _mm_mul_ps(p.dy, qy)), _mm_mul_ps(p.dz, qz)), inv_det);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 hit = _mm_and_ps(p.active, _mm_cmpgt_ps(abs_det, _mm_set1_ps(1e-12f)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(RayEpsilon)), _mm_cmplt_ps(t, p.t)));
+	if (_mm_movemask_ps(hit) == 0) return;
+
+	p.t = select(hit, t, p.t);
+	p.u = select(hit, u, p.u);
+	p.v = select(hit, v, p.v);
+	__m128i hit_i = _mm_castps_si128(hit);
+	p.tri = _mm_or_si128(_mm_and_si128(hit_i, _mm_set1_epi32(index)), _mm_andnot_si128(hit_i, p.tri));
+	if (any_hit) p.active = _mm_andnot_ps(hit, p.active);
+}
+//---------------------------------------------------------
+void RayTracer::clear()
+{
+	triangles.clear();
+	surfaces.clear();
+	nodes.clear();
+	materials.clear();
+	lights.clear();
+}
+//---------------------------------------------------------
+int RayTracer::addMaterial(const RayMaterial& m)
+{
+	materials.push_back(m);
+	return (int)materials.size() - 1;
+}
+//---------------------------------------------------------
+void RayTracer::addLight(const RayLight& l)
+{
+	lights.push_back(l);
+}
+//---------------------------------------------------------
+void RayTracer::addMesh(const point3* position, const vec3* normal, const vec2* tex_coord, int count,
+	const mat4& model, int material)
+{
+	for (int i = 0; i + 2 < count; i += 3) {
+		point3 p[3];
+		for (int k = 0; k < 3; k++) {
+			vec4 w = model * vec4(position[i + k], 1.0);
+			p[k] = point3(w.x, w.y, w.z);
+		}
+
+		Triangle tri;
+		vec3 e1 = p[1] - p[0], e2 = p[2] - p[0];
+		for (int k = 0; k < 3; k++) {
+			tri.v0[k] = p[0][k];
+			tri.e1[k] = e1[k];
+			tri.e2[k] = e2[k];
+		}
+		triangles.push_back(tri);
+
+		Surface s;
+		vec3 face = normalize(cross(e1, e2));
+		for (int k = 0; k < 3; k++) {
+			if (normal) {
+				vec4 n = model * vec4(normal[i + k], 0.0);
+				s.normal[k] = normalize(vec3(n.x, n.y, n.z));
+			}
+			else
+				s.normal[k] = face;
+			s.tex_coord[k] = tex_coord ? tex_coord[i + k] : vec2(0.0, 0.0);
+		}
+		s.material = material;
+		surfaces.push_back(s);
+	}
+}
+//---------------------------------------------------------
+void RayTracer::setTexture2D(int width, int height, const unsigned char* rgba)
+{
+	texture_width = width;
+	texture_height = height;
+	texture = rgba;
+}
+//---------------------------------------------------------
+void RayTracer::setCamera(const vec4& eye, const vec4& at, const vec4& up, float fovy, float aspect)
+{
+	//The same frame as LookAt()
+	vec3 n = normalize(vec3(eye.x - at.x, eye.y - at.y, eye.z - at.z));
+	vec3 u = normalize(cross(vec3(up.x, up.y, up.z), n));
+	camera_eye = point3(eye.x, eye.y, eye.z);
+
+	//Perspective() starts from an identity mat4 and keeps its 1 in the w row, so clip w is
+	//1 - z: the GL image is projected from one unit behind the eye. Rays start there as well.
+	camera_origin = camera_eye + n;
+	camera_right = u;
+	camera_up = normalize(cross(n, u));
+	camera_forward = -n;
+	tan_half_fovy = tan(fovy * Pi / 360.0);
+	camera_aspect = aspect;
+}
+//---------------------------------------------------------
+/*
+	Binned SAH: the triangle centroids of the range are binned along each
+	axis, and the range is split at the bin boundary with the lowest
+	TraversalCost + IntersectionCost * (area_l * n_l + area_r * n_r) / area.
+	A range becomes a leaf when that is no cheaper than testing all of its
+	triangles, as long as they fit in MaxLeaf.
+*/
+int RayTracer::buildNode(int begin, int end, int depth)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(Node());
+
+	float mn[3], mx[3], c_min[3], c_max[3];
+	emptyBox(mn, mx);
+	emptyBox(c_min, c_max);
+	for (int i = begin; i < end; i++) {
+		int t = order[i];
+		growBox(mn, mx, &box_min[t * 3], &box_max[t * 3]);
+		growBox(c_min, c_max, &centroid[t * 3], &centroid[t * 3]);
+	}
+
+	Node node;
+	for (int k = 0; k < 3; k++) {
+		node.min[k] = mn[k];
+		node.max[k] = mx[k];
+	}
+	node.offset = begin;
+	node.count = end - begin;
+	node.axis = 0;
+
+	int count = end - begin;
+	float best_cost = IntersectionCost * count;
+	int best_axis = -1, best_split = 0;
+	if (count > 1 && depth < MaxDepth) {
+		float area = std::max(surfaceArea(mn, mx), 1e-20f);
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = c_max[axis] - c_min[axis];
+			if (extent <= 0.0f) continue;
+			float scale = Bins / extent;
+
+			int bin_count[Bins] = { 0 };
+			float bin_min[Bins][3], bin_max[Bins][3];
+			for (int b = 0; b < Bins; b++) emptyBox(bin_min[b], bin_max[b]);
+			for (int i = begin; i < end; i++) {
+				int t = order[i];
+				int b = std::min(Bins - 1, (int)((centroid[t * 3 + axis] - c_min[axis]) * scale));
+				bin_count[b]++;
+				growBox(bin_min[b], bin_max[b], &box_min[t * 3], &box_max[t * 3]);
+			}
+
+			//Sweep from the right for the right-hand areas, then from the left
+			float right_area[Bins];
+			int right_count[Bins];
+			float r_min[3], r_max[3];
+			emptyBox(r_min, r_max);
+			for (int b = Bins - 1, n = 0; b > 0; b--) {
+				n += bin_count[b];
+				growBox(r_min, r_max, bin_min[b], bin_max[b]);
+				right_count[b] = n;
+				right_area[b] = n ? surfaceArea(r_min, r_max) : 0.0f;
+			}
+			float l_min[3], l_max[3];
+			emptyBox(l_min, l_max);
+			for (int b = 1, n = 0; b < Bins; b++) {
+				n += bin_count[b - 1];
+				growBox(l_min, l_max, bin_min[b - 1], bin_max[b - 1]);
+				if (n == 0 || right_count[b] == 0) continue;
+				float cost = TraversalCost + IntersectionCost *
+					(surfaceArea(l_min, l_max) * n + right_area[b] * right_count[b]) / area;
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b;
+				}
+			}
+		}
+	}
+
+	if (best_axis < 0 && count > MaxLeaf && depth < MaxDepth) {
+		//No useful SAH split (or all centroids coincide) but too many triangles: halve the range
+		int axis = 0;
+		for (int k = 1; k < 3; k++)
+			if (mx[k] - mn[k] > mx[axis] - mn[axis]) axis = k;
+		int mid = (begin + end) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+			[&](int a, int b) { return centroid[a * 3 + axis] < centroid[b * 3 + axis]; });
+		node.axis = axis;
+		node.count = 0;
+		nodes[index] = node;
+		buildNode(begin, mid, depth + 1);
+		nodes[index].offset = buildNode(mid, end, depth + 1);
+		return index;
+	}
+
+	if (best_axis < 0) {
+		nodes[index] = node;
+		return index;
+	}
+
+	float scale = Bins / (c_max[best_axis] - c_min[best_axis]);
+	int* mid = std::partition(order.data() + begin, order.data() + end, [&](int t) {
+		return std::min(Bins - 1, (int)((centroid[t * 3 + best_axis] - c_min[best_axis]) * scale)) < best_split;
+	});
+
+	node.axis = best_axis;
+	node.count = 0;
+	nodes[index] = node;
+	buildNode(begin, (int)(mid - order.data()), depth + 1);
+	nodes[index].offset = buildNode((int)(mid - order.data()), end, depth + 1);
+	return index;
+}
+//---------------------------------------------------------
+void RayTracer::build()
+{
+	PROFILE_ZONE("bvh build");
+	double start = wallTimeMs();
+	int count = (int)triangles.size();
+
+	box_min.resize(count * 3);
+	box_max.resize(count * 3);
+	centroid.resize(count * 3);
+	order.resize(count);
+	for (int t = 0; t < count; t++) {
+		const Triangle& tri = triangles[t];
+		for (int k = 0; k < 3; k++) {
+			float a = tri.v0[k], b = a + tri.e1[k], c = a + tri.e2[k];
+			box_min[t * 3 + k] = std::min(a, std::min(b, c));
+			box_max[t * 3 + k] = std::max(a, std::max(b, c));
+			centroid[t * 3 + k] = 0.5f * (box_min[t * 3 + k] + box_max[t * 3 + k]);
+		}
+		order[t] = t;
+	}
+
+	nodes.clear();
+	nodes.reserve(2 * count + 1);
+	if (count > 0) buildNode(0, count, 0);
+
+	//Store the triangles in leaf order
+	std::vector<Triangle> sorted_triangles(count);
+	std::vector<Surface> sorted_surfaces(count);
+	for (int i = 0; i < count; i++) {
+		sorted_triangles[i] = triangles[order[i]];
+		sorted_surfaces[i] = surfaces[order[i]];
+	}
+	triangles.swap(sorted_triangles);
+	surfaces.swap(sorted_surfaces);
+
+	build_ms = wallTimeMs() - start;
+}
+//---------------------------------------------------------
+/*
+	Packet traversal: a node is entered when any active ray reaches its box
+	before its current nearest hit. Children are visited near to far by the
+	direction of the packet's first active ray, which the four rays of a 2x2
+	packet (or shadow rays toward one light) mostly share. Any-hit traces
+	(shadow rays) retire a lane at its first hit and stop once all are retired.
+*/
+void RayTracer::trace(Packet& p, bool any_hit) const
+{
+	if (nodes.empty() || _mm_movemask_ps(p.active) == 0) return;
+
+	float dir[3][4];
+	_mm_storeu_ps(dir[0], p.dx);
+	_mm_storeu_ps(dir[1], p.dy);
+	_mm_storeu_ps(dir[2], p.dz);
+	int lead = 0;
+	while (!((_mm_movemask_ps(p.active) >> lead) & 1)) lead++;
+	bool negative[3] = { dir[0][lead] < 0.0f, dir[1][lead] < 0.0f, dir[2][lead] < 0.0f };
+
+	int stack[MaxDepth + 4];
+	int top = 0;
+	stack[top++] = 0;
+	__m128 zero = _mm_setzero_ps();
+
+	while (top > 0) {
+		int index = stack[--top];
+		const Node& n = nodes[index];
+
+		__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min[0]), p.ox), p.ix);
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max[0]), p.ox), p.ix);
+		__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min[1]), p.oy), p.iy);
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max[1]), p.oy), p.iy);
+		__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.min[2]), p.oz), p.iz);
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.max[2]), p.oz), p.iz);
+		__m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), zero));
+		__m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), p.t));
+		if (_mm_movemask_ps(_mm_and_ps(p.active, _mm_cmple_ps(t_near, t_far))) == 0) continue;
+
+		if (n.count > 0) {
+			for (int i = n.offset; i < n.offset + n.count; i++)
+				intersectTriangle(triangles[i], i, p, any_hit);
+			if (any_hit && _mm_movemask_ps(p.active) == 0) return;
+			continue;
+		}
+
+		//Push the far child first
+		if (negative[n.axis]) {
+			stack[top++] = index + 1;
+			stack[top++] = n.offset;
+		}
+		else {
+			stack[top++] = n.offset;
+			stack[top++] = index + 1;
+		}
+	}
+}
+//---------------------------------------------------------
+/*
+	Shades the pixels [x0, x1) x [y0, y1), 2x2 at a time: one primary packet,
+	then per light one shadow packet from the four hit points. The lighting
+	is processLight() of vshader53.glsl in the world frame; a shadowed light
+	keeps only its (attenuated) ambient term.
+*/
+void RayTracer::shadeTile(int x0, int y0, int x1, int y1, int width, int height, unsigned char* rgb,
+	long long& shadow_count) const
+{
+	const color4 fog_color(0.7, 0.7, 0.7, 0.5);
+
+	for (int py = y0; py < y1; py += 2)
+		for (int px = x0; px < x1; px += 2) {
+			float o[12], d[12];
+			int mask = 0;
+			for (int lane = 0; lane < 4; lane++) {
+				int x = px + (lane & 1), y = py + (lane >> 1);
+				if (x < x1 && y < y1) mask |= 1 << lane;
+
+				float sx = (2.0f * (x + 0.5f) / width - 1.0f) * tan_half_fovy * camera_aspect;
+				float sy = (1.0f - 2.0f * (y + 0.5f) / height) * tan_half_fovy;
+				vec3 dir = normalize(camera_forward + sx * camera_right + sy * camera_up);
+				for (int k = 0; k < 3; k++) {
+					o[k * 4 + lane] = camera_origin[k];
+					d[k * 4 + lane] = dir[k];
+				}
+			}
+			__m128 active = _mm_castsi128_ps(_mm_set_epi32(mask & 8 ? -1 : 0, mask & 4 ? -1 : 0, mask & 2 ? -1 : 0, mask & 1 ? -1 : 0));
+
+			Packet primary;
+			initPacket(primary, o, d, active, _mm_set1_ps(NoHit));
+			trace(primary, false);
+
+			float t[4], u[4], v[4];
+			int tri[4];
+			_mm_storeu_ps(t, primary.t);
+			_mm_storeu_ps(u, primary.u);
+			_mm_storeu_ps(v, primary.v);
+			_mm_storeu_si128((__m128i*)tri, primary.tri);
+
+			//Per lane: hit point, shading frame and the color so far
+			point3 pos[4];
+			vec3 N[4], E[4], Ng[4];
+			color4 color[4];
+			for (int lane = 0; lane < 4; lane++) {
+				if (tri[lane] < 0) continue;
+				vec3 dir(d[lane], d[4 + lane], d[8 + lane]);
+				pos[lane] = camera_origin + t[lane] * dir;
+				E[lane] = normalize(camera_eye - pos[lane]);
+
+				const Surface& s = surfaces[tri[lane]];
+				float w = 1.0f - u[lane] - v[lane];
+				N[lane] = normalize(w * s.normal[0] + u[lane] * s.normal[1] + v[lane] * s.normal[2]);
+				const Triangle& g = triangles[tri[lane]];
+				Ng[lane] = normalize(cross(vec3(g.e1[0], g.e1[1], g.e1[2]), vec3(g.e2[0], g.e2[1], g.e2[2])));
+				if (dot(Ng[lane], dir) > 0.0f) Ng[lane] = -Ng[lane];
+
+				color[lane] = global_ambient * materials[s.material].ambient;
+			}
+
+			for (size_t i = 0; i < lights.size(); i++) {
+				const RayLight& light = lights[i];
+				color4 direct[4];
+				float distance[4];
+				int shadow_mask = 0;
+				float so[12], sd[12];
+
+				for (int lane = 0; lane < 4; lane++) {
+					if (tri[lane] < 0) continue;
+					const RayMaterial& m = materials[surfaces[tri[lane]].material];
+					color4 ambient = light.ambient * m.ambient;
+
+					if (light.type == 0) {
+						color[lane] += ambient;
+						continue;
+					}
+
+					vec3 L;
+					float attenuation = 1.0f;
+					if (light.type == 1) {
+						L = -light.direction;
+						distance[lane] = NoHit;
+					}
+					else if (light.type == 2 || light.type == 3) {
+						vec3 D = light.position - pos[lane];
+						float dist = length(D);
+						L = D / dist;
+						distance[lane] = dist;
+						attenuation = 1.0f / (light.const_att + light.linear_att * dist + light.quad_att * dist * dist);
+					}
+					else
+						continue;
+
+					if (light.type == 3) {
+						vec3 Lf = normalize(light.focus - light.position);
+						float Lfl = dot(Lf, -L);
+						if (Lfl < cos(light.cutoff * Pi / 180.0))
+							attenuation = 0.0f;
+						else
+							attenuation *= pow(Lfl, light.exponent);
+					}
+
+					vec3 H = normalize(L + E[lane]);
+					float NL = dot(L, N[lane]);
+					color4 diffuse = fmax(NL, 0.0f) * (light.diffuse * m.diffuse);
+					color4 specular = NL < 0.0f ? color4(0.0, 0.0, 0.0, 1.0) :
+						(float)pow(fmax(dot(N[lane], H), 0.0f), m.shininess) * (light.specular * m.specular);
+
+					color[lane] += attenuation * ambient;
+					direct[lane] = attenuation * (diffuse + specular);
+
+					//Only a side facing the light, with light to lose, needs a shadow ray
+					if (!shadows || dot(L, Ng[lane]) <= 0.0f || attenuation <= 0.0f) {
+						color[lane] += direct[lane];
+						continue;
+					}
+					shadow_mask |= 1 << lane;
+					point3 origin = pos[lane] + ShadowOffset * Ng[lane];
+					for (int k = 0; k < 3; k++) {
+						so[k * 4 + lane] = origin[k];
+						sd[k * 4 + lane] = L[k];
+					}
+				}
+				if (shadow_mask == 0) continue;
+
+				for (int lane = 0; lane < 4; lane++)
+					if (!(shadow_mask & (1 << lane))) {
+						for (int k = 0; k < 3; k++) {
+							so[k * 4 + lane] = 0.0f;
+							sd[k * 4 + lane] = 1.0f;
+						}
+						distance[lane] = 0.0f;
+					}
+
+				Packet shadow;
+				__m128 shadow_active = _mm_castsi128_ps(_mm_set_epi32(shadow_mask & 8 ? -1 : 0, shadow_mask & 4 ? -1 : 0,
+					shadow_mask & 2 ? -1 : 0, shadow_mask & 1 ? -1 : 0));
+				initPacket(shadow, so, sd, shadow_active, _mm_loadu_ps(distance));
+				trace(shadow, true);
+				int occluded = _mm_movemask_ps(_mm_andnot_ps(shadow.active, shadow_active));
+
+				for (int lane = 0; lane < 4; lane++)
+					if ((shadow_mask & (1 << lane)) && !(occluded & (1 << lane))) color[lane] += direct[lane];
+				for (int lane = 0; lane < 4; lane++)
+					if (shadow_mask & (1 << lane)) shadow_count++;
+			}
+
+			for (int lane = 0; lane < 4; lane++) {
+				if (!(mask & (1 << lane))) continue;
+				int x = px + (lane & 1), y = py + (lane >> 1);
+
+				color4 c = background;
+				if (tri[lane] >= 0) {
+					const Surface& s = surfaces[tri[lane]];
+					c = color[lane];
+
+					if (materials[s.material].textured && texture) {
+						float w = 1.0f - u[lane] - v[lane];
+						vec2 st = w * s.tex_coord[0] + u[lane] * s.tex_coord[1] + v[lane] * s.tex_coord[2];
+						int tx = (int)floor(st.x * texture_width) % texture_width;
+						int ty = (int)floor(st.y * texture_height) % texture_height;
+						if (tx < 0) tx += texture_width;
+						if (ty < 0) ty += texture_height;
+						const unsigned char* texel = texture + (ty * texture_width + tx) * 4;
+						c = c * color4(texel[0] / 255.0, texel[1] / 255.0, texel[2] / 255.0, texel[3] / 255.0);
+					}
+
+					//fshader53.glsl fog, on the eye-space depth
+					float fZ = dot(pos[lane] - camera_eye, camera_forward);
+					float f = 1.0f;
+					if (fog == 1) f = (18.0f - fZ) / 18.0f;
+					else if (fog == 2) f = exp(-0.09f * fZ);
+					else if (fog == 3) f = exp(-pow(0.09f * fZ, 2.0f));
+					f = fmin(fmax(f, 0.0f), 1.0f);
+					c = (1.0f - f) * fog_color + f * c;
+				}
+
+				unsigned char* out = rgb + (y * width + x) * 3;
+				for (int k = 0; k < 3; k++)
+					out[k] = (unsigned char)(fmin(fmax(c[k], 0.0f), 1.0f) * 255.0f + 0.5f);
+			}
+		}
+}
+//---------------------------------------------------------
+void RayTracer::render(int width, int height, unsigned char* rgb)
+{
+	PROFILE_ZONE("ray trace");
+	double start = wallTimeMs();
+	ThreadPool& pool = ThreadPool::instance();
+	int tiles_x = (width + Tile - 1) / Tile, tiles_y = (height + Tile - 1) / Tile;
+
+	std::vector<long long> shadow_counts(pool.size(), 0);
+	pool.run(tiles_x * tiles_y, [&](int tile, int thread) {
+		PROFILE_ZONE("trace tile");
+		int x0 = (tile % tiles_x) * Tile, y0 = (tile / tiles_x) * Tile;
+		shadeTile(x0, y0, std::min(x0 + Tile, width), std::min(y0 + Tile, height), width, height,
+			rgb, shadow_counts[thread]);
+	});
+
+	primary_rays = (long long)width * height;
+	shadow_rays = 0;
+	for (size_t i = 0; i < shadow_counts.size(); i++) shadow_rays += shadow_counts[i];
+	trace_ms = wallTimeMs() - start;
+}
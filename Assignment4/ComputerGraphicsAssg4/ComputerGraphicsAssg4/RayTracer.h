@@ -0,0 +1,129 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- RayTracer.h ---
+//
+//   CPU ray tracer for the rolling-sphere scene, used as a reference image
+//   and as a throughput benchmark. Meshes are flattened to world-space
+//   triangles under one BVH, built with binned SAH. Pixels are shaded with
+//   the lighting model of vshader53.glsl (evaluated per pixel instead of per
+//   vertex) and every non-ambient light casts a shadow ray, in place of the
+//   projected sphere_shadow of the GL path.
+//
+//   Rays are traced as 2x2 packets with SSE (one ray per lane): the packet
+//   descends into a node when any of its rays hits the box, and triangles
+//   are tested against all four rays at once. Image tiles are shared out
+//   over the ThreadPool.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RAYTRACER_H__
+#define __RAYTRACER_H__
+
+#include "Angel-yjc.h"
+#include <vector>
+
+typedef Angel::vec4  color4;
+typedef Angel::vec3  point3;
+
+struct RayMaterial {
+	color4 ambient, diffuse, specular;
+	float shininess;
+	bool textured; //Diffuse-lit color modulated by the 2D texture, like texture_flag in fshader53.glsl
+};
+
+//A light as vshader53.glsl sees it, but in the world frame
+struct RayLight {
+	int type;          //0: ambient, 1: directional, 2: point, 3: spot
+	point3 position;   //Point and spot
+	vec3 direction;    //Directional: the direction the light travels
+	point3 focus;      //Spot: the point it is aimed at
+	float cutoff, exponent; //Spot, cutoff in degrees
+	float const_att, linear_att, quad_att;
+	color4 ambient, diffuse, specular;
+};
+
+class RayTracer {
+public:
+	color4 global_ambient = color4(1.0, 1.0, 1.0, 1.0);
+	color4 background = color4(0.0, 0.0, 0.0, 1.0);
+	int fog = 0; //As Fog in fshader53.glsl
+	bool shadows = true;
+
+	//Starts a new scene: drops all meshes, materials and lights
+	void clear();
+
+	int addMaterial(const RayMaterial& m);
+	void addLight(const RayLight& l);
+
+	//count vertices of a triangle list, transformed by model (rotation and translation only);
+	//normals and tex_coord may be NULL (face normals, zero coordinates)
+	void addMesh(const point3* position, const vec3* normal, const vec2* tex_coord, int count,
+		const mat4& model, int material);
+
+	//RGBA8, sampled GL_NEAREST with GL_REPEAT; the data is not copied
+	void setTexture2D(int width, int height, const unsigned char* rgba);
+
+	void setCamera(const vec4& eye, const vec4& at, const vec4& up, float fovy, float aspect);
+
+	//Builds the BVH over everything added since clear()
+	void build();
+
+	//Renders a width x height image as RGB rows, top row first
+	void render(int width, int height, unsigned char* rgb);
+
+	double lastBuildMs() const { return build_ms; }
+	double lastTraceMs() const { return trace_ms; }
+	long long lastRayCount() const { return primary_rays + shadow_rays; }
+	long long lastShadowRayCount() const { return shadow_rays; }
+	int triangleCount() const { return (int)triangles.size(); }
+	int nodeCount() const { return (int)nodes.size(); }
+
+	//Intersection data of one triangle, in BVH leaf order
+	struct Triangle {
+		float v0[3], e1[3], e2[3];
+	};
+
+	//Shading data of one triangle, parallel to the triangles
+	struct Surface {
+		vec3 normal[3];
+		vec2 tex_coord[3];
+		int material;
+	};
+
+	struct Node {
+		float min[3], max[3];
+		int offset; //Inner: right child (the left child follows the node); leaf: first triangle
+		int count;  //Triangles in a leaf, 0 for inner nodes
+		int axis;   //Split axis of inner nodes
+	};
+
+	struct Packet;
+
+private:
+	int buildNode(int begin, int end, int depth);
+	void trace(Packet& p, bool any_hit) const;
+	void shadeTile(int x0, int y0, int x1, int y1, int width, int height, unsigned char* rgb,
+		long long& shadow_count) const;
+
+	std::vector<Triangle> triangles;
+	std::vector<Surface> surfaces;
+	std::vector<Node> nodes;
+	std::vector<RayMaterial> materials;
+	std::vector<RayLight> lights;
+
+	//Build scratch: per-triangle bounds and centroids, permuted during the build
+	std::vector<float> box_min, box_max, centroid;
+	std::vector<int> order;
+
+	int texture_width = 0, texture_height = 0;
+	const unsigned char* texture = NULL;
+
+	point3 camera_eye, camera_origin;
+	vec3 camera_right, camera_up, camera_forward;
+	float tan_half_fovy = 1.0, camera_aspect = 1.0;
+
+	double build_ms = 0.0, trace_ms = 0.0;
+	long long primary_rays = 0, shadow_rays = 0;
+};
+
+#endif // __RAYTRACER_H__
@@ -0,0 +1,219 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "Regression.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+const RegressionCase regression_cases[] = {
+	{ "sphere-8",        "--sphere sphere.8.txt", 60 },
+	{ "sphere-128",      "--sphere sphere.128.txt", 60 },
+	{ "sphere-256",      "--sphere sphere.256.txt", 60 },
+	{ "sphere-1024",     "--sphere sphere.1024.txt", 60 },
+	{ "flat",            "--sphere sphere.128.txt --shading flat", 60 },
+	{ "smooth-point",    "--sphere sphere.128.txt --shading smooth --light point", 60 },
+	{ "unlit",           "--sphere sphere.128.txt --lighting off", 60 },
+	{ "fog-linear",      "--sphere sphere.128.txt --fog linear", 90 },
+	{ "fog-exp",         "--sphere sphere.128.txt --fog exp", 90 },
+	{ "fog-exp2",        "--sphere sphere.128.txt --fog exp2", 90 },
+	{ "ground-off",      "--sphere sphere.128.txt --ground-texture off", 60 },
+	{ "ground-trilinear", "--sphere sphere.128.txt --ground-filter trilinear --eye 7,1.5,-4", 60 },
+	{ "sphere-lines",    "--sphere sphere.256.txt --sphere-texture lines", 120 },
+	{ "sphere-checker",  "--sphere sphere.256.txt --sphere-texture checker", 120 },
+	{ "lattice-upright", "--sphere sphere.256.txt --lattice upright", 120 },
+	{ "lattice-tilted",  "--sphere sphere.256.txt --lattice tilted", 120 },
+	{ "shadow-off",      "--sphere sphere.128.txt --shadow off", 60 },
+	{ "shadow-blend",    "--sphere sphere.128.txt --blend-shadow on", 60 },
+	{ "shadow-stencil",  "--sphere sphere.128.txt --shadow-mode stencil --blend-shadow on --spheres 10 --eye 2,9,-9", 60 },
+	{ "shadow-mask",     "--sphere sphere.128.txt --shadow-mode mask --spheres 10 --eye 2,9,-9", 60 },
+	{ "shadow-maps",     "--sphere sphere.128.txt --shadow-mode maps --shadow-map-size 256 --light point --spheres 10 --eye 2,9,-9", 60 },
+	{ "per-pixel-prepass", "--sphere sphere.128.txt --per-pixel all --depth-prepass --light point", 60 },
+	{ "deferred",        "--sphere sphere.128.txt --deferred --lights 16", 60 },
+	{ "particles-gpu",   "--sphere sphere.128.txt --particles gpu", 150 },
+	{ "particles-cpu",   "--sphere sphere.128.txt --particles cpu", 150 },
+	{ NULL, NULL, 0 }
+};
+
+//Every case: the same clock, and a small frame so the references stay small
+static const char* const run_options = "--step 16.667 --warmup 2 --size 256x256";
+
+//---------------------------------------------------------
+//The running program's own file; argv[0] may be relative to a directory --data-dir has left
+static std::string programPath(const char* argv0)
+{
+#ifdef _WIN32
+	char path[MAX_PATH];
+	DWORD n = GetModuleFileNameA(NULL, path, MAX_PATH);
+	if (n > 0 && n < MAX_PATH) return std::string(path, n);
+#elif defined(__linux__)
+	char path[4096];
+	ssize_t n = readlink("/proc/self/exe", path, sizeof(path));
+	if (n > 0 && n < (ssize_t)sizeof(path)) return std::string(path, n);
+#endif
+	return argv0;
+}
+//---------------------------------------------------------
+static std::string quoted(const std::string& s)
+{
+	return "\"" + s + "\"";
+}
+//---------------------------------------------------------
+static std::string budgetsPath(const char* dir)
+{
+	return std::string(dir) + "/budgets.txt";
+}
+//---------------------------------------------------------
+static bool readBudgets(const char* dir, std::map<std::string, double>* budgets)
+{
+	FILE* fp = fopen(budgetsPath(dir).c_str(), "r");
+	if (fp == NULL) return false;
+	char line[256], name[128];
+	double ms;
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (line[0] != '#' && sscanf(line, "%127s %lf", name, &ms) == 2) (*budgets)[name] = ms;
+	fclose(fp);
+	return true;
+}
+//---------------------------------------------------------
+static bool writeBudgets(const char* dir, const std::map<std::string, double>& budgets)
+{
+	FILE* fp = fopen(budgetsPath(dir).c_str(), "w");
+	if (fp == NULL) return false;
+	fprintf(fp, "# Median frame ms of each regression case, the larger of CPU and GPU\n");
+	for (std::map<std::string, double>::const_iterator it = budgets.begin(); it != budgets.end(); ++it)
+		fprintf(fp, "%s %.3f\n", it->first.c_str(), it->second);
+	fclose(fp);
+	return true;
+}
+//---------------------------------------------------------
+struct CaseResult {
+	int status = -1;         //The process's exit code
+	double frame_ms = -1.0;  //-1 when the timing table was not printed
+	std::string compare;     //Its "Compare with" line
+	std::vector<std::string> errors;
+};
+//---------------------------------------------------------
+//Runs command, picking the medians out of the timing table runHeadless() prints
+static CaseResult runCase(const std::string& command)
+{
+	CaseResult result;
+	FILE* out = popen((command + " 2>&1").c_str(), "r");
+	if (out == NULL) {
+		result.errors.push_back("cannot start the case");
+		return result;
+	}
+	char line[1024];
+	double cpu = -1.0, gpu = -1.0, min_ms, avg_ms;
+	while (fgets(line, sizeof(line), out) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (sscanf(line, "  cpu %lf %lf %lf", &min_ms, &avg_ms, &cpu) == 3) continue;
+		if (sscanf(line, "  gpu %lf %lf %lf", &min_ms, &avg_ms, &gpu) == 3) continue;
+		if (strncmp(line, "Compare with", 12) == 0) result.compare = line;
+		else if (strncmp(line, "Error", 5) == 0) result.errors.push_back(line);
+	}
+	int status = pclose(out);
+#ifdef _WIN32
+	result.status = status;
+#else
+	result.status = status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+	if (cpu >= 0.0 && gpu >= 0.0) result.frame_ms = cpu > gpu ? cpu : gpu;
+	return result;
+}
+//---------------------------------------------------------
+int runRegression(const RegressionSettings& settings)
+{
+	std::string program = programPath(settings.program);
+	std::map<std::string, double> budgets;
+	if (!readBudgets(settings.dir, &budgets) && !settings.update) {
+		printf("Error: cannot read %s; --regress-update writes it\n", budgetsPath(settings.dir).c_str());
+		return 1;
+	}
+
+	if (settings.update)
+		printf("Regression references in %s: writing them\n", settings.dir);
+	else
+		printf("Regression run against %s: tolerance %d, frame time margin %.0f%%, median of %d runs\n", settings.dir,
+			settings.tolerance, settings.margin, settings.repeats);
+	printf("  %-18s %-8s %9s %9s  %s\n", "case", "image", "ms", "budget", "result");
+
+	int run = 0, failed = 0;
+	double start = wallTimeMs();
+	for (const RegressionCase* c = regression_cases; c->name != NULL; c++) {
+		if (settings.only != NULL && strstr(c->name, settings.only) == NULL) continue;
+		run++;
+
+		std::string image = std::string(settings.dir) + "/" + c->name + ".ppm";
+		char frames[64];
+		sprintf(frames, " --frames %d ", c->frames);
+		std::string command = quoted(program) + " --headless --summary-only " + run_options + frames + c->options;
+		if (settings.update)
+			command += " --screenshot " + quoted(image);
+		else {
+			char tolerance[64];
+			sprintf(tolerance, " --perceptual --tolerance %d", settings.tolerance);
+			command += " --compare " + quoted(image) + tolerance;
+		}
+
+		//Every run must match; the median run sets the frame time, for the check as for the budget
+		CaseResult r;
+		std::vector<double> times;
+		for (int i = 0; i < settings.repeats; i++) {
+			CaseResult run_result = runCase(command);
+			if (run_result.frame_ms >= 0.0) times.push_back(run_result.frame_ms);
+			if (i == 0 || (r.status == 0 && r.errors.empty())) r = run_result; //Keep the first failure
+		}
+		std::sort(times.begin(), times.end());
+		r.frame_ms = times.empty() ? -1.0 : times[times.size() / 2];
+		bool image_ok = r.status == 0 && r.errors.empty();
+		if (settings.update) {
+			if (image_ok && r.frame_ms >= 0.0) budgets[c->name] = r.frame_ms;
+			bool ok = image_ok && r.frame_ms >= 0.0;
+			printf("  %-18s %-8s %9.3f %9s  %s\n", c->name, ok ? "written" : "-", r.frame_ms, "", ok ? "ok" : "FAILED");
+			if (ok) continue;
+		}
+		else {
+			std::map<std::string, double>::const_iterator budget = budgets.find(c->name);
+			bool has_budget = budget != budgets.end();
+			double limit = has_budget ? budget->second * (1.0 + settings.margin / 100.0) : 0.0;
+			bool time_ok = has_budget && r.frame_ms >= 0.0 && r.frame_ms <= limit;
+			const char* why = image_ok ? (time_ok ? "ok" : has_budget ? "FAILED, too slow" : "FAILED, no budget") :
+				time_ok ? "FAILED, image" : "FAILED, image and time";
+			printf("  %-18s %-8s %9.3f %9.3f  %s\n", c->name, image_ok ? "ok" : "differs", r.frame_ms,
+				has_budget ? budget->second : 0.0, why);
+			if (image_ok && time_ok) continue;
+		}
+
+		//Failed: what the case said, and how to run it again
+		failed++;
+		if (!r.compare.empty()) printf("      %s\n", r.compare.c_str());
+		for (size_t i = 0; i < r.errors.size(); i++) printf("      %s\n", r.errors[i].c_str());
+		printf("      exit %d: %s\n", r.status, command.c_str());
+	}
+	if (run == 0) {
+		printf("Error: no case matches %s\n", settings.only);
+		return 1;
+	}
+
+	if (settings.update && !writeBudgets(settings.dir, budgets)) {
+		printf("Error: cannot write %s\n", budgetsPath(settings.dir).c_str());
+		return 1;
+	}
+	printf("%d cases, %d failed, in %.1f s\n", run, failed, (wallTimeMs() - start) / 1000.0);
+	return failed == 0 ? 0 : 1;
+}
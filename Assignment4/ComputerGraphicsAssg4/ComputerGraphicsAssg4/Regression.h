@@ -0,0 +1,55 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- Regression.h ---
+//
+//   Golden image and frame time regression runs of the headless renderer.
+//   A fixed list of canonical scenes (each sphere file, flat and smooth
+//   shading, the fog modes, the textures, the lattice, each shadow mode,
+//   per pixel and deferred lighting, the particles), each rendered for a
+//   fixed number of frames on the fixed clock, so its last frame is always
+//   at the same simulated time.
+//
+//   Each case runs as a process of its own, this program with --headless
+//   and the case's options, so no scene state leaks from one case into the
+//   next, and a failing case is reproduced by the command line printed for
+//   it. Its last frame is compared (--compare --perceptual) with the case's
+//   reference image, and its frame time with the case's budget. A run's
+//   frame time is the larger of its CPU and GPU medians; a case runs a few
+//   times, and its median run is timed, in the check as in the budget.
+//
+//   The reference directory holds NAME.ppm for every case and budgets.txt,
+//   a "name ms" line per case. Update mode renders and writes both. The
+//   references in regression/ were made headless on Mesa llvmpipe at
+//   256x256, which the CTest target forces; another renderer rasterizes
+//   and times differently and needs references of its own.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __REGRESSION_H__
+#define __REGRESSION_H__
+
+#include <stddef.h>
+
+struct RegressionCase {
+	const char* name;
+	const char* options; //Headless options, including the sphere file
+	int frames;          //Timed frames; with the warm-up ones they set the simulated time of the last frame
+};
+
+//The canonical scenes, ended by a case with a NULL name
+extern const RegressionCase regression_cases[];
+
+struct RegressionSettings {
+	const char* program = NULL; //This program, to run the cases with
+	const char* dir = NULL;     //The references
+	const char* only = NULL;    //Run only the cases whose name contains this; NULL for all
+	bool update = false;        //Write the references instead of checking against them
+	int tolerance = 2;          //Of comparePerceptual()
+	int repeats = 3;            //Runs of each case
+	double margin = 25.0;       //Percent over its budget a case's frame time may be
+};
+
+//Runs the cases and prints a row for each; 0 when all passed (or were written), 1 otherwise
+int runRegression(const RegressionSettings& settings);
+
+#endif // __REGRESSION_H__
@@ -0,0 +1,280 @@
+#include "RenderQueue.h"
+#include <algorithm>
+#include <stddef.h>
+#include <string.h>
+#include "GLStats.h"
+
+//---------------------------------------------------------
+void UniformBlock::add(const char* name, Type type, int count, const void* values, int words)
+{
+	const uint32_t* v = (const uint32_t*)values;
+
+	//Set again: the new value replaces the old one in place
+	for (size_t i = 0; i < entries.size(); i++) {
+		const Entry& e = entries[i];
+		if (e.type == type && e.count == count && strcmp(e.name, name) == 0) {
+			std::copy(v, v + words, data.begin() + e.offset);
+			return;
+		}
+	}
+
+	Entry e = { name, (uint8_t)type, count, (int)data.size() };
+	entries.push_back(e);
+	data.insert(data.end(), v, v + words);
+}
+void UniformBlock::set(const char* name, int v) { add(name, Int, 1, &v, 1); }
+void UniformBlock::set(const char* name, float v) { add(name, Float, 1, &v, 1); }
+void UniformBlock::set(const char* name, const vec4& v) { add(name, Float4, 1, &v, 4); }
+void UniformBlock::set(const char* name, const int* v, int count) { add(name, Int, count, v, count); }
+void UniformBlock::set(const char* name, const float* v, int count, int components)
+{
+	add(name, components == 4 ? Float4 : components == 3 ? Float3 : Float, count, v, count * components);
+}
+void UniformBlock::set(const char* name, const mat3& m) { add(name, Mat3, 1, (const GLfloat*)m, 9); }
+void UniformBlock::set(const char* name, const mat4& m) { add(name, Mat4, 1, (const GLfloat*)m, 16); }
+void UniformBlock::set(const char* name, const mat4* m, int count) { add(name, Mat4, count, (const GLfloat*)m, 16 * count); }
+
+//---------------------------------------------------------
+uint64_t RenderQueue::makeKey(int pass, int program, int material, int geometry, float depth)
+{
+	const uint64_t depth_max = (1ull << DepthBits) - 1;
+	uint64_t d = depth <= 0.0f ? 0 : depth >= 1.0f ? depth_max : (uint64_t)(depth * depth_max);
+
+	uint64_t key = (uint64_t)pass & ((1 << PassBits) - 1);
+	key = (key << ProgramBits) | ((uint64_t)program & ((1 << ProgramBits) - 1));
+	key = (key << MaterialBits) | ((uint64_t)material & ((1 << MaterialBits) - 1));
+	key = (key << GeometryBits) | ((uint64_t)geometry & ((1 << GeometryBits) - 1));
+	return (key << DepthBits) | d;
+}
+//---------------------------------------------------------
+int RenderQueue::addProgram(GLuint program)
+{
+	Program p;
+	p.name = program;
+	p.position = glGetAttribLocation(program, "vPosition");
+	p.normal = glGetAttribLocation(program, "vNormal");
+	p.color = glGetAttribLocation(program, "vColor");
+	p.texcoord = glGetAttribLocation(program, "vTexCoord");
+	const char* instance_attribs[] = { "vModelRow0", "vModelRow1", "vModelRow2", "vModelRow3", "vMaterial" };
+	for (int i = 0; i < 5; i++) p.instance[i] = glGetAttribLocation(program, instance_attribs[i]);
+	programs.push_back(p);
+	return (int)programs.size() - 1;
+}
+//---------------------------------------------------------
+int RenderQueue::addGeometry(GLuint buffer, int vertex_count, GLenum mode, bool normals, bool texcoords)
+{
+	Geometry g = { buffer, vertex_count, mode, normals, texcoords };
+	geometries.push_back(g);
+	return (int)geometries.size() - 1;
+}
+//---------------------------------------------------------
+UniformBlock& RenderQueue::addMaterial(int* index)
+{
+	if (material_count == (int)materials.size()) materials.push_back(UniformBlock());
+	*index = material_count;
+	UniformBlock& m = materials[material_count++];
+	m.clear();
+	return m;
+}
+//---------------------------------------------------------
+DrawPacket& RenderQueue::add(int pass, int program, int material, int geometry, float depth)
+{
+	if (packet_count == (int)packets.size()) packets.push_back(DrawPacket());
+	DrawPacket& p = packets[packet_count++];
+	p.key = makeKey(pass, program, material, geometry, depth);
+	p.program = program;
+	p.material = material;
+	p.geometry = geometry;
+	p.state = RenderState();
+	p.instance_buffer = 0;
+	p.instance_offset = 0;
+	p.instance_count = 0;
+	p.uniforms.clear();
+	return p;
+}
+//---------------------------------------------------------
+void RenderQueue::invalidateUniforms()
+{
+	for (size_t i = 0; i < programs.size(); i++) programs[i].values.clear();
+}
+//---------------------------------------------------------
+//Uploads the entries whose value differs from what the program holds
+void RenderQueue::apply(Program& p, const UniformBlock& block)
+{
+	for (size_t i = 0; i < block.entries.size(); i++) {
+		const UniformBlock::Entry& e = block.entries[i];
+
+		std::unordered_map<const char*, GLint>::iterator found = p.locations.find(e.name);
+		GLint location;
+		if (found != p.locations.end()) location = found->second;
+		else location = p.locations[e.name] = glGetUniformLocation(p.name, e.name);
+		if (location < 0) continue;
+
+		static const int words_per_element[] = { 1, 1, 3, 4, 9, 16 };
+		int words = words_per_element[e.type] * e.count;
+		const uint32_t* v = &block.data[e.offset];
+		if ((int)p.values.size() <= location) p.values.resize(location + 1);
+		std::vector<uint32_t>& held = p.values[location];
+		if ((int)held.size() == words && memcmp(held.data(), v, words * sizeof(uint32_t)) == 0) {
+			counters.uniforms_skipped++;
+			continue;
+		}
+		held.assign(v, v + words);
+		counters.uniform_uploads++;
+
+		switch (e.type) {
+		case UniformBlock::Int: glUniform1iv(location, e.count, (const GLint*)v); break;
+		case UniformBlock::Float: glUniform1fv(location, e.count, (const GLfloat*)v); break;
+		case UniformBlock::Float3: glUniform3fv(location, e.count, (const GLfloat*)v); break;
+		case UniformBlock::Float4: glUniform4fv(location, e.count, (const GLfloat*)v); break;
+		case UniformBlock::Mat3: glUniformMatrix3fv(location, e.count, GL_TRUE, (const GLfloat*)v); break;
+		case UniformBlock::Mat4: glUniformMatrix4fv(location, e.count, GL_TRUE, (const GLfloat*)v); break;
+		}
+	}
+}
+//---------------------------------------------------------
+void RenderQueue::disableAttributes()
+{
+	for (size_t i = 0; i < divisors.size(); i++) glVertexAttribDivisor(divisors[i], 0);
+	for (size_t i = 0; i < enabled.size(); i++) glDisableVertexAttribArray(enabled[i]);
+	divisors.clear();
+	enabled.clear();
+}
+//---------------------------------------------------------
+void RenderQueue::bindGeometry(const Program& p, const DrawPacket& packet)
+{
+	disableAttributes();
+	const Geometry& g = geometries[packet.geometry];
+
+	//Blocks in order: positions, normals, colors, texture coordinates
+	glBindBuffer(GL_ARRAY_BUFFER, g.buffer);
+	GLintptr offset = 0;
+	struct { GLint location; int components; bool present; } blocks[] = {
+		{ p.position, 3, true }, { p.normal, 3, g.normals }, { p.color, 4, true }, { p.texcoord, 2, g.texcoords }
+	};
+	for (int i = 0; i < 4; i++) {
+		if (!blocks[i].present) continue;
+		if (blocks[i].location >= 0) {
+			glEnableVertexAttribArray(blocks[i].location);
+			glVertexAttribPointer(blocks[i].location, blocks[i].components, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(offset));
+			enabled.push_back(blocks[i].location);
+		}
+		offset += sizeof(GLfloat) * blocks[i].components * g.vertex_count;
+	}
+
+	//Model matrix rows and material, advanced once per instance
+	if (packet.instance_buffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, packet.instance_buffer);
+		for (int i = 0; i < 5; i++) {
+			if (p.instance[i] < 0) continue;
+			glEnableVertexAttribArray(p.instance[i]);
+			glVertexAttribPointer(p.instance[i], i < 4 ? 4 : 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+				BUFFER_OFFSET(packet.instance_offset + (i < 4 ? sizeof(GLfloat) * 4 * i : offsetof(InstanceData, material))));
+			glVertexAttribDivisor(p.instance[i], 1);
+			enabled.push_back(p.instance[i]);
+			divisors.push_back(p.instance[i]);
+		}
+	}
+	counters.geometry_binds++;
+}
+//---------------------------------------------------------
+void RenderQueue::setState(const RenderState& s, bool force)
+{
+	RenderState& current = current_state;
+	if (!force && s == current) return;
+
+	if (force || s.polygon_mode != current.polygon_mode) glPolygonMode(GL_FRONT_AND_BACK, s.polygon_mode);
+	if (force || s.depth_test != current.depth_test) {
+		if (s.depth_test) glEnable(GL_DEPTH_TEST);
+		else glDisable(GL_DEPTH_TEST);
+	}
+	if (force || s.depth_write != current.depth_write) glDepthMask(s.depth_write);
+	if (force || s.depth_equal != current.depth_equal) glDepthFunc(s.depth_equal ? GL_LEQUAL : GL_LESS);
+	if (force || s.color_write != current.color_write || s.masked_targets != current.masked_targets) {
+		glColorMask(s.color_write, s.color_write, s.color_write, s.color_write);
+		for (int i = 0; i < 8; i++) {
+			if (s.masked_targets >> i & 1) glColorMaski(i, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		}
+	}
+	if (force || s.blend != current.blend) {
+		if (s.blend == RenderState::BlendOff) glDisable(GL_BLEND);
+		else {
+			if (s.blend == RenderState::BlendAlpha) glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			else glBlendFunc(GL_ONE, GL_ONE);
+			glEnable(GL_BLEND);
+		}
+	}
+	if (force || s.stencil != current.stencil) {
+		if (s.stencil == RenderState::StencilOff) glDisable(GL_STENCIL_TEST);
+		else {
+			glEnable(GL_STENCIL_TEST);
+			if (s.stencil == RenderState::StencilMark) {
+				glStencilFunc(GL_ALWAYS, 1, 0xFF);
+				glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+			}
+			else {
+				glStencilFunc(GL_EQUAL, 1, 0xFF);
+				glStencilOp(GL_KEEP, GL_KEEP, GL_INCR);
+			}
+		}
+	}
+	current = s;
+	counters.state_changes++;
+}
+//---------------------------------------------------------
+void RenderQueue::flush(const std::function<void(int)>& on_pass)
+{
+	order.resize(packet_count);
+	for (int i = 0; i < packet_count; i++) order[i] = std::make_pair(packets[i].key, i);
+	std::sort(order.begin(), order.end());
+
+	//Other code draws between flushes, so the state is only known from the first packet on
+	int program = -1, material = -1, pass = -1;
+	const DrawPacket* bound = NULL; //The packet whose geometry and instances are bound
+	for (int i = 0; i < packet_count; i++) {
+		const DrawPacket& packet = packets[order[i].second];
+		int packet_pass = keyPass(packet.key);
+		if (packet_pass != pass) {
+			pass = packet_pass;
+			if (on_pass) on_pass(pass);
+		}
+
+		Program& p = programs[packet.program];
+		if (packet.program != program) {
+			glUseProgram(p.name);
+			apply(p, p.frame_uniforms);
+			program = packet.program;
+			material = -1;
+			bound = NULL;
+			counters.program_binds++;
+		}
+		setState(packet.state, i == 0);
+
+		if (packet.material != material) {
+			apply(p, materials[packet.material]);
+			material = packet.material;
+			counters.material_binds++;
+		}
+		apply(p, packet.uniforms);
+
+		if (bound == NULL || bound->geometry != packet.geometry || bound->instance_buffer != packet.instance_buffer ||
+			bound->instance_offset != packet.instance_offset) {
+			bindGeometry(p, packet);
+			bound = &packet;
+		}
+
+		const Geometry& g = geometries[packet.geometry];
+		if (packet.instance_buffer != 0)
+			glDrawArraysInstanced(g.mode, 0, g.vertex_count, packet.instance_count);
+		else
+			glDrawArrays(g.mode, 0, g.vertex_count);
+	}
+
+	//Leave the defaults for whatever draws next (particles, the HUD)
+	disableAttributes();
+	if (packet_count > 0) setState(RenderState(), false);
+
+	counters.packets += packet_count;
+	counters.flushes++;
+	packet_count = material_count = 0;
+}
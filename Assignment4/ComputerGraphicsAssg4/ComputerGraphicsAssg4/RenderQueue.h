@@ -0,0 +1,179 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- RenderQueue.h ---
+//
+//   Sorted draw submission. Each frame the scene adds one DrawPacket per
+//   draw: a 64-bit sort key, the fixed-function state it needs, the
+//   geometry and its per-draw uniforms. flush() sorts the packets by key and
+//   submits them in order, issuing only the state that differs from the
+//   previous packet:
+//       program binds, glPolygonMode/depth/glColorMask(i)/blending/stencil,
+//       buffer binds and attribute pointers (skipped for the same geometry
+//       and instances), material uniform blocks (skipped for the same
+//       material), and any uniform whose value the program already holds.
+//
+//   Key layout, most significant first:
+//       pass (4 bits) | program (6) | material (12) | geometry (14) | depth (28)
+//   Passes keep the order the effects depend on (the floor and its shadow
+//   before the depth-only floor, ...); inside a pass packets group by
+//   program, then material, then geometry, then front to back.
+//
+//   Geometry uses this program's vertex layout: one buffer per mesh holding
+//   positions, then optional normals, colors, then optional texture
+//   coordinates, each as a tightly packed block; instanced packets read
+//   InstanceData records through the vModelRow0-3 and vMaterial attributes.
+//
+//   Uniform names must be string literals (or otherwise outlive the queue):
+//   locations are cached per program by the name's address.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __RENDERQUEUE_H__
+#define __RENDERQUEUE_H__
+
+#include "Angel-yjc.h"
+#include <stdint.h>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+//Per-instance record of instanced geometry: model matrix rows, then the material index
+struct InstanceData {
+	GLfloat model[4][4];
+	GLfloat material;
+};
+
+//Uniform values to upload before a draw, by name; setting a name again replaces its value
+class UniformBlock {
+public:
+	void clear() { entries.clear(); data.clear(); }
+
+	void set(const char* name, int v);
+	void set(const char* name, float v);
+	void set(const char* name, const vec4& v);
+	void set(const char* name, const int* v, int count);
+	void set(const char* name, const float* v, int count, int components = 1); //1, 3 or 4 floats per element
+	void set(const char* name, const mat3& m); //Row-major, uploaded transposed like the rest of the code
+	void set(const char* name, const mat4& m);
+	void set(const char* name, const mat4* m, int count);
+
+private:
+	friend class RenderQueue;
+	enum Type { Int, Float, Float3, Float4, Mat3, Mat4 };
+	struct Entry {
+		const char* name;
+		uint8_t type;
+		int count, offset; //Elements; offset into data
+	};
+	void add(const char* name, Type type, int count, const void* values, int words);
+
+	std::vector<Entry> entries;
+	std::vector<uint32_t> data;
+};
+
+//Fixed-function state of a packet
+struct RenderState {
+	enum Blend {
+		BlendOff,
+		BlendAlpha,   //GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA
+		BlendAdd      //GL_ONE, GL_ONE: light accumulation
+	};
+	enum Stencil {
+		StencilOff,
+		StencilMark,  //Writes 1 where the packet is drawn
+		StencilOnce   //Draws only where the stencil is 1 and increments it, so each such pixel is drawn once
+	};
+
+	GLenum polygon_mode = GL_FILL;
+	bool depth_test = true, depth_write = true, color_write = true;
+	bool depth_equal = false; //GL_LEQUAL instead of GL_LESS: passes where a depth prepass put this surface
+	uint8_t blend = BlendOff;
+	uint8_t stencil = StencilOff;
+	uint8_t masked_targets = 0; //Draw buffers left unwritten (bit i: buffer i), as a decal leaves a G-buffer's normals
+
+	bool operator==(const RenderState& o) const {
+		return polygon_mode == o.polygon_mode && depth_test == o.depth_test && depth_write == o.depth_write &&
+			depth_equal == o.depth_equal && color_write == o.color_write && blend == o.blend && stencil == o.stencil &&
+			masked_targets == o.masked_targets;
+	}
+};
+
+struct DrawPacket {
+	uint64_t key;
+	int program, material, geometry;
+	RenderState state;
+	GLuint instance_buffer;  //0: not instanced
+	GLintptr instance_offset;
+	int instance_count;
+	UniformBlock uniforms;   //Per draw (matrices), applied after the material's
+};
+
+class RenderQueue {
+public:
+	enum { PassBits = 4, ProgramBits = 6, MaterialBits = 12, GeometryBits = 14, DepthBits = 28 };
+
+	//depth: view distance over the far plane, in [0, 1]
+	static uint64_t makeKey(int pass, int program, int material, int geometry, float depth = 0.0f);
+	static int keyPass(uint64_t key) { return (int)(key >> (64 - PassBits)); }
+
+	//Registration, after the GL context exists; the indices go into keys
+	int addProgram(GLuint program);
+	int addGeometry(GLuint buffer, int vertex_count, GLenum mode, bool normals, bool texcoords);
+	//After the geometry's buffer was refilled with another number of vertices
+	void setVertexCount(int geometry, int vertex_count) { geometries[geometry].vertex_count = vertex_count; }
+
+	//Frame-wide uniforms of a program (projection, fog, ...), uploaded when the program is first bound in a flush
+	UniformBlock& frameUniforms(int program) { return programs[program].frame_uniforms; }
+
+	//Per frame: materials and packets are recycled, so adding them allocates only while the scene grows
+	UniformBlock& addMaterial(int* index);
+	DrawPacket& add(int pass, int program, int material, int geometry, float depth = 0.0f);
+
+	//Sorts and submits the packets added since the last flush; on_pass is called before the first packet of each pass
+	void flush(const std::function<void(int)>& on_pass = nullptr);
+
+	//Forgets what the programs hold (after drawing with them outside the queue)
+	void invalidateUniforms();
+
+	struct Stats {
+		long long packets = 0, flushes = 0;
+		long long program_binds = 0, state_changes = 0, geometry_binds = 0, material_binds = 0;
+		long long uniform_uploads = 0, uniforms_skipped = 0;
+	};
+	const Stats& stats() const { return counters; }
+	void resetStats() { counters = Stats(); }
+
+private:
+	struct Program {
+		GLuint name;
+		GLint position, normal, color, texcoord, instance[5];
+		UniformBlock frame_uniforms;
+		std::unordered_map<const char*, GLint> locations;
+		std::vector<std::vector<uint32_t> > values; //Last upload, by location
+	};
+	struct Geometry {
+		GLuint buffer;
+		int vertex_count;
+		GLenum mode;
+		bool normals, texcoords;
+	};
+
+	void apply(Program& p, const UniformBlock& block);
+	void bindGeometry(const Program& p, const DrawPacket& packet);
+	void setState(const RenderState& s, bool force);
+	void disableAttributes();
+
+	std::vector<Program> programs;
+	std::vector<Geometry> geometries;
+	std::vector<UniformBlock> materials;
+	std::vector<DrawPacket> packets;
+	int material_count = 0, packet_count = 0;
+	std::vector<std::pair<uint64_t, int> > order;
+
+	std::vector<GLuint> enabled; //Attribute arrays enabled by the current geometry
+	std::vector<GLuint> divisors; //Of those, the ones with a divisor
+	RenderState current_state;
+	Stats counters;
+};
+
+#endif // __RENDERQUEUE_H__
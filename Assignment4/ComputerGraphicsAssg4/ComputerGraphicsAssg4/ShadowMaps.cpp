@@ -0,0 +1,234 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "ShadowMaps.h"
+#include <math.h>
+#include <stdio.h>
+#include "GLStats.h"
+
+//Inverse of a rotation followed by a translation, as LookAt() builds
+static mat4 rigidInverse(const mat4& m)
+{
+	mat4 r;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) r[i][j] = m[j][i];
+		r[i][3] = -(m[0][i] * m[0][3] + m[1][i] * m[1][3] + m[2][i] * m[2][3]);
+	}
+	return r;
+}
+static vec3 transformPoint(const mat4& m, const vec3& p)
+{
+	vec4 q = m * vec4(p, 1.0);
+	return vec3(q.x, q.y, q.z);
+}
+static void boxCorners(const vec3& lo, const vec3& hi, vec3* out)
+{
+	for (int i = 0; i < 8; i++) out[i] = vec3(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y, i & 4 ? hi.z : lo.z);
+}
+static vec4 upFor(const vec3& direction)
+{
+	return fabs(direction.y) > 0.99f ? vec4(1.0, 0.0, 0.0, 0.0) : vec4(0.0, 1.0, 0.0, 0.0);
+}
+
+//---------------------------------------------------------
+void ShadowMaps::init(int size, int cascades)
+{
+	map_size = size;
+	cascade_count = cascades < 1 ? 1 : cascades > MaxCascades ? MaxCascades : cascades;
+
+	//Linear filtering with comparison: each lookup is already a 2x2 percentage-closer filter
+	glGenTextures(1, &maps);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, maps);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, map_size, map_size, layers(), 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+	//Depth only
+	GLint previous = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, maps, 0, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		printf("Error: shadow map framebuffer incomplete\n");
+	glBindFramebuffer(GL_FRAMEBUFFER, previous);
+
+	for (int i = 0; i < MaxLayers; i++) active[i] = false;
+}
+//---------------------------------------------------------
+void ShadowMaps::fitDirectional(const mat4& view, const vec3& direction, float fovy, float aspect, float z_near, float z_far,
+	const vec3& scene_min, const vec3& scene_max)
+{
+	vec3 box[8];
+	boxCorners(scene_min, scene_max, box);
+
+	//Only the depths the scene reaches
+	float nearest = z_far, deepest = z_near;
+	for (int i = 0; i < 8; i++) {
+		float z = -transformPoint(view, box[i]).z;
+		nearest = fmin(nearest, z);
+		deepest = fmax(deepest, z);
+	}
+	float shadow_near = fmax(nearest, z_near), shadow_far = fmin(deepest, z_far);
+	for (int c = 0; c < cascade_count; c++) active[c] = shadow_far > shadow_near;
+	if (!active[0]) return;
+
+	mat4 to_world = rigidInverse(view);
+	vec3 d = normalize(direction);
+	float tan_y = tan(fovy * DegreesToRadians / 2), tan_x = tan_y * aspect;
+	const float lambda = 0.75f; //Weight of the logarithmic split against the uniform one
+
+	float slice_near = shadow_near;
+	for (int c = 0; c < cascade_count; c++) {
+		float t = float(c + 1) / cascade_count;
+		float slice_far = lambda * shadow_near * pow(shadow_far / shadow_near, t) + (1 - lambda) * (shadow_near + (shadow_far - shadow_near) * t);
+		split_far[c] = slice_far;
+
+		//Bounding sphere of the slice, its radius rounded up so it holds still while the camera turns
+		vec3 corners[8];
+		vec3 center(0.0, 0.0, 0.0);
+		for (int i = 0; i < 8; i++) {
+			float depth = i & 4 ? slice_far : slice_near;
+			corners[i] = transformPoint(to_world, vec3((i & 1 ? 1 : -1) * tan_x * depth, (i & 2 ? 1 : -1) * tan_y * depth, -depth));
+			center += corners[i];
+		}
+		center *= 1.0f / 8;
+		float radius = 0.0f;
+		for (int i = 0; i < 8; i++) radius = fmax(radius, length(corners[i] - center));
+		radius = ceil(radius * 16.0f) / 16.0f;
+
+		//Depth over the whole scene, so casters outside the slice still cast into it
+		mat4 v = LookAt(vec4(center - d, 1.0), vec4(center, 1.0), upFor(d));
+		float z_lo = 1e30f, z_hi = -1e30f;
+		slice_back[c] = 1e30f;
+		for (int i = 0; i < 16; i++) {
+			float z = transformPoint(v, i < 8 ? box[i] : corners[i - 8]).z;
+			z_lo = fmin(z_lo, z);
+			z_hi = fmax(z_hi, z);
+			if (i >= 8) slice_back[c] = fmin(slice_back[c], z);
+		}
+		mat4 p = Ortho(-radius, radius, -radius, radius, -z_hi - 0.5f, -z_lo + 0.5f);
+
+		//Moved by whole texels, so the shadow edges do not crawl as the camera moves
+		vec4 origin = p * v * vec4(0.0, 0.0, 0.0, 1.0);
+		float half_size = map_size * 0.5f;
+		p = Translate((floor(origin.x * half_size + 0.5f) - origin.x * half_size) / half_size,
+			(floor(origin.y * half_size + 0.5f) - origin.y * half_size) / half_size, 0.0) * p;
+
+		light_view[c] = v;
+		extent[c] = radius;
+		matrix[c] = p * v;
+		slice_near = slice_far;
+	}
+}
+//---------------------------------------------------------
+void ShadowMaps::fitLocal(const vec3& position, const vec3& focus, float cone_degrees, const vec3& scene_min, const vec3& scene_max)
+{
+	int layer = localLayer();
+	vec3 box[8];
+	boxCorners(scene_min, scene_max, box);
+
+	//Through the spot's cone, or around the scene box, with a margin for the filter
+	vec3 axis;
+	float half_angle = 0.0f;
+	if (cone_degrees > 0.0f) {
+		axis = normalize(focus - position);
+		half_angle = cone_degrees / 2;
+	}
+	else {
+		axis = normalize((scene_min + scene_max) * 0.5f - position);
+		for (int i = 0; i < 8; i++) {
+			float c = dot(normalize(box[i] - position), axis);
+			half_angle = fmax(half_angle, acos(c < -1.0f ? -1.0f : c > 1.0f ? 1.0f : c) / DegreesToRadians);
+		}
+	}
+	half_angle = fmin(half_angle + 2.0f, 80.0f);
+
+	float z_lo = 1e30f, z_hi = -1e30f;
+	for (int i = 0; i < 8; i++) {
+		float z = dot(box[i] - position, axis);
+		z_lo = fmin(z_lo, z);
+		z_hi = fmax(z_hi, z);
+	}
+	active[layer] = z_hi > 0.0f;
+	if (!active[layer]) return;
+
+	mat4 p = Perspective(2 * half_angle, 1.0, fmax(z_lo - 0.5f, 0.1f), z_hi + 0.5f);
+	p[3][3] = 0.0; //Angel's Perspective() leaves w = 1 - z
+	mat4 v = LookAt(vec4(position, 1.0), vec4(position + axis, 1.0), upFor(axis));
+
+	light_view[layer] = v;
+	extent[layer] = tan(half_angle * DegreesToRadians);
+	matrix[layer] = p * v;
+	local_position = position;
+	local_axis = axis;
+}
+//---------------------------------------------------------
+bool ShadowMaps::castsInto(int layer, const vec3& center, float radius) const
+{
+	if (!active[layer]) return false;
+	if (layer < cascade_count) {
+		//Beside the box, or past the slice's far side from the light, it shadows nothing in the slice
+		vec3 p = transformPoint(light_view[layer], center);
+		float reach = extent[layer] * (1.0f + 2.0f / map_size) + radius;
+		return fabs(p.x) <= reach && fabs(p.y) <= reach && p.z + radius >= slice_back[layer];
+	}
+
+	//The cone around the frustum's corners, widened by the sphere
+	vec3 to = center - local_position;
+	float dist = length(to);
+	if (dist <= radius) return true;
+	float along = dot(to, local_axis);
+	float across = sqrt(fmax(dist * dist - along * along, 0.0f));
+	return atan2(across, along) <= atan(extent[layer] * 1.4143f) + asin(radius / dist);
+}
+//---------------------------------------------------------
+void ShadowMaps::begin()
+{
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &saved_fbo);
+	glGetIntegerv(GL_VIEWPORT, saved_viewport);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(0, 0, map_size, map_size);
+	for (int i = 0; i < layers(); i++) {
+		if (!active[i]) continue;
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, maps, 0, i);
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+}
+//---------------------------------------------------------
+void ShadowMaps::selectLayer(int layer)
+{
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, maps, 0, layer);
+}
+//---------------------------------------------------------
+void ShadowMaps::end()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, saved_fbo);
+	glViewport(saved_viewport[0], saved_viewport[1], saved_viewport[2], saved_viewport[3]);
+}
+//---------------------------------------------------------
+void ShadowMaps::receiverMatrices(const mat4& view, mat4* out) const
+{
+	mat4 to_world = rigidInverse(view);
+	mat4 bias = Translate(0.5, 0.5, 0.5) * Scale(0.5, 0.5, 0.5);
+	for (int i = 0; i < layers(); i++) out[i] = bias * matrix[i] * to_world;
+}
+//---------------------------------------------------------
+vec4 ShadowMaps::splits() const
+{
+	float s[MaxCascades];
+	for (int c = 0; c < MaxCascades; c++) s[c] = c < cascade_count ? split_far[c] : 1e30f;
+	return vec4(s[0], s[1], s[2], s[3]);
+}
+//---------------------------------------------------------
+void ShadowMaps::offsets(float* out) const
+{
+	for (int i = 0; i < layers(); i++) out[i] = 1.5f * 2.0f * extent[i] / map_size;
+}
@@ -0,0 +1,91 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- ShadowMaps.h ---
+//
+//   Depth-map shadows for the two lights: cascades for the directional
+//   light and one perspective map for the point or spot light, all layers of
+//   one depth texture array sampled with hardware depth comparison
+//   (sampler2DArrayShadow), so any lit surface receives shadows from any
+//   caster drawn into the maps.
+//
+//   The cascades split the part of the view frustum that holds the scene
+//   (between the nearest and farthest corners of the scene bounds, not the
+//   near and far planes), between a logarithmic and a uniform split. A
+//   caster is drawn only into the cascades it can shadow. Each cascade is an
+//   orthographic box around the bounding sphere of its slice, whose size
+//   does not change as the camera turns and whose position moves in whole
+//   texels, so the shadow edges do not crawl. Its depth range covers the
+//   scene bounds, so casters outside the slice still cast into it.
+//
+//   The local light's map looks from the light at the spot's focus through
+//   the cone, or for a point light at the scene bounds; a point light
+//   outside the scene casts everything within one frustum, so no cube map.
+//
+//   Usage per frame:
+//       fitDirectional(...); fitLocal(...);
+//       begin();  for each active layer: selectLayer(l); ... draw casters with layerMatrix(l) ...  end();
+//       ... draw receivers with receiverMatrices(), splits(), offsets() ...
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SHADOWMAPS_H__
+#define __SHADOWMAPS_H__
+
+#include "Angel-yjc.h"
+
+class ShadowMaps {
+public:
+	enum { MaxCascades = 4, MaxLayers = MaxCascades + 1 };
+
+	//size x size texels per layer, cascades from 1 to MaxCascades; needs the GL context
+	void init(int size, int cascades);
+	bool isInitialized() const { return fbo != 0; }
+
+	int size() const { return map_size; }
+	int cascades() const { return cascade_count; }
+	int layers() const { return cascade_count + 1; }
+	int localLayer() const { return cascade_count; }
+
+	//Cascades for a light shining along direction (world frame), over the slices of the view frustum holding the scene box
+	void fitDirectional(const mat4& view, const vec3& direction, float fovy, float aspect, float z_near, float z_far,
+		const vec3& scene_min, const vec3& scene_max);
+	//The local light's map: cone_degrees is the spot's full cone, or 0 for a point light aimed at the scene box
+	void fitLocal(const vec3& position, const vec3& focus, float cone_degrees, const vec3& scene_min, const vec3& scene_max);
+
+	//False for a cascade past the scene, or a local light with the scene behind it
+	bool layerActive(int layer) const { return active[layer]; }
+	//World to the layer's clip space
+	const mat4& layerMatrix(int layer) const { return matrix[layer]; }
+	//Whether a sphere (world center and radius) may cast into the layer
+	bool castsInto(int layer, const vec3& center, float radius) const;
+
+	//Binds the maps and clears the active layers, until end() restores the previous framebuffer and viewport
+	void begin();
+	void selectLayer(int layer);
+	void end();
+
+	//For the receivers, all in the eye frame of view: per layer, eye position to map coordinates and depth in [0, 1]
+	void receiverMatrices(const mat4& view, mat4* out) const;
+	//Far view depth of each cascade; unused cascades are never reached
+	vec4 splits() const;
+	//Per layer, how far to push the receiver along its normal, about a texel and a half: world units for the
+	//cascades, and per unit of distance from the light for the local layer
+	void offsets(float* out) const;
+	GLuint texture() const { return maps; }
+
+private:
+	GLuint fbo = 0, maps = 0;
+	int map_size = 0, cascade_count = 0;
+
+	bool active[MaxLayers] = { false };
+	mat4 matrix[MaxLayers];
+	mat4 light_view[MaxLayers];
+	float extent[MaxLayers] = { 0 };      //Cascades: half the box's side; local: tangent of half the field of view
+	float split_far[MaxCascades] = { 0 };
+	float slice_back[MaxCascades] = { 0 }; //Light view depth of the slice's point farthest from the light
+	vec3 local_position, local_axis;
+
+	GLint saved_fbo = 0, saved_viewport[4];
+};
+
+#endif // __SHADOWMAPS_H__
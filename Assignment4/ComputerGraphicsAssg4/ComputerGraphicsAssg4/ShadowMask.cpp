@@ -0,0 +1,60 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "ShadowMask.h"
+#include <stdio.h>
+#include "GLStats.h"
+
+//---------------------------------------------------------
+void ShadowMask::init(int texels, float x0, float x1, float z0, float z1)
+{
+	size = texels;
+	area.place(x0, x1, z0, z1);
+
+	//Coverage only, so one channel; linear filtering softens the edges by a texel
+	glGenTextures(1, &mask);
+	glBindTexture(GL_TEXTURE_2D, mask);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, size, size, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	GLint previous = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+	GLfloat clear[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, mask, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		printf("Error: shadow mask framebuffer incomplete\n");
+	glClearColor(0.0, 0.0, 0.0, 0.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(clear[0], clear[1], clear[2], clear[3]);
+	glBindFramebuffer(GL_FRAMEBUFFER, previous);
+
+	update_count = 0;
+}
+//---------------------------------------------------------
+void ShadowMask::begin()
+{
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &saved_fbo);
+	glGetIntegerv(GL_VIEWPORT, saved_viewport);
+	GLfloat clear[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(0, 0, size, size);
+	glClearColor(0.0, 0.0, 0.0, 0.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(clear[0], clear[1], clear[2], clear[3]);
+	update_count++;
+}
+//---------------------------------------------------------
+void ShadowMask::end()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, saved_fbo);
+	glViewport(saved_viewport[0], saved_viewport[1], saved_viewport[2], saved_viewport[3]);
+}
@@ -0,0 +1,53 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- ShadowMask.h ---
+//
+//   A floor-space texture of where the projected shadows fall, kept between
+//   frames. The shadows are drawn into it from above, through an orthographic
+//   projection of the floor rectangle, and the floor shader samples it, so
+//   shading the shadows costs the floor draw only. It is redrawn only when
+//   its key (sphere transforms, the light, draw settings) changes; see
+//   FloorMap.h.
+//
+//   Usage per frame:
+//       if (mask.changed(key)) { mask.begin(); ... draw shadows ... mask.end(); }
+//       ... draw the floor sampling texture() through bounds() ...
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SHADOWMASK_H__
+#define __SHADOWMASK_H__
+
+#include "Angel-yjc.h"
+#include "FloorMap.h"
+#include <vector>
+
+class ShadowMask {
+public:
+	//size x size texels over the floor rectangle [min_x, max_x] x [min_z, max_z]; needs the GL context
+	void init(int size, float min_x, float max_x, float min_z, float max_z);
+	bool isInitialized() const { return fbo != 0; }
+
+	bool changed(const std::vector<float>& key) { return area.changed(key); }
+
+	//Renders into the mask (cleared, viewport set) until end() restores the previous framebuffer and viewport
+	void begin();
+	void end();
+
+	//The projection for drawing into the mask, and the floor's mapping onto it
+	mat4 projection() const { return area.projection(); }
+	vec4 bounds() const { return area.bounds(); }
+	GLuint texture() const { return mask; }
+
+	int updates() const { return update_count; }
+
+private:
+	GLuint fbo = 0, mask = 0;
+	int size = 0;
+	FloorMap area;
+	int update_count = 0;
+
+	GLint saved_fbo = 0, saved_viewport[4];
+};
+
+#endif // __SHADOWMASK_H__
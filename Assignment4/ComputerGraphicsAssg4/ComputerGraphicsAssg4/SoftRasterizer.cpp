@@ -0,0 +1,730 @@
+#include "SoftRasterizer.h"
+#include "ThreadPool.h"
+#include "Timing.h"
+#include "Profiler.h"
+#include <math.h>
+#include <algorithm>
+#include <emmintrin.h>
+
+//Varying slots, in the order vshader53.glsl writes them; the floor has no lattice, so its x and z for the
+//lightmap (fFloorXZ) take the lattice's slots
+enum { V_R, V_G, V_B, V_A, V_FZ, V_S, V_T, V_S1D, V_LU, V_LV, V_FLOOR_X = V_LU, V_FLOOR_Z = V_LV };
+
+//Clip-space x and y are kept within GuardBand * w, so fixed point window coordinates stay small
+static const float GuardBand = 2.0;
+static const int SubPixel = 16;
+static const double Pi = 3.1415926535897932384626433832795;
+
+struct ClipVertex {
+	float x, y, z, w;
+	float var[SoftRasterizer::Varyings];
+};
+
+//---------------------------------------------------------
+//processLight() of vshader53.glsl; baked leaves out the ambient and diffuse terms, which the lightmap holds
+static color4 processLight(const SoftUniforms& u, int i, const vec3& pos, const vec3& E, const vec3& N, bool baked)
+{
+	float attenuation;
+	vec3 L, LP(u.LightPosition[i].x, u.LightPosition[i].y, u.LightPosition[i].z);
+
+	if (u.LightType[i] == 0) //Ambient
+		return baked ? color4(0.0, 0.0, 0.0, 0.0) : u.AmbientProduct[i];
+	else if (u.LightType[i] == 1) { //Directional, the direction is in the eye frame
+		L = -u.LightDirection[i];
+		attenuation = 1.0;
+	}
+	else if (u.LightType[i] == 2 || u.LightType[i] == 3) { //Point and spot, the position is in the eye frame
+		vec3 D = LP - pos;
+		float dist = length(D);
+		L = D / dist;
+		attenuation = 1.0 / (u.ConstAtt[i] + u.LinearAtt[i] * dist + u.QuadAtt[i] * dist * dist);
+	}
+	else
+		return color4(0.0, 0.0, 0.0, 0.0);
+
+	vec3 H = normalize(L + E);
+	color4 ambient = u.AmbientProduct[i];
+	color4 diffuse = fmax(dot(L, N), 0.0) * u.DiffuseProduct[i];
+	color4 specular = (float)pow(fmax(dot(N, H), 0.0), u.Shininess) * u.SpecularProduct[i];
+	if (dot(L, N) < 0.0)
+		specular = color4(0.0, 0.0, 0.0, 1.0);
+	if (baked)
+		ambient = diffuse = color4(0.0, 0.0, 0.0, 0.0);
+
+	if (u.LightType[i] == 3) {
+		vec3 Lf = normalize(u.LightDirection[i] - LP); //LightDirection is the spot light focal position
+		float Lfl = dot(Lf, -L);
+		if (Lfl < cos(u.Cutoff[i] * Pi / 180.0))
+			attenuation = 0.0;
+		else
+			attenuation *= pow(Lfl, u.Exponent[i]);
+	}
+
+	return attenuation * (ambient + diffuse + specular);
+}
+//---------------------------------------------------------
+//main() of vshader53.glsl for vertex v of the mesh, with MV and NM already chosen for the instance
+static void shadeVertex(const SoftUniforms& u, const mat4& MV, const mat3& NM, bool instanced, float material,
+	const SoftMesh& m, int v, ClipVertex& out)
+{
+	vec4 p(m.position[v].x, m.position[v].y, m.position[v].z, 1.0);
+	vec4 eye = MV * p;
+	float* var = out.var;
+
+	var[V_LU] = var[V_LV] = 0.0;
+	if (u.lattice_on) {
+		if (u.lattice_upright) {
+			var[V_LU] = 0.5 * (p.x + 1);
+			var[V_LV] = 0.5 * (p.y + 1);
+		}
+		else {
+			var[V_LU] = 0.3 * (p.x + p.y + p.z);
+			var[V_LV] = 0.3 * (p.x - p.y + p.z);
+		}
+	}
+	else if (u.lightmap_on) {
+		var[V_FLOOR_X] = p.x;
+		var[V_FLOOR_Z] = p.z;
+	}
+
+	var[V_S] = var[V_T] = var[V_S1D] = 0.0;
+	if (u.calculate_texCoord) {
+		float s = 0.0, t = 0.0;
+		vec4 q = u.sphere_texture_space ? eye : p;
+
+		if (u.texture_Dimension == 1)
+			s = u.sphere_texture_dir ? 1.5 * (q.x + q.y + q.z) : 2.5 * q.x;
+		else if (u.texture_Dimension == 2) {
+			if (u.sphere_texture_dir) {
+				s = 0.45 * (q.x + q.y + q.z);
+				t = 0.45 * (q.x - q.y + q.z);
+			}
+			else {
+				s = 0.75 * (q.x + 1);
+				t = 0.75 * (q.y + 1);
+			}
+		}
+		var[V_S] = var[V_S1D] = s;
+		var[V_T] = t;
+	}
+	else if (m.tex_coord) {
+		var[V_S] = m.tex_coord[v].x;
+		var[V_T] = m.tex_coord[v].y;
+	}
+
+	color4 c;
+	if (u.lighting) {
+		vec3 pos(eye.x, eye.y, eye.z);
+		vec3 E = normalize(-pos);
+		vec3 N = normalize(NM * (m.normal ? m.normal[v] : vec3(0.0, 0.0, 0.0)));
+
+		c = u.GlobalAmbientProduct;
+		for (int i = 0; i < u.LightCount; i++)
+			c += processLight(u, i, pos, E, N, u.lightmap_on && i == 1);
+	}
+	else
+		c = m.color[v];
+
+	if (instanced && u.use_material)
+		c = c * u.MaterialTint[(int)material];
+
+	var[V_R] = c.x; var[V_G] = c.y; var[V_B] = c.z; var[V_A] = c.w;
+	var[V_FZ] = -eye.z;
+
+	vec4 clip = u.projection * eye;
+	out.x = clip.x; out.y = clip.y; out.z = clip.z; out.w = clip.w;
+}
+//---------------------------------------------------------
+//Signed distance to clip plane k: near, far, then the four guard band planes
+static inline float planeDistance(const ClipVertex& v, int k)
+{
+	switch (k) {
+	case 0: return v.z + v.w;
+	case 1: return v.w - v.z;
+	case 2: return GuardBand * v.w + v.x;
+	case 3: return GuardBand * v.w - v.x;
+	case 4: return GuardBand * v.w + v.y;
+	default: return GuardBand * v.w - v.y;
+	}
+}
+//---------------------------------------------------------
+static ClipVertex lerpVertex(const ClipVertex& a, const ClipVertex& b, float t)
+{
+	ClipVertex r;
+	r.x = a.x + (b.x - a.x) * t;
+	r.y = a.y + (b.y - a.y) * t;
+	r.z = a.z + (b.z - a.z) * t;
+	r.w = a.w + (b.w - a.w) * t;
+	for (int i = 0; i < SoftRasterizer::Varyings; i++)
+		r.var[i] = a.var[i] + (b.var[i] - a.var[i]) * t;
+	return r;
+}
+//---------------------------------------------------------
+//Sutherland-Hodgman against the six planes; returns the vertex count of the clipped polygon (or line if count is 2)
+static int clipPolygon(ClipVertex* poly, int count)
+{
+	ClipVertex tmp[9];
+	for (int k = 0; k < 6 && count > 0; k++) {
+		bool all_in = true;
+		for (int i = 0; i < count; i++)
+			if (planeDistance(poly[i], k) < 0.0) { all_in = false; break; }
+		if (all_in) continue;
+
+		int n = 0;
+		int edges = count == 2 ? 1 : count;
+		for (int i = 0; i < edges; i++) {
+			const ClipVertex& a = poly[i];
+			const ClipVertex& b = poly[(i + 1) % count];
+			float da = planeDistance(a, k), db = planeDistance(b, k);
+			if (da >= 0.0) tmp[n++] = a;
+			if ((da >= 0.0) != (db >= 0.0)) tmp[n++] = lerpVertex(a, b, da / (da - db));
+			if (count == 2 && db >= 0.0) tmp[n++] = b;
+		}
+		for (int i = 0; i < n; i++) poly[i] = tmp[i];
+		count = n;
+	}
+	return count;
+}
+//---------------------------------------------------------
+//Perspective divide and viewport transform of vertex v into slot i of the primitive
+static void toWindow(const ClipVertex& v, int width, int height, SoftRasterizer::Primitive& p, int i)
+{
+	float inv_w = 1.0 / v.w;
+	p.x[i] = (int)lround((0.5 + 0.5 * v.x * inv_w) * width * SubPixel);
+	p.y[i] = (int)lround((0.5 - 0.5 * v.y * inv_w) * height * SubPixel);
+	p.z[i] = 0.5 + 0.5 * v.z * inv_w;
+	p.inv_w[i] = inv_w;
+	for (int k = 0; k < SoftRasterizer::Varyings; k++)
+		p.var[i][k] = v.var[k] * inv_w;
+}
+//---------------------------------------------------------
+//First and last pixel whose center lies in [lo, hi] (fixed point)
+static inline void pixelSpan(int lo, int hi, int limit, int& first, int& last)
+{
+	first = std::max(0, (int)ceil((lo - SubPixel / 2) / (double)SubPixel));
+	last = std::min(limit - 1, (int)floor((hi - SubPixel / 2) / (double)SubPixel));
+}
+//---------------------------------------------------------
+static void emitTriangle(const ClipVertex* v, int command, int width, int height,
+	std::vector<SoftRasterizer::Primitive>& out)
+{
+	SoftRasterizer::Primitive p;
+	p.command = command;
+	p.vertices = 3;
+	for (int i = 0; i < 3; i++) toWindow(v[i], width, height, p, i);
+
+	//Counter-clockwise on screen (y down), so every edge function is positive inside
+	long long area = (long long)(p.x[1] - p.x[0]) * (p.y[2] - p.y[0]) - (long long)(p.x[2] - p.x[0]) * (p.y[1] - p.y[0]);
+	if (area == 0) return;
+	if (area < 0) {
+		std::swap(p.x[1], p.x[2]); std::swap(p.y[1], p.y[2]);
+		std::swap(p.z[1], p.z[2]); std::swap(p.inv_w[1], p.inv_w[2]);
+		for (int k = 0; k < SoftRasterizer::Varyings; k++) std::swap(p.var[1][k], p.var[2][k]);
+	}
+
+	pixelSpan(std::min(p.x[0], std::min(p.x[1], p.x[2])), std::max(p.x[0], std::max(p.x[1], p.x[2])), width, p.min_x, p.max_x);
+	pixelSpan(std::min(p.y[0], std::min(p.y[1], p.y[2])), std::max(p.y[0], std::max(p.y[1], p.y[2])), height, p.min_y, p.max_y);
+	if (p.min_x > p.max_x || p.min_y > p.max_y) return; //Covers no pixel center
+
+	out.push_back(p);
+}
+//---------------------------------------------------------
+static void emitLine(const ClipVertex& a, const ClipVertex& b, int command, int width, int height, float line_width,
+	std::vector<SoftRasterizer::Primitive>& out)
+{
+	ClipVertex v[9] = { a, b };
+	if (clipPolygon(v, 2) != 2) return;
+
+	SoftRasterizer::Primitive p;
+	p.command = command;
+	p.vertices = 2;
+	toWindow(v[0], width, height, p, 0);
+	toWindow(v[1], width, height, p, 1);
+
+	int pad = (int)ceil(line_width * 0.5 * SubPixel) + SubPixel;
+	pixelSpan(std::min(p.x[0], p.x[1]) - pad, std::max(p.x[0], p.x[1]) + pad, width, p.min_x, p.max_x);
+	pixelSpan(std::min(p.y[0], p.y[1]) - pad, std::max(p.y[0], p.y[1]) + pad, height, p.min_y, p.max_y);
+	if (p.min_x > p.max_x || p.min_y > p.max_y) return;
+
+	out.push_back(p);
+}
+//---------------------------------------------------------
+bool SoftRasterizer::resize(int width, int height)
+{
+	if (width <= 0 || height <= 0 || width > MaxSize || height > MaxSize) return false;
+
+	frame_width = width;
+	frame_height = height;
+	tiles_x = (width + TileSize - 1) / TileSize;
+	tiles_y = (height + TileSize - 1) / TileSize;
+
+	size_t pixels = (size_t)tiles_x * tiles_y * TileSize * TileSize;
+	color.assign(pixels * 4, 0.0f);
+	depth.assign(pixels, 1.0f);
+	block_depth.assign(pixels / (BlockSize * BlockSize), 1.0f);
+	return true;
+}
+//---------------------------------------------------------
+void SoftRasterizer::setTexture2D(int width, int height, const unsigned char* rgba)
+{
+	texture_2D.width = width;
+	texture_2D.height = height;
+	texture_2D.rgba = rgba;
+}
+//---------------------------------------------------------
+void SoftRasterizer::setTexture1D(int width, const unsigned char* rgba)
+{
+	texture_1D.width = width;
+	texture_1D.height = 1;
+	texture_1D.rgba = rgba;
+}
+//---------------------------------------------------------
+void SoftRasterizer::clear(const color4& c)
+{
+	const int tile_pixels = TileSize * TileSize, tile_blocks = tile_pixels / (BlockSize * BlockSize);
+
+	ThreadPool::instance().parallelFor(tiles_x * tiles_y, [&](int begin, int end, int) {
+		for (int tile = begin; tile < end; tile++) {
+			float* rgba = &color[(size_t)tile * tile_pixels * 4];
+			for (int i = 0; i < tile_pixels; i++) {
+				rgba[4 * i] = c.x; rgba[4 * i + 1] = c.y; rgba[4 * i + 2] = c.z; rgba[4 * i + 3] = c.w;
+			}
+			std::fill(depth.begin() + (size_t)tile * tile_pixels, depth.begin() + (size_t)(tile + 1) * tile_pixels, 1.0f);
+			std::fill(block_depth.begin() + (size_t)tile * tile_blocks, block_depth.begin() + (size_t)(tile + 1) * tile_blocks, 1.0f);
+		}
+	});
+
+	commands.clear();
+	primitives.clear();
+	vertex_ms = 0.0;
+}
+//---------------------------------------------------------
+void SoftRasterizer::addPrimitives(std::vector<std::vector<Primitive> >& chunks)
+{
+	for (size_t i = 0; i < chunks.size(); i++)
+		primitives.insert(primitives.end(), chunks[i].begin(), chunks[i].end());
+}
+//---------------------------------------------------------
+void SoftRasterizer::drawTriangles(const SoftMesh& mesh, const SoftInstance* instances, int instance_count)
+{
+	PROFILE_ZONE("soft vertex");
+	double start = wallTimeMs();
+
+	Command c = { uniforms.Fog, uniforms.texture_flag, uniforms.texture_Dimension, uniforms.sphere, uniforms.lattice_on,
+		uniforms.lightmap_on && uniforms.lighting && uniforms.lightmap != NULL, state };
+	commands.push_back(c);
+	const int command = (int)commands.size() - 1;
+
+	const bool instanced = instances != NULL && instance_count > 0;
+	const int per_instance = mesh.count / 3, triangles = per_instance * (instanced ? instance_count : 1);
+	ThreadPool& pool = ThreadPool::instance();
+	const int chunks = triangles < 256 ? 1 : pool.size() * 4;
+	std::vector<std::vector<Primitive> > out(chunks);
+
+	pool.parallelFor(triangles, [&](int begin, int end, int chunk) {
+		mat4 MV = uniforms.model_view;
+		mat3 NM = uniforms.Normal_Matrix;
+		int current = -1;
+		float material = 0.0;
+
+		for (int t = begin; t < end; t++) {
+			if (instanced && t / per_instance != current) {
+				current = t / per_instance;
+				MV = uniforms.view * instances[current].model;
+				NM = upperLeftMat3(MV); //Instances are only rotated and translated
+				material = instances[current].material;
+			}
+
+			ClipVertex v[9];
+			int first = (t % per_instance) * 3;
+			for (int i = 0; i < 3; i++)
+				shadeVertex(uniforms, MV, NM, instanced, material, mesh, first + i, v[i]);
+
+			if (state.wireframe) {
+				for (int i = 0; i < 3; i++)
+					emitLine(v[i], v[(i + 1) % 3], command, frame_width, frame_height, state.line_width, out[chunk]);
+				continue;
+			}
+
+			int n = clipPolygon(v, 3);
+			for (int i = 1; i + 1 < n; i++) {
+				ClipVertex fan[3] = { v[0], v[i], v[i + 1] };
+				emitTriangle(fan, command, frame_width, frame_height, out[chunk]);
+			}
+		}
+	}, chunks);
+
+	addPrimitives(out);
+	vertex_ms += wallTimeMs() - start;
+}
+//---------------------------------------------------------
+void SoftRasterizer::drawLines(const SoftMesh& mesh)
+{
+	PROFILE_ZONE("soft vertex");
+	double start = wallTimeMs();
+
+	Command c = { uniforms.Fog, uniforms.texture_flag, uniforms.texture_Dimension, uniforms.sphere, uniforms.lattice_on,
+		uniforms.lightmap_on && uniforms.lighting && uniforms.lightmap != NULL, state };
+	commands.push_back(c);
+
+	std::vector<std::vector<Primitive> > out(1);
+	mat3 NM = uniforms.Normal_Matrix;
+	for (int i = 0; i + 1 < mesh.count; i += 2) {
+		ClipVertex a, b;
+		shadeVertex(uniforms, uniforms.model_view, NM, false, 0.0, mesh, i, a);
+		shadeVertex(uniforms, uniforms.model_view, NM, false, 0.0, mesh, i + 1, b);
+		emitLine(a, b, (int)commands.size() - 1, frame_width, frame_height, state.line_width, out[0]);
+	}
+
+	addPrimitives(out);
+	vertex_ms += wallTimeMs() - start;
+}
+//---------------------------------------------------------
+void SoftRasterizer::finish()
+{
+	ThreadPool& pool = ThreadPool::instance();
+	const int tiles = tiles_x * tiles_y, count = (int)primitives.size();
+
+	//Bin: each chunk keeps its own per-tile lists, so a tile's primitives stay in submission order
+	ProfileZone stage("soft bin");
+	double start = wallTimeMs();
+	const int chunks = std::max(1, std::min(count / 64, pool.size() * 4));
+	if ((int)bins.size() < chunks) bins.resize(chunks);
+	for (int k = 0; k < chunks; k++) {
+		bins[k].resize(tiles);
+		for (int t = 0; t < tiles; t++) bins[k][t].clear();
+	}
+
+	pool.parallelFor(count, [&](int begin, int end, int chunk) {
+		std::vector<std::vector<int> >& bin = bins[chunk];
+		for (int i = begin; i < end; i++) {
+			const Primitive& p = primitives[i];
+			for (int ty = p.min_y / TileSize; ty <= p.max_y / TileSize; ty++)
+				for (int tx = p.min_x / TileSize; tx <= p.max_x / TileSize; tx++)
+					bin[ty * tiles_x + tx].push_back(i);
+		}
+	}, chunks);
+	bin_ms = wallTimeMs() - start;
+
+	//Raster: one tile per task, no two tasks touch the same pixels
+	stage.restart("soft raster");
+	start = wallTimeMs();
+	pool.run(tiles, [&](int tile, int) {
+		PROFILE_ZONE("raster tile");
+		for (int k = 0; k < chunks; k++) {
+			const std::vector<int>& bin = bins[k][tile];
+			for (size_t i = 0; i < bin.size(); i++) {
+				const Primitive& p = primitives[bin[i]];
+				if (p.vertices == 3) rasterTriangle(p, commands[p.command], tile);
+				else rasterLine(p, commands[p.command], tile);
+			}
+		}
+	});
+	raster_ms = wallTimeMs() - start;
+
+	last_primitives = count;
+}
+//---------------------------------------------------------
+void SoftRasterizer::rasterTriangle(const Primitive& p, const Command& c, int tile)
+{
+	const int tile_x = (tile % tiles_x) * TileSize, tile_y = (tile / tiles_x) * TileSize;
+	const int x0 = std::max(p.min_x, tile_x), x1 = std::min(p.max_x, tile_x + TileSize - 1);
+	const int y0 = std::max(p.min_y, tile_y), y1 = std::min(p.max_y, tile_y + TileSize - 1);
+	if (x0 > x1 || y0 > y1) return;
+
+	//Edge k is opposite vertex k: E(X, Y) = a X + b Y + c at fixed point pixel centers, >= 0 inside.
+	//Edges that are not top or left get -1, so a pixel center exactly on them is left to the neighbour.
+	long long ea[3], eb[3], ec[3];
+	for (int k = 0; k < 3; k++) {
+		int i = (k + 1) % 3, j = (k + 2) % 3;
+		ea[k] = -(long long)(p.y[j] - p.y[i]);
+		eb[k] = p.x[j] - p.x[i];
+		ec[k] = -(ea[k] * p.x[i] + eb[k] * p.y[i]);
+	}
+	const long long area = ea[0] * p.x[0] + eb[0] * p.y[0] + ec[0];
+
+	//Tile-level test on the corners of the covered rectangle. Edges crossing the rectangle are
+	//stepped in 32 bits from its origin; edges it lies entirely inside are dropped from the test.
+	int e_origin[3], step_x[3], step_y[3];
+	for (int k = 0; k < 3; k++) {
+		long long bias = (ea[k] > 0 || (ea[k] == 0 && eb[k] > 0)) ? 0 : -1;
+		long long e00 = ea[k] * (x0 * SubPixel + SubPixel / 2) + eb[k] * (y0 * SubPixel + SubPixel / 2) + ec[k] + bias;
+		long long dx = ea[k] * SubPixel * (x1 - x0), dy = eb[k] * SubPixel * (y1 - y0);
+		long long lo = e00 + std::min(dx, 0LL) + std::min(dy, 0LL), hi = e00 + std::max(dx, 0LL) + std::max(dy, 0LL);
+		if (hi < 0) return;
+		if (lo >= 0) { e_origin[k] = 0; step_x[k] = step_y[k] = 0; }
+		else { e_origin[k] = (int)e00; step_x[k] = (int)(ea[k] * SubPixel); step_y[k] = (int)(eb[k] * SubPixel); }
+	}
+
+	//Barycentrics of vertices 1 and 2 at the rectangle origin and their per-pixel steps
+	const double inv_area = 1.0 / (double)area;
+	float l_origin[3], l_dx[3], l_dy[3];
+	for (int k = 1; k < 3; k++) {
+		l_origin[k] = (ea[k] * (x0 * SubPixel + SubPixel / 2) + eb[k] * (y0 * SubPixel + SubPixel / 2) + ec[k]) * inv_area;
+		l_dx[k] = ea[k] * SubPixel * inv_area;
+		l_dy[k] = eb[k] * SubPixel * inv_area;
+	}
+
+	const float z0 = p.z[0], dz1 = p.z[1] - p.z[0], dz2 = p.z[2] - p.z[0];
+	const float z_min = std::min(p.z[0], std::min(p.z[1], p.z[2]));
+	const __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+	__m128i lane_step[3];
+	for (int k = 0; k < 3; k++)
+		lane_step[k] = _mm_setr_epi32(0, step_x[k], 2 * step_x[k], 3 * step_x[k]);
+
+	const int blocks_per_row = TileSize / BlockSize;
+	float* tile_depth = &depth[(size_t)tile * TileSize * TileSize];
+	float* tile_block_depth = &block_depth[(size_t)tile * blocks_per_row * blocks_per_row];
+
+	for (int by = (y0 - tile_y) / BlockSize; by <= (y1 - tile_y) / BlockSize; by++) {
+		for (int bx = (x0 - tile_x) / BlockSize; bx <= (x1 - tile_x) / BlockSize; bx++) {
+			const int block = by * blocks_per_row + bx;
+
+			//Hierarchical Z: the nearest point of the triangle is behind everything in the block
+			if (z_min >= tile_block_depth[block]) continue;
+
+			const int block_x = tile_x + bx * BlockSize, block_y = tile_y + by * BlockSize;
+			const int bx0 = std::max(x0, block_x), bx1 = std::min(x1, block_x + BlockSize - 1);
+			const int by0 = std::max(y0, block_y), by1 = std::min(y1, block_y + BlockSize - 1);
+
+			//Block corners: skip blocks outside an edge, drop the per-pixel test for blocks inside all edges
+			int e[3];
+			bool outside = false, full = true;
+			for (int k = 0; k < 3; k++) {
+				e[k] = e_origin[k] + (bx0 - x0) * step_x[k] + (by0 - y0) * step_y[k];
+				int dx = (bx1 - bx0) * step_x[k], dy = (by1 - by0) * step_y[k];
+				int lo = e[k] + std::min(dx, 0) + std::min(dy, 0), hi = e[k] + std::max(dx, 0) + std::max(dy, 0);
+				if (hi < 0) outside = true;
+				if (lo < 0) full = false;
+			}
+			if (outside) continue;
+
+			bool wrote = false;
+			for (int py = by0; py <= by1; py++) {
+				for (int gx = block_x; gx < block_x + BlockSize; gx += 4) {
+					int mask = 0;
+					for (int l = 0; l < 4; l++)
+						if (gx + l >= bx0 && gx + l <= bx1) mask |= 1 << l;
+					if (!mask) continue;
+
+					if (!full) {
+						__m128i outside_bits = _mm_setzero_si128();
+						for (int k = 0; k < 3; k++) {
+							int eg = e[k] + (gx - bx0) * step_x[k] + (py - by0) * step_y[k];
+							outside_bits = _mm_or_si128(outside_bits, _mm_add_epi32(_mm_set1_epi32(eg), lane_step[k]));
+						}
+						mask &= ~_mm_movemask_ps(_mm_castsi128_ps(outside_bits));
+						if (!mask) continue;
+					}
+
+					//Depth test, 4 pixels at a time (GL_LESS)
+					float fx = (float)(gx - x0), fy = (float)(py - y0);
+					__m128 px = _mm_add_ps(_mm_set1_ps(fx), lanes);
+					__m128 l1 = _mm_add_ps(_mm_set1_ps(l_origin[1] + fy * l_dy[1]), _mm_mul_ps(px, _mm_set1_ps(l_dx[1])));
+					__m128 l2 = _mm_add_ps(_mm_set1_ps(l_origin[2] + fy * l_dy[2]), _mm_mul_ps(px, _mm_set1_ps(l_dx[2])));
+					__m128 z = _mm_add_ps(_mm_set1_ps(z0),
+						_mm_add_ps(_mm_mul_ps(l1, _mm_set1_ps(dz1)), _mm_mul_ps(l2, _mm_set1_ps(dz2))));
+					const int index = (py - tile_y) * TileSize + (gx - tile_x);
+					mask &= _mm_movemask_ps(_mm_cmplt_ps(z, _mm_loadu_ps(&tile_depth[index])));
+					if (!mask) continue;
+
+					float lambda1[4], lambda2[4], zs[4];
+					_mm_storeu_ps(lambda1, l1);
+					_mm_storeu_ps(lambda2, l2);
+					_mm_storeu_ps(zs, z);
+
+					for (int l = 0; l < 4; l++) {
+						if (!(mask & (1 << l))) continue;
+
+						//Perspective-correct varyings
+						float b1 = lambda1[l], b2 = lambda2[l], b0 = 1.0f - b1 - b2;
+						float w = 1.0f / (b0 * p.inv_w[0] + b1 * p.inv_w[1] + b2 * p.inv_w[2]);
+						float var[Varyings], rgba[4];
+						for (int i = 0; i < Varyings; i++)
+							var[i] = (b0 * p.var[0][i] + b1 * p.var[1][i] + b2 * p.var[2][i]) * w;
+
+						if (!shadeFragment(c, var, rgba)) continue;
+						writePixel(c, tile, index + l, zs[l], rgba);
+						wrote = wrote || c.state.depth_write;
+					}
+				}
+			}
+			if (wrote) updateBlockDepth(tile, block);
+		}
+	}
+}
+//---------------------------------------------------------
+/*
+	Wide lines as GL draws them without antialiasing: one fragment per pixel
+	along the major axis, line_width fragments across it. Each tile draws the
+	part of the line that falls inside it.
+*/
+void SoftRasterizer::rasterLine(const Primitive& p, const Command& c, int tile)
+{
+	const int tile_x = (tile % tiles_x) * TileSize, tile_y = (tile / tiles_x) * TileSize;
+	const float ax = (float)p.x[0] / SubPixel, ay = (float)p.y[0] / SubPixel;
+	const float dx = (float)p.x[1] / SubPixel - ax, dy = (float)p.y[1] / SubPixel - ay;
+	const bool x_major = fabs(dx) >= fabs(dy);
+	const float major0 = x_major ? ax : ay, major_len = x_major ? dx : dy;
+	const float minor0 = x_major ? ay : ax, minor_len = x_major ? dy : dx;
+	if (major_len == 0.0f) return;
+
+	const int width = std::max(1, (int)(c.state.line_width + 0.5f));
+	const int tile_major = x_major ? tile_x : tile_y, tile_minor = x_major ? tile_y : tile_x;
+	const int limit_major = x_major ? frame_width : frame_height, limit_minor = x_major ? frame_height : frame_width;
+
+	//Pixel centers between the endpoints, within the tile
+	float lo = std::min(major0, major0 + major_len), hi = std::max(major0, major0 + major_len);
+	int first = std::max((int)ceil(lo - 0.5f), std::max(tile_major, 0));
+	int last = std::min((int)ceil(hi - 0.5f) - 1, std::min(tile_major + TileSize - 1, limit_major - 1));
+
+	unsigned long long dirty = 0; //Blocks whose depth changed
+	float* tile_depth = &depth[(size_t)tile * TileSize * TileSize];
+
+	for (int m = first; m <= last; m++) {
+		float t = ((m + 0.5f) - major0) / major_len;
+		int start = (int)floor(minor0 + t * minor_len - width * 0.5f + 0.5f);
+
+		float z = p.z[0] + (p.z[1] - p.z[0]) * t;
+		float w = 1.0f / (p.inv_w[0] + (p.inv_w[1] - p.inv_w[0]) * t);
+		float var[Varyings], rgba[4];
+		for (int i = 0; i < Varyings; i++)
+			var[i] = (p.var[0][i] + (p.var[1][i] - p.var[0][i]) * t) * w;
+
+		for (int n = std::max(start, std::max(tile_minor, 0)); n < std::min(start + width, std::min(tile_minor + TileSize, limit_minor)); n++) {
+			int x = x_major ? m : n, y = x_major ? n : m;
+			int index = (y - tile_y) * TileSize + (x - tile_x);
+			if (!(z < tile_depth[index])) continue;
+			if (!shadeFragment(c, var, rgba)) continue;
+
+			writePixel(c, tile, index, z, rgba);
+			if (c.state.depth_write)
+				dirty |= 1ULL << (((y - tile_y) / BlockSize) * (TileSize / BlockSize) + (x - tile_x) / BlockSize);
+		}
+	}
+
+	for (int block = 0; dirty; block++, dirty >>= 1)
+		if (dirty & 1) updateBlockDepth(tile, block);
+}
+//---------------------------------------------------------
+static inline const unsigned char* texel(int width, int height, const unsigned char* rgba, float s, float t)
+{
+	int i = (int)floor(s * width) % width, j = (int)floor(t * height) % height;
+	if (i < 0) i += width;
+	if (j < 0) j += height;
+	return rgba + 4 * (j * width + i);
+}
+//---------------------------------------------------------
+//GL_LINEAR with GL_CLAMP_TO_EDGE of a size x size RGB float texture
+static void sampleBilinear(const float* rgb, int size, float s, float t, float* out)
+{
+	float x = std::min(std::max(s * size - 0.5f, 0.0f), (float)(size - 1));
+	float y = std::min(std::max(t * size - 0.5f, 0.0f), (float)(size - 1));
+	int x0 = (int)x, y0 = (int)y;
+	int x1 = std::min(x0 + 1, size - 1), y1 = std::min(y0 + 1, size - 1);
+	float fx = x - x0, fy = y - y0;
+	const float *a = rgb + 3 * (y0 * size + x0), *b = rgb + 3 * (y0 * size + x1);
+	const float *c = rgb + 3 * (y1 * size + x0), *d = rgb + 3 * (y1 * size + x1);
+	for (int i = 0; i < 3; i++) {
+		float top = a[i] + (b[i] - a[i]) * fx, bottom = c[i] + (d[i] - c[i]) * fx;
+		out[i] = top + (bottom - top) * fy;
+	}
+}
+//---------------------------------------------------------
+//main() of fshader53.glsl; false when the fragment is discarded
+bool SoftRasterizer::shadeFragment(const Command& c, const float* var, float* rgba) const
+{
+	//Lattice effect
+	if (c.sphere && c.lattice_on) {
+		float u = 4.0f * var[V_LU], v = 4.0f * var[V_LV];
+		if (u - floor(u) < 0.35f && v - floor(v) < 0.35f) return false;
+	}
+
+	//Fog options
+	const float fog_color[4] = { 0.7f, 0.7f, 0.7f, 0.5f };
+	float fog = 1.0f, fz = var[V_FZ];
+	if (c.Fog == 1) fog = (18.0f - fz) / 18.0f;
+	else if (c.Fog == 2) fog = exp(-0.09f * fz);
+	else if (c.Fog == 3) fog = exp(-(0.09f * fz) * (0.09f * fz));
+	fog = std::min(1.0f, std::max(0.0f, fog));
+
+	//Baked light, added to the interpolated lighting
+	float lit[4] = { var[V_R], var[V_G], var[V_B], var[V_A] };
+	if (c.lightmap_on) {
+		const vec4& bounds = uniforms.lightmap_bounds;
+		float baked[3];
+		sampleBilinear(uniforms.lightmap, uniforms.lightmap_size, (var[V_FLOOR_X] - bounds.x) * bounds.z,
+			(var[V_FLOOR_Z] - bounds.y) * bounds.w, baked);
+		for (int i = 0; i < 3; i++) lit[i] += baked[i];
+	}
+
+	//Textures
+	float tex[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	float base[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+	bool textured = false;
+	if (c.texture_flag == 0) {
+		for (int i = 0; i < 4; i++) base[i] = lit[i];
+	}
+	else if (c.texture_Dimension == 2 && texture_2D.rgba) {
+		const unsigned char* t = texel(texture_2D.width, texture_2D.height, texture_2D.rgba, var[V_S], var[V_T]);
+		for (int i = 0; i < 4; i++) tex[i] = t[i] / 255.0f;
+		if (c.sphere && t[0] == 0) {
+			tex[0] = 0.9f; tex[1] = 0.1f; tex[2] = 0.1f; tex[3] = 1.0f;
+		}
+		textured = true;
+	}
+	else if (c.texture_Dimension == 1 && texture_1D.rgba) {
+		const unsigned char* t = texel(texture_1D.width, 1, texture_1D.rgba, var[V_S1D], 0.0f);
+		for (int i = 0; i < 4; i++) tex[i] = t[i] / 255.0f;
+		textured = true;
+	}
+	if (textured)
+		for (int i = 0; i < 4; i++) base[i] = lit[i] * tex[i];
+
+	for (int i = 0; i < 4; i++)
+		rgba[i] = fog_color[i] + (base[i] - fog_color[i]) * fog;
+	return true;
+}
+//---------------------------------------------------------
+void SoftRasterizer::writePixel(const Command& c, int tile, int index, float z, const float* rgba)
+{
+	size_t at = (size_t)tile * TileSize * TileSize + index;
+	if (c.state.depth_write) depth[at] = z;
+	if (!c.state.color_write) return;
+
+	//The framebuffer is fixed point, so the shader output is clamped
+	float src[4];
+	for (int i = 0; i < 4; i++) src[i] = std::min(1.0f, std::max(0.0f, rgba[i]));
+
+	float* dst = &color[at * 4];
+	if (c.state.blend) {
+		float a = src[3];
+		for (int i = 0; i < 4; i++) dst[i] = src[i] * a + dst[i] * (1.0f - a);
+	}
+	else
+		for (int i = 0; i < 4; i++) dst[i] = src[i];
+}
+//---------------------------------------------------------
+void SoftRasterizer::updateBlockDepth(int tile, int block)
+{
+	const int blocks_per_row = TileSize / BlockSize;
+	const float* d = &depth[(size_t)tile * TileSize * TileSize
+		+ (block / blocks_per_row) * BlockSize * TileSize + (block % blocks_per_row) * BlockSize];
+
+	float farthest = 0.0f;
+	for (int y = 0; y < BlockSize; y++)
+		for (int x = 0; x < BlockSize; x++)
+			farthest = std::max(farthest, d[y * TileSize + x]);
+	block_depth[(size_t)tile * blocks_per_row * blocks_per_row + block] = farthest;
+}
+//---------------------------------------------------------
+void SoftRasterizer::readPixels(unsigned char* rgb) const
+{
+	for (int y = 0; y < frame_height; y++)
+		for (int x = 0; x < frame_width; x++) {
+			int tile = (y / TileSize) * tiles_x + x / TileSize;
+			const float* c = &color[((size_t)tile * TileSize * TileSize + (y % TileSize) * TileSize + x % TileSize) * 4];
+			for (int i = 0; i < 3; i++)
+				rgb[(y * frame_width + x) * 3 + i] = (unsigned char)(c[i] * 255.0f + 0.5f);
+		}
+}
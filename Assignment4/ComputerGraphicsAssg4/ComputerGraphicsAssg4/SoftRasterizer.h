@@ -0,0 +1,180 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- SoftRasterizer.h ---
+//
+//   CPU implementation of the vshader53.glsl / fshader53.glsl pipeline, for
+//   machines without an OpenGL driver. It renders into its own color and
+//   depth buffers; the uniforms keep the shader names so the scene code
+//   reads like the GL path.
+//
+//   Draw calls run the vertex stage at once, in parallel over triangles,
+//   clip against the near/far planes and a guard band, and append the
+//   window-space primitives to the frame. finish() bins them into 64x64
+//   tiles and rasterizes the tiles in parallel on the ThreadPool, each tile
+//   replaying its primitives in submission order, so depth and blending
+//   behave as in GL.
+//
+//   Positions are snapped to 1/16 pixel and covered by integer edge
+//   functions with the top-left rule, so triangles sharing an edge never
+//   both draw a pixel. A triangle is tested per tile and per 8x8 block at
+//   the corners first: blocks farther than the block's farthest stored
+//   depth (a one-level hierarchical Z) or outside an edge are skipped,
+//   and the rest are covered 4 pixels at a time with SSE2.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SOFTRASTERIZER_H__
+#define __SOFTRASTERIZER_H__
+
+#include "Angel-yjc.h"
+#include <vector>
+
+typedef Angel::vec4  color4;
+typedef Angel::vec3  point3;
+
+//Uniforms read by vshader53.glsl and fshader53.glsl, under the shader's names
+struct SoftUniforms {
+	int Fog = 0;
+
+	bool sphere_texture_dir = false, sphere_texture_space = false;
+	bool calculate_texCoord = false;
+	int texture_Dimension = 2;
+	int texture_flag = 0;
+	bool sphere = false;
+	bool lattice_on = false, lattice_upright = true;
+
+	bool lighting = false;
+	int LightCount = 0;
+	color4 GlobalAmbientProduct;
+	color4 AmbientProduct[2], DiffuseProduct[2], SpecularProduct[2];
+	vec4 LightPosition[2];  //Eye frame
+	vec3 LightDirection[2];
+	int LightType[2] = { 0, 0 };
+	float Cutoff[2] = { 0.0, 0.0 }, Exponent[2] = { 0.0, 0.0 };
+	float ConstAtt[2] = { 1.0, 1.0 }, LinearAtt[2] = { 0.0, 0.0 }, QuadAtt[2] = { 0.0, 0.0 };
+	float Shininess = 1.0;
+
+	//The floor's lightmap (light 1's ambient and diffuse), RGB float texels sampled bilinearly and clamped;
+	//uv = (xz - lightmap_bounds.xy) * lightmap_bounds.zw
+	bool lightmap_on = false;
+	const float* lightmap = NULL;
+	int lightmap_size = 0;
+	vec4 lightmap_bounds;
+
+	mat4 model_view, projection;
+	mat3 Normal_Matrix;
+
+	//Instanced draws take model_view = view * (instance model matrix)
+	mat4 view;
+	bool use_material = false;
+	color4 MaterialTint[4];
+};
+
+//Fixed-function state that display() sets with glDepthMask, glColorMask, GL_BLEND and glPolygonMode
+struct SoftRenderState {
+	bool depth_write = true;
+	bool color_write = true;
+	bool blend = false;      //GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA
+	bool wireframe = false;  //Triangles drawn as their edges
+	float line_width = 1.0;
+};
+
+//Non-indexed vertex arrays; normal and tex_coord may be NULL (read as zero, like a disabled attribute)
+struct SoftMesh {
+	const point3* position;
+	const vec3* normal;
+	const color4* color;
+	const vec2* tex_coord;
+	int count;
+};
+
+struct SoftInstance {
+	mat4 model;
+	float material; //Index into MaterialTint
+};
+
+class SoftRasterizer {
+public:
+	SoftUniforms uniforms;
+	SoftRenderState state;
+
+	//Width and height up to MaxSize
+	bool resize(int width, int height);
+	int width() const { return frame_width; }
+	int height() const { return frame_height; }
+
+	//RGBA8 images, sampled GL_NEAREST with GL_REPEAT; the data is not copied
+	void setTexture2D(int width, int height, const unsigned char* rgba);
+	void setTexture1D(int width, const unsigned char* rgba);
+
+	//Starts a frame: clears color and depth (to 1.0)
+	void clear(const color4& c);
+
+	void drawTriangles(const SoftMesh& mesh, const SoftInstance* instances = NULL, int instance_count = 0);
+	void drawLines(const SoftMesh& mesh);
+
+	//Rasterizes everything drawn since clear()
+	void finish();
+
+	//Tightly packed RGB rows, top row first
+	void readPixels(unsigned char* rgb) const;
+
+	//Stage costs of the last frame
+	double lastVertexMs() const { return vertex_ms; }
+	double lastBinMs() const { return bin_ms; }
+	double lastRasterMs() const { return raster_ms; }
+	int lastPrimitiveCount() const { return last_primitives; }
+
+	static const int MaxSize = 4096;
+
+	enum { TileSize = 64, BlockSize = 8, Varyings = 10 };
+
+	//State of fshader53.glsl and the output merger for one draw call
+	struct Command {
+		int Fog, texture_flag, texture_Dimension;
+		bool sphere, lattice_on, lightmap_on;
+		SoftRenderState state;
+	};
+
+	//A clipped triangle or line in window coordinates (y down, 1/16 pixel fixed point)
+	struct Primitive {
+		int command;
+		int vertices;            //3 or 2
+		int x[3], y[3];          //Fixed point
+		float z[3], inv_w[3];    //Depth in [0, 1], 1 / clip w
+		float var[3][Varyings];  //Varyings divided by clip w
+		int min_x, min_y, max_x, max_y; //Pixel bounds, inclusive
+	};
+
+private:
+	struct Texture {
+		int width = 0, height = 0;
+		const unsigned char* rgba = NULL;
+	};
+
+	void addPrimitives(std::vector<std::vector<Primitive> >& chunks);
+	void rasterTriangle(const Primitive& p, const Command& c, int tile);
+	void rasterLine(const Primitive& p, const Command& c, int tile);
+	bool shadeFragment(const Command& c, const float* var, float* rgba) const;
+	void writePixel(const Command& c, int tile, int index, float z, const float* rgba);
+	void updateBlockDepth(int tile, int block);
+
+	int frame_width = 0, frame_height = 0;
+	int tiles_x = 0, tiles_y = 0;
+
+	//Tile-major: TileSize * TileSize pixels per tile, rows of TileSize
+	std::vector<float> color;  //RGBA
+	std::vector<float> depth;
+	std::vector<float> block_depth; //Farthest depth per 8x8 block
+
+	Texture texture_2D, texture_1D;
+
+	std::vector<Command> commands;
+	std::vector<Primitive> primitives;
+	std::vector<std::vector<std::vector<int> > > bins; //[chunk][tile] -> primitive indices
+
+	double vertex_ms = 0.0, bin_ms = 0.0, raster_ms = 0.0;
+	int last_primitives = 0;
+};
+
+#endif // __SOFTRASTERIZER_H__
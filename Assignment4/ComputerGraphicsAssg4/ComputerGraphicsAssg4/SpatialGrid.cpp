@@ -0,0 +1,126 @@
+#include "SpatialGrid.h"
+#include "ThreadPool.h"
+#include <math.h>
+#include <chrono>
+
+typedef std::chrono::high_resolution_clock Clock;
+
+//---------------------------------------------------------
+void SpatialGrid::setBounds(const point3& floor_min, const point3& floor_max, float cell_size)
+{
+	min_x = floor_min.x;
+	min_z = floor_min.z;
+	extent_x = floor_max.x - floor_min.x;
+	extent_z = floor_max.z - floor_min.z;
+	requested_cell = cell_size;
+}
+//---------------------------------------------------------
+void SpatialGrid::build(const float* x, const float* y, const float* z, int count, float body_radius)
+{
+	Clock::time_point start = Clock::now();
+
+	//Cells must be at least one body diameter wide for the 3x3 neighbourhood to be enough,
+	//and are widened to about one body per cell so clearing and scanning cells stays O(bodies)
+	radius = body_radius;
+	cell = fmax(requested_cell, 2.0f * radius);
+	if (count > 0) cell = fmax(cell, sqrt(extent_x * extent_z / count));
+	inv_cell = 1.0 / cell;
+	nx = (int)fmax(1.0, ceil(extent_x * inv_cell));
+	nz = (int)fmax(1.0, ceil(extent_z * inv_cell));
+
+	ThreadPool& pool = ThreadPool::instance();
+	const int cells = nx * nz, chunks = pool.size();
+
+	body_cell.resize(count);
+	sorted.resize(count);
+	cell_start.assign(cells + 1, 0);
+	histogram.assign((size_t)cells * chunks, 0);
+
+	//1. Cell of each body, counted per chunk
+	pool.parallelFor(count, [&](int begin, int end, int chunk) {
+		int* h = &histogram[(size_t)cells * chunk];
+		for (int i = begin; i < end; i++) {
+			int c = cellZ(z[i]) * nx + cellX(x[i]);
+			body_cell[i] = c;
+			h[c]++;
+		}
+	}, chunks);
+
+	//2. Exclusive prefix sum, cell-major so each cell's bodies stay contiguous;
+	//   the histogram then holds each chunk's first write position per cell
+	int running = 0;
+	for (int c = 0; c < cells; c++) {
+		cell_start[c] = running;
+		for (int k = 0; k < chunks; k++) {
+			int n = histogram[(size_t)cells * k + c];
+			histogram[(size_t)cells * k + c] = running;
+			running += n;
+		}
+	}
+	cell_start[cells] = running;
+
+	//3. Scatter, each chunk into its own reserved slots, keeping input order within a cell
+	pool.parallelFor(count, [&](int begin, int end, int chunk) {
+		int* h = &histogram[(size_t)cells * chunk];
+		for (int i = begin; i < end; i++) {
+			Body& b = sorted[h[body_cell[i]]++];
+			b.x = x[i]; b.y = y[i]; b.z = z[i];
+			b.id = i;
+		}
+	}, chunks);
+
+	build_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+//---------------------------------------------------------
+void SpatialGrid::findPairs(std::vector<GridContact>& out)
+{
+	Clock::time_point start = Clock::now();
+	out.clear();
+
+	ThreadPool& pool = ThreadPool::instance();
+	const int chunks = pool.size() * 4; //Smaller chunks even out dense and empty regions
+	if ((int)chunk_contacts.size() < chunks) chunk_contacts.resize(chunks);
+
+	const float reach = 2.0f * radius;
+	pool.run(chunks, [&](int chunk, int) {
+		std::vector<GridContact>& found = chunk_contacts[chunk];
+		found.clear();
+
+		int begin = (int)((long long)sorted.size() * chunk / chunks);
+		int end = (int)((long long)sorted.size() * (chunk + 1) / chunks);
+		for (int i = begin; i < end; i++) {
+			const Body& a = sorted[i];
+			int cx = cellX(a.x), cz = cellZ(a.z);
+
+			int x0 = cx > 0 ? cx - 1 : 0, x1 = cx + 1 < nx ? cx + 1 : cx;
+
+			//Cells of a row are contiguous in sorted order, so each neighbouring row is one span
+			for (int qz = (cz > 0 ? cz - 1 : 0); qz <= (cz + 1 < nz ? cz + 1 : cz); qz++) {
+				int first = cell_start[qz * nx + x0], last = cell_start[qz * nx + x1 + 1];
+
+				//Each pair is seen from both sides; keep it from the lower sorted index only
+				for (int k = (first > i + 1 ? first : i + 1); k < last; k++) {
+					const Body& b = sorted[k];
+					float dx = b.x - a.x, dy = b.y - a.y, dz = b.z - a.z;
+					float d2 = dx * dx + dy * dy + dz * dz;
+					if (d2 >= reach * reach) continue;
+
+					float d = sqrt(d2);
+					GridContact g;
+					g.a = a.id < b.id ? a.id : b.id;
+					g.b = a.id < b.id ? b.id : a.id;
+					float sign = a.id < b.id ? 1.0f : -1.0f;
+					if (d > 1e-6f) { g.nx = sign * dx / d; g.ny = sign * dy / d; g.nz = sign * dz / d; }
+					else { g.nx = sign; g.ny = 0.0; g.nz = 0.0; }
+					g.depth = reach - d;
+					found.push_back(g);
+				}
+			}
+		}
+	});
+
+	for (int k = 0; k < chunks; k++)
+		out.insert(out.end(), chunk_contacts[k].begin(), chunk_contacts[k].end());
+
+	query_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
@@ -0,0 +1,112 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- SpatialGrid.h ---
+//
+//   Broad phase for bodies on the floor: a uniform grid over the floor's
+//   xz extent, rebuilt from scratch every step with a parallel counting sort
+//   (per-chunk histograms, one prefix sum, per-chunk scatter). Bodies are
+//   stored sorted by cell, so a cell's bodies are contiguous in memory.
+//
+//   All bodies of one build share a radius and the cell size is at least
+//   twice that radius, so overlapping bodies are always in the same or in
+//   neighbouring cells. Bodies outside the floor are clamped into the border
+//   cells; the narrow phase test is exact, so this only costs extra checks.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __SPATIALGRID_H__
+#define __SPATIALGRID_H__
+
+#include "Angel-yjc.h"
+#include <vector>
+
+typedef Angel::vec3  point3;
+
+// Overlap between bodies a and b; (nx, ny, nz) is the unit normal from a to b
+struct GridContact {
+	int a, b;
+	float nx, ny, nz;
+	float depth;
+};
+
+class SpatialGrid {
+public:
+	//Grid over the xz extent of the floor's bounding box
+	void setBounds(const point3& floor_min, const point3& floor_max, float cell_size);
+
+	//Sorts bodies (x[i], y[i], z[i]) of the given radius into cells
+	void build(const float* x, const float* y, const float* z, int count, float body_radius);
+
+	//All overlapping pairs among the built bodies, each pair once with a < b
+	void findPairs(std::vector<GridContact>& out);
+
+	//Calls visit(id, x, y, z) for every built body overlapping the sphere (x, y, z, r)
+	template <class Visit>
+	void query(float x, float y, float z, float r, Visit visit) const;
+
+	int bodyCount() const { return (int)sorted.size(); }
+	int cellCount() const { return nx * nz; }
+	float bodyRadius() const { return radius; }
+
+	double lastBuildMs() const { return build_ms; }
+	double lastQueryMs() const { return query_ms; }
+
+private:
+	struct Body {
+		float x, y, z;
+		int id;
+	};
+
+	int cellX(float x) const;
+	int cellZ(float z) const;
+
+	float min_x = 0.0, min_z = 0.0, cell = 1.0, inv_cell = 1.0, requested_cell = 1.0;
+	float extent_x = 0.0, extent_z = 0.0;
+	int nx = 1, nz = 1;
+	float radius = 0.0;
+
+	std::vector<int> cell_start; //nx * nz + 1 entries, bodies of cell c are sorted[cell_start[c] .. cell_start[c + 1])
+	std::vector<int> body_cell;  //Cell of each input body
+	std::vector<int> histogram;  //Per chunk, per cell
+	std::vector<Body> sorted;
+	std::vector<std::vector<GridContact> > chunk_contacts;
+
+	double build_ms = 0.0, query_ms = 0.0;
+};
+
+//---------------------------------------------------------
+inline int SpatialGrid::cellX(float x) const
+{
+	int c = (int)((x - min_x) * inv_cell);
+	return c < 0 ? 0 : (c >= nx ? nx - 1 : c);
+}
+//---------------------------------------------------------
+inline int SpatialGrid::cellZ(float z) const
+{
+	int c = (int)((z - min_z) * inv_cell);
+	return c < 0 ? 0 : (c >= nz ? nz - 1 : c);
+}
+//---------------------------------------------------------
+template <class Visit>
+void SpatialGrid::query(float x, float y, float z, float r, Visit visit) const
+{
+	if (sorted.empty()) return;
+
+	float reach = r + radius;
+	int x0 = cellX(x - reach), x1 = cellX(x + reach);
+	int z0 = cellZ(z - reach), z1 = cellZ(z + reach);
+
+	for (int cz = z0; cz <= z1; cz++) {
+		for (int cx = x0; cx <= x1; cx++) {
+			int c = cz * nx + cx;
+			for (int k = cell_start[c]; k < cell_start[c + 1]; k++) {
+				const Body& b = sorted[k];
+				float dx = b.x - x, dy = b.y - y, dz = b.z - z;
+				if (dx * dx + dy * dy + dz * dz < reach * reach)
+					visit(b.id, b.x, b.y, b.z);
+			}
+		}
+	}
+}
+
+#endif // __SPATIALGRID_H__
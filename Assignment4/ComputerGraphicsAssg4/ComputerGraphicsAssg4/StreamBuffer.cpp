@@ -0,0 +1,152 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include "StreamBuffer.h"
+#include <stdio.h>
+
+StreamBuffer::StreamBuffer(GLsizeiptr bytes_per_frame)
+	: region_size(bytes_per_frame)
+{
+	for (int i = 0; i < REGION_COUNT; i++) fence[i] = 0;
+}
+//---------------------------------------------------------
+void StreamBuffer::init()
+{
+	createStorage();
+	if (!persistent) printf("ARB_buffer_storage not available, streaming by buffer orphaning\n");
+}
+//---------------------------------------------------------
+void StreamBuffer::createStorage()
+{
+	glGenBuffers(1, &name);
+	//GL_COPY_WRITE_BUFFER is used for all bookkeeping so GL_ARRAY_BUFFER bindings are left alone
+	glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+
+	if (GLEW_ARB_buffer_storage) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_WRITE_BUFFER, region_size * REGION_COUNT, NULL, flags);
+		mapped = (char*)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, region_size * REGION_COUNT, flags);
+		persistent = mapped != NULL;
+	}
+
+	if (!persistent) glBufferData(GL_COPY_WRITE_BUFFER, region_size, NULL, GL_STREAM_DRAW);
+}
+//---------------------------------------------------------
+//Replaces the buffer by one with regions of at least size bytes, once the GPU is done with the old one
+void StreamBuffer::grow(GLsizeiptr size)
+{
+	GLsizeiptr grown = region_size;
+	while (grown < size && grown < MAX_REGION_SIZE) grown *= 2;
+	if (grown > MAX_REGION_SIZE) grown = MAX_REGION_SIZE;
+	if (grown <= region_size) return;
+
+	glFinish();
+	for (int i = 0; i < REGION_COUNT; i++) {
+		if (fence[i]) glDeleteSync(fence[i]);
+		fence[i] = 0;
+	}
+	if (persistent) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		mapped = NULL;
+		persistent = false;
+	}
+	glDeleteBuffers(1, &name);
+
+	region_size = grown;
+	region = 0;
+	createStorage();
+	printf("StreamBuffer: a frame needed %ld bytes, regions grown to %ld\n", (long)size, (long)region_size);
+}
+//---------------------------------------------------------
+void StreamBuffer::beginFrame()
+{
+	if (in_frame) endFrame();
+	in_frame = true;
+
+	//Last frame did not fit: what did not was not drawn, and will be from now on
+	if (wanted > region_size) grow(wanted);
+	wanted = 0;
+
+	if (persistent) {
+		region = (region + 1) % REGION_COUNT;
+		region_begin = region_size * region;
+
+		//Wait until the GPU has consumed what was written to this region three frames ago
+		if (fence[region]) {
+			GLbitfield flags = 0;
+			GLenum r = glClientWaitSync(fence[region], flags, 0);
+			if (r == GL_TIMEOUT_EXPIRED) {
+				stalls++;
+				flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+				while ((r = glClientWaitSync(fence[region], flags, 1000000)) == GL_TIMEOUT_EXPIRED)
+					flags = 0;
+			}
+			glDeleteSync(fence[region]);
+			fence[region] = 0;
+		}
+	}
+	else {
+		//Orphan: the driver hands back fresh storage while the GPU keeps reading the old one
+		region_begin = 0;
+		glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+		glBufferData(GL_COPY_WRITE_BUFFER, region_size, NULL, GL_STREAM_DRAW);
+	}
+
+	head = region_begin;
+}
+//---------------------------------------------------------
+StreamAllocation StreamBuffer::allocate(GLsizeiptr size, GLsizeiptr align)
+{
+	StreamAllocation a = { NULL, 0, size };
+	if (!in_frame) return a;
+
+	GLintptr offset = (head + align - 1) / align * align;
+	wanted = (wanted + align - 1) / align * align + size;
+	if (offset + size > region_begin + region_size) {
+		if (wanted > MAX_REGION_SIZE && !warned) {
+			printf("StreamBuffer: a frame needs more than %ld bytes; what does not fit is not drawn\n",
+				(long)MAX_REGION_SIZE);
+			warned = true;
+		}
+		return a;
+	}
+
+	if (persistent) {
+		a.ptr = mapped + offset;
+	}
+	else {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+		a.ptr = glMapBufferRange(GL_COPY_WRITE_BUFFER, offset, size,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	}
+
+	a.offset = offset;
+	head = offset + size;
+	bytes += size;
+	return a;
+}
+//---------------------------------------------------------
+void StreamBuffer::commit(const StreamAllocation& a)
+{
+	//Persistent storage is coherent, so writes are visible to the next draw call as they are
+	if (persistent || !a.ptr) return;
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, name);
+	glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+}
+//---------------------------------------------------------
+void StreamBuffer::endFrame()
+{
+	if (!in_frame) return;
+	in_frame = false;
+
+	if (persistent)
+		fence[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	last_bytes = bytes;
+	last_stalls = stalls;
+	bytes = 0;
+	stalls = 0;
+}
@@ -0,0 +1,78 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- StreamBuffer.h ---
+//
+//   Triple-buffered allocator for data that is rewritten every frame.
+//
+//   With ARB_buffer_storage the buffer is mapped once (persistent, coherent)
+//   and split into three regions; each frame writes one region while the GPU
+//   may still read the other two, and a fence per region makes beginFrame()
+//   wait only if the GPU is three frames behind. Without it, each frame
+//   orphans the buffer with glBufferData(NULL) and maps ranges unsynchronized.
+//
+//   Usage per frame:
+//       beginFrame();
+//       StreamAllocation a = allocate(bytes);  write to a.ptr;  commit(a);
+//       ... draw from buffer() at a.offset ...
+//       endFrame();
+//
+//   An allocation is valid until endFrame(). commit() must be called before
+//   the next allocate() and before drawing (it unmaps in the fallback path).
+//   An allocation that does not fit returns NULL; the next beginFrame() then
+//   grows the regions to what the frame asked for, up to MAX_REGION_SIZE.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __STREAMBUFFER_H__
+#define __STREAMBUFFER_H__
+
+#include "Angel-yjc.h"
+
+struct StreamAllocation {
+	void* ptr;         // NULL if the allocation did not fit in this frame's region
+	GLintptr offset;   // byte offset into StreamBuffer::buffer()
+	GLsizeiptr size;
+};
+
+class StreamBuffer {
+public:
+	static const int REGION_COUNT = 3;
+	static const GLsizeiptr MAX_REGION_SIZE = 256 << 20;
+
+	StreamBuffer(GLsizeiptr bytes_per_frame = 4 << 20);
+
+	void init();
+
+	void beginFrame();
+	StreamAllocation allocate(GLsizeiptr size, GLsizeiptr align = 16);
+	void commit(const StreamAllocation& a);
+	void endFrame();
+
+	GLuint buffer() const { return name; }
+	bool isPersistent() const { return persistent; }
+	GLsizeiptr regionSize() const { return region_size; }
+
+	//Statistics of the last finished frame
+	GLsizeiptr frameBytes() const { return last_bytes; }
+	int frameStalls() const { return last_stalls; } // 1 if beginFrame() had to wait on a fence
+
+private:
+	void createStorage();
+	void grow(GLsizeiptr size);
+
+	GLuint name = 0;
+	char* mapped = NULL;
+	bool persistent = false, in_frame = false;
+
+	GLsizeiptr region_size, head = 0, region_begin = 0;
+	int region = 0;
+	GLsync fence[REGION_COUNT];
+
+	GLsizeiptr wanted = 0; //This frame's allocations, the ones that did not fit too
+	bool warned = false;   //About a frame that needs more than MAX_REGION_SIZE
+
+	GLsizeiptr bytes = 0, last_bytes = 0;
+	int stalls = 0, last_stalls = 0;
+};
+
+#endif // __STREAMBUFFER_H__
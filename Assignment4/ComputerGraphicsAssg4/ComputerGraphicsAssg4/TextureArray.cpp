@@ -0,0 +1,146 @@
+#include "TextureArray.h"
+#include <string.h>
+#include <vector>
+#include "GLStats.h"
+
+//---------------------------------------------------------
+void TextureArray::init(int texture_unit, int size, int layers)
+{
+	init(texture_unit, size, size, layers, 0, GL_RGBA);
+}
+//---------------------------------------------------------
+void TextureArray::init(int texture_unit, int width, int height, int layers, int level_count, GLenum texture_format)
+{
+	unit = texture_unit;
+	layer_width = width;
+	layer_height = height;
+	layer_count = layers;
+	format = texture_format;
+	glGenTextures(1, &texture);
+
+	GLint active = bind();
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glActiveTexture(active);
+	allocate(level_count);
+}
+//---------------------------------------------------------
+void TextureArray::resize(int size)
+{
+	if (size == layer_width && size == layer_height) return;
+	layer_width = layer_height = size;
+	allocate(0);
+}
+//---------------------------------------------------------
+void TextureArray::allocate(int level_count)
+{
+	levels = 1;
+	while ((layer_width >> (levels - 1)) > 1 || (layer_height >> (levels - 1)) > 1) levels++;
+	if (level_count > 0 && level_count < levels) levels = level_count;
+
+	GLint active = bind();
+	for (int level = 0; level < levels; level++) {
+		int w = layer_width >> level, h = layer_height >> level;
+		if (w < 1) w = 1;
+		if (h < 1) h = 1;
+		if (blockBytes(format) > 0)
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, w, h, layer_count, 0,
+				(GLsizei)(levelBytes(format, w, h) * layer_count), NULL);
+		else
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, w, h, layer_count, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	glActiveTexture(active);
+}
+//---------------------------------------------------------
+GLint TextureArray::bind() const
+{
+	GLint active = 0;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &active);
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+	return active;
+}
+//---------------------------------------------------------
+void TextureArray::setLayer(int layer, const MipChain& chain)
+{
+	GLint active = bind();
+	for (int level = 0; level < levels && level < chain.levels(); level++)
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, chain.width(level), chain.height(level), 1,
+			GL_RGBA, GL_UNSIGNED_BYTE, chain.data(level));
+	glActiveTexture(active);
+}
+//---------------------------------------------------------
+void TextureArray::setRowLayer(int layer, const MipChain& chain)
+{
+	GLint active = bind();
+	std::vector<GLubyte> rows;
+	for (int level = 0; level < levels && level < chain.levels(); level++) {
+		int width = chain.width(level), height = layer_height >> level;
+		size_t row_bytes = (size_t)width * 4;
+		rows.resize(row_bytes * height);
+		for (int y = 0; y < height; y++) memcpy(&rows[y * row_bytes], chain.data(level), row_bytes);
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, rows.data());
+	}
+	glActiveTexture(active);
+}
+//---------------------------------------------------------
+void TextureArray::setCompressedLevel(int layer, int level, const void* data, size_t bytes)
+{
+	int w = layer_width >> level, h = layer_height >> level;
+	GLint active = bind();
+	glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, w < 1 ? 1 : w, h < 1 ? 1 : h, 1,
+		format, (GLsizei)bytes, data);
+	glActiveTexture(active);
+}
+//---------------------------------------------------------
+void TextureArray::setBaseLevel(int base)
+{
+	GLint active = bind();
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, base);
+	glActiveTexture(active);
+}
+//---------------------------------------------------------
+void TextureArray::setFilter(bool mipmapped, float anisotropy)
+{
+	GLint active = bind();
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, mipmapped ? GL_LINEAR : GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_NEAREST);
+	if (anisotropy >= 1.0f) glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, anisotropy);
+	glActiveTexture(active);
+}
+//---------------------------------------------------------
+int TextureArray::blockBytes(GLenum format)
+{
+	switch (format) {
+	case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RED_RGTC1:
+	case GL_COMPRESSED_SIGNED_RED_RGTC1:
+		return 8;
+	case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+	case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT:
+	case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+	case GL_COMPRESSED_RG_RGTC2:
+	case GL_COMPRESSED_SIGNED_RG_RGTC2:
+	case GL_COMPRESSED_RGBA_BPTC_UNORM:
+	case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+	case GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT:
+	case GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT:
+		return 16;
+	}
+	return 0;
+}
+//---------------------------------------------------------
+size_t TextureArray::levelBytes(GLenum format, int width, int height)
+{
+	int block = blockBytes(format);
+	if (block == 0) return (size_t)width * height * 4;
+	return (size_t)((width + 3) / 4) * ((height + 3) / 4) * block;
+}
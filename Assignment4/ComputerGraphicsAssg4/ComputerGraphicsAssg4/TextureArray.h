@@ -0,0 +1,76 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- TextureArray.h ---
+//
+//   The color textures of every material as the layers of one
+//   GL_TEXTURE_2D_ARRAY in one texture unit: a material names its layer
+//   (texture_layer) instead of a sampler and a unit of its own, so adding a
+//   texture adds no unit, no sampler uniform and no bind between draws.
+//
+//   Layers share the array's size, mip levels and filtering. A 1D texture
+//   is a row layer: its one row repeated down the layer, so any t samples
+//   it. The textures here are procedural, so a layer is generated at the
+//   array's size rather than scaled to it; a power of two that is a
+//   multiple of the pattern's period samples exactly like the original
+//   under nearest filtering.
+//
+//   Arrays of files (TextureStream) keep the file's format, which may be
+//   block compressed, and size; each format needs an array of its own.
+//
+//   Usage:
+//       array.init(unit, size, layers);  array.setLayer(0, chain);
+//       ... shader: texture(textures, vec3(uv, texture_layer))
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __TEXTUREARRAY_H__
+#define __TEXTUREARRAY_H__
+
+#include "Angel-yjc.h"
+#include "MipChain.h"
+
+class TextureArray {
+public:
+	//RGBA8 layers of size x size texels, with mip levels down to 1x1, bound to `unit`; needs the GL context
+	void init(int unit, int size, int layers);
+	//Layers of width x height in format, with `levels` mip levels
+	void init(int unit, int width, int height, int layers, int levels, GLenum format);
+	bool isInitialized() const { return texture != 0; }
+
+	//Reallocates square layers at another size, down to 1x1; their texels are undefined until set again
+	void resize(int size);
+	int size() const { return layer_width; }
+	int width() const { return layer_width; }
+	int height() const { return layer_height; }
+	int layers() const { return layer_count; }
+
+	//Every level of chain, which must be size x size, into layer
+	void setLayer(int layer, const MipChain& chain);
+	//Every level of chain, one row of size texels, repeated down layer
+	void setRowLayer(int layer, const MipChain& chain);
+	//One level of layer in a block compressed format: `bytes` of blocks at data, which is an
+	//offset instead while a GL_PIXEL_UNPACK_BUFFER is bound
+	void setCompressedLevel(int layer, int level, const void* data, size_t bytes);
+
+	//Samples from level `base` down only, while the larger levels are not set yet
+	void setBaseLevel(int base);
+
+	//Nearest texels, or trilinear and up to `anisotropy` samples along a stretched footprint
+	void setFilter(bool mipmapped, float anisotropy);
+
+	//Bytes of a 4x4 block of a block compressed format, 0 for the others; and of a width x height level (RGBA8 for the others)
+	static int blockBytes(GLenum format);
+	static size_t levelBytes(GLenum format, int width, int height);
+
+	GLuint name() const { return texture; }
+
+private:
+	void allocate(int level_count); //0: down to 1x1
+	GLint bind() const; //Returns the unit that was active
+
+	GLuint texture = 0;
+	GLenum format = GL_RGBA;
+	int unit = 0, layer_width = 0, layer_height = 0, layer_count = 0, levels = 0;
+};
+
+#endif // __TEXTUREARRAY_H__
@@ -0,0 +1,345 @@
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "TextureStream.h"
+#include "Timing.h"
+#include <stdio.h>
+#include <string.h>
+#include "GLStats.h"
+
+namespace {
+
+enum Family { S3TC, RGTC, BPTC };
+
+struct Format {
+	unsigned id;       //FourCC, DXGI_FORMAT or VkFormat
+	GLenum gl;
+	Family family;
+	const char* name;
+};
+
+#define FOURCC(a, b, c, d) ((unsigned)(a) | (unsigned)(b) << 8 | (unsigned)(c) << 16 | (unsigned)(d) << 24)
+
+//DDS without the DX10 header; DXT1 could be either, so it keeps its 1 bit alpha
+const Format fourcc_formats[] = {
+	{ FOURCC('D', 'X', 'T', '1'), GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, S3TC, "BC1" },
+	{ FOURCC('D', 'X', 'T', '3'), GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, S3TC, "BC2" },
+	{ FOURCC('D', 'X', 'T', '5'), GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, S3TC, "BC3" },
+	{ FOURCC('A', 'T', 'I', '1'), GL_COMPRESSED_RED_RGTC1, RGTC, "BC4" },
+	{ FOURCC('B', 'C', '4', 'U'), GL_COMPRESSED_RED_RGTC1, RGTC, "BC4" },
+	{ FOURCC('A', 'T', 'I', '2'), GL_COMPRESSED_RG_RGTC2, RGTC, "BC5" },
+	{ FOURCC('B', 'C', '5', 'U'), GL_COMPRESSED_RG_RGTC2, RGTC, "BC5" },
+};
+
+//DDS with the DX10 header: DXGI_FORMAT
+const Format dxgi_formats[] = {
+	{ 71, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, S3TC, "BC1" },
+	{ 72, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT, S3TC, "BC1 sRGB" },
+	{ 74, GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, S3TC, "BC2" },
+	{ 75, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT, S3TC, "BC2 sRGB" },
+	{ 77, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, S3TC, "BC3" },
+	{ 78, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT, S3TC, "BC3 sRGB" },
+	{ 80, GL_COMPRESSED_RED_RGTC1, RGTC, "BC4" },
+	{ 81, GL_COMPRESSED_SIGNED_RED_RGTC1, RGTC, "BC4 signed" },
+	{ 83, GL_COMPRESSED_RG_RGTC2, RGTC, "BC5" },
+	{ 84, GL_COMPRESSED_SIGNED_RG_RGTC2, RGTC, "BC5 signed" },
+	{ 95, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, BPTC, "BC6H" },
+	{ 96, GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT, BPTC, "BC6H signed" },
+	{ 98, GL_COMPRESSED_RGBA_BPTC_UNORM, BPTC, "BC7" },
+	{ 99, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM, BPTC, "BC7 sRGB" },
+};
+
+//KTX2: VkFormat
+const Format vk_formats[] = {
+	{ 131, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, S3TC, "BC1 RGB" },
+	{ 132, GL_COMPRESSED_SRGB_S3TC_DXT1_EXT, S3TC, "BC1 RGB sRGB" },
+	{ 133, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, S3TC, "BC1" },
+	{ 134, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT, S3TC, "BC1 sRGB" },
+	{ 135, GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, S3TC, "BC2" },
+	{ 136, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT, S3TC, "BC2 sRGB" },
+	{ 137, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, S3TC, "BC3" },
+	{ 138, GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT, S3TC, "BC3 sRGB" },
+	{ 139, GL_COMPRESSED_RED_RGTC1, RGTC, "BC4" },
+	{ 140, GL_COMPRESSED_SIGNED_RED_RGTC1, RGTC, "BC4 signed" },
+	{ 141, GL_COMPRESSED_RG_RGTC2, RGTC, "BC5" },
+	{ 142, GL_COMPRESSED_SIGNED_RG_RGTC2, RGTC, "BC5 signed" },
+	{ 143, GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT, BPTC, "BC6H" },
+	{ 144, GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT, BPTC, "BC6H signed" },
+	{ 145, GL_COMPRESSED_RGBA_BPTC_UNORM, BPTC, "BC7" },
+	{ 146, GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM, BPTC, "BC7 sRGB" },
+};
+
+const unsigned char ktx2_identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+template <size_t N>
+const Format* findFormat(const Format (&formats)[N], unsigned id)
+{
+	for (size_t i = 0; i < N; i++)
+		if (formats[i].id == id) return &formats[i];
+	return NULL;
+}
+
+//The extension a family needs beyond GL 3.3, NULL when the GL has it
+const char* missingExtension(Family family)
+{
+	if (family == S3TC && !GLEW_EXT_texture_compression_s3tc) return "GL_EXT_texture_compression_s3tc";
+	if (family == BPTC && !GLEW_ARB_texture_compression_bptc) return "GL_ARB_texture_compression_bptc";
+	return NULL; //RGTC is core since 3.0
+}
+
+unsigned readU32(const GLubyte* p)
+{
+	return (unsigned)p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24;
+}
+
+unsigned long long readU64(const GLubyte* p)
+{
+	return readU32(p) | (unsigned long long)readU32(p + 4) << 32;
+}
+
+} // namespace
+
+//---------------------------------------------------------
+bool TextureStream::fail(const std::string& why)
+{
+	error_text = why;
+	close();
+	return false;
+}
+//---------------------------------------------------------
+bool TextureStream::open(const char* path)
+{
+	close();
+	error_text.clear();
+	open_ms = wallTimeMs();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return fail("cannot open the file");
+	file_handle = file;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) return fail("cannot read the file's size, or it is empty");
+	file_size = (size_t)size.QuadPart;
+	mapping_handle = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping_handle != NULL) file_data = (const GLubyte*)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+#else
+	file_descriptor = ::open(path, O_RDONLY);
+	if (file_descriptor < 0) return fail("cannot open the file");
+	struct stat st;
+	if (fstat(file_descriptor, &st) != 0 || st.st_size == 0) return fail("cannot read the file's size, or it is empty");
+	file_size = (size_t)st.st_size;
+	void* mapped = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+	if (mapped != MAP_FAILED) file_data = (const GLubyte*)mapped;
+#endif
+	if (file_data == NULL) return fail("cannot map the file");
+
+	bool parsed;
+	if (file_size >= 4 && memcmp(file_data, "DDS ", 4) == 0) parsed = parseDDS();
+	else if (file_size >= sizeof(ktx2_identifier) && memcmp(file_data, ktx2_identifier, sizeof(ktx2_identifier)) == 0)
+		parsed = parseKTX2();
+	else return fail("neither a DDS nor a KTX2 file");
+	if (!parsed) return false;
+
+	for (int level = 0; level < levels(); level++)
+		if (level_offsets[level] > file_size || level_bytes[level] > file_size - level_offsets[level])
+			return fail("the file is cut short");
+	return true;
+}
+//---------------------------------------------------------
+//Levels of a full mip chain from width x height down to 1 x 1: floor(log2(max(width, height))) + 1
+static unsigned fullChainLevels(int width, int height)
+{
+	unsigned levels = 1;
+	while ((width >> levels) > 0 || (height >> levels) > 0) levels++;
+	return levels;
+}
+//---------------------------------------------------------
+/*
+	"DDS ", then a 124 byte DDS_HEADER: flags at 8, height 12, width 16,
+	depth 24, mip count 28, the pixel format's flags 80 and FourCC 84,
+	caps2 112. FourCC "DX10" adds a 20 byte DDS_HEADER_DXT10: DXGI format
+	128, resource dimension 132, misc flags 136. The levels follow, the
+	largest first.
+*/
+bool TextureStream::parseDDS()
+{
+	if (file_size < 128) return fail("the DDS header is cut short");
+	unsigned flags = readU32(file_data + 8), mip_count = readU32(file_data + 28);
+	unsigned pixel_flags = readU32(file_data + 80), fourcc = readU32(file_data + 84), caps2 = readU32(file_data + 112);
+	base_height = (int)readU32(file_data + 12);
+	base_width = (int)readU32(file_data + 16);
+	if (caps2 & 0x200) return fail("DDS cube maps are not supported");
+	if ((caps2 & 0x200000) && readU32(file_data + 24) > 1) return fail("DDS volume textures are not supported");
+	if (!(pixel_flags & 0x4)) return fail("the DDS file is not block compressed");
+	if (base_width <= 0 || base_height <= 0) return fail("the DDS header has no size");
+	if ((flags & 0x20000) && mip_count > fullChainLevels(base_width, base_height))
+		return fail("the DDS header has more mip levels than its size allows");
+
+	const Format* f;
+	size_t offset = 128;
+	if (fourcc == FOURCC('D', 'X', '1', '0')) {
+		if (file_size < 148) return fail("the DDS DX10 header is cut short");
+		if (readU32(file_data + 132) != 3 || (readU32(file_data + 136) & 0x4)) return fail("the DDS file is no 2D texture");
+		f = findFormat(dxgi_formats, readU32(file_data + 128));
+		offset = 148;
+	}
+	else f = findFormat(fourcc_formats, fourcc);
+	if (f == NULL) return fail("the DDS file's format is no BC format");
+	if (const char* extension = missingExtension(f->family)) return fail(std::string(f->name) + " needs " + extension);
+	gl_format = f->gl;
+	format_name = f->name;
+
+	int count = (flags & 0x20000) && mip_count > 0 ? (int)mip_count : 1;
+	for (int level = 0; level < count; level++) {
+		int w = base_width >> level, h = base_height >> level;
+		size_t bytes = TextureArray::levelBytes(gl_format, w < 1 ? 1 : w, h < 1 ? 1 : h);
+		level_offsets.push_back(offset);
+		level_bytes.push_back(bytes);
+		offset += bytes;
+	}
+	return true;
+}
+//---------------------------------------------------------
+/*
+	The 12 byte identifier, then VkFormat at 12, width 20, height 24,
+	depth 28, layer count 32, face count 36, level count 40, supercompression
+	44, and from 80 the level index: 24 bytes a level, the largest first,
+	of which the first 8 are the level's offset. The file stores the levels
+	themselves the smallest first.
+*/
+bool TextureStream::parseKTX2()
+{
+	if (file_size < 80) return fail("the KTX2 header is cut short");
+	unsigned vk_format = readU32(file_data + 12), depth = readU32(file_data + 28), faces = readU32(file_data + 36);
+	unsigned level_count = readU32(file_data + 40), supercompression = readU32(file_data + 44);
+	base_width = (int)readU32(file_data + 20);
+	base_height = (int)readU32(file_data + 24);
+	if (supercompression != 0) return fail("supercompressed KTX2 files (Basis, Zstd) are not supported");
+	if (faces != 1) return fail("KTX2 cube maps are not supported");
+	if (depth > 0) return fail("KTX2 volume textures are not supported");
+	if (base_height == 0) return fail("1D KTX2 textures are not supported");
+	if (base_width <= 0 || base_height < 0) return fail("the KTX2 header has no size");
+	if (level_count > fullChainLevels(base_width, base_height))
+		return fail("the KTX2 header has more mip levels than its size allows");
+
+	const Format* f = findFormat(vk_formats, vk_format);
+	if (f == NULL) return fail("the KTX2 file's format is no BC format");
+	if (const char* extension = missingExtension(f->family)) return fail(std::string(f->name) + " needs " + extension);
+	gl_format = f->gl;
+	format_name = f->name;
+
+	int count = level_count > 0 ? (int)level_count : 1;
+	if (file_size < 80 + (size_t)count * 24) return fail("the KTX2 level index is cut short");
+	for (int level = 0; level < count; level++) {
+		int w = base_width >> level, h = base_height >> level;
+		unsigned long long offset = readU64(file_data + 80 + level * 24);
+		if (offset > file_size) return fail("the file is cut short");
+		level_offsets.push_back((size_t)offset);
+		level_bytes.push_back(TextureArray::levelBytes(gl_format, w < 1 ? 1 : w, h < 1 ? 1 : h)); //The first layer's
+	}
+	return true;
+}
+//---------------------------------------------------------
+void TextureStream::close()
+{
+	if (reader.joinable()) reader.join();
+	for (size_t i = 0; i < pbos.size(); i++)
+		if (pbos[i] != 0) glDeleteBuffers(1, &pbos[i]); //Unmaps them too
+	pbos.clear();
+	pbo_memory.clear();
+
+#ifdef _WIN32
+	if (file_data != NULL) UnmapViewOfFile(file_data);
+	if (mapping_handle != NULL) CloseHandle(mapping_handle);
+	if (file_handle != NULL) CloseHandle(file_handle);
+	mapping_handle = file_handle = NULL;
+#else
+	if (file_data != NULL) munmap((void*)file_data, file_size);
+	if (file_descriptor >= 0) ::close(file_descriptor);
+	file_descriptor = -1;
+#endif
+	file_data = NULL;
+	file_size = 0;
+
+	gl_format = 0;
+	level_offsets.clear();
+	level_bytes.clear();
+	target = NULL;
+	read_count = 0;
+	uploaded = 0;
+	resident_bytes = 0;
+}
+//---------------------------------------------------------
+void TextureStream::start(TextureArray* array, int layer)
+{
+	target = array;
+	target_layer = layer;
+	int n = levels();
+	pbos.assign(n, 0);
+	pbo_memory.assign(n, (GLubyte*)NULL);
+	glGenBuffers(n, pbos.data());
+	for (int i = 0; i < n; i++) {
+		size_t bytes = level_bytes[n - 1 - i];
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[i]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, GL_STREAM_DRAW);
+		pbo_memory[i] = (GLubyte*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	reader = std::thread([this, n]() {
+		for (int i = 0; i < n; i++) {
+			int level = n - 1 - i;
+			if (pbo_memory[i] != NULL) memcpy(pbo_memory[i], file_data + level_offsets[level], level_bytes[level]);
+			read_count = i + 1;
+		}
+	});
+}
+//---------------------------------------------------------
+bool TextureStream::poll(bool wait)
+{
+	if (target == NULL || finished()) return finished();
+	if (wait && reader.joinable()) reader.join();
+
+	int n = levels(), ready = read_count;
+	for (; uploaded < ready; uploaded++) {
+		int level = n - 1 - uploaded;
+		bool from_pbo = false;
+		if (pbo_memory[uploaded] != NULL) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[uploaded]);
+			from_pbo = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE; //False when the memory was lost meanwhile
+			if (from_pbo) target->setCompressedLevel(target_layer, level, (const void*)0, level_bytes[level]);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		if (!from_pbo) target->setCompressedLevel(target_layer, level, file_data + level_offsets[level], level_bytes[level]);
+		glDeleteBuffers(1, &pbos[uploaded]);
+		pbos[uploaded] = 0;
+		resident_bytes += level_bytes[level];
+		if (uploaded == 0) first_level_ms = wallTimeMs() - open_ms;
+	}
+	if (finished()) {
+		all_levels_ms = wallTimeMs() - open_ms;
+		if (reader.joinable()) reader.join();
+	}
+	return finished();
+}
+//---------------------------------------------------------
+size_t TextureStream::rgba8Bytes() const
+{
+	size_t bytes = 0;
+	for (int level = 0; level < levels(); level++) {
+		int w = base_width >> level, h = base_height >> level;
+		bytes += (size_t)(w < 1 ? 1 : w) * (h < 1 ? 1 : h) * 4;
+	}
+	return bytes;
+}
@@ -0,0 +1,104 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- TextureStream.h ---
+//
+//   A block compressed texture file (BC1 to BC7) streamed into a layer of
+//   a TextureArray, its smallest mip level first, so a blurry texture
+//   shows within a frame and sharpens as the larger levels arrive.
+//
+//   Files:
+//     DDS   with a DXT1/3/5, ATI1/2, BC4U/BC5U or DX10 (BC1 to BC7) format;
+//           the first element of an array, no cube maps or volumes
+//     KTX2  with a BC VkFormat and no supercompression (Basis, Zstd); the
+//           first layer
+//   Levels stay compressed all the way to the GPU: a BC1 level takes an
+//   eighth of its RGBA8 size, BC2 to BC7 a quarter.
+//
+//   The file is memory-mapped, and an I/O thread of the stream's own copies
+//   each level from the mapping into a pixel buffer object (PBO) the GL
+//   thread mapped for it, so the page faults that read the file land on
+//   that thread. A DDS file stores the largest level first, so the mapping
+//   is what lets the stream read it smallest first. Each frame, poll()
+//   unmaps the PBOs filled since, uploads from them, and reports the
+//   largest level uploaded: the array's base level until the rest arrive.
+//
+//   Usage:
+//       stream.open(path);  array.init(unit, stream.width(), stream.height(), 1, stream.levels(), stream.format());
+//       stream.start(&array, 0);
+//       ... every frame: stream.poll(false);  array.setBaseLevel(stream.residentLevel());
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __TEXTURESTREAM_H__
+#define __TEXTURESTREAM_H__
+
+#include "Angel-yjc.h"
+#include "TextureArray.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TextureStream {
+public:
+	~TextureStream() { close(); }
+
+	//Maps the file and reads its header; false, with error() saying why, for a file this cannot stream
+	//or a format the GL lacks. Needs the GL context
+	bool open(const char* path);
+	void close();
+	bool isOpen() const { return file_data != NULL; }
+	const std::string& error() const { return error_text; }
+
+	GLenum format() const { return gl_format; }
+	const char* formatName() const { return format_name; }
+	int width() const { return base_width; }
+	int height() const { return base_height; }
+	int levels() const { return (int)level_bytes.size(); }
+
+	//Maps a PBO per level and starts the I/O thread; array must match format(), the sizes and levels()
+	void start(TextureArray* array, int layer);
+	//Uploads the levels read since the last poll, or waits for and uploads all of them; true when every level is uploaded
+	bool poll(bool wait);
+	bool finished() const { return uploaded == levels(); }
+
+	//The largest level uploaded, levels() before the first
+	int residentLevel() const { return levels() - uploaded; }
+	size_t residentBytes() const { return resident_bytes; }
+	size_t rgba8Bytes() const; //All the levels uncompressed, for comparison
+
+	double firstLevelMs() const { return first_level_ms; } //From open() to the first upload
+	double allLevelsMs() const { return all_levels_ms; }   //From open() to the last upload
+
+private:
+	bool parseDDS();
+	bool parseKTX2();
+	bool fail(const std::string& why);
+
+	std::string error_text;
+	const GLubyte* file_data = NULL;
+	size_t file_size = 0;
+#ifdef _WIN32
+	void* file_handle = NULL;
+	void* mapping_handle = NULL;
+#else
+	int file_descriptor = -1;
+#endif
+
+	GLenum gl_format = 0;
+	const char* format_name = "";
+	int base_width = 0, base_height = 0;
+	std::vector<size_t> level_offsets, level_bytes; //Level 0 (the largest) first
+
+	TextureArray* target = NULL;
+	int target_layer = 0;
+	std::vector<GLuint> pbos;            //Level i's at levels() - 1 - i: smallest first, the order they are read
+	std::vector<GLubyte*> pbo_memory;    //Their mappings; NULL where mapping failed, to upload from the file instead
+	std::thread reader;
+	std::atomic<int> read_count { 0 }; //Levels copied into their PBOs, smallest first
+	int uploaded = 0;
+	size_t resident_bytes = 0;
+	double open_ms = 0.0, first_level_ms = 0.0, all_levels_ms = 0.0;
+};
+
+#endif // __TEXTURESTREAM_H__
@@ -0,0 +1,99 @@
+#include "ThreadPool.h"
+#include "Profiler.h"
+#include <string>
+
+ThreadPool& ThreadPool::instance()
+{
+	static ThreadPool pool;
+	return pool;
+}
+//---------------------------------------------------------
+ThreadPool::ThreadPool(int threads)
+{
+	if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+	if (threads <= 0) threads = 1;
+
+	next_task = 0;
+	busy = 0;
+	for (int i = 1; i < threads; i++)
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+//---------------------------------------------------------
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+//---------------------------------------------------------
+//Takes tasks until none are left
+void ThreadPool::drain(int thread)
+{
+	int task;
+	while ((task = next_task++) < job_tasks)
+		(*job)(task, thread);
+}
+//---------------------------------------------------------
+void ThreadPool::workerLoop(int index)
+{
+	profilerSetThreadName(("worker " + std::to_string(index)).c_str());
+	unsigned long seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return quit || generation != seen; });
+			if (quit) return;
+			seen = generation;
+		}
+
+		drain(index);
+
+		if (--busy == 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			done.notify_one();
+		}
+	}
+}
+//---------------------------------------------------------
+void ThreadPool::run(int tasks, const std::function<void(int, int)>& fn)
+{
+	if (tasks <= 0) return;
+	if (workers.empty() || tasks == 1) {
+		for (int i = 0; i < tasks; i++) fn(i, 0);
+		return;
+	}
+
+	std::lock_guard<std::mutex> serialize(caller_mutex);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &fn;
+		job_tasks = tasks;
+		next_task = 0;
+		busy = (int)workers.size();
+		generation++;
+	}
+	wake.notify_all();
+
+	drain(0);
+
+	//Every worker checks in once per generation, even if it found no task left
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&] { return busy == 0; });
+	job = NULL;
+}
+//---------------------------------------------------------
+void ThreadPool::parallelFor(int count, const std::function<void(int, int, int)>& fn, int chunks)
+{
+	if (count <= 0) return;
+	if (chunks <= 0) chunks = size();
+	if (chunks > count) chunks = count;
+
+	run(chunks, [&](int chunk, int) {
+		int begin = (int)((long long)count * chunk / chunks);
+		int end = (int)((long long)count * (chunk + 1) / chunks);
+		fn(begin, end, chunk);
+	});
+}
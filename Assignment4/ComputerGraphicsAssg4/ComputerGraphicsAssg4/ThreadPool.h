@@ -0,0 +1,55 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- ThreadPool.h ---
+//
+//   A fixed set of worker threads (one per core, the calling thread counts
+//   as one) shared by the CPU-side subsystems. Jobs are fork-join: the call
+//   returns once every task has run. Calls from a task back into the pool
+//   are not supported; concurrent callers are serialized.
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+	//The process-wide pool, sized to std::thread::hardware_concurrency()
+	static ThreadPool& instance();
+
+	explicit ThreadPool(int threads = 0);
+	~ThreadPool();
+
+	//Number of threads that run tasks, including the caller
+	int size() const { return (int)workers.size() + 1; }
+
+	//Runs fn(task, thread) for every task in [0, tasks), handed out dynamically
+	void run(int tasks, const std::function<void(int, int)>& fn);
+
+	//Splits [0, count) into `chunks` contiguous ranges (size() if 0) and runs
+	//fn(begin, end, chunk) on each; chunk boundaries depend only on count and chunks
+	void parallelFor(int count, const std::function<void(int, int, int)>& fn, int chunks = 0);
+
+private:
+	void workerLoop(int index);
+	void drain(int thread);
+
+	std::vector<std::thread> workers;
+	std::mutex caller_mutex, mutex;
+	std::condition_variable wake, done;
+
+	const std::function<void(int, int)>* job = NULL;
+	int job_tasks = 0;
+	unsigned long generation = 0;
+	std::atomic<int> next_task, busy;
+	bool quit = false;
+};
+
+#endif // __THREADPOOL_H__
@@ -0,0 +1,66 @@
+#include "Timing.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+
+static bool fixed_clock = false;
+static double fixed_step = 0.0, fixed_time = 0.0;
+
+//---------------------------------------------------------
+double wallTimeMs()
+{
+	static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+//---------------------------------------------------------
+double simTimeMs()
+{
+	return fixed_clock ? fixed_time : wallTimeMs();
+}
+//---------------------------------------------------------
+void useFixedClock(double step_ms)
+{
+	fixed_clock = true;
+	fixed_step = step_ms;
+	fixed_time = 0.0;
+}
+//---------------------------------------------------------
+void advanceFixedClock()
+{
+	fixed_time += fixed_step;
+}
+//---------------------------------------------------------
+bool fixedClock()
+{
+	return fixed_clock;
+}
+//---------------------------------------------------------
+double TimingSeries::min() const
+{
+	return samples.empty() ? 0.0 : *std::min_element(samples.begin(), samples.end());
+}
+//---------------------------------------------------------
+double TimingSeries::max() const
+{
+	return samples.empty() ? 0.0 : *std::max_element(samples.begin(), samples.end());
+}
+//---------------------------------------------------------
+double TimingSeries::average() const
+{
+	if (samples.empty()) return 0.0;
+
+	double sum = 0.0;
+	for (size_t i = 0; i < samples.size(); i++) sum += samples[i];
+	return sum / samples.size();
+}
+//---------------------------------------------------------
+double TimingSeries::percentile(double p) const
+{
+	if (samples.empty()) return 0.0;
+
+	std::vector<double> sorted(samples);
+	int rank = (int)ceil(p / 100.0 * sorted.size()) - 1;
+	rank = std::max(0, std::min(rank, (int)sorted.size() - 1));
+	std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+	return sorted[rank];
+}
@@ -0,0 +1,47 @@
+//////////////////////////////////////////////////////////////////////////////
+//
+//  --- Timing.h ---
+//
+//   Clocks and timing statistics.
+//
+//   wallTimeMs() is a monotonic clock for measuring costs. simTimeMs() is the
+//   clock that drives the animation: it follows wall time by default, but can
+//   be switched to a fixed step per frame so runs are reproducible (headless
+//   benchmarks, input replay).
+//
+//////////////////////////////////////////////////////////////////////////////
+
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <vector>
+
+//Milliseconds since the first call, from a monotonic clock
+double wallTimeMs();
+
+//Milliseconds of simulated time
+double simTimeMs();
+
+//Switches simTimeMs() to advance only by step_ms per advanceFixedClock() call
+void useFixedClock(double step_ms);
+void advanceFixedClock();
+bool fixedClock();
+
+//A series of samples (e.g. frame times) with order statistics
+class TimingSeries {
+public:
+	void add(double v) { samples.push_back(v); }
+	void clear() { samples.clear(); }
+	int count() const { return (int)samples.size(); }
+	const std::vector<double>& values() const { return samples; }
+
+	double min() const;
+	double max() const;
+	double average() const;
+	double percentile(double p) const; // p in [0, 100], nearest rank
+
+private:
+	std::vector<double> samples;
+};
+
+#endif // __TIMING_H__
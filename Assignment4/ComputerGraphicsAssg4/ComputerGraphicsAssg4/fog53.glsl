@@ -0,0 +1,30 @@
+/*
+File Name: "fog53.glsl":
+Fog, included by fshader53.glsl and by the resolve of fshaderDeferred.glsl:
+  - Fog mode 0: none, 1: linear, 2: exponential, 3: exponential square.
+  - z is the distance along the view direction (eye frame -z).
+*/
+
+const vec4 fogColor = vec4(0.7, 0.7, 0.7, 0.5);
+
+// Weight of the surface color against fogColor
+float fogFactorAt(int mode, float z)
+{
+	float factor = 1.0;
+
+	// Linear
+	if (mode == 1){
+		float fogStart = 0.0, fogEnd = 18.0;
+		factor = (fogEnd - z) / (fogEnd - fogStart);
+	}
+	// Exponential
+	else if (mode == 2){
+		float density = 0.09;
+		factor = exp(-density * z);
+	}
+	else if (mode == 3){
+		float density = 0.09;
+		factor = exp(-pow(density * z, 2));
+	}
+	return clamp(factor, 0.0, 1.0);
+}
@@ -1,34 +1,85 @@
 /* 
 File Name: "fshader53.glsl":
            Fragment Shader
+  - Compiled with PER_PIXEL, lights each pixel with light53.glsl from the
+    interpolated eye frame position and normal.
+  - With gbuffer_write, stores the surface for the deferred lights instead:
+    fColor holds what is not lit (the global ambient, or the whole color of
+    an unlit surface), the other outputs its lit material and where it is.
+    Fog is left to the resolve. Lit surfaces need the PER_PIXEL build.
 */
 
-// #version 150  // YJC: Comment/un-comment this line to resolve compilation errors
+#version 150  // YJC: Comment/un-comment this line to resolve compilation errors
                  //      due to different settings of the default GLSL version
 
 in  vec4 color;
 flat in int fFog;
 in vec2 fTexCoord;
-in float fTexCoord1D;
 in vec4 fPosition;
 in float fZ;
 out vec4 fColor;
 
-uniform sampler2D texture_2D; /* Note: If using multiple textures,
-                                       each texture must be bound to a
-                                       *different texture unit*, with the
-                                       sampler uniform var set accordingly.
-                                 The (fragment) shader can access *all texture units*
-                                 simultaneously.
-                              */
-uniform sampler1D texture_1D; 
+// G-buffer, draw buffers 1 to 4 (fColor is the first); all zero where nothing was drawn
+uniform bool gbuffer_write;
+out vec4 gDiffuse;  // material diffuse color, tint and texture
+out vec4 gSpecular; // material specular color, tint and texture
+out vec4 gPosition; // eye frame; w: 1 where covered
+out vec4 gNormal;   // eye frame; w: Shininess, 0 where unlit
+
+uniform sampler2DArray textures; // every material's texture, one layer each
+uniform int texture_layer;
+uniform sampler2DArray image_textures; // the loaded image files, one layer each
+uniform bool texture_image;            // sample image_layer of them instead
+uniform int image_layer;
 uniform int texture_flag;
-uniform int texture_Dimension;
 uniform bool sphere;
 
 uniform bool lattice_on;
 in vec2 fLatticCoord;
 
+uniform bool shadow_mask_on;     // floor: shade the shadows from the cached mask
+uniform sampler2D shadow_mask;
+uniform vec4 shadow_mask_bounds; // floor x, z of the mask's corner, then 1 / its extent
+uniform vec4 shadow_mask_color;  // alpha below 1: blended over the floor
+uniform bool shadow_mask_write;  // drawing the shadows into the mask: coverage only
+in vec2 fFloorXZ;
+
+uniform sampler2DArrayShadow shadow_maps;
+uniform mat4 shadow_matrix[4 + 1];  // per layer: eye position to map coordinates and depth
+uniform int shadow_cascades;
+uniform vec4 shadow_splits;         // far view depth of each cascade
+uniform float shadow_offset[4 + 1]; // normal offset against acne; for the last layer per unit of distance to the light
+uniform bool shadow_local_on;
+uniform float shadow_texel;
+uniform int shadow_pcf;             // (2 * shadow_pcf + 1)^2 filtered lookups
+in vec4 fDirect[2];
+in vec3 fNormal;
+
+uniform sampler2D lightmap;         // floor, with lightmap_on: light 1's ambient and diffuse, baked per texel
+uniform vec4 lightmap_bounds;       // floor x, z of the map's corner, then 1 / its extent
+
+// shadow_maps_on: light 0 shadowed by the cascades, light 1 by the last layer
+#include "light53.glsl"
+#include "fog53.glsl"
+
+// Fraction of the PCF footprint around the point that the light reaches
+float shadowVisibility(int layer, vec3 pos)
+{
+	vec4 p = shadow_matrix[layer] * vec4(pos, 1.0);
+	if (p.w <= 0.0) return 1.0;
+	vec3 map = p.xyz / p.w;
+	if (any(lessThan(map, vec3(0.0))) || any(greaterThan(map, vec3(1.0)))) return 1.0;
+
+	float lit = 0.0;
+	for (int y = -shadow_pcf; y <= shadow_pcf; y++){
+		for (int x = -shadow_pcf; x <= shadow_pcf; x++){
+			lit += texture( shadow_maps, vec4(map.xy + vec2(x, y) * shadow_texel, float(layer), map.z - 0.0005) );
+		}
+	}
+	float taps = float(2 * shadow_pcf + 1);
+	return lit / (taps * taps);
+}
+
 void main() 
 { 
 
@@ -36,46 +87,103 @@ void main()
 	if (sphere && lattice_on && fract(4 * fLatticCoord.x) < 0.35 && fract(4 * fLatticCoord.y) < 0.35){
 		discard;
 	}
+	if (shadow_mask_write){
+		fColor = vec4(1.0);
+		return;
+	}
 
 	//Fog Options
-	 vec4 fogColor = vec4(0.7, 0.7, 0.7, 0.5);
-	 float fogFactor = 1.0;
+	float fogFactor = fogFactorAt(fFog, fZ);
 
-	 // Linear
-	if (fFog == 1){
-		float fogStart = 0.0, fogEnd = 18.0;
-		fogFactor = (fogEnd - fZ) / (fogEnd - fogStart);
+	//Textures
+	vec4 texColor = vec4(1.0);
+	if (texture_flag != 0){
+		if (texture_image){
+			texColor = texture( image_textures, vec3(fTexCoord, image_layer) );
+		}
+		else{
+			texColor = texture( textures, vec3(fTexCoord, texture_layer) );
+			if (sphere && texColor.x == 0){ // the checker's green squares; the stripe has none
+				texColor = vec4(0.9, 0.1, 0.1, 1.0);
+			}
+		}
 	}
-	// Exponential
-	else if (fFog == 2){
-		float density = 0.09;
-		fogFactor = exp(-density * fZ);
+
+	//Shadows from the mask: how much of the floor color the shadow color replaces
+	vec4 shadowColor;
+	float shadowed = 0.0;
+	if (shadow_mask_on){
+		float covered = texture( shadow_mask, (fFloorXZ - shadow_mask_bounds.xy) * shadow_mask_bounds.zw ).r;
+		shadowColor = mix(fogColor, shadow_mask_color, fogFactor);
+		float opacity = shadow_mask_color.a < 1.0 ? shadowColor.a : 1.0;
+		shadowed = covered * opacity;
 	}
-	else if (fFog == 3){
-		float density = 0.09;
-		fogFactor = exp(-pow(density * fZ, 2));
+
+	if (gbuffer_write){
+		//Alpha fogged as in the forward path, so a blended shadow weighs the same; blending and fog are both mixes, so
+		//the resolve fogging the blend gives the blend of the fogged colors
+		float alpha = mix(fogColor.a, color.a * texColor.a, fogFactor);
+		vec4 emissive = color * texColor;
+		gDiffuse = gSpecular = gNormal = vec4(0.0);
+		if (lighting){
+			emissive *= GlobalAmbientProduct;
+			gDiffuse = color * MaterialDiffuse * texColor;
+			gSpecular = color * MaterialSpecular * texColor;
+			gNormal = vec4(normalize(fNormal), Shininess);
+		}
+		emissive = mix(emissive, shadow_mask_color, shadowed);
+		fColor = vec4(emissive.rgb, alpha);
+		gDiffuse = vec4(gDiffuse.rgb * (1.0 - shadowed), alpha);
+		gSpecular = vec4(gSpecular.rgb * (1.0 - shadowed), alpha);
+		gPosition = vec4(fPosition.xyz / fPosition.w, 1.0); // The shadows' w is not 1
+		return;
 	}
-	fogFactor = clamp(fogFactor, 0.0, 1.0);
 
-	//Textures
-	vec4 textureColor = vec4(0.0, 0.0, 0.0, 1.0);
-	if (texture_flag == 0){
-		textureColor = color;
+	//Baked light, part of light 1 like the rest of it
+	vec4 baked = vec4(0.0);
+	if (lightmap_on){
+		baked = vec4(texture( lightmap, (fFloorXZ - lightmap_bounds.xy) * lightmap_bounds.zw ).rgb, 0.0);
 	}
-	else {
-		if (texture_Dimension == 2){
-			vec4 texColor = texture( texture_2D, fTexCoord );
-			if (sphere && texColor.x == 0){
-				texColor = vec4(0.9, 0.1, 0.1, 1.0);
-			}
 
-			textureColor = color * texColor;
+	//The lighting of the vertex shader, or the same per pixel; the tint of a sphere's material arrives as the color
+	vec4 lit = color;
+	vec4 direct[2] = vec4[2](fDirect[0], fDirect[1]);
+#ifdef PER_PIXEL
+	if (lighting){
+		lit = color * shadeLights(fPosition.xyz, normalize(fNormal), direct);
+		direct[0] *= color;
+		direct[1] *= color;
+	}
+#endif
+
+	//Shadow maps: the direct light that reaches the point
+	if (shadow_maps_on){
+		vec3 N = normalize(fNormal);
+		int cascade = 0;
+		while (cascade < shadow_cascades && fZ > shadow_splits[cascade]) cascade++;
+		if (cascade < shadow_cascades){
+			lit += shadowVisibility(cascade, fPosition.xyz + N * shadow_offset[cascade]) * direct[0];
 		}
-		else if (texture_Dimension == 1){
-			textureColor = color * texture( texture_1D, fTexCoord1D );
+		else {
+			lit += direct[0];
 		}
+		if (shadow_local_on){
+			float distance = length(LightPosition[1].xyz - fPosition.xyz);
+			lit += shadowVisibility(shadow_cascades, fPosition.xyz + N * shadow_offset[shadow_cascades] * distance) * (direct[1] + baked);
+		}
+		else {
+			lit += direct[1] + baked;
+		}
+	}
+	else {
+		lit += baked;
 	}
 
+	vec4 textureColor = lit * texColor;
 	fColor = mix(fogColor, textureColor, fogFactor);
-} 
 
+	//Fogged like the floor under it and, when blended, weighted by its fogged alpha, as a drawn shadow would be
+	if (shadow_mask_on){
+		fColor = vec4(mix(fColor.rgb, shadowColor.rgb, shadowed), fColor.a);
+	}
+} 
@@ -0,0 +1,69 @@
+/* 
+File Name: "fshaderDeferred.glsl":
+           Fragment Shader
+  - The lights over the G-buffer, added to its color target: a scene light
+    with processLight(), an extra light with processExtraLight(), the
+    products formed here from the materials stored per pixel. A light's
+    ambient term is not added (the scene's lights have none); the global
+    ambient is already in the color target.
+  - The resolve: the color target fogged as in fshader53.glsl, and the
+    depth, into the framebuffer bound.
+*/
+
+#version 150  // YJC: Comment/un-comment this line to resolve compilation errors
+                 //      due to different settings of the default GLSL version
+
+flat in int fLight;
+out vec4 fColor;
+
+uniform int deferred_pass; // 0: a scene light, 1: the extra lights, one per instance, 2: the resolve
+uniform int light_index;   // The scene light of pass 0
+uniform int Fog;
+
+// The G-buffer, by GBuffer's targets
+uniform sampler2D gbuffer_color;
+uniform sampler2D gbuffer_diffuse;
+uniform sampler2D gbuffer_specular;
+uniform sampler2D gbuffer_position;
+uniform sampler2D gbuffer_normal;
+uniform sampler2D gbuffer_depth;
+
+// The light's colors as its products: a white material
+#include "light53.glsl"
+#include "fog53.glsl"
+
+void main() 
+{ 
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	gl_FragDepth = gl_FragCoord.z;
+
+	// Nothing drawn: the clear color stays
+	vec4 position = texelFetch(gbuffer_position, texel, 0);
+	if (position.w == 0.0){
+		discard;
+	}
+	position /= position.w;
+
+	if (deferred_pass == 2){
+		vec4 color = texelFetch(gbuffer_color, texel, 0);
+		fColor = vec4(mix(fogColor.rgb, color.rgb, fogFactorAt(Fog, -position.z)), color.a);
+		gl_FragDepth = texelFetch(gbuffer_depth, texel, 0).r;
+		return;
+	}
+
+	vec4 normal = texelFetch(gbuffer_normal, texel, 0);
+	if (normal.w == 0.0){
+		discard; // Unlit
+	}
+	vec3 N = normalize(normal.xyz);
+	vec3 E = normalize(-position.xyz);
+
+	vec4 diffuse, specular;
+	if (deferred_pass == 0){
+		processLight(light_index, position.xyz, E, N, normal.w, diffuse, specular);
+	}
+	else {
+		processExtraLight(fLight, position.xyz, E, N, normal.w, diffuse, specular);
+	}
+	fColor = vec4((diffuse * texelFetch(gbuffer_diffuse, texel, 0) + specular * texelFetch(gbuffer_specular, texel, 0)).rgb, 0.0);
+} 
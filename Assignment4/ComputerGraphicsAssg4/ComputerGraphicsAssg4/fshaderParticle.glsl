@@ -1,22 +1,25 @@
 /* 
-File Name: "fshader53.glsl":
+File Name: "fshaderParticle.glsl":
            Fragment Shader
 */
 
-// #version 150  // YJC: Comment/un-comment this line to resolve compilation errors
+#version 150  // YJC: Comment/un-comment this line to resolve compilation errors
                  //      due to different settings of the default GLSL version
 
 in vec4 color;
 in float objPositionY;
+in vec2 fCorner;
 out vec4 fColor;
 
+uniform bool cull_below_floor;
+
 void main() 
 { 
 
-	if (objPositionY < 0.1){
+	//Round the quad off; ballistic particles are not collided, so hide them below the floor
+	if ((cull_below_floor && objPositionY < 0.1) || dot(fCorner, fCorner) > 0.25){
 		discard;
 	}
 
 	fColor = color;
 } 
-
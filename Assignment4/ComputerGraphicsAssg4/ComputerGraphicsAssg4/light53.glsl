@@ -0,0 +1,201 @@
+/*
+File Name: "light53.glsl":
+Lighting, included by vshader53.glsl (per vertex) and by fshader53.glsl
+(per fragment, when compiled with PER_PIXEL):
+  - Up to two lights: ambient, directional, point or spot.
+  - Any number of extra point lights from a texture buffer, each reaching
+    a radius; also read by the light volumes of fshaderDeferred.glsl.
+  - Entire shading computation is done in the Eye Frame.
+*/
+
+#define PI 3.1415926535897932384626433832795
+
+// With shadow maps the fragment shader adds each light's diffuse and specular, scaled by its visibility
+uniform bool shadow_maps_on;
+
+// The floor's lightmap holds light 1's ambient and diffuse terms
+uniform bool lightmap_on;
+
+uniform bool lighting;
+uniform int LightCount;
+
+uniform vec4 GlobalAmbientProduct; // single
+uniform vec4 AmbientProduct[2 * 4], DiffuseProduct[2 * 4], SpecularProduct[2 * 4]; //array by lights
+
+uniform vec4 LightPosition[2 * 4];   // array by lights
+uniform vec3 LightDirection[2 * 3];   // array by lights
+uniform int LightType[2]; // array by lights
+
+uniform float Cutoff[2]; // Exclusive to Spotlights, array by lights in degree
+uniform float Exponent[2]; // Exclusive to Spotlights, array by lights
+
+uniform float ConstAtt[2];  // Constant Attenuation, array by lights
+uniform float LinearAtt[2]; // Linear Attenuation, array by lights
+uniform float QuadAtt[2];   // Quadratic Attenuation, array by lights
+
+uniform float Shininess; // Single
+
+// Extra point lights, two texels each: eye frame position and radius, then color; they have no ambient term
+uniform samplerBuffer ExtraLights;
+uniform int ExtraLightCount;
+uniform vec4 MaterialDiffuse, MaterialSpecular; // The products of the extra lights are formed here
+
+//Forward Declaration
+vec4 processLight(int i, vec3 pos, vec3 E, vec3 N, float shininess, out vec4 diffuse, out vec4 specular); // i: Light index; pos: vertex position; E: unit vector from point towards viewer; N: unit normal; returns the ambient term, all three attenuated
+void processExtraLight(int j, vec3 pos, vec3 E, vec3 N, float shininess, out vec4 diffuse, out vec4 specular); // The light's color, not products
+
+// Global ambient plus each light's ambient at pos (eye frame) with unit normal N; each light's diffuse and
+// specular go to direct[] with shadow maps, which scale them by the light's visibility, else into the sum
+vec4 shadeLights(vec3 pos, vec3 N, out vec4 direct[2])
+{
+	vec3 E = normalize( -pos );
+	vec4 color = GlobalAmbientProduct;
+	direct[0] = direct[1] = vec4(0.0);
+
+	for (int i = 0; i < LightCount; i++){
+		vec4 diffuse, specular;
+		vec4 ambient = processLight(i, pos, E, N, Shininess, diffuse, specular);
+		if (lightmap_on && i == 1){
+			ambient = diffuse = vec4(0.0);
+		}
+		color += ambient;
+
+		if (shadow_maps_on) direct[i] = diffuse + specular;
+		else color += diffuse + specular;
+	}
+
+	// Unshadowed
+	for (int j = 0; j < ExtraLightCount; j++){
+		vec4 diffuse, specular;
+		processExtraLight(j, pos, E, N, Shininess, diffuse, specular);
+		color += diffuse * MaterialDiffuse + specular * MaterialSpecular;
+	}
+	return color;
+}
+
+void processExtraLight(int j, vec3 pos, vec3 E, vec3 N, float shininess, out vec4 diffuse, out vec4 specular){
+	vec4 light = texelFetch(ExtraLights, 2 * j);
+	vec4 lightColor = texelFetch(ExtraLights, 2 * j + 1);
+
+	vec3 D = light.xyz - pos;
+	float dist = length(D);
+	vec3 L = D / dist;
+	vec3 H = normalize( L + E );
+
+	// Falls to zero at the radius, so the light's volume bounds everything it lights
+	float falloff = max(1.0 - dist / light.w, 0.0);
+	float attenuation = falloff * falloff;
+
+	float d = max( dot(L, N), 0.0 );
+	diffuse = attenuation * d * lightColor;
+	specular = vec4(0.0);
+	if (d > 0.0){
+		specular = attenuation * pow( max(dot(N, H), 0.0), shininess ) * lightColor;
+	}
+}
+
+vec4 processLight(int i, vec3 pos, vec3 E, vec3 N, float shininess, out vec4 diffuse, out vec4 specular){
+	float attenuation;
+	vec4 ambient;
+
+	if (LightType[i] == 0) //Ambient
+	{
+		diffuse = specular = vec4(0.0);
+		return AmbientProduct[i];
+	}
+
+	else if (LightType[i] == 1) //Directional
+	{
+		// If directional light, then light direction stores direction in eye frame
+		vec3 L = -1 * LightDirection[i];
+		vec3 H = normalize( L + E ); //vec3 N = normalize( model_view*vec4(vNormal, 0.0) ).xyz;
+
+		attenuation = 1.0;
+
+		// Compute terms in the illumination equation
+		ambient = AmbientProduct[i];
+
+		float d = max( dot(L, N), 0.0 );
+		diffuse = d * DiffuseProduct[i];
+
+		float s = pow( max(dot(N, H), 0.0), shininess );
+		specular = s * SpecularProduct[i];
+
+		if( dot(L, N) < 0.0 ) {
+			specular = vec4(0.0, 0.0, 0.0, 1.0);
+		}
+	}
+
+	else if (LightType[i] == 2) //Point Light
+	{
+		//Light position expressed already in eye frame (in Setup light)
+		vec3 LP = LightPosition[i].xyz;
+		vec3 D = LP - pos;
+		vec3 L = normalize( D );
+		vec3 H = normalize( L + E ); //Half-way vector
+
+		float dist = length(D);
+		attenuation = 1 / (ConstAtt[i] + LinearAtt[i] * dist + QuadAtt[i] * pow(dist, 2));
+
+		// Compute terms in the illumination equation
+		ambient = AmbientProduct[i];
+
+		float d = max( dot(L, N), 0.0 );
+		diffuse = d * DiffuseProduct[i];
+
+		float s = pow( max(dot(N, H), 0.0), shininess );
+		specular = s * SpecularProduct[i];
+
+		if( dot(L, N) < 0.0 ) {
+			specular = vec4(0.0, 0.0, 0.0, 1.0);
+		}
+	}
+
+	else if (LightType[i] == 3) //Spotlight
+	{
+		//Light position expressed already in eye frame (in Setup light)
+		vec3 LP = LightPosition[i].xyz;
+		vec3 D = LP - pos;
+		vec3 L = normalize( D );
+		vec3 H = normalize( L + E ); //Half-way vector
+
+		float dist = length(D);
+		attenuation = 1 / (ConstAtt[i] + LinearAtt[i] * dist + QuadAtt[i] * pow(dist, 2));
+
+		// Compute terms in the illumination equation
+		ambient = AmbientProduct[i];
+
+		float d = max( dot(L, N), 0.0 );
+		diffuse = d * DiffuseProduct[i];
+
+		float s = pow( max(dot(N, H), 0.0), shininess );
+		specular = s * SpecularProduct[i];
+
+		if( dot(L, N) < 0.0 ) {
+			specular = vec4(0.0, 0.0, 0.0, 1.0);
+		}
+
+		// Find spotlight center focus (Lf)
+
+		//The below is WRONG, model_view is of the sphere, not of the camera
+		//vec3 Lf = normalize((model_view * LightFocus).xyz - LP); // LightDirection is the spot light focal position
+
+		vec3 Lf = normalize(LightDirection[i].xyz - LP); // LightDirection is the spot light focal position
+
+		// Find cosine of Lf and -l, and cosine of cutoff in radian
+		float Lfl = dot(Lf, -L);
+		float cut = cos(Cutoff[i] * PI / 180.0);
+
+		if (Lfl < cut){
+			attenuation = 0;
+		}
+		else {
+			attenuation = attenuation * pow(Lfl, Exponent[i]);
+		}
+
+	}
+
+	diffuse *= attenuation;
+	specular *= attenuation;
+	return attenuation * ambient;
+}
@@ -25,10 +25,46 @@
 #endif
 
 #include "Angel-yjc.h"
+#include "ParticleSystem.h"
+#include "StreamBuffer.h"
+#include "SpatialGrid.h"
+#include "ThreadPool.h"
+#include "Timing.h"
+#include "Headless.h"
+#include "SoftRasterizer.h"
+#include "RayTracer.h"
+#include "Profiler.h"
+#include "GpuTimer.h"
+#include "InputLog.h"
+#include "RenderQueue.h"
+#include "ShadowMask.h"
+#include "ShadowMaps.h"
+#include "Lightmap.h"
+#include "GBuffer.h"
+#include "MipChain.h"
+#include "ProceduralTexture.h"
+#include "TextureArray.h"
+#include "TextureStream.h"
+#include "FrameCapture.h"
+#include "Regression.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fstream>
 #include <iostream>
 #include <math.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#ifdef _WIN32
+#include <direct.h>
+#define chdir _chdir
+#else
+#include <unistd.h>
+#endif
+#include "GLStats.h" //Last: it redirects GL calls to its counting wrappers
 
 #define pi 3.1415926535
 
@@ -43,10 +79,34 @@ GLubyte Image[ImageHeight][ImageWidth][4];
 #define	stripeImageWidth 32
 GLubyte stripeImage[4 * stripeImageWidth];
 
-GLuint textures[2];
+//Every material's texture, a layer each of one array on unit 0; a material names its layer in texture_layer
+enum { LayerGround, LayerStripe, LayerCount };
+TextureArray textures;
+
+//--ground-image, --sphere-image: DDS or KTX2 files streamed into image_textures (unit 1), a layer each, in place of
+//the ground texture and the sphere's checkerboard. One array, so the second file must match the first's format and size
+enum { ImageGround, ImageSphere, ImageCount };
+const char* image_files[ImageCount] = { NULL, NULL };
+TextureStream image_streams[ImageCount];
+int image_layers[ImageCount] = { -1, -1 }; //-1: none
+int image_base_level = -1;                //The largest level every layer has, -1 before they all have one
+TextureArray image_textures;
 bool checker_ground = true;
 int sphere_texture_flag = 0; //0: No, 1: lines, 2: checker
 bool sphere_texture_dir = false, sphere_texture_space = false; //dir - 0: vertical, 1: slanted -- space - 0: object space, 1: eye space
+
+//Sampling of the ground texture: nearest texel, trilinear between mip levels, or trilinear with anisotropic footprints
+enum { FilterNearest, FilterTrilinear, FilterAnisotropic };
+int ground_filter = FilterNearest, applied_ground_filter = -1; //Applied in display(), which has the GL context
+int ground_texture_size = ImageWidth; //--ground-texture-size: texels a side of the ground pattern, same squares at any size
+MipChain::Filter mip_filter = MipChain::Kaiser;
+
+//The ground's pattern, generated through the texture cache; above ImageWidth a side it arrives from ground_job
+int ground_pattern = TextureDesc::Checker, requested_ground_pattern = -1; //Requested in display()
+const char* texture_cache_file = "textures.cache"; //--texture-cache, NULL for none
+TextureCache texture_cache;
+AsyncTexture ground_job;
+GLfloat max_anisotropy = 1.0f; //1 without GL_EXT_texture_filter_anisotropic
 /* ---------------IMAGE GLOBALS END-------------------------*/
 
 /*-------Lattice Effect-------*/
@@ -76,15 +136,52 @@ int triangle_count = -1;
 //Sphere movement
 const point3 A(-4, 1, 4), B(3, 1, -4), C(-3, 1, -3);
 float tick_bet_points = 10000.0, current_tick = 0;
-vec3 sphere_position = A, direction_vec;
-mat4 sphere_rotation = identity();
-float angle = 0;
+
+/*
+	Sphere instance table. Every instance shares the loaded sphere mesh and rolls
+	along its own closed three-point path; instance 0 is the original sphere on
+	A -> B -> C. All instances and all their shadows are drawn with one
+	instanced draw call each, from a per-frame instance buffer in dynamic_stream.
+*/
+struct SphereInstance {
+	point3 path[3];    //Waypoints, rolled through in order
+	float tick_offset; //Phase along the path, in ticks
+	point3 position;
+	vec3 offset;       //Displacement from the path by contacts, relaxes back to zero
+	mat4 rotation;     //Orientation, accumulated from the rolling motion
+	int material;      //Index into material_tint
+};
+std::vector<SphereInstance> spheres;
+
+//Sphere contacts: broad phase on a grid over the floor, then the pushes feed the rolling in idle()
+const float sphere_radius = 1.0;
+bool sphere_collisions = true;
+SpatialGrid sphere_grid;
+std::vector<GridContact> sphere_contacts;
+std::vector<float> sphere_x, sphere_y, sphere_z;
+
+#define MaterialCount 4
+color4 material_tint[MaterialCount] = {
+	color4(1.0, 1.0, 1.0, 1.0),  //The sphere's own gold material
+	color4(1.0, 0.35, 0.3, 1.0),
+	color4(0.35, 0.6, 1.0, 1.0),
+	color4(0.75, 0.75, 0.75, 1.0)
+};
+
+//CPU cost of the sphere instances, accumulated and reported every sphere_report_interval frames
+double sphere_update_us = 0.0, sphere_pack_us = 0.0;
+int sphere_cost_frames = 0, sphere_report_interval = 600;
 
 //Fog Option, 0 = off, 1 = linear, 2 = exponential, 3 = exponential square
 int fog = 0;
 
 //Sphere shadow
 bool if_shadow = true, if_blending = false;
+//How the shadow gets onto the floor: drawn between two floor passes, drawn once per floor pixel through the
+//stencil, or sampled by the floor from a floor-space mask texture that is redrawn only when the shadows move.
+//Or no projected shadow at all: depth maps of both lights, which shadow every lit surface from any viewpoint.
+enum { ShadowTwice, ShadowStencil, ShadowMaskTexture, ShadowDepthMaps };
+int shadow_technique = ShadowTwice;
 const point3 L(-14.0, 12.0, -3.0);
 mat4 sphere_shadow(L.y, 0.0f, 0.0f, 0.0f,
 	-L.x, 0.0f, -L.z, -1.0f,
@@ -96,6 +193,61 @@ int shadow_fill_mode = GL_FILL; // GL_LINE or GL_FILL
 
 int animation_flag = 0; //0 - waiting to begin, 1 animation paused, 2 animation playing
 
+//GPU time of each pass of display(), shown on the HUD and/or dumped to CSV
+enum { PassSetup, PassDepthPrepass, PassFloorColor, PassShadow, PassFloorDepth, PassAxis, PassSphere, PassDeferredLights,
+	PassDeferredResolve, PassParticles, PassShadowMap0, PassShadowMap1, PassShadowMap2, PassShadowMap3, PassShadowMapLight, PassCount };
+const char* const pass_names[PassCount] = { "setup", "depth prepass", "floor color", "shadow", "floor depth", "axis", "sphere",
+	"deferred lights", "deferred resolve", "particles", "shadow map 0", "shadow map 1", "shadow map 2", "shadow map 3",
+	"shadow map light" };
+const char* const pass_zones[PassCount] = { "pass: setup", "pass: depth prepass", "pass: floor color", "pass: shadow",
+	"pass: floor depth", "pass: axis", "pass: sphere", "pass: deferred lights", "pass: deferred resolve", "pass: particles",
+	"pass: shadow map 0", "pass: shadow map 1", "pass: shadow map 2", "pass: shadow map 3", "pass: shadow map light" };
+GpuTimer gpu_timer;
+bool gpu_timing = false, gpu_hud = false; //Headless runs always time the passes
+
+//Input record and replay; events are stamped with the frames displayed before them
+InputLog input_log;
+int displayed_frames = 0;
+
+/*-------Command line options-------*/
+bool headless = false;           //Render offscreen into an FBO, no window and no GLUT
+int headless_frames = 300, warmup_frames = 2; //Warm-up frames are drawn before timing starts
+int frame_width = 512, frame_height = 512;
+double fixed_step_ms = 0.0;      //> 0: animate on a fixed clock instead of wall time
+const char* sphere_file = NULL;  //NULL: ask on stdin
+const char* screenshot_file = NULL;
+bool start_animated = true, print_frames = true;
+bool software = false;           //Render with SoftRasterizer instead of OpenGL
+std::vector<int> software_sizes; //Width, height pairs to benchmark the software rasterizer at
+bool raytrace = false;           //Render with RayTracer, once per sphere file
+bool bench_lighting = false;     //Headless: per pixel against per vertex lighting on finer floor grids
+bool bench_deferred = false;     //Headless: forward against deferred lighting at 2, 32 and 512 lights
+bool bench_filter = false;       //Headless: the ground texture's filters from a normal and a grazing view
+bool bench_capture = false;      //Headless: frame capture overhead at 1080p, through the PBO ring and not
+int bench_broadphase = 0;        //> 0: bodies of the broad phase benchmark, which needs no GL at all
+bool frame_size_set = false;     //--size given
+int raytrace_frames = 10;
+const char* profile_file = NULL; //Chrome trace of the CPU zones, written at exit
+const char* gpu_csv_file = NULL;  //GPU ms per pass, one row per frame
+const char* record_file = NULL;  //Input log written at exit
+const char* replay_file = NULL;  //Input log to replay headless
+const char* compare_file = NULL; //Headless: PPM the last frame must match
+const char* capture_file = NULL; //Every frame to PNG files (a printf pattern) or a Y4M stream
+FrameCapture frame_capture;
+int compare_tolerance = 2;       //Largest channel difference that still matches
+bool perceptual_compare = false;  //Compare with comparePerceptual() instead of channel by channel
+const char* regress_dir = NULL;  //References of the regression cases to check against, or with regress_update to write
+bool regress_update = false;
+const char* regress_only = NULL; //Only the regression cases whose name contains this
+double budget_margin = 25.0;     //Percent a regression case's frame time may be over its budget
+int regress_repeats = 3;         //Runs of each regression case
+struct SceneOption {
+	void (*apply)(int); //A menu callback
+	int id;
+};
+std::vector<SceneOption> scene_options; //Scene settings, applied after init() through the menus
+/*----------------------------------*/
+
 //--------------Shader Lighting Parameters-------------------//
 int light_count = 2;
 color4 global_ambient(1.0, 1.0, 1.0, 1.0);
@@ -145,51 +297,185 @@ float specular_ground_product[2 * 4];
 
 
 bool lighting = true, flat = false, sphere_lighting = true;
+
+//Where the lights are evaluated: per vertex, or per pixel (the PER_PIXEL build of the shaders) on the floor only or on
+//the spheres too, or per pixel after the surfaces are in a G-buffer (not with shadow maps, which fall back to forward
+//per pixel). The floor is floor_grid x floor_grid quads, so per vertex lighting can be given more vertices.
+enum { LightPerVertex, LightPerPixelFloor, LightPerPixel, LightDeferred };
+int light_model = LightPerVertex;
+int floor_grid = 1;
+//Lit surfaces first drawn depth only, so the lighting runs once per visible pixel
+bool depth_prepass = false;
+
+//Light 1 on the floor, baked per texel whenever it changes; light 0 is in the eye frame, so it stays per vertex
+Lightmap floor_lightmap;
+bool baked_floor = true;
+const int lightmap_size = 256;
+
+//Point lights past the two above, for large light counts: fixed in the world frame over the floor, unshadowed, each
+//reaching extra_light_radius. Their eye frame positions go into a texture buffer every frame.
+struct ExtraLight {
+	point3 position;
+	color4 color;
+};
+std::vector<ExtraLight> extra_lights;
+int total_lights = 2; //--lights: the scene's two and the extra ones
+const float extra_light_radius = 3.0f;
+GLuint extra_light_buffer, extra_light_texture;
 //--------------------------------------------------------//
 
+//Headless runs have no GLUT window to redisplay; they draw every frame anyway
+void postRedisplay()
+{
+	if (!headless) glutPostRedisplay();
+}
+//---------------------------------------------------------
+//The ground texture at size texels a side: the green and white checkerboard, or noise or a gradient between them
+TextureDesc groundDesc(int size)
+{
+	const GLubyte green[4] = { 0, 150, 0, 255 }, white[4] = { 255, 255, 255, 255 };
+	TextureDesc d;
+	d.pattern = ground_pattern;
+	d.width = d.height = size;
+	d.cells = 4;
+	memcpy(d.a, green, 4);
+	memcpy(d.b, white, 4);
+	return d;
+}
+//---------------------------------------------------------
+//The 1D stripe at width texels: red (255, 0, 0) over the first 5 of every 32, then yellow (255, 255, 0)
+TextureDesc stripeDesc(int width)
+{
+	const GLubyte red[4] = { 255, 0, 0, 255 }, yellow[4] = { 255, 255, 0, 255 };
+	TextureDesc d;
+	d.pattern = TextureDesc::Stripe;
+	d.width = width;
+	d.height = 1;
+	d.cells = 1;
+	d.split = 5.0f / stripeImageWidth;
+	memcpy(d.a, red, 4);
+	memcpy(d.b, yellow, 4);
+	return d;
+}
+//---------------------------------------------------------
 void image_set_up(void)
 {
-	int i, j, c;
+	std::vector<GLubyte> texels;
 
-	/* --- Generate checkerboard image to the image array ---*/
-	for (i = 0; i < ImageHeight; i++)
-		for (j = 0; j < ImageWidth; j++)
-		{
-			c = (((i & 0x8) == 0) ^ ((j & 0x8) == 0));
-
-			if (c == 1) /* white */
-			{
-				c = 255;
-				Image[i][j][0] = (GLubyte)c;
-				Image[i][j][1] = (GLubyte)c;
-				Image[i][j][2] = (GLubyte)c;
-			}
-			else  /* green */
-			{
-				Image[i][j][0] = (GLubyte)0;
-				Image[i][j][1] = (GLubyte)150;
-				Image[i][j][2] = (GLubyte)0;
-			}
+	/* --- Checkerboard image to the image array, squares of 8 texels; always a checkerboard ---*/
+	TextureDesc checker = groundDesc(ImageWidth);
+	checker.pattern = TextureDesc::Checker;
+	texture_cache.get(checker, texels);
+	memcpy(Image, texels.data(), sizeof(Image));
 
-			Image[i][j][3] = (GLubyte)255;
+	/*--- 1D stripe image to array stripeImage[] ---*/
+	texture_cache.get(stripeDesc(stripeImageWidth), texels);
+	memcpy(stripeImage, texels.data(), sizeof(stripeImage));
+}
+//---------------------------------------------------------
+//The stripe at the array's size, its row down the whole layer; layers share the array's size
+void setStripeLayer()
+{
+	std::vector<GLubyte> texels;
+	texture_cache.get(stripeDesc(textures.size()), texels);
+	MipChain chain;
+	chain.build(texels.data(), textures.size(), 1, mip_filter);
+	textures.setRowLayer(LayerStripe, chain);
+}
+//---------------------------------------------------------
+//The array at size texels a side: the ground texture and the stripe, with their mip chains; now
+void uploadTextures(int size)
+{
+	std::vector<GLubyte> texels;
+	texture_cache.get(groundDesc(size), texels);
+	MipChain chain;
+	chain.build(texels.data(), size, size, mip_filter);
+
+	textures.resize(size);
+	textures.setLayer(LayerGround, chain);
+	setStripeLayer();
+	requested_ground_pattern = ground_pattern;
+}
+//---------------------------------------------------------
+//The ground texture at ImageWidth now and, when it is to be larger, in full from ground_job later
+void requestGroundTexture()
+{
+	uploadTextures(ImageWidth);
+	if (ground_texture_size > ImageWidth) ground_job.start(groundDesc(ground_texture_size), &texture_cache, mip_filter);
+}
+//---------------------------------------------------------
+//Uploads ground_job's texture once it is ready; headless frames wait for it, so every run draws the same
+void pollGroundTexture()
+{
+	if (!ground_job.ready() && !(headless && ground_job.pending())) return;
+
+	const MipChain& chain = ground_job.finish();
+	textures.resize(chain.width(0));
+	textures.setLayer(LayerGround, chain);
+	setStripeLayer();
+	printf("Ground texture %dx%d: %s with its mip chain in %.1f ms\n", ground_job.desc().width, ground_job.desc().height,
+		ground_job.lastFromCache() ? "read from the cache" : "generated", ground_job.lastJobMs());
+}
+//---------------------------------------------------------
+//Opens the image files and starts streaming them; a file that cannot be streamed leaves the generated texture
+void openImages()
+{
+	const char* const names[ImageCount] = { "--ground-image", "--sphere-image" };
+	const TextureStream* first = NULL;
+	int layers = 0;
+	for (int i = 0; i < ImageCount; i++) {
+		TextureStream& stream = image_streams[i];
+		if (image_files[i] == NULL) continue;
+		if (!stream.open(image_files[i])) {
+			printf("Warning: %s %s: %s\n", names[i], image_files[i], stream.error().c_str());
+			continue;
 		}
-
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-	/*--- Generate 1D stripe image to array stripeImage[] ---*/
-	for (j = 0; j < stripeImageWidth; j++) {
-		/* When j <= 4, the color is (255, 0, 0),   i.e., red stripe/line.
-		When j > 4,  the color is (255, 255, 0), i.e., yellow remaining texture
-		*/
-		stripeImage[4 * j] = (GLubyte)255;
-		stripeImage[4 * j + 1] = (GLubyte)((j>4) ? 255 : 0);
-		stripeImage[4 * j + 2] = (GLubyte)0;
-		stripeImage[4 * j + 3] = (GLubyte)255;
+		if (first != NULL && (stream.format() != first->format() || stream.width() != first->width() ||
+			stream.height() != first->height() || stream.levels() != first->levels())) {
+			printf("Warning: %s %s: not %s %dx%d with %d levels like the first image\n", names[i], image_files[i],
+				first->formatName(), first->width(), first->height(), first->levels());
+			stream.close();
+			continue;
+		}
+		if (first == NULL) first = &stream;
+		image_layers[i] = layers++;
 	}
+	if (first == NULL) return;
 
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-	/*----------- End 1D stripe image ----------------*/
-
+	image_textures.init(1, first->width(), first->height(), layers, first->levels(), first->format());
+	for (int i = 0; i < ImageCount; i++)
+		if (image_layers[i] >= 0) image_streams[i].start(&image_textures, image_layers[i]);
+}
+//---------------------------------------------------------
+//Uploads the levels read since; the array samples from the largest level all its layers have. Headless frames wait
+void pollImages()
+{
+	if (!image_textures.isInitialized() || image_base_level == 0) return;
+
+	int base = 0;
+	for (int i = 0; i < ImageCount; i++) {
+		if (image_layers[i] < 0) continue;
+		TextureStream& stream = image_streams[i];
+		if (!stream.finished() && stream.poll(headless))
+			printf("Image %s: %s %dx%d, %d levels; first level after %.1f ms, all after %.1f ms; %.2f MB resident (%.2f MB as RGBA8)\n",
+				image_files[i], stream.formatName(), stream.width(), stream.height(), stream.levels(),
+				stream.firstLevelMs(), stream.allLevelsMs(), stream.residentBytes() / 1048576.0, stream.rgba8Bytes() / 1048576.0);
+		int level = stream.residentLevel();
+		if (level == stream.levels()) base = -1;
+		else if (base >= 0 && level > base) base = level;
+	}
+	if (base >= 0 && base != image_base_level) image_textures.setBaseLevel(base);
+	image_base_level = base;
+}
+//---------------------------------------------------------
+void applyGroundFilter()
+{
+	//One filter for every layer: the stripe and the images are filtered like the ground
+	float anisotropy = ground_filter == FilterAnisotropic ? max_anisotropy : 1.0f;
+	textures.setFilter(ground_filter != FilterNearest, max_anisotropy > 1.0f ? anisotropy : 0.0f);
+	if (image_textures.isInitialized())
+		image_textures.setFilter(ground_filter != FilterNearest, max_anisotropy > 1.0f ? anisotropy : 0.0f);
+	applied_ground_filter = ground_filter;
 }
 vec3 lerp(const vec3& begin, const vec3& end, float percent) {
 	return vec3(begin.x + (end.x - begin.x) * percent,
@@ -213,6 +499,7 @@ point3 floor_points[] = {
 	point3(-5.0, 0.0, 8.0)
 };
 vec3 fn(0.0f, 1.0f, 0.0f);// = cross(floor_points[1] - floor_points[0], floor_points[5] - floor_points[0]);
+point3 floor_min, floor_max; //Bounds of floor_points, set by findFloorBounds() in initScene()
 vec3 floor_normals[] = {
 	vec3(fn), vec3(fn), vec3(fn),
 	vec3(fn), vec3(fn), vec3(fn)
@@ -258,158 +545,211 @@ color4 axis_color[] = {
 	color4(0.0, 0.0, 1.0, 1.0),
 };
 
-GLuint Angel::InitShader(const char* vShaderFile, const char* fShaderFile);
-
-void loadSphereFile();
-
-/*===========Particle System Class===========*/
-class ParticleSystem {
-public:
-	ParticleSystem() {
-		velocity = new point3[N];
-		color = new color4[N];
-	}
-
-	void init() {
-
-		glGenBuffers(1, &particle_buffer);
-		glBindBuffer(GL_ARRAY_BUFFER, particle_buffer);
-
-		glBufferData(GL_ARRAY_BUFFER,
-			sizeof(color[0]) * N + sizeof(velocity[0]) * N,
-			NULL, GL_STATIC_DRAW);
-
-		shaderProgram = InitShader("vshaderParticle.glsl", "fshaderParticle.glsl");
-	}
-
-	void startAnimation() {
-		glBindBuffer(GL_ARRAY_BUFFER, particle_buffer);
-		for (int i = 0; i < N; i++) {
-			velocity[i].x = 2.0*((rand() % 256) / 256.0 - 0.5);
-			velocity[i].y = 1.2*2.0*((rand() % 256) / 256.0);
-			velocity[i].z = 2.0*((rand() % 256) / 256.0 - 0.5);
+GLuint Angel::InitShader(const char* vShaderFile, const char* fShaderFile, const char* defines);
 
-			color[i].x = (rand() % 256) / 256.0;
-			color[i].y = (rand() % 256) / 256.0;
-			color[i].z = (rand() % 256) / 256.0;
-			color[i].w = 1.0;
+//---------------------------------------------------------
+void findFloorBounds()
+{
+	floor_min = floor_max = floor_points[0];
+	for (int i = 1; i < (int)(sizeof(floor_points) / sizeof(floor_points[0])); i++) {
+		for (int c = 0; c < 3; c++) {
+			floor_min[c] = fmin(floor_min[c], floor_points[i][c]);
+			floor_max[c] = fmax(floor_max[c], floor_points[i][c]);
 		}
-		glBufferSubData(GL_ARRAY_BUFFER, 0,
-			sizeof(velocity[0]) * N, velocity);
-		glBufferSubData(GL_ARRAY_BUFFER,
-			sizeof(velocity[0]) * N,
-			sizeof(color[0]) * N, color);
-
-		initialTime = (float)glutGet(GLUT_ELAPSED_TIME);
 	}
-
-	void update() {
-		if (!active) return;
-
-		t = (float)glutGet(GLUT_ELAPSED_TIME) - initialTime;
-		int particle_below_threshold = 0;
-
-		for (int i = 0; i < N; i++) {
-			if (initialPosition.y + 0.001 * velocity[i].y * t + 0.5 * -0.00000049 * t * t 
-				< 0.1) particle_below_threshold++;
-		}
-
-		//If most particles' y positions are less than 0.1, then start new animation, else update buffer
-		if (t > tMax || particle_below_threshold > N - 10)
-			startAnimation();
-
+}
+//---------------------------------------------------------
+//Rebuilds the instance table: instance 0 is the original sphere, the rest get random paths on the floor
+void setSphereCount(int count)
+{
+	if (count < 1) count = 1;
+
+	SphereInstance first;
+	first.path[0] = A; first.path[1] = B; first.path[2] = C;
+	first.tick_offset = 0.0;
+	first.position = A;
+	first.offset = vec3(0.0, 0.0, 0.0);
+	first.rotation = mat4();
+	first.material = 0;
+
+	spheres.resize(1);
+	spheres[0] = first;
+
+	const float min_x = floor_min.x, max_x = floor_max.x, min_z = floor_min.z, max_z = floor_max.z;
+
+	for (int i = 1; i < count; i++) {
+		SphereInstance s;
+		for (int k = 0; k < 3; k++)
+			s.path[k] = point3(min_x + 1.0 + (max_x - min_x - 2.0) * (rand() % 1000) / 1000.0, 1.0,
+				min_z + 1.0 + (max_z - min_z - 2.0) * (rand() % 1000) / 1000.0);
+		s.tick_offset = (float)(rand() % (int)(3 * tick_bet_points));
+		s.position = s.path[0];
+		s.offset = vec3(0.0, 0.0, 0.0);
+		s.rotation = mat4();
+		s.material = rand() % MaterialCount;
+		spheres.push_back(s);
 	}
 
-	void draw(mat4& modelview, mat4& projection)
-	{
-		if (!active) return;
+	printf("Sphere instances: %d\n", (int)spheres.size());
+}
 
-		glUseProgram(shaderProgram);
-		//--- Activate the vertex buffer object to be drawn ---//
-		glBindBuffer(GL_ARRAY_BUFFER, particle_buffer);
+void loadSphereFile(const char* path);
+void resolveSphereContacts();
 
-		GLuint mv = glGetUniformLocation(shaderProgram, "model_view");
-		GLuint p = glGetUniformLocation(shaderProgram, "projection");
+ParticleSystem firework;
 
-		glUniformMatrix4fv(mv, 1, GL_TRUE, modelview); // GL_TRUE: matrix is row-major
-		glUniformMatrix4fv(p, 1, GL_TRUE, projection);
+//Per-frame dynamic data (particles, instance matrices) is written here instead of glBufferSubData
+StreamBuffer dynamic_stream(8 << 20);
 
-		glUniform1f(glGetUniformLocation(shaderProgram, "t"), t); // GL_TRUE: matrix is row-major
-		glUniform3fv(glGetUniformLocation(shaderProgram, "initialPos"), 1, initialPosition);
+//display() queues a packet per draw; the passes above are the first field of the sort key
+RenderQueue render_queue;
+int main_program; //program, in render_queue
+GLuint per_pixel_shader; //The same shaders built with PER_PIXEL
+int per_pixel_program;
+int deferred_program; //The lights and the resolve over gbuffer, drawn as quad_geometry
+int floor_geometry, axis_geometry, shadow_geometry, flat_sphere_geometry, smooth_sphere_geometry, quad_geometry;
 
-		GLuint vVelocity = glGetAttribLocation(shaderProgram, "vVelocity");
-		glEnableVertexAttribArray(vVelocity);
-		glVertexAttribPointer(vVelocity, 3, GL_FLOAT, GL_FALSE, 0,
-			BUFFER_OFFSET(0));
+//Units 6 to 11; allocated when first drawn deferred
+GBuffer gbuffer;
+const int gbuffer_first_unit = 6;
 
-		GLuint vColor = glGetAttribLocation(shaderProgram, "vColor");
-		glEnableVertexAttribArray(vColor);
-		glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0,
-			BUFFER_OFFSET(sizeof(velocity[0]) * N));
+ShadowMask shadow_mask;
+const int shadow_mask_size = 512; //About a texel per floor pixel at the default view
 
-		glPointSize(3.0);
-		glDrawArrays(GL_POINTS, 0, N);
+//Cascades for light 0 and a map for light 1; the size, cascade count and filter are set on the command line
+ShadowMaps shadow_maps;
+int shadow_map_size = 1024, shadow_cascades = 3, shadow_pcf = 1;
+long long shadow_casters[ShadowMaps::MaxLayers] = { 0 }; //Spheres drawn into each layer, summed for the headless report
 
-		/*--- Disable each vertex attribute array being enabled ---*/
-		glDisableVertexAttribArray(vVelocity);
-		glDisableVertexAttribArray(vColor);
+//---------------------------------------------------------
+//Fills floor_buffer with the floor as grid x grid quads, each split like the two triangles of floor_points (so a grid
+//of 1 is floor_points itself), positions and texture coordinates interpolated between its corners; returns the vertex count
+int uploadFloor(int grid)
+{
+	static std::vector<point3> points;
+	static std::vector<vec3> normals;
+	static std::vector<color4> colors;
+	static std::vector<vec2> tex_coords;
+	points.clear(); normals.clear(); colors.clear(); tex_coords.clear();
+
+	//floor_points[2] is the corner at the smallest x and z, floor_points[0] the opposite one
+	const point3 &lo = floor_points[2], &hi = floor_points[0];
+	const vec2 &tex_lo = floor_texCoord[2], &tex_hi = floor_texCoord[0];
+	for (int row = 0; row < grid; row++) {
+		for (int column = 0; column < grid; column++) {
+			const int corners[6][2] = { { 1, 1 }, { 1, 0 }, { 0, 0 }, { 1, 1 }, { 0, 0 }, { 0, 1 } }; //x, z: 0 low, 1 high
+			for (int v = 0; v < 6; v++) {
+				float i = float(column + corners[v][0]), j = float(row + corners[v][1]);
+				points.push_back(point3((lo.x * (grid - i) + hi.x * i) / grid, lo.y, (lo.z * (grid - j) + hi.z * j) / grid));
+				tex_coords.push_back(vec2((tex_lo.x * (grid - i) + tex_hi.x * i) / grid, (tex_lo.y * (grid - j) + tex_hi.y * j) / grid));
+				normals.push_back(fn);
+				colors.push_back(floor_colors[0]);
+			}
+		}
 	}
 
-	void setParticleActive(bool a) {
-		if (a && !active) startAnimation();
-
-		active = a;
+	size_t n = points.size();
+	glBindBuffer(GL_ARRAY_BUFFER, floor_buffer);
+	glBufferData(GL_ARRAY_BUFFER,
+		n * (sizeof(point3) + sizeof(vec3) + sizeof(color4) + sizeof(vec2)),
+		NULL, GL_STATIC_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0,
+		n * sizeof(point3), points.data());
+	glBufferSubData(GL_ARRAY_BUFFER,
+		n * sizeof(point3),
+		n * sizeof(vec3), normals.data());
+	glBufferSubData(GL_ARRAY_BUFFER,
+		n * (sizeof(point3) + sizeof(vec3)),
+		n * sizeof(color4), colors.data());
+	glBufferSubData(GL_ARRAY_BUFFER,
+		n * (sizeof(point3) + sizeof(vec3) + sizeof(color4)),
+		n * sizeof(vec2), tex_coords.data());
+	return (int)n;
+}
+//---------------------------------------------------------
+//count extra lights at random over the floor, all the dimmer the more there are: over the disk a light reaches its
+//falloff averages 1/6, so a point of the floor receives about count * (pi r^2 / floor area) / 6 of a light's color
+void setExtraLights(int count)
+{
+	extra_lights.resize(count);
+	std::minstd_rand random(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	float r = extra_light_radius;
+	float area = (floor_max.x - floor_min.x) * (floor_max.z - floor_min.z);
+	float intensity = count > 0 ? fmin(1.0f, 3.0f * area / (count * float(pi) * r * r)) : 0.0f;
+	for (int i = 0; i < count; i++) {
+		ExtraLight& light = extra_lights[i];
+		light.position = point3(floor_min.x + (floor_max.x - floor_min.x) * unit(random), floor_min.y + 0.5f + 2.0f * unit(random),
+			floor_min.z + (floor_max.z - floor_min.z) * unit(random));
+		color4 c(unit(random), unit(random), unit(random), 0.0);
+		float brightest = fmax(c.x, fmax(c.y, c.z));
+		light.color = c * (intensity / fmax(brightest, 0.01f));
 	}
+}
+//---------------------------------------------------------
+//The extra lights in the eye frame of view, into their texture buffer
+void uploadExtraLights(const mat4& view)
+{
+	static std::vector<vec4> texels;
+	texels.resize(extra_lights.size() * 2);
+	for (size_t i = 0; i < extra_lights.size(); i++) {
+		vec4 position = view * vec4(extra_lights[i].position, 1.0);
+		texels[2 * i] = vec4(position.x, position.y, position.z, extra_light_radius);
+		texels[2 * i + 1] = extra_lights[i].color;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, extra_light_buffer);
+	glBufferData(GL_ARRAY_BUFFER, texels.size() * sizeof(vec4), texels.data(), GL_STREAM_DRAW);
+}
+//---------------------------------------------------------
+//The part of init() that needs no GL context, shared with the software rasterizer
+void initScene()
+{
+	//Ask User to input file, unless one was given with --sphere
+	loadSphereFile(sphere_file);
+	if (texture_cache_file != NULL && !texture_cache.isOpen() && !texture_cache.open(texture_cache_file))
+		printf("Warning: %s is not a texture cache, textures are generated every run\n", texture_cache_file);
+	image_set_up();
 
-private:
-	int N = 300;
-	point3 initialPosition = point3(0.0, 0.1, 0.0);
-	point3* velocity;
-	color4* color;
-
-	float initialTime, t, tMax = 10000;
-
-	GLuint particle_buffer, shaderProgram;
-
-	bool active = false;
-};
+	//Set up products
+	for (int i = 0; i < light_count * 4; i++) {
+		ambient_sphere_product[i] = light_ambient[i] * sphere_ambient[i % 4];
+		diffuse_sphere_product[i] = light_diffuse[i] * sphere_diffuse[i % 4];
+		specular_sphere_product[i] = light_specular[i] * sphere_specular[i % 4];
 
-ParticleSystem firework;
+		ambient_ground_product[i] = light_ambient[i] * ground_ambient[i % 4];
+		diffuse_ground_product[i] = light_diffuse[i] * ground_diffuse[i % 4];
+		specular_ground_product[i] = light_specular[i] * ground_specular[i % 4];
+	}
 
+	findFloorBounds();
+	sphere_grid.setBounds(floor_min, floor_max, 2.0 * sphere_radius);
+	setSphereCount(1);
+	resolveSphereContacts();
+}
+//---------------------------------------------------------
 void init()
 {
-	//Ask User to input file
-	loadSphereFile();
-	image_set_up();
+	PROFILE_ZONE("init");
+	initScene();
+
+	ProfileZone stage("particle init");
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	dynamic_stream.init();
+	firework.setFloor(floor_min, floor_max);
+	firework.setStream(&dynamic_stream);
+	firework.setColliders(&sphere_grid);
 	firework.init();
 
 	/*--- Create and Initialize a texture object ---*/
-	glGenTextures(2, textures);      // Generate texture obj name(s)
-
-	glActiveTexture(GL_TEXTURE0);  // Set the active texture unit to be 0 
-	glBindTexture(GL_TEXTURE_2D, textures[0]); // Bind the texture to this texture unit
-
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ImageWidth, ImageHeight,
-		0, GL_RGBA, GL_UNSIGNED_BYTE, Image);
-
-	glActiveTexture(GL_TEXTURE1);  // Set the active texture unit to be 1
-	glBindTexture(GL_TEXTURE_1D, textures[1]); // Bind the texture to this texture unit
-
-	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, stripeImageWidth,
-		0, GL_RGBA, GL_UNSIGNED_BYTE, stripeImage);
+	stage.restart("texture upload");
+	textures.init(0, ImageWidth, LayerCount);
+	requestGroundTexture(); //The mip levels are sampled only by the filtered modes
+	if (GLEW_EXT_texture_filter_anisotropic) glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max_anisotropy);
+	applied_ground_filter = FilterNearest;
+	openImages();
 
 	//FLAT Sphere into the buffer
+	stage.restart("buffer upload");
 	glGenBuffers(1, &flat_sphere_buffer);
 	glBindBuffer(GL_ARRAY_BUFFER, flat_sphere_buffer);
 
@@ -457,22 +797,7 @@ void init()
 
 	//Floor into the buffer
 	glGenBuffers(1, &floor_buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, floor_buffer);
-
-	glBufferData(GL_ARRAY_BUFFER,
-		sizeof(floor_points) + sizeof(floor_colors) + sizeof(floor_normals) + sizeof(floor_texCoord),
-		NULL, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, 0,
-		sizeof(floor_points), floor_points);
-	glBufferSubData(GL_ARRAY_BUFFER,
-		sizeof(floor_points),
-		sizeof(floor_normals), floor_normals);
-	glBufferSubData(GL_ARRAY_BUFFER,
-		sizeof(floor_points) + sizeof(floor_normals),
-		sizeof(floor_colors), floor_colors);
-	glBufferSubData(GL_ARRAY_BUFFER,
-		sizeof(floor_points) + sizeof(floor_colors) + sizeof(floor_normals),
-		sizeof(floor_texCoord), floor_texCoord);
+	int floor_vertices = uploadFloor(floor_grid);
 
 	//Axis into the buffer
 	glGenBuffers(1, &axis_buffer);
@@ -487,39 +812,96 @@ void init()
 		sizeof(axis_point),
 		sizeof(axis_color), axis_color);
 
-	//Set up products
-	for (int i = 0; i < light_count * 4; i++) {
-		ambient_sphere_product[i] = light_ambient[i] * sphere_ambient[i % 4];
-		diffuse_sphere_product[i] = light_diffuse[i] * sphere_diffuse[i % 4];
-		specular_sphere_product[i] = light_specular[i] * sphere_specular[i % 4];
-
-		ambient_ground_product[i] = light_ambient[i] * ground_ambient[i % 4];
-		diffuse_ground_product[i] = light_diffuse[i] * ground_diffuse[i % 4];
-		specular_ground_product[i] = light_specular[i] * ground_specular[i % 4];
-	}
-
 	// Load shaders and create a shader program (to be used in display())
+	stage.restart("shader compile");
 	program = InitShader("vshader53.glsl", "fshader53.glsl");
+	per_pixel_shader = InitShader("vshader53.glsl", "fshader53.glsl", "#define PER_PIXEL");
+	GLuint deferred_shader = InitShader("vshaderDeferred.glsl", "fshaderDeferred.glsl");
 
 	glEnable(GL_DEPTH_TEST);
 	glClearColor(0.529, 0.807, 0.92, 0.0);
 	glLineWidth(2.0);
+
+	//Texture units 2 to 5, after the texture arrays (0 and 1); the G-buffer takes the ones after
+	glActiveTexture(GL_TEXTURE2);
+	shadow_mask.init(shadow_mask_size, floor_min.x, floor_max.x, floor_min.z, floor_max.z);
+	glActiveTexture(GL_TEXTURE3);
+	shadow_maps.init(shadow_map_size, shadow_cascades);
+	glActiveTexture(GL_TEXTURE0);
+	floor_lightmap.init(4, lightmap_size, floor_min.x, floor_max.x, floor_min.z, floor_max.z, floor_min.y);
+	glGenBuffers(1, &extra_light_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, extra_light_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vec4) * 2, NULL, GL_STREAM_DRAW);
+	glActiveTexture(GL_TEXTURE5);
+	glGenTextures(1, &extra_light_texture);
+	glBindTexture(GL_TEXTURE_BUFFER, extra_light_texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, extra_light_buffer);
+	glActiveTexture(GL_TEXTURE0);
+	setExtraLights(total_lights - light_count);
+
+	//The G-buffer outputs of fshader53.glsl in the order of GBuffer's targets; binding them takes a relink
+	const char* const gbuffer_outputs[GBuffer::TargetCount] = { "fColor", "gDiffuse", "gSpecular", "gPosition", "gNormal" };
+	GLuint shaders[] = { program, per_pixel_shader };
+	for (int i = 0; i < 2; i++) {
+		for (int t = 0; t < GBuffer::TargetCount; t++) glBindFragDataLocation(shaders[i], t, gbuffer_outputs[t]);
+		glLinkProgram(shaders[i]);
+		glUseProgram(shaders[i]);
+		//Samplers of different types must never share a unit, even when unused; strict drivers reject the draw
+		glUniform1i(glGetUniformLocation(shaders[i], "textures"), 0);
+		glUniform1i(glGetUniformLocation(shaders[i], "image_textures"), 1);
+		glUniform1i(glGetUniformLocation(shaders[i], "shadow_mask"), 2);
+		glUniform1i(glGetUniformLocation(shaders[i], "shadow_maps"), 3);
+		glUniform1i(glGetUniformLocation(shaders[i], "lightmap"), 4);
+		glUniform1i(glGetUniformLocation(shaders[i], "ExtraLights"), 5);
+		glUniform4fv(glGetUniformLocation(shaders[i], "MaterialTint"), MaterialCount, (GLfloat*)material_tint);
+	}
+	const char* const gbuffer_samplers[GBuffer::TargetCount + 1] = { "gbuffer_color", "gbuffer_diffuse", "gbuffer_specular",
+		"gbuffer_position", "gbuffer_normal", "gbuffer_depth" };
+	glUseProgram(deferred_shader);
+	glUniform1i(glGetUniformLocation(deferred_shader, "ExtraLights"), 5);
+	for (int t = 0; t <= GBuffer::TargetCount; t++)
+		glUniform1i(glGetUniformLocation(deferred_shader, gbuffer_samplers[t]), gbuffer_first_unit + t);
+
+	//One quad for the passes over the G-buffer
+	const point3 quad_points[] = { point3(-1.0, -1.0, 0.0), point3(1.0, -1.0, 0.0), point3(-1.0, 1.0, 0.0), point3(1.0, 1.0, 0.0) };
+	GLuint quad_buffer;
+	glGenBuffers(1, &quad_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, quad_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad_points), quad_points, GL_STATIC_DRAW);
+
+	//What display() draws, by buffer and vertex layout
+	main_program = render_queue.addProgram(program);
+	per_pixel_program = render_queue.addProgram(per_pixel_shader);
+	deferred_program = render_queue.addProgram(deferred_shader);
+	floor_geometry = render_queue.addGeometry(floor_buffer, floor_vertices, GL_TRIANGLES, true, true);
+	axis_geometry = render_queue.addGeometry(axis_buffer, sizeof(axis_point) / sizeof(axis_point[0]), GL_LINES, false, false);
+	shadow_geometry = render_queue.addGeometry(sphere_shadow_buffer, triangle_count * 3, GL_TRIANGLES, false, false);
+	flat_sphere_geometry = render_queue.addGeometry(flat_sphere_buffer, triangle_count * 3, GL_TRIANGLES, true, false);
+	smooth_sphere_geometry = render_queue.addGeometry(smooth_sphere_buffer, triangle_count * 3, GL_TRIANGLES, true, false);
+	quad_geometry = render_queue.addGeometry(quad_buffer, 4, GL_TRIANGLE_STRIP, false, false);
+
+	gpu_timer.init(pass_names, PassCount);
+	if (gpu_csv_file != NULL) {
+		if (gpu_timer.openCSV(gpu_csv_file)) gpu_timing = true;
+		else printf("Error: cannot write %s\n", gpu_csv_file);
+	}
+	if (headless) gpu_timing = true;
 }
 //---------------------------------------------------------
 /*
 	IMPORTANT: since the model_view in shader program is the model_view of the sphere, we NEED to calculate
 				all the world frame position in here, this function must be called after mv = LookAt(eye, at, up) so every position is converted to the frame of the camera
 */
-void SetUp_Lighting_Uniform_Vars(mat4 mv, color4 GlobalAmbientProduct, float* AmbientProduct, float* DiffuseProduct, float* SpecularProduct) {
-	glUniform4fv(glGetUniformLocation(program, "GlobalAmbientProduct"), 1, GlobalAmbientProduct);
-	glUniform4fv(glGetUniformLocation(program, "AmbientProduct"), light_count, AmbientProduct);
-	glUniform4fv(glGetUniformLocation(program, "DiffuseProduct"), light_count, DiffuseProduct);
-	glUniform4fv(glGetUniformLocation(program, "SpecularProduct"), light_count, SpecularProduct);
+void SetUp_Lighting_Uniform_Vars(UniformBlock& u, mat4 mv, color4 GlobalAmbientProduct, float* AmbientProduct, float* DiffuseProduct, float* SpecularProduct) {
+	u.set("GlobalAmbientProduct", GlobalAmbientProduct);
+	u.set("AmbientProduct", AmbientProduct, light_count, 4);
+	u.set("DiffuseProduct", DiffuseProduct, light_count, 4);
+	u.set("SpecularProduct", SpecularProduct, light_count, 4);
 
 	//Light Characteristics
-	glUniform1fv(glGetUniformLocation(program, "Exponent"), 2, exponent);
-	glUniform1fv(glGetUniformLocation(program, "Cutoff"), 2, cutoff);
-	glUniform1i(glGetUniformLocation(program, "LightCount"), light_count);
+	u.set("Exponent", exponent, 2);
+	u.set("Cutoff", cutoff, 2);
+	u.set("LightCount", light_count);
 
 	//The Light Position in Eye Frame
 	float li_pos[2 * 4];
@@ -538,254 +920,775 @@ void SetUp_Lighting_Uniform_Vars(mat4 mv, color4 GlobalAmbientProduct, float* Am
 	float li_dir[] = { light_dir[0].x, light_dir[0].y, light_dir[0].z,
 		light_dir_eye.x, light_dir_eye.y, light_dir_eye.z };
 
-	glUniform4fv(glGetUniformLocation(program, "LightPosition"), light_count, li_pos);
-	glUniform3fv(glGetUniformLocation(program, "LightDirection"), light_count, li_dir);
-	glUniform1iv(glGetUniformLocation(program, "LightType"), light_count, light_type);
+	u.set("LightPosition", li_pos, light_count, 4);
+	u.set("LightDirection", li_dir, light_count, 3);
+	u.set("LightType", light_type, light_count);
 
-	glUniform1fv(glGetUniformLocation(program, "ConstAtt"), 2, const_att);
-	glUniform1fv(glGetUniformLocation(program, "LinearAtt"), 2, linear_att);
-	glUniform1fv(glGetUniformLocation(program, "QuadAtt"), 2, quad_att);
-	glUniform1f(glGetUniformLocation(program, "Shininess"), shininess);
+	u.set("ConstAtt", const_att, 2);
+	u.set("LinearAtt", linear_att, 2);
+	u.set("QuadAtt", quad_att, 2);
+	u.set("Shininess", shininess);
+	u.set("ExtraLightCount", (int)extra_lights.size());
 }
 //---------------------------------------------------------
-void draw(GLuint buffer, int num_vertices, int mode = GL_TRIANGLES, bool lighting = false, bool normal = false, int texture = 0)
+//A material with every switch of the main shaders at its off value: unlit, untextured, no shadow inputs. The queue may
+//reorder draws, so each material sets all of them; callers set only what differs
+UniformBlock& unlitMaterial(int* material, bool deferred = false)
 {
-	//--- Activate the vertex buffer object to be drawn ---//
-	glBindBuffer(GL_ARRAY_BUFFER, buffer);
-
-	glUniform1i(glGetUniformLocation(program, "lighting"), lighting);
-	glUniform1i(glGetUniformLocation(program, "texture_flag"), texture);
-
-	/*----- Set up vertex attribute arrays for each vertex attribute -----*/
-	GLuint vPosition = glGetAttribLocation(program, "vPosition");
-	glEnableVertexAttribArray(vPosition);
-	glVertexAttribPointer(vPosition, 3, GL_FLOAT, GL_FALSE, 0,
-		BUFFER_OFFSET(0));
-
-	//--- Activate the normal buffer ---//
-	GLuint vNormal = glGetAttribLocation(program, "vNormal");
-	int NormalSize = 0;
-	if (normal) {
-		glEnableVertexAttribArray(vNormal);
-		glVertexAttribPointer(vNormal, 3, GL_FLOAT, GL_FALSE, 0,
-			BUFFER_OFFSET(sizeof(point3) * num_vertices));
-		NormalSize = sizeof(vec3) * num_vertices;
+	UniformBlock& m = render_queue.addMaterial(material);
+	m.set("lighting", 0);
+	m.set("gbuffer_write", deferred);
+	m.set("texture_flag", 0);
+	m.set("calculate_texCoord", 0);
+	m.set("sphere", 0);
+	m.set("lattice_on", lattice_on);
+	m.set("lattice_upright", lattice_upright);
+	m.set("use_material", 0);
+	m.set("shadow_mask_on", 0);
+	m.set("shadow_mask_write", 0);
+	m.set("shadow_maps_on", 0);
+	m.set("lightmap_on", 0);
+	return m;
+}
+//---------------------------------------------------------
+//Writes one InstanceData per sphere, or per sphere of subset, into this frame's stream region
+StreamAllocation packSphereInstances(const std::vector<int>* subset = NULL)
+{
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	size_t count = subset ? subset->size() : spheres.size();
+	StreamAllocation a = dynamic_stream.allocate(sizeof(InstanceData) * count);
+	if (a.ptr) {
+		InstanceData* out = (InstanceData*)a.ptr;
+		for (size_t i = 0; i < count; i++) {
+			//Translate(position) * rotation, written row by row
+			SphereInstance& s = spheres[subset ? (*subset)[i] : i];
+			for (int r = 0; r < 3; r++) {
+				out[i].model[r][0] = s.rotation[r][0];
+				out[i].model[r][1] = s.rotation[r][1];
+				out[i].model[r][2] = s.rotation[r][2];
+				out[i].model[r][3] = s.position[r];
+			}
+			out[i].model[3][0] = out[i].model[3][1] = out[i].model[3][2] = 0.0;
+			out[i].model[3][3] = 1.0;
+			out[i].material = (GLfloat)s.material;
+		}
+		dynamic_stream.commit(a);
 	}
 
-	//--- Activate the color buffer ---//
-	GLuint vColor = glGetAttribLocation(program, "vColor");
-	glEnableVertexAttribArray(vColor);
-	glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 0,
-		BUFFER_OFFSET(sizeof(point3) * num_vertices + NormalSize));
+	sphere_pack_us += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+	return a;
+}
+//---------------------------------------------------------
+//Everything the shadow mask depends on: the light, the draw settings of the shadows, each sphere's transform
+const std::vector<float>& shadowMaskKey()
+{
+	static std::vector<float> key;
+	key.clear();
+	for (int r = 0; r < 4; r++)
+		for (int c = 0; c < 4; c++) key.push_back(sphere_shadow[r][c]);
+	key.push_back((float)shadow_fill_mode);
+	key.push_back(lattice_on);
+	key.push_back(lattice_upright);
+	for (size_t i = 0; i < spheres.size(); i++) {
+		const SphereInstance& s = spheres[i];
+		for (int r = 0; r < 3; r++) {
+			key.push_back(s.position[r]);
+			for (int c = 0; c < 3; c++) key.push_back(s.rotation[r][c]);
+		}
+	}
+	return key;
+}
+//---------------------------------------------------------
+//Everything the floor's lightmap depends on: light 1 and the floor material's products with it
+const std::vector<float>& lightmapKey()
+{
+	static std::vector<float> key;
+	key.clear();
+	key.push_back((float)light_type[1]);
+	for (int c = 0; c < 3; c++) {
+		key.push_back(light_position[1][c]);
+		key.push_back(light_dir[1][c]);
+	}
+	float parameters[] = { cutoff[1], exponent[1], const_att[1], linear_att[1], quad_att[1] };
+	key.insert(key.end(), parameters, parameters + 5);
+	key.insert(key.end(), ambient_ground_product + 4, ambient_ground_product + 8);
+	key.insert(key.end(), diffuse_ground_product + 4, diffuse_ground_product + 8);
+	return key;
+}
+//---------------------------------------------------------
+void bakeFloorLightmap()
+{
+	PROFILE_ZONE("bake floor lightmap");
+	BakeLight light;
+	light.type = light_type[1];
+	light.position = point3(light_position[1].x, light_position[1].y, light_position[1].z);
+	light.focus = light_dir[1];
+	light.ambient = color4(ambient_ground_product[4], ambient_ground_product[5], ambient_ground_product[6], ambient_ground_product[7]);
+	light.diffuse = color4(diffuse_ground_product[4], diffuse_ground_product[5], diffuse_ground_product[6], diffuse_ground_product[7]);
+	light.const_att = const_att[1];
+	light.linear_att = linear_att[1];
+	light.quad_att = quad_att[1];
+	light.cutoff = cutoff[1];
+	light.exponent = exponent[1];
+	floor_lightmap.bake(&light, 1);
+}
+//---------------------------------------------------------
+//Fits the shadow maps to this frame, then draws into each layer the spheres that can cast into it, in one flush
+void renderShadowMaps(const mat4& view, const std::function<void(int)>& on_pass)
+{
+	//The scene: the floor and every sphere
+	point3 scene_min = floor_min, scene_max = floor_max;
+	for (size_t i = 0; i < spheres.size(); i++) {
+		for (int c = 0; c < 3; c++) {
+			scene_min[c] = fmin(scene_min[c], spheres[i].position[c] - sphere_radius);
+			scene_max[c] = fmax(scene_max[c], spheres[i].position[c] + sphere_radius);
+		}
+	}
 
-	GLuint vTexCoord = glGetAttribLocation(program, "vTexCoord");
-	if (texture) {
-		//--- Activate the texture coordinates buffer ---//
-		glEnableVertexAttribArray(vTexCoord);
-		glVertexAttribPointer(vTexCoord, 2, GL_FLOAT, GL_FALSE, 0,
-			BUFFER_OFFSET(sizeof(point3) * num_vertices + NormalSize + sizeof(color4) * num_vertices));
+	//Light 0's direction is in the eye frame: back to the world frame by the transposed rotation of view
+	vec3 direction(0.0, 0.0, 0.0);
+	for (int r = 0; r < 3; r++)
+		for (int c = 0; c < 3; c++) direction[c] += view[r][c] * light_dir[0][r];
+	shadow_maps.fitDirectional(view, direction, fovy, aspect, zNear, zFar, scene_min, scene_max);
+	shadow_maps.fitLocal(point3(light_position[1].x, light_position[1].y, light_position[1].z), light_dir[1],
+		light_type[1] == 3 ? 2 * cutoff[1] : 0.0f, scene_min, scene_max);
+
+	int depth;
+	unlitMaterial(&depth).set("sphere", 1); //The lattice cuts the shadow too
+
+	//The floor only receives; a layer without casters is just cleared
+	static std::vector<int> casters;
+	for (int layer = 0; layer < shadow_maps.layers(); layer++) {
+		casters.clear();
+		for (size_t i = 0; i < spheres.size(); i++)
+			if (shadow_maps.castsInto(layer, spheres[i].position, sphere_radius)) casters.push_back((int)i);
+		if (casters.empty()) continue;
+		shadow_casters[layer] += casters.size();
+
+		StreamAllocation instances = packSphereInstances(&casters);
+		int pass = layer == shadow_maps.localLayer() ? PassShadowMapLight : PassShadowMap0 + layer;
+		DrawPacket& packet = render_queue.add(pass, main_program, depth, shadow_geometry);
+		packet.state.polygon_mode = shadow_fill_mode;
+		packet.uniforms.set("projection", shadow_maps.layerMatrix(layer));
+		packet.uniforms.set("view", mat4());
+		packet.uniforms.set("instanced", 1);
+		packet.instance_buffer = dynamic_stream.buffer();
+		packet.instance_offset = instances.offset;
+		packet.instance_count = instances.ptr ? (int)casters.size() : 0;
 	}
 
-	/* Draw a sequence of geometric objs (triangles) from the vertex buffer
-	(using the attributes specified in each enabled vertex attribute array) */
-	glDrawArrays(mode, 0, num_vertices);
+	shadow_maps.begin();
+	render_queue.flush([&](int queue_pass) {
+		on_pass(queue_pass);
+		shadow_maps.selectLayer(queue_pass == PassShadowMapLight ? shadow_maps.localLayer() : queue_pass - PassShadowMap0);
+	});
+	shadow_maps.end();
+}
+//---------------------------------------------------------
+//Rolling GPU ms per pass in the top left corner, with fixed-function bitmaps
+void drawGpuHud()
+{
+	char counts[128];
+	sprintf(counts, "draws %lld  vertices %lld  state changes %lld\n",
+		gl_stats_last.draw_calls, gl_stats_last.vertices, gl_stats_last.stateChanges());
+	std::string text = counts + gpu_timer.summary();
+#ifdef __APPLE__ // No bitmaps in the core profile
+	static int frame = 0;
+	if (++frame % 60 == 0) printf("%s", text.c_str());
+#else
+	int width = glutGet(GLUT_WINDOW_WIDTH), height = glutGet(GLUT_WINDOW_HEIGHT);
+	glUseProgram(0);
+	glDisable(GL_DEPTH_TEST);
+	glViewport(0, 0, width, height);
+	glColor3f(0.0, 0.0, 0.0);
 
-	/*--- Disable each vertex attribute array being enabled ---*/
-	glDisableVertexAttribArray(vPosition);
-	glDisableVertexAttribArray(vNormal);
-	glDisableVertexAttribArray(vColor);
-	glDisableVertexAttribArray(vTexCoord);
+	int y = height - 16;
+	glWindowPos2i(8, y);
+	for (size_t i = 0; i < text.size(); i++) {
+		if (text[i] == '\n') glWindowPos2i(8, y -= 14);
+		else glutBitmapCharacter(GLUT_BITMAP_8_BY_13, text[i]);
+	}
+	glEnable(GL_DEPTH_TEST);
+#endif
+}
+//---------------------------------------------------------
+void toggleGpuHud()
+{
+	gpu_hud = !gpu_hud;
+	gpu_timing = gpu_hud || gpu_csv_file != NULL || headless;
 }
 //---------------------------------------------------------
 void display(void)
 {
-	//Unifor shader variable location
-	GLuint model_view;
-	GLuint projection;
-
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	glUseProgram(program);
-
-	model_view = glGetUniformLocation(program, "model_view");
-	projection = glGetUniformLocation(program, "projection");
+	PROFILE_ZONE("display");
+	ProfileZone pass("pass: setup");
+	glStatsBeginFrame();
+	if (gpu_timing) gpu_timer.beginFrame();
+	gpu_timer.beginPass(PassSetup);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	if (ground_pattern != requested_ground_pattern) requestGroundTexture();
+	pollGroundTexture();
+	pollImages();
+	if (ground_filter != applied_ground_filter) applyGroundFilter();
+	dynamic_stream.beginFrame();
+	StreamAllocation sphere_instances = packSphereInstances();
 
 	//Set up Projection Matrix
 	mat4 p = Perspective(fovy, aspect, zNear, zFar);
-	glUniformMatrix4fv(projection, 1, GL_TRUE, p); //GL_TRUE: matrix is row-major
 
 	//Set up camera orientation
 	vec4	at(0.0, 0.0, 0.0, 1.0);//at(-7.0, -3.0, 10.0, 0.0);
 	vec4    up(0.0, 1.0, 0.0, 0.0);
-	mat4 mv = LookAt(eye, at, up);
-
-	//Fog option
-	glUniform1i(glGetUniformLocation(program, "Fog"), fog);
+	mat4 view = LookAt(eye, at, up);
+	mat3 normal_matrix = NormalMatrix(view, 1); // 1: model_view involves non-uniform scaling, 0: otherwise, 1 is always correct, 0 is faster
+
+	std::function<void(int)> on_pass = [&](int queue_pass) {
+		pass.restart(pass_zones[queue_pass]);
+		gpu_timer.beginPass(queue_pass);
+	};
+
+	UniformBlock& frame = render_queue.frameUniforms(main_program);
+	bool floor_shadow = if_shadow && eye.y >= 0 && shadow_technique != ShadowDepthMaps;
+	bool masked = floor_shadow && shadow_technique == ShadowMaskTexture;
+	bool mapped = if_shadow && lighting && shadow_technique == ShadowDepthMaps;
+	bool deferred = lighting && light_model == LightDeferred && !mapped;
+	bool baked = lighting && baked_floor && !deferred;
+	if (baked && floor_lightmap.changed(lightmapKey())) bakeFloorLightmap();
+	if (lighting && !extra_lights.empty()) uploadExtraLights(view);
+
+	//The programs lighting the floor and the spheres. With the prepass they go into the depth buffer first, through
+	//the same programs (an invariant gl_Position puts them at the same depth), and their color passes only test it:
+	//the lighting then runs only where they are visible, even with discard in the shader since depth writes are off.
+	//Not the floor drawn twice, whose shadows must be drawn over it before it is in the depth buffer.
+	//Deferred, they go into the G-buffer through the PER_PIXEL build, unlit draws through either.
+	int floor_program = lighting && light_model != LightPerVertex ? per_pixel_program : main_program;
+	int sphere_program = lighting && light_model >= LightPerPixel ? per_pixel_program : main_program;
+	bool floor_prepass = depth_prepass && (!floor_shadow || shadow_technique != ShadowTwice);
+	if (masked && shadow_mask.changed(shadowMaskKey())) {
+		//----------SHADOW MASK----------
+		//The shadows from above into the floor-space mask, in a flush of their own before the frame's
+		frame.clear();
+		frame.set("projection", shadow_mask.projection());
+		int coverage;
+		UniformBlock& mask_material = unlitMaterial(&coverage);
+		mask_material.set("sphere", 1); //The lattice cuts the shadow too
+		mask_material.set("shadow_mask_write", 1);
+
+		DrawPacket& shadows = render_queue.add(PassShadow, main_program, coverage, shadow_geometry);
+		shadows.state.depth_test = false;
+		shadows.state.depth_write = false;
+		shadows.state.polygon_mode = shadow_fill_mode;
+		shadows.uniforms.set("view", sphere_shadow);
+		shadows.uniforms.set("instanced", 1);
+		shadows.instance_buffer = dynamic_stream.buffer();
+		shadows.instance_offset = sphere_instances.offset;
+		shadows.instance_count = sphere_instances.ptr ? int(sphere_instances.size / sizeof(InstanceData)) : 0;
+
+		shadow_mask.begin();
+		render_queue.flush(on_pass);
+		shadow_mask.end();
+	}
+	if (mapped) renderShadowMaps(view, on_pass);
+	frame.clear();
+	frame.set("projection", p);
+	frame.set("Fog", fog);
+	if (mapped) {
+		mat4 receivers[ShadowMaps::MaxLayers];
+		float offsets[ShadowMaps::MaxLayers];
+		shadow_maps.receiverMatrices(view, receivers);
+		shadow_maps.offsets(offsets);
+		frame.set("shadow_matrix", receivers, shadow_maps.layers());
+		frame.set("shadow_offset", offsets, shadow_maps.layers());
+		frame.set("shadow_cascades", shadow_maps.cascades());
+		frame.set("shadow_splits", shadow_maps.splits());
+		frame.set("shadow_local_on", shadow_maps.layerActive(shadow_maps.localLayer()));
+		frame.set("shadow_texel", 1.0f / shadow_maps.size());
+		frame.set("shadow_pcf", shadow_pcf);
+	}
+	if (floor_program != main_program || sphere_program != main_program) render_queue.frameUniforms(per_pixel_program) = frame;
+	if (deferred) {
+		render_queue.frameUniforms(deferred_program) = frame;
+		render_queue.frameUniforms(deferred_program).set("z_near", zNear);
+	}
 
+	//Materials: every uniform the shaders read for the draws using them, since the queue may reorder those draws
+	int ground, shadow, axis, sphere;
+	UniformBlock& ground_material = unlitMaterial(&ground, deferred);
 	//Must be called after mv for light position is set up
-	if (lighting) SetUp_Lighting_Uniform_Vars(mv, global_ground_product, ambient_ground_product, diffuse_ground_product, specular_ground_product);
-	glUniform1i(glGetUniformLocation(program, "texture_2D"), 0);
-	glUniform1i(glGetUniformLocation(program, "texture_Dimension"), 2);
+	if (lighting) SetUp_Lighting_Uniform_Vars(ground_material, view, global_ground_product, ambient_ground_product, diffuse_ground_product, specular_ground_product);
+	if (lighting) {
+		ground_material.set("MaterialDiffuse", ground_diffuse);
+		ground_material.set("MaterialSpecular", ground_specular);
+	}
+	ground_material.set("lighting", lighting);
+	ground_material.set("texture_flag", checker_ground);
+	ground_material.set("texture_Dimension", 2);
+	ground_material.set("texture_layer", LayerGround);
+	ground_material.set("texture_image", image_layers[ImageGround] >= 0 && image_base_level >= 0);
+	ground_material.set("image_layer", image_layers[ImageGround]);
+	ground_material.set("shadow_mask_on", masked);
+	ground_material.set("shadow_maps_on", mapped);
+	ground_material.set("lightmap_on", baked);
+	if (baked) ground_material.set("lightmap_bounds", floor_lightmap.bounds());
+	if (masked) {
+		//Blending off: the shadow replaces the floor color, as when drawn over it
+		ground_material.set("shadow_mask_bounds", shadow_mask.bounds());
+		ground_material.set("shadow_mask_color", if_blending ? sphere_shadow_colors[0] : color4(sphere_shadow_colors[0].x, sphere_shadow_colors[0].y, sphere_shadow_colors[0].z, 1.0));
+	}
 
-	if (if_shadow && eye.y >= 0) {
+	unlitMaterial(&shadow, deferred).set("sphere", 1); //The lattice cuts the shadow too
+	unlitMaterial(&axis, deferred);
 
-		//----------FLOOR IN FRAME BUFFER----------
-		//Set up Model-view matrix
+	UniformBlock& sphere_material = unlitMaterial(&sphere, deferred);
+	if (lighting) SetUp_Lighting_Uniform_Vars(sphere_material, view, global_sphere_product, ambient_sphere_product, diffuse_sphere_product, specular_sphere_product);
+	if (lighting) {
+		sphere_material.set("MaterialDiffuse", sphere_diffuse);
+		sphere_material.set("MaterialSpecular", sphere_specular);
+	}
+	sphere_material.set("lighting", lighting && sphere_lighting);
+	sphere_material.set("texture_flag", sphere_texture_flag);
+	sphere_material.set("texture_Dimension", sphere_texture_flag == 1 ? 1 : 2);
+	sphere_material.set("texture_layer", sphere_texture_flag == 1 ? LayerStripe : LayerGround);
+	sphere_material.set("texture_image", sphere_texture_flag == 2 && image_layers[ImageSphere] >= 0 && image_base_level >= 0);
+	sphere_material.set("image_layer", image_layers[ImageSphere]);
+	sphere_material.set("sphere_texture_dir", sphere_texture_dir);
+	sphere_material.set("sphere_texture_space", sphere_texture_space);
+	sphere_material.set("calculate_texCoord", 1);
+	sphere_material.set("sphere", 1);
+	sphere_material.set("use_material", 1);
+	sphere_material.set("shadow_maps_on", mapped);
+
+	if (depth_prepass) {
+		//----------DEPTH PREPASS----------
+		//No lighting, and the fragment shader stops once the lattice has cut the spheres
+		int prepass_floor, prepass_sphere;
+		for (int m = 0; m < 2; m++) {
+			UniformBlock& material = unlitMaterial(m == 0 ? &prepass_floor : &prepass_sphere);
+			material.set("sphere", m);
+			material.set("shadow_mask_write", 1);
+		}
 
-		//Disable drawing to Z
-		glDepthMask(GL_FALSE);
-		//
+		if (floor_prepass) {
+			DrawPacket& floor = render_queue.add(PassDepthPrepass, floor_program, prepass_floor, floor_geometry);
+			floor.state.color_write = false;
+			floor.uniforms.set("model_view", view);
+			floor.uniforms.set("instanced", 0);
+		}
+		DrawPacket& spheres_depth = render_queue.add(PassDepthPrepass, sphere_program, prepass_sphere, flat ? flat_sphere_geometry : smooth_sphere_geometry);
+		spheres_depth.state.color_write = false;
+		spheres_depth.state.polygon_mode = shadow_fill_mode;
+		spheres_depth.uniforms.set("view", view);
+		spheres_depth.uniforms.set("instanced", 1);
+		spheres_depth.instance_buffer = dynamic_stream.buffer();
+		spheres_depth.instance_offset = sphere_instances.offset;
+		spheres_depth.instance_count = sphere_instances.ptr ? int(sphere_instances.size / sizeof(InstanceData)) : 0;
+	}
 
-		mv = LookAt(eye, at, up);
-		mv = mv * Translate(0.0, 0.0, 0.0) * Scale(1.0, 1.0, 1.0);// * Rotate(0.0, 0.0, 0.0, 0.0);
-		//Set up material for floor
-		mat3 normal_matrix = NormalMatrix(mv, 1); // 1: model_view involves non-uniform scaling, 0: otherwise, 1 is always correct, 0 is faster
-		glUniformMatrix3fv(glGetUniformLocation(program, "Normal_Matrix"), 1, GL_TRUE, normal_matrix);
-		glUniformMatrix4fv(model_view, 1, GL_TRUE, mv); // GL_TRUE: matrix is row-major
+	if (masked) {
+		//----------FLOOR, SHADOWS FROM THE MASK----------
+		DrawPacket& floor = render_queue.add(PassFloorColor, floor_program, ground, floor_geometry);
+		floor.state.depth_write = !floor_prepass;
+		floor.state.depth_equal = floor_prepass;
+		floor.uniforms.set("model_view", view);
+		floor.uniforms.set("Normal_Matrix", normal_matrix);
+		floor.uniforms.set("instanced", 0);
+	}
+	else if (floor_shadow && shadow_technique == ShadowStencil) {
+		//----------FLOOR, MARKED IN THE STENCIL----------
+		DrawPacket& floor = render_queue.add(PassFloorColor, floor_program, ground, floor_geometry);
+		floor.state.stencil = RenderState::StencilMark;
+		floor.state.depth_write = !floor_prepass;
+		floor.state.depth_equal = floor_prepass;
+		floor.uniforms.set("model_view", view);
+		floor.uniforms.set("Normal_Matrix", normal_matrix);
+		floor.uniforms.set("instanced", 0);
 
-		//Draw Floor
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL); //Wireframe mode, GL_FILL to fill
-		draw(floor_buffer,
-			sizeof(floor_points) / sizeof(floor_points[0]), GL_TRIANGLES, lighting, true, checker_ground);
+		//----------SPHERE SHADOW---------
+		//Only on the visible floor, and once per pixel however many shadow triangles cover it (no double blending).
+		//The shadow lies in the floor plane, so the stencil decides instead of the depth test.
+		DrawPacket& shadows = render_queue.add(PassShadow, main_program, shadow, shadow_geometry);
+		shadows.state.depth_test = false;
+		shadows.state.depth_write = false;
+		shadows.state.stencil = RenderState::StencilOnce;
+		shadows.state.blend = if_blending ? RenderState::BlendAlpha : RenderState::BlendOff;
+		shadows.state.masked_targets = deferred ? GBuffer::DecalTargets : 0;
+		shadows.state.polygon_mode = shadow_fill_mode;
+		shadows.uniforms.set("view", view * sphere_shadow);
+		shadows.uniforms.set("instanced", 1);
+		shadows.instance_buffer = dynamic_stream.buffer();
+		shadows.instance_offset = sphere_instances.offset;
+		shadows.instance_count = sphere_instances.ptr ? int(sphere_instances.size / sizeof(InstanceData)) : 0;
+	}
+	else if (floor_shadow) {
+		//----------FLOOR IN FRAME BUFFER----------
+		//Not in the depth buffer, so the shadow can be drawn over it
+		DrawPacket& floor = render_queue.add(PassFloorColor, floor_program, ground, floor_geometry);
+		floor.state.depth_write = false;
+		floor.uniforms.set("model_view", view);
+		floor.uniforms.set("Normal_Matrix", normal_matrix);
+		floor.uniforms.set("instanced", 0);
 
 		//----------SPHERE SHADOW---------
+		DrawPacket& shadows = render_queue.add(PassShadow, main_program, shadow, shadow_geometry);
+		shadows.state.depth_write = false;
+		shadows.state.blend = if_blending ? RenderState::BlendAlpha : RenderState::BlendOff;
+		shadows.state.masked_targets = deferred ? GBuffer::DecalTargets : 0;
+		shadows.state.polygon_mode = shadow_fill_mode;
+		shadows.uniforms.set("view", view * sphere_shadow);
+		shadows.uniforms.set("instanced", 1);
+		shadows.instance_buffer = dynamic_stream.buffer();
+		shadows.instance_offset = sphere_instances.offset;
+		shadows.instance_count = sphere_instances.ptr ? int(sphere_instances.size / sizeof(InstanceData)) : 0;
+	}
+
+	//----------FLOOR IN DEPTH BUFFER----------
+	//Only depth when the floor is already in the frame buffer, which needs no lighting per pixel
+	if (!floor_shadow || shadow_technique == ShadowTwice) {
+		DrawPacket& floor = render_queue.add(PassFloorDepth, floor_shadow ? main_program : floor_program, ground, floor_geometry);
+		floor.state.color_write = !floor_shadow;
+		floor.state.depth_write = !floor_prepass;
+		floor.state.depth_equal = floor_prepass;
+		floor.uniforms.set("model_view", view);
+		floor.uniforms.set("Normal_Matrix", normal_matrix);
+		floor.uniforms.set("instanced", 0);
+	}
+
+	//----------AXIS----------
+	DrawPacket& axes = render_queue.add(PassAxis, main_program, axis, axis_geometry);
+	axes.state.polygon_mode = GL_LINE;
+	axes.uniforms.set("model_view", view * Scale(10.0, 10.0, 10.0));
+	axes.uniforms.set("instanced", 0);
 
-		if (if_blending) {
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-			glEnable(GL_BLEND);
+	//----------SPHERE----------
+	//Each instance's model matrix comes from the instance buffer; the shader forms view * model
+	DrawPacket& spheres_packet = render_queue.add(PassSphere, sphere_program, sphere, flat ? flat_sphere_geometry : smooth_sphere_geometry);
+	spheres_packet.state.polygon_mode = shadow_fill_mode;
+	spheres_packet.state.depth_write = !depth_prepass;
+	spheres_packet.state.depth_equal = depth_prepass;
+	spheres_packet.uniforms.set("view", view);
+	spheres_packet.uniforms.set("instanced", 1);
+	spheres_packet.instance_buffer = dynamic_stream.buffer();
+	spheres_packet.instance_offset = sphere_instances.offset;
+	spheres_packet.instance_count = sphere_instances.ptr ? int(sphere_instances.size / sizeof(InstanceData)) : 0;
+
+	if (deferred) {
+		//----------DEFERRED LIGHTS----------
+		//The scene's lights over the whole screen, the extra ones each over its sphere; the light colors stand for the
+		//products, the materials are in the G-buffer
+		int lights;
+		UniformBlock& lights_material = render_queue.addMaterial(&lights);
+		SetUp_Lighting_Uniform_Vars(lights_material, view, color4(0.0, 0.0, 0.0, 0.0), light_ambient, light_diffuse, light_specular);
+		for (int i = 0; i <= light_count; i++) {
+			if (i == light_count && extra_lights.empty()) break;
+			DrawPacket& light = render_queue.add(PassDeferredLights, deferred_program, lights, quad_geometry);
+			light.state.depth_test = false;
+			light.state.depth_write = false;
+			light.state.blend = RenderState::BlendAdd;
+			light.uniforms.set("deferred_pass", i < light_count ? 0 : 1);
+			light.uniforms.set("light_index", i);
+			if (i == light_count) {
+				light.instance_buffer = extra_light_buffer; //No attributes, only the instance count
+				light.instance_count = (int)extra_lights.size();
+			}
 		}
 
-		glUniform1i(glGetUniformLocation(program, "sphere"), 1);
-		mv = LookAt(eye, at, up);
-		mv = mv * sphere_shadow * Translate(sphere_position) * Scale(1.0, 1.0, 1.0) * sphere_rotation;
-		glUniformMatrix4fv(model_view, 1, GL_TRUE, mv);
+		//----------RESOLVE----------
+		DrawPacket& resolve = render_queue.add(PassDeferredResolve, deferred_program, lights, quad_geometry);
+		resolve.state.depth_equal = true; //Shadows past the floor's edge are at the cleared depth
+		resolve.uniforms.set("deferred_pass", 2);
+
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		if (!gbuffer.isInitialized()) gbuffer.init(gbuffer_first_unit, viewport[2], viewport[3]);
+		else gbuffer.resize(viewport[2], viewport[3]);
+		gbuffer.begin();
+		render_queue.flush([&](int queue_pass) {
+			if (queue_pass == PassDeferredLights) gbuffer.beginLights();
+			else if (queue_pass == PassDeferredResolve) gbuffer.end();
+			on_pass(queue_pass);
+		});
+	}
+	else render_queue.flush(on_pass);
 
-		glPolygonMode(GL_FRONT_AND_BACK, shadow_fill_mode);
-		draw(sphere_shadow_buffer,
-			triangle_count * 3);
+	//Particle System Draw, with its own program
+	pass.restart("pass: particles");
+	gpu_timer.beginPass(PassParticles);
+	firework.draw(view, p);
 
-		//Disable drawing to frame buffer
-		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-		//
-		glUniform1i(glGetUniformLocation(program, "sphere"), 0);
+	gpu_timer.endFrame();
+	glStatsEndFrame();
 
-		glDisable(GL_BLEND);
-		//Enable drawing to Z
-		glDepthMask(GL_TRUE);
-		//
+	if (frame_capture.isOpen()) {
+		pass.restart("pass: capture");
+		GLint viewport[4];
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		frame_capture.capture(headless ? headlessFramebuffer() : 0, viewport[2], viewport[3]);
 	}
-	
-	//----------FLOOR IN DEPTH BUFFER----------
-	mv = LookAt(eye, at, up);
-	mv = mv * Translate(0.0, 0.0, 0.0) * Scale(1.0, 1.0, 1.0);// * Rotate(0.0, 0.0, 0.0, 0.0);
-	glUniformMatrix4fv(model_view, 1, GL_TRUE, mv); // GL_TRUE: matrix is row-major
-
-	if (!if_shadow || eye.y < 0) {
-		mat3 normal_matrix = NormalMatrix(mv, 1); // 1: model_view involves non-uniform scaling, 0: otherwise, 1 is always correct, 0 is faster
-		glUniformMatrix3fv(glGetUniformLocation(program, "Normal_Matrix"), 1, GL_TRUE, normal_matrix);
 
+	pass.restart("pass: present");
+	dynamic_stream.endFrame();
+	if (gpu_hud && !headless) drawGpuHud();
+	if (!headless) glutSwapBuffers();
+	displayed_frames++;
+}
+//---------------------------------------------------------
+//SetUp_Lighting_Uniform_Vars() for the software rasterizer
+void SetUp_Soft_Lighting_Uniform_Vars(SoftUniforms& u, mat4 mv, color4 GlobalAmbientProduct, float* AmbientProduct, float* DiffuseProduct, float* SpecularProduct)
+{
+	u.GlobalAmbientProduct = GlobalAmbientProduct;
+	u.LightCount = light_count;
+	for (int i = 0; i < light_count; i++) {
+		u.AmbientProduct[i] = color4(AmbientProduct[i * 4], AmbientProduct[i * 4 + 1], AmbientProduct[i * 4 + 2], AmbientProduct[i * 4 + 3]);
+		u.DiffuseProduct[i] = color4(DiffuseProduct[i * 4], DiffuseProduct[i * 4 + 1], DiffuseProduct[i * 4 + 2], DiffuseProduct[i * 4 + 3]);
+		u.SpecularProduct[i] = color4(SpecularProduct[i * 4], SpecularProduct[i * 4 + 1], SpecularProduct[i * 4 + 2], SpecularProduct[i * 4 + 3]);
+
+		u.Exponent[i] = exponent[i];
+		u.Cutoff[i] = cutoff[i];
+		u.ConstAtt[i] = const_att[i];
+		u.LinearAtt[i] = linear_att[i];
+		u.QuadAtt[i] = quad_att[i];
+		u.LightType[i] = light_type[i];
+
+		//The Light Position in Eye Frame
+		u.LightPosition[i] = mv * vec4(light_position[i].x, light_position[i].y, light_position[i].z, 1.0);
 	}
 
-	//Draw Floor
+	//The first light direction is already in the eye frame, the second one is a focus point in the world frame
+	vec4 light_dir_eye = mv * vec4(light_dir[1].x, light_dir[1].y, light_dir[1].z, 1.0);
+	u.LightDirection[0] = light_dir[0];
+	u.LightDirection[1] = vec3(light_dir_eye.x, light_dir_eye.y, light_dir_eye.z);
+	u.Shininess = shininess;
+}
+//---------------------------------------------------------
+/*
+	display() on the software rasterizer: the same passes with the same
+	uniforms and state changes, in the same order. The particles are left
+	out, they have their own shaders.
+*/
+SoftRasterizer soft_raster;
+std::vector<SoftInstance> soft_instances;
 
-	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL); //Wireframe mode, GL_FILL to fill
-	draw(floor_buffer,
-		sizeof(floor_points) / sizeof(floor_points[0]), GL_TRIANGLES, lighting, true, checker_ground);
+void displaySoftware(SoftRasterizer& r)
+{
+	PROFILE_ZONE("display software");
+	SoftUniforms& u = r.uniforms;
+	SoftRenderState& state = r.state;
 
-	//Enable drawing to framebuffer
-	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-	//
+	r.clear(color4(0.529, 0.807, 0.92, 0.0));
 
-	//----------AXIS----------
-	//Set up Model-view matrix
-	mv = LookAt(eye, at, up);
-	mv = mv * Translate(0.0, 0.0, 0.0) * Scale(10.0, 10.0, 10.0);// * Rotate(0.0, 0.0, 0.0, 0.0);
-	glUniformMatrix4fv(model_view, 1, GL_TRUE, mv); // GL_TRUE: matrix is row-major
+	//Same instance records as packSphereInstances()
+	soft_instances.resize(spheres.size());
+	for (size_t i = 0; i < spheres.size(); i++) {
+		soft_instances[i].model = Translate(spheres[i].position) * spheres[i].rotation;
+		soft_instances[i].material = (float)spheres[i].material;
+	}
 
-	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE); //Wireframe mode, GL_FILL to fill
-	draw(axis_buffer, sizeof(axis_point)/sizeof(axis_point[0]), GL_LINES);
+	SoftMesh floor_mesh = { floor_points, floor_normals, floor_colors, floor_texCoord, sizeof(floor_points) / sizeof(floor_points[0]) };
+	SoftMesh shadow_mesh = { sphere_points, NULL, sphere_shadow_colors, NULL, triangle_count * 3 };
+	SoftMesh axis_mesh = { axis_point, NULL, axis_color, NULL, sizeof(axis_point) / sizeof(axis_point[0]) };
+	SoftMesh sphere_mesh = { sphere_points, flat ? sphere_flat_normals : sphere_smooth_normals, sphere_colors, NULL, triangle_count * 3 };
 
-	//----------SPHERE----------
-	//Setup sphere material
-	mv = LookAt(eye, at, up);
-	if (lighting) SetUp_Lighting_Uniform_Vars(mv, global_sphere_product, ambient_sphere_product, diffuse_sphere_product, specular_sphere_product);
-	if (sphere_texture_flag == 1) { 
-		glUniform1i(glGetUniformLocation(program, "texture_1D"), 1); 
-		glUniform1i(glGetUniformLocation(program, "texture_Dimension"), 1);
-	}
-	else if (sphere_texture_flag == 2) { 
-		glUniform1i(glGetUniformLocation(program, "texture_2D"), 0); 
-		glUniform1i(glGetUniformLocation(program, "texture_Dimension"), 2);
-	}
-	glUniform1i(glGetUniformLocation(program, "sphere_texture_dir"), sphere_texture_dir);
-	glUniform1i(glGetUniformLocation(program, "sphere_texture_space"), sphere_texture_space);
-	glUniform1i(glGetUniformLocation(program, "calculate_texCoord"), 1);
-	glUniform1i(glGetUniformLocation(program, "sphere"), 1);
-	glUniform1i(glGetUniformLocation(program, "lattice_on"), lattice_on);
-	glUniform1i(glGetUniformLocation(program, "lattice_upright"), lattice_upright);
-
-	mv = mv * Translate(sphere_position) * Scale(1.0, 1.0, 1.0) * sphere_rotation;//Rotate(angle, direction_vec.z, -direction_vec.y, -direction_vec.x);
-	mat3 normal_matrix = NormalMatrix(mv, 1); // 1: model_view involves non-uniform scaling, 0: otherwise, 1 is always correct, 0 is faster
-	glUniformMatrix3fv(glGetUniformLocation(program, "Normal_Matrix"), 1, GL_TRUE, normal_matrix);
-	glUniformMatrix4fv(model_view, 1, GL_TRUE, mv); // GL_TRUE: matrix is row-major
-	glPolygonMode(GL_FRONT_AND_BACK, shadow_fill_mode);
-
-	if (flat)
-		draw(flat_sphere_buffer, triangle_count * 3, GL_TRIANGLES, lighting && sphere_lighting, true, sphere_texture_flag);
-	else
-		draw(smooth_sphere_buffer, triangle_count * 3, GL_TRIANGLES, lighting && sphere_lighting, true, sphere_texture_flag);
-	glUniform1i(glGetUniformLocation(program, "calculate_texCoord"), 0);
-	glUniform1i(glGetUniformLocation(program, "sphere"), 0);
+	u.projection = Perspective(fovy, aspect, zNear, zFar);
 
-	//Particle System Draw
-	mv = LookAt(eye, at, up);
-	firework.draw(mv, p);
+	vec4	at(0.0, 0.0, 0.0, 1.0);
+	vec4    up(0.0, 1.0, 0.0, 0.0);
+	mat4 mv = LookAt(eye, at, up);
 
-	glutSwapBuffers();
-}
-//---------------------------------------------------------
-void idle(void)
-{
-	//sphere rolling
-	current_tick++;
-	int phase_num = (int)(current_tick / tick_bet_points) % 3;
-	vec3 begin, end;
+	u.Fog = fog;
+	if (lighting) SetUp_Soft_Lighting_Uniform_Vars(u, mv, global_ground_product, ambient_ground_product, diffuse_ground_product, specular_ground_product);
+	u.texture_Dimension = 2;
 
-	if (phase_num == 0) {
-		begin = A;
-		end = B;
-	}
-	else if (phase_num == 1) {
-		begin = B;
-		end = C;
-	}
-	else {
-		begin = C;
-		end = A;
+	//Light 1 on the floor from the lightmap, as in display()
+	bool baked = lighting && baked_floor;
+	if (baked && floor_lightmap.changed(lightmapKey())) bakeFloorLightmap();
+	u.lightmap = floor_lightmap.texels();
+	u.lightmap_size = floor_lightmap.texelsPerSide();
+	u.lightmap_bounds = floor_lightmap.bounds();
+
+	if (if_shadow && eye.y >= 0) {
+		//----------FLOOR IN FRAME BUFFER----------
+		state.depth_write = false;
+		u.Normal_Matrix = NormalMatrix(mv, 1);
+		u.model_view = mv;
+
+		state.wireframe = false;
+		u.lighting = lighting;
+		u.lightmap_on = baked;
+		u.texture_flag = checker_ground;
+		r.drawTriangles(floor_mesh);
+		u.lightmap_on = false;
+
+		//----------SPHERE SHADOW---------
+		state.blend = if_blending;
+		u.sphere = true;
+		u.view = mv * sphere_shadow;
+		u.use_material = false;
+
+		state.wireframe = shadow_fill_mode == GL_LINE;
+		u.lighting = false;
+		u.texture_flag = 0;
+		r.drawTriangles(shadow_mesh, soft_instances.data(), (int)soft_instances.size());
+
+		state.color_write = false;
+		u.sphere = false;
+		state.blend = false;
+		state.depth_write = true;
 	}
 
-	point3 sphere_old_position = sphere_position;
-	sphere_position = lerp(begin, end,
-		(float)((int)current_tick % (int)tick_bet_points) / tick_bet_points);
+	//----------FLOOR IN DEPTH BUFFER----------
+	u.model_view = mv;
+	if (!if_shadow || eye.y < 0) u.Normal_Matrix = NormalMatrix(mv, 1);
 
-	angle = find_dist(sphere_old_position, sphere_position) * 180.0 / pi;
-	direction_vec = sphere_position - sphere_old_position;
+	state.wireframe = false;
+	u.lighting = lighting;
+	u.lightmap_on = baked;
+	u.texture_flag = checker_ground;
+	r.drawTriangles(floor_mesh);
+	u.lightmap_on = false;
+	state.color_write = true;
 
-	vec3 rotation = cross(vec3(0.0f, 1.0f, 0.0f), direction_vec); //Floor normal cross direction vec
-	sphere_rotation = Rotate(angle, rotation.x, rotation.y, rotation.z) * sphere_rotation;
+	//----------AXIS----------
+	u.model_view = mv * Scale(10.0, 10.0, 10.0);
+	u.lighting = false;
+	u.texture_flag = 0;
+	r.drawLines(axis_mesh);
 
-	firework.update();
+	//----------SPHERE----------
+	if (lighting) SetUp_Soft_Lighting_Uniform_Vars(u, mv, global_sphere_product, ambient_sphere_product, diffuse_sphere_product, specular_sphere_product);
+	if (sphere_texture_flag == 1) u.texture_Dimension = 1;
+	else if (sphere_texture_flag == 2) u.texture_Dimension = 2;
+	u.sphere_texture_dir = sphere_texture_dir;
+	u.sphere_texture_space = sphere_texture_space;
+	u.calculate_texCoord = true;
+	u.sphere = true;
+	u.lattice_on = lattice_on;
+	u.lattice_upright = lattice_upright;
+
+	u.view = mv;
+	u.use_material = true;
+	state.wireframe = shadow_fill_mode == GL_LINE;
+	u.lighting = lighting && sphere_lighting;
+	u.texture_flag = sphere_texture_flag;
+	r.drawTriangles(sphere_mesh, soft_instances.data(), (int)soft_instances.size());
+	u.calculate_texCoord = false;
+	u.sphere = false;
+
+	r.finish();
+}
+//---------------------------------------------------------
+//Moves one sphere instance to its path position at the current tick, plus its contact offset
+void advanceSphere(SphereInstance& sphere)
+{
+	float tick = current_tick + sphere.tick_offset;
+	int phase_num = (int)(tick / tick_bet_points) % 3;
+	vec3 begin = sphere.path[phase_num], end = sphere.path[(phase_num + 1) % 3];
 
-	glutPostRedisplay();
+	sphere.offset *= 0.99; //Pushed spheres drift back onto their paths
+	sphere.position = lerp(begin, end,
+		(float)((int)tick % (int)tick_bet_points) / tick_bet_points) + sphere.offset;
 }
 //---------------------------------------------------------
-void keyboard(unsigned char key, int x, int y)
+//Rolls the sphere by the distance it actually moved, including contact pushes
+void rollSphere(SphereInstance& sphere, const point3& sphere_old_position)
 {
-	switch (key) {
-	case 'X': eye[0] += 1.0; break;
-	case 'x': eye[0] -= 1.0; break;
-	case 'Y': eye[1] += 1.0; break;
-	case 'y': eye[1] -= 1.0; break;
+	float angle = find_dist(sphere_old_position, sphere.position) * 180.0 / pi;
+	vec3 direction_vec = sphere.position - sphere_old_position;
+	if (angle == 0.0) return;
+
+	vec3 rotation = cross(vec3(0.0f, 1.0f, 0.0f), direction_vec); //Floor normal cross direction vec
+	if (length(rotation) < 0.00001) return; //Too short a move for Rotate(), which exits on it
+	sphere.rotation = Rotate(angle, rotation.x, rotation.y, rotation.z) * sphere.rotation;
+}
+//---------------------------------------------------------
+//Rebuilds the sphere grid and separates overlapping spheres along the floor
+void resolveSphereContacts()
+{
+	int n = (int)spheres.size();
+	sphere_x.resize(n); sphere_y.resize(n); sphere_z.resize(n);
+	for (int i = 0; i < n; i++) {
+		sphere_x[i] = spheres[i].position.x;
+		sphere_y[i] = spheres[i].position.y;
+		sphere_z[i] = spheres[i].position.z;
+	}
+
+	sphere_grid.build(sphere_x.data(), sphere_y.data(), sphere_z.data(), n, sphere_radius);
+	if (!sphere_collisions || n < 2) return;
+
+	sphere_grid.findPairs(sphere_contacts);
+
+	//Each sphere of a pair takes half of the overlap; spheres stay on the floor, so only x and z move
+	const float max_offset = 2.0 * sphere_radius;
+	for (size_t k = 0; k < sphere_contacts.size(); k++) {
+		const GridContact& c = sphere_contacts[k];
+		vec3 push(0.5 * c.depth * c.nx, 0.0, 0.5 * c.depth * c.nz);
+		SphereInstance& a = spheres[c.a];
+		SphereInstance& b = spheres[c.b];
+		a.position -= push; a.offset -= push;
+		b.position += push; b.offset += push;
+	}
+
+	//Crowded scenes would otherwise push spheres arbitrarily far from their paths
+	for (int i = 0; i < n; i++) {
+		float len = length(spheres[i].offset);
+		if (len > max_offset) {
+			vec3 excess = spheres[i].offset * (1.0 - max_offset / len);
+			spheres[i].offset -= excess;
+			spheres[i].position -= excess;
+		}
+	}
+}
+//---------------------------------------------------------
+void idle(void)
+{
+	if (fixedClock()) advanceFixedClock();
+	PROFILE_ZONE("simulation");
+
+	//sphere rolling
+	ProfileZone step("sphere paths");
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	current_tick++;
+
+	static std::vector<point3> old_position;
+	old_position.resize(spheres.size());
+	for (size_t i = 0; i < spheres.size(); i++) {
+		old_position[i] = spheres[i].position;
+		advanceSphere(spheres[i]);
+	}
+	step.restart("sphere contacts");
+	resolveSphereContacts();
+	step.restart("sphere rolling");
+	for (size_t i = 0; i < spheres.size(); i++)
+		rollSphere(spheres[i], old_position[i]);
+	sphere_update_us += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count();
+
+	if (++sphere_cost_frames == sphere_report_interval) {
+		double per_1k = 1000.0 / spheres.size() / sphere_cost_frames;
+		printf("Sphere instances: %d, CPU per frame per 1k instances: update %.1f us, pack %.1f us\n",
+			(int)spheres.size(), sphere_update_us * per_1k, sphere_pack_us * per_1k);
+		sphere_update_us = sphere_pack_us = 0.0;
+		sphere_cost_frames = 0;
+	}
+
+	step.restart("particle update");
+	firework.update();
+
+	postRedisplay();
+}
+//---------------------------------------------------------
+//Headless runs step the animation themselves
+void setIdle(bool animating)
+{
+	if (!headless) glutIdleFunc(animating ? idle : NULL);
+}
+//---------------------------------------------------------
+void keyboard(unsigned char key, int x, int y)
+{
+	switch (key) {
+	case 'X': eye[0] += 1.0; break;
+	case 'x': eye[0] -= 1.0; break;
+	case 'Y': eye[1] += 1.0; break;
+	case 'y': eye[1] -= 1.0; break;
 	case 'Z': eye[2] += 1.0; break;
 	case 'z': eye[2] -= 1.0; break;
 	case 'v': case 'V': sphere_texture_dir = 0; break;
@@ -795,13 +1698,14 @@ void keyboard(unsigned char key, int x, int y)
 	case 'l': case 'L': lattice_on = !lattice_on; break;
 	case 'u': case 'U': lattice_upright = true; break;
 	case 't': case 'T': lattice_upright = false; break;
+	case 'g': case 'G': toggleGpuHud(); break;
 	case 'b': case 'B': 
 		if (animation_flag == 0) {
-			glutIdleFunc(idle);
+			setIdle(true);
 			animation_flag = 2;
 		} break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void mouse(int button, int state, int x, int y)
@@ -810,8 +1714,7 @@ void mouse(int button, int state, int x, int y)
 		switch (button) {
 		case GLUT_RIGHT_BUTTON:
 			if (animation_flag > 0) {
-				if (animation_flag == 2) glutIdleFunc(NULL);
-				else glutIdleFunc(idle);
+				setIdle(animation_flag != 2);
 
 				animation_flag = (animation_flag * 2) % 3; // 2 -> 1, 1 -> 2
 			}
@@ -820,7 +1723,7 @@ void mouse(int button, int state, int x, int y)
 			break;
 		}
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void main_menu(int id)
@@ -841,8 +1744,18 @@ void main_menu(int id)
 			shadow_fill_mode = GL_FILL;
 			sphere_lighting = true;
 		}
+		break;
+	case 4:
+		sphere_collisions = !sphere_collisions;
+		break;
+	case 5:
+		toggleGpuHud();
+		break;
+	case 6:
+		depth_prepass = !depth_prepass;
+		break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void shadow_menu(int id)
@@ -854,8 +1767,20 @@ void shadow_menu(int id)
 	case 2:
 		if_shadow = false;
 		break;
+	case 3:
+		shadow_technique = ShadowTwice;
+		break;
+	case 4:
+		shadow_technique = ShadowStencil;
+		break;
+	case 5:
+		shadow_technique = ShadowMaskTexture;
+		break;
+	case 6:
+		shadow_technique = ShadowDepthMaps;
+		break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void light_menu(int id)
@@ -870,8 +1795,26 @@ void light_menu(int id)
 		lighting = false;
 		sphere_lighting = false;
 		break;
+	case 3:
+		baked_floor = true;
+		break;
+	case 4:
+		baked_floor = false;
+		break;
+	case 5:
+		light_model = LightPerVertex;
+		break;
+	case 6:
+		light_model = LightPerPixelFloor;
+		break;
+	case 7:
+		light_model = LightPerPixel;
+		break;
+	case 8:
+		light_model = LightDeferred;
+		break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void shading_menu(int id)
@@ -884,7 +1827,7 @@ void shading_menu(int id)
 		flat = false;
 		break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void lightsource_menu(int id)
@@ -897,7 +1840,7 @@ void lightsource_menu(int id)
 		light_type[1] = 2;
 		break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void checker_menu(int id)
@@ -909,20 +1852,44 @@ void checker_menu(int id)
 	case 2:
 		checker_ground = true;
 		break;
+	case 3: case 4: case 5:
+		ground_filter = id - 3;
+		break;
+	case 6: case 7: case 8:
+		ground_pattern = id == 6 ? TextureDesc::Checker : id == 7 ? TextureDesc::Noise : TextureDesc::Gradient;
+		break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void sphere_texture_menu(int id)
 {
 	sphere_texture_flag = id;
-	glutPostRedisplay();
+	postRedisplay();
+}
+//---------------------------------------------------------
+void sphere_count_menu(int id)
+{
+	setSphereCount(id);
+	sphere_update_us = sphere_pack_us = 0.0;
+	sphere_cost_frames = 0;
+	postRedisplay();
 }
 //---------------------------------------------------------
+const int EmitterMenuBase = 100;
 void particle_menu(int id)
 {
-	firework.setParticleActive(id);
-	glutPostRedisplay();
+	//EmitterMenuBase + N: N emitters, drawn by the same instanced draw
+	if (id > EmitterMenuBase) {
+		firework.setEmitterCount(id - EmitterMenuBase);
+		postRedisplay();
+		return;
+	}
+
+	//0: off, 1: GPU ballistic, 2: CPU with floor bounce, 3: CPU streamed through a mapped ring buffer
+	if (id > 0) firework.setMode((ParticleSystem::Mode)(id - 1));
+	firework.setParticleActive(id > 0);
+	postRedisplay();
 }
 //---------------------------------------------------------
 void fog_menu(int id)
@@ -945,7 +1912,7 @@ void fog_menu(int id)
 		fog = 3;
 		break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void shadow_blending_menu(int id)
@@ -959,30 +1926,102 @@ void shadow_blending_menu(int id)
 		if_blending = true;
 		break;
 	}
-	glutPostRedisplay();
+	postRedisplay();
 }
 //---------------------------------------------------------
 void reshape(int width, int height)
 {
 	glViewport(0, 0, width, height);
 	aspect = (GLfloat)width / (GLfloat)height;
-	glutPostRedisplay();
+	postRedisplay();
+}
+//---------------------------------------------------------
+//The menus by their index in input logs; only append, old logs refer to them by position
+enum { MenuMain, MenuShadow, MenuLight, MenuShading, MenuLightSource, MenuChecker, MenuSphereTexture,
+	MenuSphereCount, MenuParticle, MenuFog, MenuShadowBlending, MenuCount };
+void (*const menu_callbacks[MenuCount])(int) = { main_menu, shadow_menu, light_menu, shading_menu, lightsource_menu,
+	checker_menu, sphere_texture_menu, sphere_count_menu, particle_menu, fog_menu, shadow_blending_menu };
+
+//The callbacks GLUT is given: each records its event (when recording) and passes it on
+void recordKeyboard(unsigned char key, int x, int y)
+{
+	input_log.record(displayed_frames, InputLog::Keyboard, 0, key, x, y);
+	keyboard(key, x, y);
+}
+void recordMouse(int button, int state, int x, int y)
+{
+	input_log.record(displayed_frames, InputLog::Mouse, button, state, x, y);
+	mouse(button, state, x, y);
+}
+void recordReshape(int width, int height)
+{
+	input_log.record(displayed_frames, InputLog::Reshape, 0, 0, width, height);
+	reshape(width, height);
+}
+template <int M> void recordMenu(int id)
+{
+	input_log.record(displayed_frames, InputLog::Menu, M, id);
+	menu_callbacks[M](id);
+}
+//---------------------------------------------------------
+//Calls the callbacks of the events logged before frame
+void replayInput(int frame)
+{
+	while (const InputLog::Event* e = input_log.next(frame)) {
+		switch (e->type) {
+		case InputLog::Keyboard: keyboard((unsigned char)e->value, e->x, e->y); break;
+		case InputLog::Mouse: mouse(e->code, e->value, e->x, e->y); break;
+		case InputLog::Reshape: reshape(e->x, e->y); break;
+		case InputLog::Menu:
+			//Quit ended the recording; the replay ends at the End event instead
+			if (e->code == MenuMain && e->value == 2) break;
+			if (e->code < MenuCount) menu_callbacks[e->code](e->value);
+			break;
+		}
+	}
 }
 //---------------------------------------------------------
-void loadSphereFile() 
+void saveInputLog()
 {
+	if (input_log.save(record_file, displayed_frames))
+		printf("Wrote %s (%d events, %d frames)\n", record_file, (int)input_log.events().size(), displayed_frames);
+	else
+		printf("Error: cannot write %s\n", record_file);
+}
+//---------------------------------------------------------
+void loadSphereFile(const char* path)
+{
+	PROFILE_ZONE("load sphere file");
 	std::ifstream f;
 	char fpath[1024];
 
+	if (path != NULL) {
+		f.open(path);
+		if (!f.is_open()) {
+			printf("Error: cannot open sphere file %s\n", path);
+			exit(1);
+		}
+	}
+	else if (headless) {
+		printf("Error: a headless run needs --sphere FILE\n");
+		exit(1);
+	}
+
 	while (!f.is_open()) {
 		printf("\nPlease enter the file path >>");
-		scanf("%s", fpath);
+		if (scanf("%1023s", fpath) != 1) {
+			printf("\nError: no sphere file given\n");
+			exit(1);
+		}
 
 		f.open(fpath);
 
 		if (!f.is_open())
 			printf("Invalid path, please try again");
+		else
+			path = fpath;
 	}
+	input_log.sphere_file = path;
 
 	int read_count = 0, vertex_count = 0;
 	GLfloat x, y, z;
@@ -1013,6 +2052,7 @@ void loadSphereFile()
 	}
 
 	//Initialize normals
+	ProfileZone stage("sphere normals");
 	sphere_flat_normals = new vec3[triangle_count * 3];
 	for (int i = 0; i < triangle_count * 3; i += 3) {
 		vec3 u = sphere_points[i + 1] - sphere_points[i],
@@ -1027,6 +2067,7 @@ void loadSphereFile()
 		sphere_smooth_normals[i] = normalize(sphere_points[i]);
 
 	//Initialize colors
+	stage.restart("sphere colors");
 	sphere_colors = new color4[triangle_count * 3];
 	for (int i = 0; i < triangle_count * 3; i++)
 		sphere_colors[i] = color4(1.0, 0.84, 0.0, 1.0);
@@ -1037,15 +2078,1114 @@ void loadSphereFile()
 		sphere_shadow_colors[i] = color4(0.25, 0.25, 0.25, 0.65);
 }
 //---------------------------------------------------------
+/*
+	Broad phase benchmark, no window needed: `count` bodies (sphere or particle
+	sized) random-walk over the floor; every step the grid is rebuilt and all
+	overlapping pairs are found. Reports build and query times against a 60 Hz
+	frame, and checks the pair count against brute force for small counts.
+*/
+void benchmarkBroadPhase(int count)
+{
+	const int steps = 60;
+	const float body_radius = 0.01;
+	findFloorBounds();
+
+	std::vector<float> x(count), y(count), z(count);
+	for (int i = 0; i < count; i++) {
+		x[i] = -5.0 + 10.0 * (rand() % 10000) / 10000.0;
+		y[i] = 1.0 * (rand() % 10000) / 10000.0;
+		z[i] = -4.0 + 12.0 * (rand() % 10000) / 10000.0;
+	}
+
+	SpatialGrid grid;
+	grid.setBounds(floor_min, floor_max, 2.0 * body_radius);
+	std::vector<GridContact> pairs;
+
+	double build_sum = 0.0, query_sum = 0.0, build_min = 1e30, query_min = 1e30;
+	for (int step = 0; step < steps; step++) {
+		for (int i = 0; i < count; i++) {
+			x[i] += 0.002 * ((rand() % 201) - 100) / 100.0;
+			z[i] += 0.002 * ((rand() % 201) - 100) / 100.0;
+		}
+		grid.build(x.data(), y.data(), z.data(), count, body_radius);
+		grid.findPairs(pairs);
+
+		build_sum += grid.lastBuildMs(); build_min = fmin(build_min, grid.lastBuildMs());
+		query_sum += grid.lastQueryMs(); query_min = fmin(query_min, grid.lastQueryMs());
+	}
+
+	printf("Broad phase: %d bodies, %d cells, %d threads, %d pairs\n",
+		count, grid.cellCount(), ThreadPool::instance().size(), (int)pairs.size());
+	printf("  build: avg %.3f ms, min %.3f ms\n", build_sum / steps, build_min);
+	printf("  query: avg %.3f ms, min %.3f ms\n", query_sum / steps, query_min);
+	printf("  total: avg %.3f ms of a 16.667 ms frame\n", (build_sum + query_sum) / steps);
+
+	if (count <= 20000) {
+		int brute = 0;
+		for (int i = 0; i < count; i++)
+			for (int j = i + 1; j < count; j++) {
+				float dx = x[j] - x[i], dy = y[j] - y[i], dz = z[j] - z[i];
+				if (dx * dx + dy * dy + dz * dz < 4.0 * body_radius * body_radius) brute++;
+			}
+		printf("  brute force pairs: %d (%s)\n", brute, brute == (int)pairs.size() ? "match" : "MISMATCH");
+	}
+}
+//---------------------------------------------------------
+void key_option(int key)
+{
+	keyboard((unsigned char)key, 0, 0);
+}
+//---------------------------------------------------------
+void printUsage(const char* name)
+{
+	printf("Usage: %s [options]\n", name);
+	printf("  --sphere FILE              sphere file to load (asked for when omitted)\n");
+	printf("  --data-dir DIR             directory holding the shaders and sphere files\n");
+	printf("  --headless                 render offscreen, time every frame and print statistics\n");
+	printf("  --frames N                 frames to render headless (default 300)\n");
+	printf("  --warmup N                 untimed frames before those (default 2)\n");
+	printf("  --size WxH                 framebuffer or window size (default 512x512)\n");
+	printf("  --step MS                  fixed simulation step per frame (headless default 16.667)\n");
+	printf("  --no-animate               headless: do not start rolling\n");
+	printf("  --summary-only             headless: print only the summary, not every frame\n");
+	printf("  --screenshot FILE.ppm      headless: write the last frame\n");
+	printf("  --compare FILE.ppm         headless: diff the last frame against FILE, exit 1 if a pixel differs\n");
+	printf("  --capture PATTERN.png|FILE.y4m  every frame to PNG files named by a printf pattern of the frame\n");
+	printf("                             number (frame%%04d.png), or to one Y4M stream; read back without stalls\n");
+	printf("  --tolerance N              by more than N in a channel (default 2)\n");
+	printf("  --perceptual               compare 3x3 neighborhood means by luma and chroma, not channel by channel\n");
+	printf("  --regress DIR              render the regression cases headless, each in a process of its own, and\n");
+	printf("                             check their last frames (--perceptual) and frame times against DIR\n");
+	printf("  --regress-update DIR       render them and write their images and frame time budgets to DIR\n");
+	printf("  --only NAME                regress only the cases whose name contains NAME\n");
+	printf("  --budget-margin PCT        how far over its budget a case's frame time may be (default 25)\n");
+	printf("  --repeat N                 runs of each case, the median timed (default 3)\n");
+	printf("  --software                 like --headless, but render with the CPU rasterizer (no OpenGL)\n");
+	printf("  --sizes WxH,WxH,...        software: resolutions to time (default --size)\n");
+	printf("  --raytrace                 ray trace --frames frames (default 10) of each of sphere.8/128/256/1024.txt,\n");
+	printf("                             or only of --sphere, and report Mrays/s (no OpenGL)\n");
+	printf("  --profile FILE.json        record CPU zones, write them as a Chrome trace at exit\n");
+	printf("  --gpu-csv FILE.csv         write the GPU time of every pass of every frame ('g' shows them on screen)\n");
+	printf("  --record FILE              log the keys, mouse buttons, menus and reshapes of this session (fixed clock)\n");
+	printf("  --replay FILE              like --headless, but replay a logged session frame for frame instead of\n");
+	printf("                             --frames; it brings its step, size, sphere file and scene settings\n");
+	printf("  --eye X,Y,Z                viewer position\n");
+	printf("  --spheres N                number of rolling spheres\n");
+	printf("  --shadow on|off            --blend-shadow on|off\n");
+	printf("  --shadow-mode twice|stencil|mask|maps  shadow over the floor drawn twice, or once with a stencil mask,\n");
+	printf("                             or sampled by the floor from a texture redrawn only when the shadows move;\n");
+	printf("                             or shadow maps of both lights on every lit surface\n");
+	printf("  --shadow-map-size N        --cascades 1-4               --shadow-pcf 0-3 (default 1024, 3, 1)\n");
+	printf("  --lighting on|off          --shading flat|smooth        --light spot|point\n");
+	printf("  --floor-lighting baked|vertex  light 1 on the floor from a lightmap baked on the CPU, or per vertex\n");
+	printf("  --per-pixel off|floor|all  light per vertex, or per pixel the floor or everything\n");
+	printf("  --floor-grid N             the floor as N x N quads (default 1)\n");
+	printf("  --depth-prepass            draw the lit surfaces depth only first, then shade the visible pixels\n");
+	printf("  --deferred                 draw the surfaces into a G-buffer, then light them per light and fog them\n");
+	printf("                             (forward per pixel with shadow maps)\n");
+	printf("  --lights N                 the two lights and N - 2 point lights over the floor (default 2)\n");
+	printf("  --fog none|linear|exp|exp2\n");
+	printf("  --ground-texture on|off    --sphere-texture none|lines|checker\n");
+	printf("  --ground-filter nearest|trilinear|anisotropic  sampling of the ground texture\n");
+	printf("  --ground-texture-size N    the ground pattern at N x N texels, a power of two (default 32)\n");
+	printf("  --mip-filter box|kaiser    the filter of the ground texture's mip chain (default kaiser)\n");
+	printf("  --ground-pattern checker|noise|gradient  above 32 texels generated in the background\n");
+	printf("  --texture-cache FILE|off   where generated textures are kept between runs (default textures.cache)\n");
+	printf("  --ground-image FILE        a BC compressed DDS or KTX2 file on the ground, streamed smallest level first\n");
+	printf("  --sphere-image FILE        the same on the sphere, in place of its checkerboard\n");
+	printf("  --lattice off|upright|tilted\n");
+	printf("  --particles off|gpu|cpu|streamed\n");
+	printf("  --emitters N               firework emitters, all drawn by one instanced draw, 1-%d (default 1)\n",
+		firework.maxEmitters());
+	printf("  --wireframe                --no-collisions\n");
+	printf("  --bench-broadphase [N]     broad phase benchmark of N bodies (default 100000), no window needed\n");
+	printf("  --bench-lighting           headless: per pixel lighting of the 2 triangle floor against per vertex\n");
+	printf("                             lighting of finer floor grids, for time and difference\n");
+	printf("  --bench-deferred           headless: forward per vertex and per pixel against deferred lighting\n");
+	printf("                             at 2, 32 and 512 lights\n");
+	printf("  --bench-filter             headless: mip chain build times, and the ground filters timed on the GPU\n");
+	printf("                             from the viewer and from near the floor\n");
+	printf("  --bench-capture            headless: frame time with PNG and Y4M capture, through the PBO ring and\n");
+	printf("                             by plain glReadPixels, at 1920x1080 unless --size is given\n");
+}
+//---------------------------------------------------------
+//Index of value in the NULL terminated list of choices, or -1
+int choice(const char* value, const char* const* choices)
+{
+	for (int i = 0; choices[i] != NULL; i++)
+		if (strcmp(value, choices[i]) == 0) return i;
+	return -1;
+}
+//---------------------------------------------------------
+/*
+	Reads the command line. Window and run settings go to the option globals,
+	scene settings are queued as menu selections so they go through exactly the
+	same code as the menus. Arguments not starting with "--" are left to GLUT.
+*/
+bool parseOptions(int argc, char** argv)
+{
+	static const char* const on_off[] = { "on", "off", NULL };
+	static const char* const fogs[] = { "none", "linear", "exp", "exp2", NULL };
+	static const char* const shadings[] = { "flat", "smooth", NULL };
+	static const char* const lights[] = { "spot", "point", NULL };
+	static const char* const sphere_textures[] = { "none", "lines", "checker", NULL };
+	static const char* const lattices[] = { "off", "upright", "tilted", NULL };
+	static const char* const particles[] = { "off", "gpu", "cpu", "streamed", NULL };
+	static const char* const shadow_modes[] = { "twice", "stencil", "mask", "maps", NULL };
+	static const char* const floor_lightings[] = { "baked", "vertex", NULL };
+	static const char* const per_pixel[] = { "off", "floor", "all", NULL };
+	static const char* const ground_filters[] = { "nearest", "trilinear", "anisotropic", NULL };
+	static const char* const mip_filters[] = { "box", "kaiser", NULL };
+	static const char* const ground_patterns[] = { "checker", "noise", "gradient", NULL };
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		if (strncmp(arg, "--", 2) != 0) continue;
+
+		//Flags
+		if (strcmp(arg, "--headless") == 0) { headless = true; continue; }
+		if (strcmp(arg, "--software") == 0) { headless = software = true; continue; }
+		if (strcmp(arg, "--raytrace") == 0) { headless = raytrace = true; continue; }
+		if (strcmp(arg, "--no-animate") == 0) { start_animated = false; continue; }
+		if (strcmp(arg, "--summary-only") == 0) { print_frames = false; continue; }
+		if (strcmp(arg, "--wireframe") == 0) { scene_options.push_back({ main_menu, 3 }); continue; }
+		if (strcmp(arg, "--no-collisions") == 0) { scene_options.push_back({ main_menu, 4 }); continue; }
+		if (strcmp(arg, "--depth-prepass") == 0) { scene_options.push_back({ main_menu, 6 }); continue; }
+		if (strcmp(arg, "--bench-lighting") == 0) { headless = bench_lighting = true; continue; }
+		if (strcmp(arg, "--deferred") == 0) { scene_options.push_back({ light_menu, 8 }); continue; }
+		if (strcmp(arg, "--bench-deferred") == 0) { headless = bench_deferred = true; continue; }
+		if (strcmp(arg, "--bench-filter") == 0) { headless = bench_filter = true; continue; }
+		if (strcmp(arg, "--bench-capture") == 0) { headless = bench_capture = true; continue; }
+		if (strcmp(arg, "--bench-broadphase") == 0) {
+			//The body count is optional
+			bench_broadphase = i + 1 < argc && argv[i + 1][0] != '-' ? atoi(argv[++i]) : 100000;
+			if (bench_broadphase <= 0) {
+				printf("Error: bad value '%s' for %s\n", argv[i], arg);
+				return false;
+			}
+			continue;
+		}
+		if (strcmp(arg, "--perceptual") == 0) { perceptual_compare = true; continue; }
+
+		//Options with a value
+		if (i + 1 >= argc) {
+			printf("Error: %s needs a value\n", arg);
+			return false;
+		}
+		const char* value = argv[++i];
+		int k = 0;
+
+		if (strcmp(arg, "--sphere") == 0) sphere_file = value;
+		else if (strcmp(arg, "--screenshot") == 0) screenshot_file = value;
+		else if (strcmp(arg, "--compare") == 0) compare_file = value;
+		else if (strcmp(arg, "--capture") == 0) capture_file = value;
+		else if (strcmp(arg, "--regress") == 0) regress_dir = value;
+		else if (strcmp(arg, "--regress-update") == 0) { regress_dir = value; regress_update = true; }
+		else if (strcmp(arg, "--only") == 0) regress_only = value;
+		else if (strcmp(arg, "--budget-margin") == 0) k = (budget_margin = atof(value)) >= 0.0 ? 0 : -1;
+		else if (strcmp(arg, "--repeat") == 0) k = (regress_repeats = atoi(value)) > 0 ? 0 : -1;
+		else if (strcmp(arg, "--tolerance") == 0) k = (compare_tolerance = atoi(value)) >= 0 ? 0 : -1;
+		else if (strcmp(arg, "--profile") == 0) profile_file = value;
+		else if (strcmp(arg, "--gpu-csv") == 0) gpu_csv_file = value;
+		else if (strcmp(arg, "--texture-cache") == 0) texture_cache_file = strcmp(value, "off") == 0 ? NULL : value;
+		else if (strcmp(arg, "--ground-image") == 0) image_files[ImageGround] = value;
+		else if (strcmp(arg, "--sphere-image") == 0) image_files[ImageSphere] = value;
+		else if (strcmp(arg, "--record") == 0) record_file = value;
+		else if (strcmp(arg, "--replay") == 0) { replay_file = value; headless = true; }
+		else if (strcmp(arg, "--data-dir") == 0) {
+			if (chdir(value) != 0) {
+				printf("Error: cannot change to directory %s\n", value);
+				return false;
+			}
+		}
+		else if (strcmp(arg, "--frames") == 0) k = (raytrace_frames = headless_frames = atoi(value)) > 0 ? 0 : -1;
+		else if (strcmp(arg, "--shadow-map-size") == 0) k = (shadow_map_size = atoi(value)) >= 16 ? 0 : -1;
+		else if (strcmp(arg, "--cascades") == 0)
+			k = (shadow_cascades = atoi(value)) >= 1 && shadow_cascades <= ShadowMaps::MaxCascades ? 0 : -1;
+		else if (strcmp(arg, "--shadow-pcf") == 0) k = (shadow_pcf = atoi(value)) >= 0 && shadow_pcf <= 3 ? 0 : -1;
+		else if (strcmp(arg, "--floor-grid") == 0) k = (floor_grid = atoi(value)) >= 1 && floor_grid <= 512 ? 0 : -1;
+		else if (strcmp(arg, "--lights") == 0) k = (total_lights = atoi(value)) >= light_count && total_lights <= 4096 ? 0 : -1;
+		else if (strcmp(arg, "--ground-texture-size") == 0)
+			k = (ground_texture_size = atoi(value)) >= ImageWidth && ground_texture_size <= 8192 &&
+				(ground_texture_size & (ground_texture_size - 1)) == 0 ? 0 : -1;
+		else if (strcmp(arg, "--mip-filter") == 0) {
+			if ((k = choice(value, mip_filters)) >= 0) mip_filter = (MipChain::Filter)k;
+		}
+		else if (strcmp(arg, "--warmup") == 0) k = (warmup_frames = atoi(value)) >= 0 ? 0 : -1;
+		else if (strcmp(arg, "--step") == 0) k = (fixed_step_ms = atof(value)) > 0.0 ? 0 : -1;
+		else if (strcmp(arg, "--size") == 0) {
+			k = sscanf(value, "%dx%d", &frame_width, &frame_height) == 2 && frame_width > 0 && frame_height > 0 ? 0 : -1;
+			frame_size_set = true;
+		}
+		else if (strcmp(arg, "--sizes") == 0) {
+			int w, h, n;
+			for (const char* at = value; sscanf(at, "%dx%d%n", &w, &h, &n) == 2 && w > 0 && h > 0; at += n + (at[n] == ',')) {
+				software_sizes.push_back(w);
+				software_sizes.push_back(h);
+				if (at[n] != ',') break;
+			}
+			if (software_sizes.empty()) k = -1;
+		}
+		else if (strcmp(arg, "--eye") == 0) {
+			float x, y, z;
+			if (sscanf(value, "%f,%f,%f", &x, &y, &z) == 3) init_eye = eye = vec4(x, y, z, 1.0);
+			else k = -1;
+		}
+		else if (strcmp(arg, "--spheres") == 0) {
+			if (atoi(value) > 0) scene_options.push_back({ sphere_count_menu, atoi(value) });
+			else k = -1;
+		}
+		else if (strcmp(arg, "--shadow") == 0) {
+			if ((k = choice(value, on_off)) >= 0) scene_options.push_back({ shadow_menu, k + 1 });
+		}
+		else if (strcmp(arg, "--shadow-mode") == 0) {
+			if ((k = choice(value, shadow_modes)) >= 0) scene_options.push_back({ shadow_menu, k + 3 });
+		}
+		else if (strcmp(arg, "--blend-shadow") == 0) {
+			if ((k = choice(value, on_off)) >= 0) scene_options.push_back({ shadow_blending_menu, 2 - k });
+		}
+		else if (strcmp(arg, "--lighting") == 0) {
+			if ((k = choice(value, on_off)) >= 0) scene_options.push_back({ light_menu, k + 1 });
+		}
+		else if (strcmp(arg, "--floor-lighting") == 0) {
+			if ((k = choice(value, floor_lightings)) >= 0) scene_options.push_back({ light_menu, k + 3 });
+		}
+		else if (strcmp(arg, "--per-pixel") == 0) {
+			if ((k = choice(value, per_pixel)) >= 0) scene_options.push_back({ light_menu, k + 5 });
+		}
+		else if (strcmp(arg, "--shading") == 0) {
+			if ((k = choice(value, shadings)) >= 0) scene_options.push_back({ shading_menu, k + 1 });
+		}
+		else if (strcmp(arg, "--light") == 0) {
+			if ((k = choice(value, lights)) >= 0) scene_options.push_back({ lightsource_menu, k + 1 });
+		}
+		else if (strcmp(arg, "--fog") == 0) {
+			if ((k = choice(value, fogs)) >= 0) scene_options.push_back({ fog_menu, k + 1 });
+		}
+		else if (strcmp(arg, "--ground-texture") == 0) {
+			if ((k = choice(value, on_off)) >= 0) scene_options.push_back({ checker_menu, 2 - k });
+		}
+		else if (strcmp(arg, "--ground-pattern") == 0) {
+			if ((k = choice(value, ground_patterns)) >= 0) scene_options.push_back({ checker_menu, k + 6 });
+		}
+		else if (strcmp(arg, "--ground-filter") == 0) {
+			if ((k = choice(value, ground_filters)) >= 0) scene_options.push_back({ checker_menu, k + 3 });
+		}
+		else if (strcmp(arg, "--sphere-texture") == 0) {
+			if ((k = choice(value, sphere_textures)) >= 0) scene_options.push_back({ sphere_texture_menu, k });
+		}
+		else if (strcmp(arg, "--lattice") == 0) {
+			if ((k = choice(value, lattices)) > 0) {
+				scene_options.push_back({ key_option, 'l' });
+				scene_options.push_back({ key_option, k == 1 ? 'u' : 't' });
+			}
+		}
+		else if (strcmp(arg, "--particles") == 0) {
+			if ((k = choice(value, particles)) >= 0) scene_options.push_back({ particle_menu, k });
+		}
+		else if (strcmp(arg, "--emitters") == 0) {
+			int n = atoi(value);
+			if (n >= 1 && n <= firework.maxEmitters()) scene_options.push_back({ particle_menu, EmitterMenuBase + n });
+			else k = -1;
+		}
+		else {
+			printf("Error: unknown option %s\n", arg);
+			return false;
+		}
+
+		if (k < 0) {
+			printf("Error: bad value '%s' for %s\n", value, arg);
+			return false;
+		}
+	}
+	return true;
+}
+//---------------------------------------------------------
+void applySceneOptions()
+{
+	for (int i = 0; i < (int)scene_options.size(); i++) {
+		const SceneOption& option = scene_options[i];
+		//Logged as the menu or key they stand for, so a replay needs no options
+		if (option.apply == key_option)
+			input_log.record(displayed_frames, InputLog::Keyboard, 0, option.id);
+		for (int m = 0; m < MenuCount; m++)
+			if (option.apply == menu_callbacks[m]) input_log.record(displayed_frames, InputLog::Menu, m, option.id);
+		option.apply(option.id);
+	}
+}
+//---------------------------------------------------------
+//--capture into frame_capture; a Y4M stream plays at the fixed step's rate
+bool openCapture()
+{
+	int fps = (int)(1000.0 / (fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0) + 0.5);
+	if (frame_capture.open(capture_file, fps)) return true;
+	printf("Error: --capture %s: %s\n", capture_file, frame_capture.error().c_str());
+	return false;
+}
+//---------------------------------------------------------
+//Also the atexit() handler of the windowed runs
+void closeCapture()
+{
+	if (!frame_capture.isOpen()) return;
+	frame_capture.close();
+	const FrameCapture::Stats& s = frame_capture.stats();
+	double n = s.captured > 0 ? s.captured : 1;
+	printf("Captured %d frames to %s: %d written, %d failed, %.1f MB\n", s.captured, capture_file, s.written, s.failed,
+		s.bytes / 1048576.0);
+	printf("  GL thread %.3f ms per frame (%.3f waiting on reads, %.3f on the writer), writer %.2f ms per frame\n",
+		s.gl_ms / n, s.fence_wait_ms / n, s.queue_wait_ms / n, s.write_ms / n);
+}
+//---------------------------------------------------------
+void printTimingRow(const char* name, const TimingSeries& series)
+{
+	printf("  %-8s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", name, series.min(), series.average(),
+		series.percentile(50), series.percentile(90), series.percentile(99), series.max());
+}
+//---------------------------------------------------------
+/*
+	Headless benchmark: renders headless_frames frames into an offscreen
+	framebuffer on a fixed clock, so every run animates the same frames
+	(after warmup_frames untimed ones).
+	Each frame is timed on the CPU (idle + display) and on the GPU with a
+	GL_TIME_ELAPSED query; the queries rotate through a small ring and are
+	read back query_count frames late so reading them never stalls the frame.
+
+	With --replay the run is a recorded session instead: its frames, step,
+	size and sphere file, and before each frame the input logged before it
+	(scene settings included), in the order GLUT called them: the idle step
+	after the previous frame, then the input, then display().
+*/
+int runHeadless()
+{
+	if (replay_file != NULL) {
+		if (!input_log.load(replay_file)) {
+			printf("Error: cannot read input log %s\n", replay_file);
+			return 1;
+		}
+		fixed_step_ms = input_log.step_ms;
+		frame_width = input_log.width;
+		frame_height = input_log.height;
+		headless_frames = input_log.endFrame();
+		if (sphere_file == NULL && !input_log.sphere_file.empty()) sphere_file = input_log.sphere_file.c_str();
+		start_animated = false;
+		scene_options.clear();
+		if (headless_frames == 0) {
+			printf("Error: %s has no frames\n", replay_file);
+			return 1;
+		}
+	}
+	if (!createHeadlessContext(frame_width, frame_height)) return 1;
+
+	printf("Renderer: %s\n", glGetString(GL_RENDERER));
+	printf("OpenGL version supported %s\n", glGetString(GL_VERSION));
+
+	useFixedClock(fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0);
+	init();
+	applySceneOptions();
+	reshape(frame_width, frame_height);
+	if (start_animated) animation_flag = 2;
+
+	//The first frames pay for shader and buffer setup in the driver
+	for (int frame = 0; frame < warmup_frames; frame++) {
+		if (animation_flag == 2) idle();
+		display();
+	}
+	glFinish();
+	if (capture_file != NULL && !openCapture()) return 1;
+
+	const int query_count = 4;
+	GLuint queries[query_count];
+	glGenQueries(query_count, queries);
+
+	std::vector<double> cpu_ms(headless_frames), gpu_ms(headless_frames);
+	GLStats gl_total;
+	render_queue.resetStats();
+	int mask_updates = shadow_mask.updates();
+	for (int i = 0; i < ShadowMaps::MaxLayers; i++) shadow_casters[i] = 0;
+	for (int frame = 0; frame < headless_frames + query_count; frame++) {
+		GLuint query = queries[frame % query_count];
+		if (frame >= query_count) {
+			GLuint64 elapsed_ns = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed_ns);
+			gpu_ms[frame - query_count] = elapsed_ns / 1.0e6;
+		}
+		if (frame >= headless_frames) continue; //Only draining the ring
+
+		double start = wallTimeMs();
+		if (animation_flag == 2) idle();
+		if (replay_file != NULL) replayInput(frame);
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		display();
+		glEndQuery(GL_TIME_ELAPSED);
+		cpu_ms[frame] = wallTimeMs() - start;
+		gl_total += gl_stats_last;
+	}
+	glDeleteQueries(query_count, queries);
+	closeCapture();
+
+	TimingSeries cpu, gpu;
+	for (int frame = 0; frame < headless_frames; frame++) {
+		if (print_frames)
+			printf("frame %4d  cpu %8.3f ms  gpu %8.3f ms\n", frame, cpu_ms[frame], gpu_ms[frame]);
+		cpu.add(cpu_ms[frame]);
+		gpu.add(gpu_ms[frame]);
+	}
+
+	printf("Headless run: %d frames at %dx%d, %.3f ms per step, %d spheres\n",
+		headless_frames, frame_width, frame_height, fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0, (int)spheres.size());
+	if (replay_file != NULL)
+		printf("Replayed %s: %d events, recorded over %.1f s\n", replay_file, (int)input_log.events().size() - 1,
+			input_log.events().back().wall_ms / 1000.0);
+	printf("  %-8s %9s %9s %9s %9s %9s %9s\n", "ms", "min", "avg", "p50", "p90", "p99", "max");
+	printTimingRow("cpu", cpu);
+	printTimingRow("gpu", gpu);
+
+	gpu_timer.flush();
+	gpu_timer.closeCSV();
+	printf("GPU passes, last %d frames (%d dropped while waiting on the GPU):\n", std::min(headless_frames, (int)GpuTimer::Window), gpu_timer.droppedFrames());
+	std::string passes = gpu_timer.summary();
+	for (size_t start = 0, end; (end = passes.find('\n', start)) != std::string::npos; start = end + 1)
+		printf("  %s\n", passes.substr(start, end - start).c_str());
+	printf("GL calls per frame:\n");
+	printGLStats(gl_total, headless_frames);
+	const RenderQueue::Stats& queue = render_queue.stats();
+	double n = headless_frames;
+	printf("Render queue per frame: %.1f packets, %.1f program binds, %.1f state changes, %.1f geometry binds, %.1f materials\n",
+		queue.packets / n, queue.program_binds / n, queue.state_changes / n, queue.geometry_binds / n, queue.material_binds / n);
+	printf("  uniforms: %.1f uploaded, %.1f skipped as already held\n", queue.uniform_uploads / n, queue.uniforms_skipped / n);
+	if (shadow_technique == ShadowMaskTexture)
+		printf("Shadow mask: %d updates in %d frames\n", shadow_mask.updates() - mask_updates, headless_frames);
+	if (lighting && baked_floor)
+		printf("Floor lightmap: %d bakes, the last in %.2f ms (%dx%d texels, %d threads)\n", floor_lightmap.bakes(),
+			floor_lightmap.lastBakeMs(), lightmap_size, lightmap_size, ThreadPool::instance().size());
+	if (shadow_technique == ShadowDepthMaps) {
+		printf("Shadow maps: %d cascades and the light's map, %dx%d, %dx%d PCF; spheres drawn per frame into each:",
+			shadow_maps.cascades(), shadow_maps.size(), shadow_maps.size(), 2 * shadow_pcf + 1, 2 * shadow_pcf + 1);
+		for (int i = 0; i < shadow_maps.layers(); i++) printf(" %.1f", shadow_casters[i] / n);
+		printf("\n");
+	}
+
+	int result = 0;
+	std::vector<unsigned char> rgb(frame_width * frame_height * 3);
+	if (screenshot_file != NULL || compare_file != NULL) readHeadlessPixels(frame_width, frame_height, rgb.data());
+	if (screenshot_file != NULL) {
+		if (writePPM(screenshot_file, frame_width, frame_height, rgb.data()))
+			printf("Wrote %s\n", screenshot_file);
+		else {
+			printf("Error: cannot write %s\n", screenshot_file);
+			result = 1;
+		}
+	}
+	if (compare_file != NULL) {
+		int width, height;
+		std::vector<unsigned char> reference;
+		if (!readPPM(compare_file, &width, &height, &reference)) {
+			printf("Error: cannot read %s\n", compare_file);
+			result = 1;
+		}
+		else if (width != frame_width || height != frame_height) {
+			printf("Compare with %s: FAILED, it is %dx%d\n", compare_file, width, height);
+			result = 1;
+		}
+		else {
+			ImageDiff d = perceptual_compare ? comparePerceptual(rgb.data(), reference.data(), width, height, compare_tolerance) :
+				compareImages(rgb.data(), reference.data(), width, height, compare_tolerance);
+			printf("Compare with %s: %s, %d pixels differ by more than %d%s (max %d, mean %.4f)\n", compare_file,
+				d.pixels_over == 0 ? "ok" : "FAILED", d.pixels_over, compare_tolerance, perceptual_compare ? " perceptually" : "",
+				d.max_channel, d.mean_channel);
+			if (d.pixels_over > 0) result = 1;
+		}
+	}
+
+	destroyHeadlessContext();
+	return result;
+}
+//---------------------------------------------------------
+/*
+	Lighting benchmark: the floor lit per pixel as its two triangles, against
+	the floor lit per vertex as finer and finer grids, each without and with
+	the depth prepass. The animation is paused, so every run draws the same
+	frame, and the lightmap is off, so the floor is lit in the shaders only;
+	the spheres stay lit per vertex. A run times headless_frames frames
+	(after warmup_frames), each until glFinish() returns, and compares its
+	frame with the per pixel one.
+	Interpolated lighting never quite matches at the hard edge of the spot's
+	cone, so equal quality is the first grid with fewer than one pixel in a
+	thousand off by more than --tolerance in a channel.
+*/
+int runLightingBenchmark()
+{
+	if (!createHeadlessContext(frame_width, frame_height)) return 1;
+	printf("Renderer: %s\n", glGetString(GL_RENDERER));
+
+	useFixedClock(fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0);
+	init();
+	applySceneOptions();
+	reshape(frame_width, frame_height);
+	baked_floor = false;
+	gpu_timing = false;
+
+	//ms per frame without and with the prepass; the frame read back is drawn without
+	std::vector<unsigned char> rgb(frame_width * frame_height * 3), reference;
+	auto measure = [&](int model, int grid, double* ms) {
+		light_model = model;
+		render_queue.setVertexCount(floor_geometry, uploadFloor(grid));
+		for (int prepass = 1; prepass >= 0; prepass--) {
+			depth_prepass = prepass != 0;
+			for (int frame = 0; frame < warmup_frames; frame++) display();
+			glFinish();
+			TimingSeries frames;
+			for (int frame = 0; frame < headless_frames; frame++) {
+				double start = wallTimeMs();
+				display();
+				glFinish();
+				frames.add(wallTimeMs() - start);
+			}
+			ms[prepass] = frames.average();
+		}
+		readHeadlessPixels(frame_width, frame_height, rgb.data());
+	};
+	auto print = [&](const char* name, int grid, const double* ms, const ImageDiff* d) {
+		char label[64];
+		sprintf(label, "%s, %dx%d", name, grid, grid);
+		printf("  %-20s %8d %9.3f %9.3f", label, 6 * grid * grid, ms[0], ms[1]);
+		if (d) printf(" %5d %8.4f %9d", d->max_channel, d->mean_channel, d->pixels_over);
+		printf("\n");
+	};
+
+	printf("Lighting benchmark: %dx%d, %d frames per run, %d spheres, paused\n",
+		frame_width, frame_height, headless_frames, (int)spheres.size());
+	printf("  %-20s %8s %9s %9s %5s %8s  pixels>%d\n", "floor lit", "vertices", "ms", "+prepass", "max", "mean", compare_tolerance);
+
+	double per_pixel[2];
+	measure(LightPerPixelFloor, 1, per_pixel);
+	reference = rgb;
+	print("per pixel", 1, per_pixel, NULL);
+
+	int matched = 0;
+	double per_vertex[2];
+	for (int grid = 1; grid <= 256 && !matched; grid *= 2) {
+		measure(LightPerVertex, grid, per_vertex);
+		ImageDiff d = compareImages(rgb.data(), reference.data(), frame_width, frame_height, compare_tolerance);
+		print("per vertex", grid, per_vertex, &d);
+		if (d.pixels_over * 1000 < frame_width * frame_height) matched = grid;
+	}
+
+	if (matched)
+		printf("Equal quality: per vertex needs a %dx%d floor, %.3f ms a frame (%.3f with the prepass) against %.3f (%.3f) per pixel\n",
+			matched, matched, per_vertex[0], per_vertex[1], per_pixel[0], per_pixel[1]);
+	else
+		printf("Equal quality: not reached by per vertex lighting up to a 256x256 floor\n");
+
+	destroyHeadlessContext();
+	return 0;
+}
+//---------------------------------------------------------
+/*
+	Deferred benchmark: at 2, 32 and 512 lights (the scene's two, the rest
+	extra point lights), the scene lit forward per vertex and per pixel
+	(floor and spheres) and deferred, on the paused scene without the
+	lightmap, timed like the lighting benchmark. Forward costs about
+	vertices or pixels times lights; deferred the surfaces once, then each
+	light over the pixels it may reach. The deferred frame is compared with
+	the forward per pixel one, which lights the same way.
+*/
+int runDeferredBenchmark()
+{
+	if (!createHeadlessContext(frame_width, frame_height)) return 1;
+	printf("Renderer: %s\n", glGetString(GL_RENDERER));
+
+	useFixedClock(fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0);
+	init();
+	applySceneOptions();
+	reshape(frame_width, frame_height);
+	baked_floor = false;
+	gpu_timing = false;
+
+	std::vector<unsigned char> rgb(frame_width * frame_height * 3), per_pixel;
+	auto measure = [&](int model) {
+		light_model = model;
+		for (int frame = 0; frame < warmup_frames; frame++) display();
+		glFinish();
+		TimingSeries frames;
+		for (int frame = 0; frame < headless_frames; frame++) {
+			double start = wallTimeMs();
+			display();
+			glFinish();
+			frames.add(wallTimeMs() - start);
+		}
+		readHeadlessPixels(frame_width, frame_height, rgb.data());
+		return frames.average();
+	};
+
+	printf("Deferred benchmark: %dx%d, %d frames per run, %d spheres, paused\n",
+		frame_width, frame_height, headless_frames, (int)spheres.size());
+	printf("  %-8s %11s %11s %11s   deferred against per pixel: %5s %8s  pixels>%d\n", "lights", "per vertex", "per pixel",
+		"deferred", "max", "mean", compare_tolerance);
+
+	const int counts[] = { 2, 32, 512 };
+	for (int i = 0; i < 3; i++) {
+		setExtraLights(counts[i] - light_count);
+		double vertex_ms = measure(LightPerVertex);
+		double pixel_ms = measure(LightPerPixel);
+		per_pixel = rgb;
+		double deferred_ms = measure(LightDeferred);
+		ImageDiff d = compareImages(rgb.data(), per_pixel.data(), frame_width, frame_height, compare_tolerance);
+		printf("  %-8d %11.3f %11.3f %11.3f   %33d %8.4f %9d\n", counts[i], vertex_ms, pixel_ms, deferred_ms,
+			d.max_channel, d.mean_channel, d.pixels_over);
+	}
+
+	destroyHeadlessContext();
+	return 0;
+}
+//---------------------------------------------------------
+/*
+	Filter benchmark: first the CPU cost of building mip chains with each
+	filter, then the ground texture at its own size and at 2048 texels a
+	side, seen from the viewer and from just above the floor, sampled
+	nearest, trilinear and anisotropic. The animation is paused. A run is
+	timed like the lighting benchmark, and the floor passes also on the GPU.
+	Near the floor a pixel's footprint stretches over many texels along the
+	view: nearest sampling skips through level 0 and trilinear blurs it
+	across, while anisotropic takes several mip samples along the stretch.
+*/
+int runFilterBenchmark()
+{
+	if (!createHeadlessContext(frame_width, frame_height)) return 1;
+	printf("Renderer: %s\n", glGetString(GL_RENDERER));
+
+	useFixedClock(fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0);
+	init();
+	applySceneOptions();
+	reshape(frame_width, frame_height);
+	gpu_timing = true;
+
+	printf("Mip chain build, %d threads:\n", ThreadPool::instance().size());
+	const char* const mip_filter_names[] = { "box", "kaiser" };
+	for (int size = 1024; size <= 4096; size *= 4) {
+		std::vector<GLubyte> texels;
+		generateTexture(groundDesc(size), texels);
+		for (int f = 0; f < 2; f++) {
+			MipChain chain;
+			chain.build(texels.data(), size, size, (MipChain::Filter)f);
+			printf("  %4dx%-4d %-6s %9.2f ms, %d levels\n", size, size, mip_filter_names[f], chain.lastBuildMs(), chain.levels());
+		}
+	}
+
+	auto measure = [&](double* gpu_ms) {
+		for (int frame = 0; frame < warmup_frames; frame++) display();
+		glFinish();
+		gpu_timer.flush();
+		gpu_timer.clearStats();
+		TimingSeries frames;
+		for (int frame = 0; frame < headless_frames; frame++) {
+			double start = wallTimeMs();
+			display();
+			glFinish();
+			frames.add(wallTimeMs() - start);
+		}
+		gpu_timer.flush();
+		*gpu_ms = gpu_timer.passStats(PassFloorColor).average() + gpu_timer.passStats(PassFloorDepth).average();
+		return frames.average();
+	};
+
+	printf("Filter benchmark: %dx%d, %d frames per run, %d spheres, paused, %s mip chain, anisotropy up to %.0f\n",
+		frame_width, frame_height, headless_frames, (int)spheres.size(), mip_filter_names[mip_filter], max_anisotropy);
+	printf("  %-9s %-8s %-12s %9s %9s\n", "texture", "view", "filter", "ms", "floor gpu");
+
+	const char* const filter_names[] = { "nearest", "trilinear", "anisotropic" };
+	const int sizes[] = { ground_texture_size, 2048 };
+	const vec4 views[] = { init_eye, vec4(0.0, 0.6, -4.5, 1.0) }; //The second just off the floor's near edge
+	const char* const view_names[] = { "viewer", "grazing" };
+	for (int i = 0; i < 2; i++) {
+		uploadTextures(sizes[i]);
+		for (int v = 0; v < 2; v++) {
+			for (int f = FilterNearest; f <= FilterAnisotropic; f++) {
+				ground_filter = f;
+				eye = views[v];
+				double gpu_ms;
+				double ms = measure(&gpu_ms);
+				char texture[32];
+				sprintf(texture, "%dx%d", sizes[i], sizes[i]);
+				printf("  %-9s %-8s %-12s %9.3f %9.3f\n", texture, view_names[v], filter_names[f], ms, gpu_ms);
+			}
+		}
+	}
+
+	destroyHeadlessContext();
+	return 0;
+}
+//---------------------------------------------------------
+/*
+	Capture benchmark: headless_frames frames (after warmup_frames) at
+	1920x1080, or --size, without capture, then captured to PNG files and
+	to a Y4M stream, each read back through the PBO ring and by plain
+	glReadPixels. The animation runs, so every frame differs. A run is timed
+	from its first frame until its last is written, so a writer that falls
+	behind counts; the overhead is against the run without capture. The GL
+	thread column is the time display() spends in capture(); on a software
+	renderer that includes drawing the frame, which the read waits for, and
+	the writer takes CPU time from the renderer. The files go to the
+	current directory and are deleted after.
+*/
+int runCaptureBenchmark()
+{
+	if (!frame_size_set) {
+		frame_width = 1920;
+		frame_height = 1080;
+	}
+	if (!createHeadlessContext(frame_width, frame_height)) return 1;
+	printf("Renderer: %s\n", glGetString(GL_RENDERER));
+
+	useFixedClock(fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0);
+	init();
+	applySceneOptions();
+	reshape(frame_width, frame_height);
+	animation_flag = 2;
+
+	printf("Capture benchmark: %dx%d, %d frames per run, %d spheres, writer thread and %d pool threads\n",
+		frame_width, frame_height, headless_frames, (int)spheres.size(), ThreadPool::instance().size());
+	printf("  %-6s %-12s %9s %9s %9s %9s %9s\n", "format", "readback", "ms", "overhead", "gl thread", "writer", "MB");
+
+	const char* const files[] = { NULL, "bench-capture-%04d.png", "bench-capture.y4m" };
+	const char* const formats[] = { "none", "png", "y4m" };
+	double base_ms = 0.0;
+	for (int f = 0; f < 3; f++) {
+		for (int ring = FrameCapture::DefaultRing; ring >= 0; ring -= FrameCapture::DefaultRing) {
+			if (f == 0 && ring == 0) continue;
+			for (int frame = 0; frame < warmup_frames; frame++) {
+				idle();
+				display();
+			}
+			glFinish();
+
+			if (files[f] != NULL && !frame_capture.open(files[f], 60, ring)) {
+				printf("Error: %s: %s\n", files[f], frame_capture.error().c_str());
+				return 1;
+			}
+			double start = wallTimeMs();
+			for (int frame = 0; frame < headless_frames; frame++) {
+				idle();
+				display();
+			}
+			glFinish();
+			frame_capture.close();
+			double ms = (wallTimeMs() - start) / headless_frames;
+
+			if (f == 0) {
+				base_ms = ms;
+				printf("  %-6s %-12s %9.2f\n", formats[f], "-", ms);
+				continue;
+			}
+			const FrameCapture::Stats& stats = frame_capture.stats();
+			printf("  %-6s %-12s %9.2f %8.1f%% %9.3f %9.2f %9.1f\n", formats[f], ring > 0 ? "pbo ring" : "glReadPixels",
+				ms, 100.0 * (ms - base_ms) / base_ms, stats.gl_ms / headless_frames, stats.write_ms / headless_frames,
+				stats.bytes / 1048576.0);
+
+			char name[64];
+			for (int frame = 0; frame < headless_frames && f == 1; frame++) {
+				sprintf(name, files[f], frame);
+				remove(name);
+			}
+			if (f == 2) remove(files[f]);
+		}
+	}
+
+	destroyHeadlessContext();
+	return 0;
+}
+//---------------------------------------------------------
+/*
+	Software rasterizer benchmark: renders frames with SoftRasterizer at each
+	of the --sizes, every size from the same starting state and on the fixed
+	clock, and reports the frame time and its stages per resolution. No
+	OpenGL context is created.
+*/
+int runSoftware()
+{
+	initScene();
+	applySceneOptions();
+	if (start_animated) animation_flag = 2;
+	if (software_sizes.empty()) {
+		software_sizes.push_back(frame_width);
+		software_sizes.push_back(frame_height);
+	}
+
+	soft_raster.setTexture2D(ImageWidth, ImageHeight, &Image[0][0][0]);
+	soft_raster.setTexture1D(stripeImageWidth, stripeImage);
+	soft_raster.state.line_width = 2.0; //glLineWidth(2.0) in init()
+	//The floor's lightmap, baked as for display() but kept on the CPU
+	floor_lightmap.init(-1, lightmap_size, floor_min.x, floor_max.x, floor_min.z, floor_max.z, floor_min.y);
+	for (int i = 0; i < MaterialCount; i++) soft_raster.uniforms.MaterialTint[i] = material_tint[i];
+
+	const double step = fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0;
+	const std::vector<SphereInstance> start_spheres = spheres;
+	const float start_tick = current_tick;
+
+	printf("Software rasterizer: %d threads, %dx%d tiles, %d frames per size, %d spheres\n",
+		ThreadPool::instance().size(), SoftRasterizer::TileSize, SoftRasterizer::TileSize, headless_frames, (int)spheres.size());
+
+	std::vector<std::string> rows;
+	for (size_t r = 0; r + 1 < software_sizes.size(); r += 2) {
+		int w = software_sizes[r], h = software_sizes[r + 1];
+		if (!soft_raster.resize(w, h)) {
+			printf("Error: %dx%d is larger than %dx%d\n", w, h, SoftRasterizer::MaxSize, SoftRasterizer::MaxSize);
+			return 1;
+		}
+		aspect = (GLfloat)w / (GLfloat)h;
+		spheres = start_spheres;
+		current_tick = start_tick;
+		useFixedClock(step);
+
+		for (int frame = 0; frame < warmup_frames; frame++) {
+			if (animation_flag == 2) idle();
+			displaySoftware(soft_raster);
+		}
+
+		TimingSeries total, vertex, bin, raster;
+		for (int frame = 0; frame < headless_frames; frame++) {
+			if (animation_flag == 2) idle();
+			double start = wallTimeMs();
+			displaySoftware(soft_raster);
+			total.add(wallTimeMs() - start);
+			vertex.add(soft_raster.lastVertexMs());
+			bin.add(soft_raster.lastBinMs());
+			raster.add(soft_raster.lastRasterMs());
+
+			if (print_frames)
+				printf("frame %4d  %dx%d  %8.3f ms  (vertex %.3f, bin %.3f, raster %.3f, %d primitives)\n", frame, w, h,
+					total.values().back(), vertex.values().back(), bin.values().back(), raster.values().back(),
+					soft_raster.lastPrimitiveCount());
+		}
+
+		char row[256];
+		sprintf(row, "  %-11s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.1f", (std::to_string(w) + "x" + std::to_string(h)).c_str(),
+			total.min(), total.average(), total.percentile(50), total.percentile(99),
+			vertex.average(), bin.average(), raster.average(), 1000.0 / total.average());
+		rows.push_back(row);
+	}
+
+	printf("  %-11s %9s %9s %9s %9s %9s %9s %9s %9s\n", "size", "min ms", "avg ms", "p50 ms", "p99 ms", "vertex", "bin", "raster", "fps");
+	for (size_t i = 0; i < rows.size(); i++) printf("%s\n", rows[i].c_str());
+
+	if (screenshot_file != NULL) {
+		std::vector<unsigned char> rgb(soft_raster.width() * soft_raster.height() * 3);
+		soft_raster.readPixels(rgb.data());
+		if (!writePPM(screenshot_file, soft_raster.width(), soft_raster.height(), rgb.data())) {
+			printf("Error: cannot write %s\n", screenshot_file);
+			return 1;
+		}
+		printf("Wrote %s\n", screenshot_file);
+	}
+	return 0;
+}
+//---------------------------------------------------------
+/*
+	The scene of display() for the ray tracer: the floor and every sphere
+	instance as world-space triangles, the lights moved to the world frame.
+	The ray-traced shadows stand in for the projected sphere_shadow, so they
+	follow the shadow menu; the axis lines are not drawn.
+*/
+RayTracer ray_tracer;
+
+void setUpRayScene(RayTracer& rt)
+{
+	PROFILE_ZONE("ray scene");
+	vec4	at(0.0, 0.0, 0.0, 1.0);
+	vec4    up(0.0, 1.0, 0.0, 0.0);
+	mat4 mv = LookAt(eye, at, up);
+
+	rt.clear();
+	rt.setCamera(eye, at, up, fovy, aspect);
+	rt.setTexture2D(ImageWidth, ImageHeight, &Image[0][0][0]);
+	rt.background = color4(0.529, 0.807, 0.92, 0.0);
+	rt.fog = fog;
+	rt.shadows = if_shadow;
+	rt.global_ambient = lighting ? global_ambient : color4(1.0, 1.0, 1.0, 1.0);
+
+	//Unlit surfaces take their vertex color, as the ambient term of a material with no lights on it
+	const color4 black(0.0, 0.0, 0.0, 1.0);
+	RayMaterial ground = { ground_ambient, ground_diffuse, ground_specular, shininess, checker_ground };
+	if (!lighting) ground = { floor_colors[0], black, black, 1.0, checker_ground };
+	int ground_material = rt.addMaterial(ground);
+	rt.addMesh(floor_points, floor_normals, floor_texCoord, sizeof(floor_points) / sizeof(floor_points[0]), mat4(), ground_material);
+
+	int sphere_material = 0;
+	for (int i = 0; i < MaterialCount; i++) {
+		const color4& tint = material_tint[i];
+		RayMaterial m = { sphere_ambient * tint, sphere_diffuse * tint, sphere_specular * tint, shininess, false };
+		if (!lighting || !sphere_lighting) m = { sphere_colors[0] * tint, black, black, 1.0, false };
+		int k = rt.addMaterial(m);
+		if (i == 0) sphere_material = k;
+	}
+	for (size_t i = 0; i < spheres.size(); i++)
+		rt.addMesh(sphere_points, flat ? sphere_flat_normals : sphere_smooth_normals, NULL, triangle_count * 3,
+			Translate(spheres[i].position) * spheres[i].rotation, sphere_material + spheres[i].material);
+
+	if (!lighting) return;
+	mat4 eye_to_world = transpose1(mv); //Rotation part only, for directions
+	for (int i = 0; i < light_count; i++) {
+		RayLight l;
+		vec4 dir = eye_to_world * vec4(light_dir[i].x, light_dir[i].y, light_dir[i].z, 0.0);
+		l.type = light_type[i];
+		l.position = point3(light_position[i].x, light_position[i].y, light_position[i].z);
+		l.direction = vec3(dir.x, dir.y, dir.z); //light_dir is in the eye frame for directional lights
+		l.focus = light_dir[i];                  //and the world-frame focus for spot lights
+		l.cutoff = cutoff[i];
+		l.exponent = exponent[i];
+		l.const_att = const_att[i];
+		l.linear_att = linear_att[i];
+		l.quad_att = quad_att[i];
+		l.ambient = color4(light_ambient[i * 4], light_ambient[i * 4 + 1], light_ambient[i * 4 + 2], light_ambient[i * 4 + 3]);
+		l.diffuse = color4(light_diffuse[i * 4], light_diffuse[i * 4 + 1], light_diffuse[i * 4 + 2], light_diffuse[i * 4 + 3]);
+		l.specular = color4(light_specular[i * 4], light_specular[i * 4 + 1], light_specular[i * 4 + 2], light_specular[i * 4 + 3]);
+		rt.addLight(l);
+	}
+}
+//---------------------------------------------------------
+//Frees the sphere mesh so loadSphereFile() can read another
+void unloadSphereFile()
+{
+	delete[] sphere_points;
+	delete[] sphere_flat_normals;
+	delete[] sphere_smooth_normals;
+	delete[] sphere_colors;
+	delete[] sphere_shadow_colors;
+	triangle_count = -1;
+}
+//---------------------------------------------------------
+/*
+	Ray tracer benchmark: for each sphere file (the four shipped ones unless
+	--sphere names one) renders raytrace_frames frames from the same starting
+	state on the fixed clock. Every frame rebuilds the BVH, as the spheres
+	move; the rays per second count primary and shadow rays over the trace
+	time alone.
+*/
+int runRayTrace()
+{
+	static const char* const sphere_files[] = { "sphere.8.txt", "sphere.128.txt", "sphere.256.txt", "sphere.1024.txt" };
+	std::vector<const char*> files;
+	if (sphere_file != NULL) files.push_back(sphere_file);
+	else files.assign(sphere_files, sphere_files + sizeof(sphere_files) / sizeof(sphere_files[0]));
+
+	sphere_file = files[0];
+	initScene();
+	applySceneOptions();
+	if (start_animated) animation_flag = 2;
+	aspect = (GLfloat)frame_width / (GLfloat)frame_height;
+
+	const double step = fixed_step_ms > 0.0 ? fixed_step_ms : 1000.0 / 60.0;
+	const std::vector<SphereInstance> start_spheres = spheres;
+	const float start_tick = current_tick;
+	std::vector<unsigned char> rgb(frame_width * frame_height * 3);
+
+	printf("Ray tracer: %d threads, %dx%d, %d frames per sphere file, %d spheres\n",
+		ThreadPool::instance().size(), frame_width, frame_height, raytrace_frames, (int)spheres.size());
+
+	std::vector<std::string> rows;
+	for (size_t f = 0; f < files.size(); f++) {
+		if (f > 0) {
+			unloadSphereFile();
+			loadSphereFile(files[f]);
+		}
+		spheres = start_spheres;
+		current_tick = start_tick;
+		useFixedClock(step);
+
+		TimingSeries build, trace;
+		long long rays = 0;
+		for (int frame = 0; frame < raytrace_frames; frame++) {
+			if (animation_flag == 2) idle();
+			setUpRayScene(ray_tracer);
+			ray_tracer.build();
+			ray_tracer.render(frame_width, frame_height, rgb.data());
+			build.add(ray_tracer.lastBuildMs());
+			trace.add(ray_tracer.lastTraceMs());
+			rays += ray_tracer.lastRayCount();
+
+			if (print_frames)
+				printf("frame %4d  %s  build %8.3f ms  trace %8.3f ms  %lld rays (%lld shadow)\n", frame, files[f],
+					build.values().back(), trace.values().back(), ray_tracer.lastRayCount(), ray_tracer.lastShadowRayCount());
+		}
+
+		double trace_sum = trace.average() * trace.count();
+		char row[256];
+		sprintf(row, "  %-16s %9d %9d %9.3f %9.3f %9.3f %12lld %9.2f", files[f], ray_tracer.triangleCount(), ray_tracer.nodeCount(),
+			build.average(), trace.min(), trace.average(), rays / raytrace_frames, rays / (trace_sum * 1000.0));
+		rows.push_back(row);
+	}
+
+	printf("  %-16s %9s %9s %9s %9s %9s %12s %9s\n", "sphere file", "triangles", "nodes", "build ms", "min ms", "avg ms", "rays/frame", "Mrays/s");
+	for (size_t i = 0; i < rows.size(); i++) printf("%s\n", rows[i].c_str());
+
+	if (screenshot_file != NULL) {
+		if (!writePPM(screenshot_file, frame_width, frame_height, rgb.data())) {
+			printf("Error: cannot write %s\n", screenshot_file);
+			return 1;
+		}
+		printf("Wrote %s\n", screenshot_file);
+	}
+	return 0;
+}
+//---------------------------------------------------------
+//atexit() handler for --profile, so quitting from the menu writes the trace as well
+void writeProfile()
+{
+	profilerEnable(false);
+	if (profilerWriteChromeTrace(profile_file))
+		printf("Wrote %s (%lld zones)\n", profile_file, profilerZoneCount());
+	else
+		printf("Error: cannot write %s\n", profile_file);
+}
+//---------------------------------------------------------
 int main( int argc, char **argv )
 {
+	if (!parseOptions(argc, argv)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (bench_broadphase > 0) {
+		benchmarkBroadPhase(bench_broadphase);
+		return 0;
+	}
+	if (profile_file != NULL) {
+		profilerSetThreadName("main");
+		profilerEnable(true);
+		atexit(writeProfile);
+	}
+	if (regress_dir != NULL) {
+		RegressionSettings settings;
+		settings.program = argv[0];
+		settings.dir = regress_dir;
+		settings.only = regress_only;
+		settings.update = regress_update;
+		settings.tolerance = compare_tolerance;
+		settings.margin = budget_margin;
+		settings.repeats = regress_repeats;
+		return runRegression(settings);
+	}
+	if (software) return runSoftware();
+	if (raytrace) return runRayTrace();
+	if (bench_lighting) return runLightingBenchmark();
+	if (bench_deferred) return runDeferredBenchmark();
+	if (bench_filter) return runFilterBenchmark();
+	if (bench_capture) return runCaptureBenchmark();
+	if (headless) return runHeadless();
+	if (record_file != NULL) {
+		//A replay steps the clock once per frame, so the recording has to as well
+		if (fixed_step_ms <= 0.0) fixed_step_ms = 1000.0 / 60.0;
+		input_log.startRecording(fixed_step_ms, frame_width, frame_height);
+		atexit(saveInputLog);
+	}
+	if (fixed_step_ms > 0.0) useFixedClock(fixed_step_ms);
+
 	glutInit(&argc, argv);
 #ifdef __APPLE__ // Enable core profile of OpenGL 3.2 on macOS.
-	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_3_2_CORE_PROFILE);
+	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_STENCIL | GLUT_3_2_CORE_PROFILE);
 #else
-	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+	glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_STENCIL);
 #endif
-	glutInitWindowSize(512, 512);
+	glutInitWindowSize(frame_width, frame_height);
 	glutCreateWindow("Rolling Sphere");
 
 #ifdef __APPLE__ // on macOS
@@ -1068,58 +3208,89 @@ int main( int argc, char **argv )
 	printf("OpenGL version supported %s\n", glGetString(GL_VERSION));
 
 	glutDisplayFunc(display);
-	glutReshapeFunc(reshape);
+	glutReshapeFunc(recordReshape);
 	glutIdleFunc(NULL);
-	glutMouseFunc(mouse);
-	glutKeyboardFunc(keyboard);
+	glutMouseFunc(recordMouse);
+	glutKeyboardFunc(recordKeyboard);
 
 	//add mouse menu
-	int shadowMenu = glutCreateMenu(shadow_menu);
+	int shadowMenu = glutCreateMenu(recordMenu<MenuShadow>);
 	glutAddMenuEntry("Yes", 1);
 	glutAddMenuEntry("No", 2);
+	glutAddMenuEntry("Technique: floor drawn twice", 3);
+	glutAddMenuEntry("Technique: stencil", 4);
+	glutAddMenuEntry("Technique: cached mask texture", 5);
+	glutAddMenuEntry("Technique: shadow maps", 6);
 
-	int lightMenu = glutCreateMenu(light_menu);
+	int lightMenu = glutCreateMenu(recordMenu<MenuLight>);
 	glutAddMenuEntry("Yes", 1);
 	glutAddMenuEntry("No", 2);
-
-	int shadingMenu = glutCreateMenu(shading_menu);
+	glutAddMenuEntry("Floor: baked lightmap", 3);
+	glutAddMenuEntry("Floor: per vertex", 4);
+	glutAddMenuEntry("Lit per vertex", 5);
+	glutAddMenuEntry("Lit per pixel: floor", 6);
+	glutAddMenuEntry("Lit per pixel: floor and spheres", 7);
+	glutAddMenuEntry("Lit deferred: G-buffer and light volumes", 8);
+
+	int shadingMenu = glutCreateMenu(recordMenu<MenuShading>);
 	glutAddMenuEntry("Flat shading", 1);
 	glutAddMenuEntry("Smoothing shading", 2);
 
-	int lightSourceMenu = glutCreateMenu(lightsource_menu);
+	int lightSourceMenu = glutCreateMenu(recordMenu<MenuLightSource>);
 	glutAddMenuEntry("Spot Light", 1);
 	glutAddMenuEntry("Point Source", 2);
 
-	int fogMenu = glutCreateMenu(fog_menu);
+	int fogMenu = glutCreateMenu(recordMenu<MenuFog>);
 	glutAddMenuEntry("No Fog", 1);
 	glutAddMenuEntry("Linear", 2);
 	glutAddMenuEntry("Exponential", 3);
 	glutAddMenuEntry("Exponential Square", 4);
 
-	int shadowBlendingMenu = glutCreateMenu(shadow_blending_menu);
+	int shadowBlendingMenu = glutCreateMenu(recordMenu<MenuShadowBlending>);
 	glutAddMenuEntry("No", 1);
 	glutAddMenuEntry("Yes", 2);
 
-	int checkerMenu = glutCreateMenu(checker_menu);
+	int checkerMenu = glutCreateMenu(recordMenu<MenuChecker>);
 	glutAddMenuEntry("No", 1);
 	glutAddMenuEntry("Yes", 2);
-
-	int sphereTexMenu = glutCreateMenu(sphere_texture_menu);
+	glutAddMenuEntry("Filter: nearest", 3);
+	glutAddMenuEntry("Filter: trilinear mipmaps", 4);
+	glutAddMenuEntry("Filter: anisotropic", 5);
+	glutAddMenuEntry("Pattern: checkerboard", 6);
+	glutAddMenuEntry("Pattern: noise", 7);
+	glutAddMenuEntry("Pattern: gradient", 8);
+
+	int sphereTexMenu = glutCreateMenu(recordMenu<MenuSphereTexture>);
 	glutAddMenuEntry("No", 0);
 	glutAddMenuEntry("Yes - Contour Lines", 1);
 	glutAddMenuEntry("Yes - Checkerboard", 2);
 
-	int particleMenu = glutCreateMenu(particle_menu);
+	int particleMenu = glutCreateMenu(recordMenu<MenuParticle>);
 	glutAddMenuEntry("No", 0);
 	glutAddMenuEntry("Yes", 1);
-
-	glutCreateMenu(main_menu);
+	glutAddMenuEntry("Yes - Bouncing (CPU)", 2);
+	glutAddMenuEntry("Yes - Bouncing (CPU, streamed)", 3);
+	glutAddMenuEntry("1 Emitter", EmitterMenuBase + 1);
+	glutAddMenuEntry("4 Emitters", EmitterMenuBase + 4);
+	glutAddMenuEntry("8 Emitters", EmitterMenuBase + 8);
+
+	int sphereCountMenu = glutCreateMenu(recordMenu<MenuSphereCount>);
+	glutAddMenuEntry("1", 1);
+	glutAddMenuEntry("100", 100);
+	glutAddMenuEntry("1000", 1000);
+	glutAddMenuEntry("5000", 5000);
+
+	glutCreateMenu(recordMenu<MenuMain>);
 	glutAddSubMenu("Shadow", shadowMenu);
 	glutAddSubMenu("Blending Shadow", shadowBlendingMenu);
 	glutAddSubMenu("Texture Mapped Ground", checkerMenu);
 	glutAddSubMenu("Texture Mapped Sphere", sphereTexMenu);
 	glutAddSubMenu("Firework", particleMenu);
+	glutAddSubMenu("Sphere Count", sphereCountMenu);
 	glutAddMenuEntry("Toggle wire frame sphere", 3);
+	glutAddMenuEntry("Toggle sphere collisions", 4);
+	glutAddMenuEntry("Toggle GPU pass timings", 5);
+	glutAddMenuEntry("Toggle depth prepass", 6);
 	glutAddSubMenu("Enable Lighting", lightMenu);
 	glutAddSubMenu("Shading", shadingMenu);
 	glutAddSubMenu("Light Source", lightSourceMenu);
@@ -1129,6 +3300,11 @@ int main( int argc, char **argv )
 	glutAttachMenu(GLUT_LEFT_BUTTON);
 
 	init();
+	applySceneOptions();
+	if (capture_file != NULL) {
+		if (!openCapture()) return 1;
+		atexit(closeCapture);
+	}
 	glutMainLoop();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,48 @@
+/* 
+File Name: "vshaderDeferred.glsl":
+Vertex shader:
+  - The passes over the G-buffer: one quad, over the whole screen for the
+    two scene lights and the resolve, and instanced over the extra lights,
+    each shrunk to the screen rectangle around its sphere of influence.
+*/
+
+#version 150  // YJC: Comment/un-comment this line to resolve compilation errors
+                 //      due to different settings of the default GLSL version
+
+in  vec3 vPosition; // quad corner, x and y in [-1, 1]
+flat out int fLight;
+
+uniform int deferred_pass; // 0: a scene light, 1: the extra lights, one per instance, 2: the resolve
+uniform mat4 projection;
+uniform float z_near;
+
+// As in light53.glsl: eye frame position and radius, then color
+uniform samplerBuffer ExtraLights;
+
+void main()
+{
+	fLight = gl_InstanceID;
+	gl_Position = vec4(vPosition.xy, 0.0, 1.0);
+	if (deferred_pass != 1) return;
+
+	vec4 light = texelFetch(ExtraLights, 2 * gl_InstanceID);
+	if (light.z - light.w > -z_near){
+		// All behind the near plane
+		gl_Position = vec4(2.0, 2.0, 0.0, 1.0);
+		return;
+	}
+	if (light.z + light.w > -z_near){
+		// Reaching past the near plane: the whole screen
+		return;
+	}
+
+	// The projected corners of the box around the sphere bound its projection
+	vec2 lo = vec2(1e30), hi = vec2(-1e30);
+	for (int i = 0; i < 8; i++){
+		vec3 corner = light.xyz + light.w * vec3((i & 1) != 0 ? 1.0 : -1.0, (i & 2) != 0 ? 1.0 : -1.0, (i & 4) != 0 ? 1.0 : -1.0);
+		vec4 clip = projection * vec4(corner, 1.0);
+		lo = min(lo, clip.xy / clip.w);
+		hi = max(hi, clip.xy / clip.w);
+	}
+	gl_Position = vec4(mix(lo, hi, vPosition.xy * 0.5 + 0.5), 0.0, 1.0);
+}
@@ -1,31 +1,41 @@
 /* 
-File Name: "vshader53.glsl":
+File Name: "vshaderParticle.glsl":
 Vertex shader:
-  - Per vertex shading for a single point light source;
-    distance attenuation is Yet To Be Completed.
-  - Entire shading computation is done in the Eye Frame.
+  - Instanced billboard particles. Each instance carries its own origin,
+    launch velocity, color, spawn time and size; the position is evaluated
+    from the ballistic path at the current time t.
+  - The quad is expanded in the Eye Frame, so its size shrinks with distance.
 */
 
 #version 150  // YJC: Comment/un-comment this line to resolve compilation errors
                  //      due to different settings of the default GLSL version
 
-in  vec3 vVelocity;
-in  vec4 vColor;
+in  vec2 vCorner;     // per vertex: quad corner in [-0.5, 0.5]
+in  vec3 vOrigin;     // per instance
+in  vec3 vVelocity;   // per instance
+in  vec4 vColor;      // per instance
+in  float vSpawnTime; // per instance, in ms
+in  float vSize;      // per instance, in world units
 out vec4 color;
 out float objPositionY;
+out vec2 fCorner;
 
 uniform float t;
-uniform vec3 initialPos;
 uniform mat4 model_view;
 uniform mat4 projection;
 void main()
 {
-	vec4 vPosition4 = vec4(initialPos.x + 0.001 * vVelocity.x * t,
-		initialPos.y + 0.001 * vVelocity.y * t + 0.5 * -0.00000049 * t * t , 
-		initialPos.z + 0.001 * vVelocity.z * t,
+	float age = t - vSpawnTime;
+	vec4 vPosition4 = vec4(vOrigin.x + 0.001 * vVelocity.x * age,
+		vOrigin.y + 0.001 * vVelocity.y * age + 0.5 * -0.00000049 * age * age , 
+		vOrigin.z + 0.001 * vVelocity.z * age,
 		1.0);
 	color = vColor;
+	fCorner = vCorner;
 
 	objPositionY = vPosition4.y;
-    gl_Position = projection * model_view * vPosition4;
-}
\ No newline at end of file
+
+	vec4 eyePosition = model_view * vPosition4;
+	eyePosition.xy += vCorner * vSize;
+    gl_Position = projection * eyePosition;
+}